@@ -3,6 +3,23 @@
 
 #include "DesFireKey.h"
 
+// 1: T-table implementation. The encryption and decryption key schedules are expanded once in SetKeyData().
+//    Costs 2 kB of tables and 352 bytes per AES instance.
+// 0: the small TI implementation which expands the key anew for each block.
+#ifndef AES_TABLES
+    #define AES_TABLES  1
+#endif
+
+// Host build on x86-64 or aarch64 Linux: AES-NI / ARMv8 Crypto Extensions if the CPU has them (see AES128_HW.h)
+#ifndef AES_HW
+    #if defined(PN532_HOST) && AES_TABLES && defined(__GNUC__) && \
+        (defined(__x86_64__) || (defined(__aarch64__) && defined(__linux__)))
+        #define AES_HW  1
+    #else
+        #define AES_HW  0
+    #endif
+#endif
+
 class AES : public DESFireKey
 {
 public:
@@ -10,10 +27,33 @@ public:
     ~AES();
     bool SetKeyData(const byte* u8_Key, int s32_KeySize, byte u8_Version);
     bool CryptDataBlock(byte* u8_Out, const byte* u8_In, DESFireCipher e_Cipher);
+#if AES_TABLES
+    bool CryptBlocks(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In, int s32_Blocks);
+#endif
+#if AES_HW
+    // Enabled by default. Returns false if the CPU has no AES instructions.
+    static bool UseHardware(bool b_Enable);
+#endif
 
 private:
+#if AES_TABLES
+    void ExpandKey();
+    void Encrypt(uint32_t u32_State[4]);
+    void Decrypt(uint32_t u32_State[4]);
+    static void Load (uint32_t u32_State[4], const byte* u8_In);
+    static void Store(byte* u8_Out, const uint32_t u32_State[4]);
+
+    uint32_t mu32_EncKeys[44]; // 11 round keys, big endian columns
+    uint32_t mu32_DecKeys[44]; // the round keys in reverse order for the equivalent inverse cipher
+#endif
+#if AES_HW
+    byte mu8_HwKeys[2][176];   // mu32_EncKeys and mu32_DecKeys in memory order, index = DESFireCipher
+    static bool sb_Hardware;
+#endif
+#if !AES_TABLES
     static void aes_enc_dec(unsigned char state[16], unsigned char key[16], unsigned char dir);
     static unsigned char galois_mul2(unsigned char value);
+#endif
 };
 
 #endif // TI_OPT_AES_H_
\ No newline at end of file
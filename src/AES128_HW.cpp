@@ -0,0 +1,187 @@
+/**************************************************************************
+
+    class AesHw: AES-128 with the AES instructions of the CPU (see AES128_HW.h)
+
+**************************************************************************/
+
+#include "AES128.h"
+
+#if AES_HW
+
+#include "AES128_HW.h"
+
+#if defined(__x86_64__)
+
+#include <wmmintrin.h>
+#include <cpuid.h>
+
+#define HW_TARGET  __attribute__((target("aes,sse2")))
+typedef __m128i tBlock;
+#define HW_LOAD(u8_Ptr)         _mm_loadu_si128((const __m128i*)(u8_Ptr))
+#define HW_STORE(u8_Ptr, x)     _mm_storeu_si128((__m128i*)(u8_Ptr), x)
+#define HW_XOR(a, b)            _mm_xor_si128(a, b)
+
+bool AesHw::IsSupported()
+{
+    static int s32_Supported = -1;
+    if (s32_Supported < 0)
+    {
+        unsigned int a, b, c, d;
+        s32_Supported = (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES)) ? 1 : 0;
+    }
+    return s32_Supported == 1;
+}
+
+// AESENC: ShiftRows + SubBytes + MixColumns + AddRoundKey
+HW_TARGET static inline tBlock Crypt1(const tBlock* k_Keys, bool b_Decrypt, tBlock x)
+{
+    x = _mm_xor_si128(x, k_Keys[0]);
+    if (b_Decrypt)
+    {
+        for (int R=1; R<10; R++) x = _mm_aesdec_si128(x, k_Keys[R]);
+        return _mm_aesdeclast_si128(x, k_Keys[10]);
+    }
+    for (int R=1; R<10; R++) x = _mm_aesenc_si128(x, k_Keys[R]);
+    return _mm_aesenclast_si128(x, k_Keys[10]);
+}
+
+HW_TARGET static inline void Crypt4(const tBlock* k_Keys, bool b_Decrypt, tBlock* x)
+{
+    for (int i=0; i<4; i++) x[i] = _mm_xor_si128(x[i], k_Keys[0]);
+    if (b_Decrypt)
+    {
+        for (int R=1; R<10; R++)
+            for (int i=0; i<4; i++) x[i] = _mm_aesdec_si128(x[i], k_Keys[R]);
+        for (int i=0; i<4; i++) x[i] = _mm_aesdeclast_si128(x[i], k_Keys[10]);
+    }
+    else
+    {
+        for (int R=1; R<10; R++)
+            for (int i=0; i<4; i++) x[i] = _mm_aesenc_si128(x[i], k_Keys[R]);
+        for (int i=0; i<4; i++) x[i] = _mm_aesenclast_si128(x[i], k_Keys[10]);
+    }
+}
+
+#elif defined(__aarch64__) && defined(__linux__)
+
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#if defined(__clang__)
+    #define HW_TARGET  __attribute__((target("aes")))
+#else
+    #define HW_TARGET  __attribute__((target("+crypto")))
+#endif
+typedef uint8x16_t tBlock;
+#define HW_LOAD(u8_Ptr)         vld1q_u8(u8_Ptr)
+#define HW_STORE(u8_Ptr, x)     vst1q_u8(u8_Ptr, x)
+#define HW_XOR(a, b)            veorq_u8(a, b)
+
+bool AesHw::IsSupported()
+{
+    static int s32_Supported = -1;
+    if (s32_Supported < 0)
+        s32_Supported = (getauxval(AT_HWCAP) & HWCAP_AES) ? 1 : 0;
+    return s32_Supported == 1;
+}
+
+// AESE: AddRoundKey + SubBytes + ShiftRows, so the last round key is XORed separately
+HW_TARGET static inline tBlock Crypt1(const tBlock* k_Keys, bool b_Decrypt, tBlock x)
+{
+    if (b_Decrypt)
+    {
+        for (int R=0; R<9; R++) x = vaesimcq_u8(vaesdq_u8(x, k_Keys[R]));
+        x = vaesdq_u8(x, k_Keys[9]);
+    }
+    else
+    {
+        for (int R=0; R<9; R++) x = vaesmcq_u8(vaeseq_u8(x, k_Keys[R]));
+        x = vaeseq_u8(x, k_Keys[9]);
+    }
+    return veorq_u8(x, k_Keys[10]);
+}
+
+HW_TARGET static inline void Crypt4(const tBlock* k_Keys, bool b_Decrypt, tBlock* x)
+{
+    if (b_Decrypt)
+    {
+        for (int R=0; R<9; R++)
+            for (int i=0; i<4; i++) x[i] = vaesimcq_u8(vaesdq_u8(x[i], k_Keys[R]));
+        for (int i=0; i<4; i++) x[i] = vaesdq_u8(x[i], k_Keys[9]);
+    }
+    else
+    {
+        for (int R=0; R<9; R++)
+            for (int i=0; i<4; i++) x[i] = vaesmcq_u8(vaeseq_u8(x[i], k_Keys[R]));
+        for (int i=0; i<4; i++) x[i] = vaeseq_u8(x[i], k_Keys[9]);
+    }
+    for (int i=0; i<4; i++) x[i] = veorq_u8(x[i], k_Keys[10]);
+}
+
+#endif
+
+HW_TARGET void AesHw::CryptBlock(const byte* u8_Keys, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In)
+{
+    tBlock k_Keys[11];
+    for (int R=0; R<11; R++)
+    {
+        k_Keys[R] = HW_LOAD(u8_Keys + 16 * R);
+    }
+    HW_STORE(u8_Out, Crypt1(k_Keys, e_Cipher == KEY_DECIPHER, HW_LOAD(u8_In)));
+}
+
+HW_TARGET void AesHw::CryptCBC(const byte* u8_Keys, DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_IV,
+                               byte* u8_Out, const byte* u8_In, int s32_Blocks)
+{
+    tBlock k_Keys[11];
+    for (int R=0; R<11; R++)
+    {
+        k_Keys[R] = HW_LOAD(u8_Keys + 16 * R);
+    }
+
+    bool   b_Decrypt = (e_Cipher == KEY_DECIPHER);
+    tBlock k_IV      = HW_LOAD(u8_IV);
+    int    B = 0;
+
+    if (e_CBC == CBC_SEND)
+    {
+        // Each block depends on the previous result
+        for (; B<s32_Blocks; B++, u8_In += 16)
+        {
+            k_IV = Crypt1(k_Keys, b_Decrypt, HW_XOR(HW_LOAD(u8_In), k_IV));
+            if (u8_Out) // NULL for a CMAC
+            {
+                HW_STORE(u8_Out, k_IV);
+                u8_Out += 16;
+            }
+        }
+    }
+    else // CBC_RECEIVE
+    {
+        // All input blocks are loaded before the output is stored (u8_Out may be u8_In)
+        for (; B+4<=s32_Blocks; B+=4, u8_In += 64, u8_Out += 64)
+        {
+            tBlock k_In[4], x[4];
+            for (int i=0; i<4; i++)
+            {
+                k_In[i] = x[i] = HW_LOAD(u8_In + 16 * i);
+            }
+            Crypt4(k_Keys, b_Decrypt, x);
+            HW_STORE(u8_Out,      HW_XOR(x[0], k_IV));
+            HW_STORE(u8_Out + 16, HW_XOR(x[1], k_In[0]));
+            HW_STORE(u8_Out + 32, HW_XOR(x[2], k_In[1]));
+            HW_STORE(u8_Out + 48, HW_XOR(x[3], k_In[2]));
+            k_IV = k_In[3];
+        }
+        for (; B<s32_Blocks; B++, u8_In += 16, u8_Out += 16)
+        {
+            tBlock k_In = HW_LOAD(u8_In);
+            HW_STORE(u8_Out, HW_XOR(Crypt1(k_Keys, b_Decrypt, k_In), k_IV));
+            k_IV = k_In;
+        }
+    }
+    HW_STORE(u8_IV, k_IV);
+}
+
+#endif // AES_HW
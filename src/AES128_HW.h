@@ -0,0 +1,39 @@
+/**************************************************************************
+
+    AesHw: AES-128 with the AES instructions of the CPU (host build only)
+
+    x86-64:        AES-NI
+    aarch64 Linux: ARMv8 Crypto Extensions
+
+    IsSupported() checks the CPU once at runtime. The AES class uses this
+    code if the CPU has the instructions and falls back to the T-table
+    implementation otherwise (see AES::UseHardware()).
+
+    The round keys are passed as 11 x 16 byte in memory order:
+    for encryption the expanded key, for decryption the round keys of the
+    equivalent inverse cipher (FIPS 197 chapter 5.3.5) in the order they
+    are used. AES::ExpandKey() generates both.
+
+    CBC_RECEIVE does not chain the cipher, so 4 blocks are processed in
+    parallel which hides the latency of the AES instructions.
+
+**************************************************************************/
+
+#ifndef AES128_HW_H
+#define AES128_HW_H
+
+#include "DesFireKey.h"
+
+class AesHw
+{
+public:
+    static bool IsSupported();
+
+    static void CryptBlock(const byte* u8_Keys, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In);
+    // The same chaining as DESFireKey::CryptBlocks(). u8_IV (16 byte) is updated.
+    // u8_Out may be u8_In, or NULL with CBC_SEND if only the IV is needed.
+    static void CryptCBC  (const byte* u8_Keys, DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_IV,
+                           byte* u8_Out, const byte* u8_In, int s32_Blocks);
+};
+
+#endif // AES128_HW_H
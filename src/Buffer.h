@@ -17,7 +17,7 @@
 
 // These macros create a new buffer on the stack avoiding the use of the 'new' operator.
 // ATTENTION:
-// These macros will not work if you define the TxBuffer/RxBuffer as member of a class (see mi_CmacBuffer).
+// These macros will not work if you define the TxBuffer/RxBuffer as member of a class.
 // They compile only inside the code of a function.
 //
 // TX_BUFFER(i_SessKey, 16)
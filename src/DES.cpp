@@ -607,6 +607,7 @@ DES::~DES()
 
 bool DES::SetKeyData(const byte* u8_Key, int s32_KeySize, byte u8_Version)
 {
+    mb_CmacSubkeys = false; // the CMAC subkeys must be generated anew
     StoreKeyVersion(mu8_Key, u8_Key, s32_KeySize, u8_Version);
 
     DES_cblock* pk_Block = (DES_cblock*)mu8_Key;
@@ -648,50 +649,215 @@ bool DES::SetKeyData(const byte* u8_Key, int s32_KeySize, byte u8_Version)
 // 1 block = 8 bytes
 bool DES::CryptDataBlock(byte u8_Out[8], const byte u8_In[8], DESFireCipher e_Cipher)
 {
-    switch (ms32_KeySize)
+    if (ms32_KeySize == 0)
+        return false; // key not set
+
+    DES_LONG u32_Data[2];
+    c2l(u8_In, u32_Data[0]);
+    c2l(u8_In, u32_Data[1]);
+    Crypt3(u32_Data, e_Cipher);
+    l2c(u32_Data[0], u8_Out);
+    l2c(u32_Data[1], u8_Out);
+    return true;
+}
+
+// The 1 or 3 DES operations of the key on one block that has already been loaded into 2 words.
+void DES::Crypt3(DES_LONG u32_Data[2], DESFireCipher e_Cipher)
+{
+    Crypt3Lanes((DES_LONG(*)[2])u32_Data, 1, e_Cipher);
+}
+
+// The 1 or 3 DES operations on s32_Lanes (max DES_LANES) independent blocks.
+// IP and FP are executed only once for all 3 operations (they cancel out between the operations).
+// The rounds of the blocks are interleaved, so the CPU can overlap the table lookups of the different blocks.
+void DES::Crypt3Lanes(DES_LONG u32_Data[][2], int s32_Lanes, DESFireCipher e_Cipher)
+{
+    DES_key_schedule* pk_KS3 = (ms32_KeySize == 24) ? &mk_ks3 : &mk_ks1;
+
+    for (int L=0; L<s32_Lanes; L++)
     {
-        case 8: // simple DES
-            if (e_Cipher == KEY_ENCIPHER)
-            {
-                ecb_encrypt((DES_cblock*)u8_In, (DES_cblock*)u8_Out, &mk_ks1, DES_ENCRYPT);
-            }
-            else // KEY_DECIPHER
-            {
-                ecb_encrypt((DES_cblock*)u8_In, (DES_cblock*)u8_Out, &mk_ks1, DES_DECRYPT);
-            }
-            return true;
+        DES_LONG l = u32_Data[L][0];
+        DES_LONG r = u32_Data[L][1];
+        IP(l, r);
+        u32_Data[L][0] = l;
+        u32_Data[L][1] = r;
+    }
 
-        case 16: // 2K3DES
-            if (e_Cipher == KEY_ENCIPHER)
-            {
-                ecb_encrypt((DES_cblock*)u8_In,  (DES_cblock*)u8_Out, &mk_ks1, DES_ENCRYPT);
-                ecb_encrypt((DES_cblock*)u8_Out, (DES_cblock*)u8_Out, &mk_ks2, DES_DECRYPT);
-                ecb_encrypt((DES_cblock*)u8_Out, (DES_cblock*)u8_Out, &mk_ks1, DES_ENCRYPT);
-            }
-            else // KEY_DECIPHER
-            {
-                ecb_encrypt((DES_cblock*)u8_In,  (DES_cblock*)u8_Out, &mk_ks1, DES_DECRYPT);
-                ecb_encrypt((DES_cblock*)u8_Out, (DES_cblock*)u8_Out, &mk_ks2, DES_ENCRYPT);
-                ecb_encrypt((DES_cblock*)u8_Out, (DES_cblock*)u8_Out, &mk_ks1, DES_DECRYPT);
-            }
-            return true;
+    if (ms32_KeySize == 8) // simple DES
+    {
+        rounds(u32_Data, s32_Lanes, &mk_ks1, e_Cipher == KEY_ENCIPHER ? DES_ENCRYPT : DES_DECRYPT);
+    }
+    else if (e_Cipher == KEY_ENCIPHER)
+    {
+        rounds(u32_Data, s32_Lanes, &mk_ks1, DES_ENCRYPT);
+        rounds(u32_Data, s32_Lanes, &mk_ks2, DES_DECRYPT);
+        rounds(u32_Data, s32_Lanes, pk_KS3,  DES_ENCRYPT);
+    }
+    else // KEY_DECIPHER
+    {
+        rounds(u32_Data, s32_Lanes, pk_KS3,  DES_DECRYPT);
+        rounds(u32_Data, s32_Lanes, &mk_ks2, DES_ENCRYPT);
+        rounds(u32_Data, s32_Lanes, &mk_ks1, DES_DECRYPT);
+    }
 
-        case 24: // 3K3DES
-            if (e_Cipher == KEY_ENCIPHER)
-            {
-                ecb_encrypt((DES_cblock*)u8_In,  (DES_cblock*)u8_Out, &mk_ks1, DES_ENCRYPT);
-                ecb_encrypt((DES_cblock*)u8_Out, (DES_cblock*)u8_Out, &mk_ks2, DES_DECRYPT);
-                ecb_encrypt((DES_cblock*)u8_Out, (DES_cblock*)u8_Out, &mk_ks3, DES_ENCRYPT);
-            }
-            else // KEY_DECIPHER
+    for (int L=0; L<s32_Lanes; L++)
+    {
+        DES_LONG l = u32_Data[L][0];
+        DES_LONG r = u32_Data[L][1];
+        FP(r, l);
+        u32_Data[L][0] = l;
+        u32_Data[L][1] = r;
+    }
+}
+
+// The 16 rounds of encrypt1() without IP and FP, interleaved over s32_Lanes blocks (like DES_encrypt2() in OpenSSL)
+void DES::rounds(DES_LONG u32_Data[][2], int s32_Lanes, DES_key_schedule* ks, int enc)
+{
+    register DES_LONG t,u;
+    register DES_LONG *s = ks->ks->deslong;
+    DES_LONG l[DES_LANES], r[DES_LANES];
+
+    for (int L=0; L<s32_Lanes; L++)
+    {
+        r[L]=ROTATE(u32_Data[L][0],29)&0xffffffffL;
+        l[L]=ROTATE(u32_Data[L][1],29)&0xffffffffL;
+    }
+
+    if (enc) {
+        for (int i=0; i<32; i+=4) {
+            for (int L=0; L<s32_Lanes; L++) D_ENCRYPT(l[L],r[L],i+0);
+            for (int L=0; L<s32_Lanes; L++) D_ENCRYPT(r[L],l[L],i+2);
+        }
+    } else {
+        for (int i=30; i>0; i-=4) {
+            for (int L=0; L<s32_Lanes; L++) D_ENCRYPT(l[L],r[L],i-0);
+            for (int L=0; L<s32_Lanes; L++) D_ENCRYPT(r[L],l[L],i-2);
+        }
+    }
+
+    for (int L=0; L<s32_Lanes; L++)
+    {
+        u32_Data[L][0]=ROTATE(l[L],3)&0xffffffffL;
+        u32_Data[L][1]=ROTATE(r[L],3)&0xffffffffL;
+    }
+}
+
+// CBC over all blocks in one call without virtual calls and copies. The IV is kept in words while chaining.
+// u8_Out may be u8_In: each input block is loaded before the output block is stored.
+bool DES::CryptBlocks(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In, int s32_Blocks)
+{
+    if (ms32_KeySize == 0)
+        return false; // key not set
+
+    const byte* u8_Ptr = mu8_IV;
+    DES_LONG u32_IV[2], u32_Data[2];
+    c2l(u8_Ptr, u32_IV[0]);
+    c2l(u8_Ptr, u32_IV[1]);
+
+    for (int B=0; B<s32_Blocks; B++)
+    {
+        c2l(u8_In, u32_Data[0]);
+        c2l(u8_In, u32_Data[1]);
+        if (e_CBC == CBC_SEND)
+        {
+            u32_Data[0] ^= u32_IV[0];
+            u32_Data[1] ^= u32_IV[1];
+            Crypt3(u32_Data, e_Cipher);
+            u32_IV[0] = u32_Data[0];
+            u32_IV[1] = u32_Data[1];
+        }
+        else // CBC_RECEIVE
+        {
+            DES_LONG u32_Next0 = u32_Data[0];
+            DES_LONG u32_Next1 = u32_Data[1];
+            Crypt3(u32_Data, e_Cipher);
+            u32_Data[0] ^= u32_IV[0];
+            u32_Data[1] ^= u32_IV[1];
+            u32_IV[0] = u32_Next0;
+            u32_IV[1] = u32_Next1;
+        }
+
+        if (u8_Out) // NULL for a CMAC
+        {
+            l2c(u32_Data[0], u8_Out);
+            l2c(u32_Data[1], u8_Out);
+        }
+    }
+
+    byte* u8_IV = mu8_IV;
+    l2c(u32_IV[0], u8_IV);
+    l2c(u32_IV[1], u8_IV);
+    return true;
+}
+
+// Batch engine: s32_Count independent blocks (ECB), DES_LANES at a time.
+// The key schedules have been computed once in SetKeyData() and are used for all blocks.
+bool DES::CryptBlocksECB(byte* u8_Out, const byte* u8_In, int s32_Count, DESFireCipher e_Cipher)
+{
+    if (ms32_KeySize == 0)
+        return false; // key not set
+
+    DES_LONG u32_Data[DES_LANES][2];
+    while (s32_Count > 0)
+    {
+        int s32_Lanes = min(s32_Count, DES_LANES);
+        for (int L=0; L<s32_Lanes; L++)
+        {
+            c2l(u8_In, u32_Data[L][0]);
+            c2l(u8_In, u32_Data[L][1]);
+        }
+        Crypt3Lanes(u32_Data, s32_Lanes, e_Cipher);
+        for (int L=0; L<s32_Lanes; L++)
+        {
+            l2c(u32_Data[L][0], u8_Out);
+            l2c(u32_Data[L][1], u8_Out);
+        }
+        s32_Count -= s32_Lanes;
+    }
+    return true;
+}
+
+// Batch engine: s32_Count independent CBC encryptions with a zero IV (e.g. CMACs of prepared messages).
+// u8_Msgs contains s32_Count messages of s32_MsgLen bytes each (a multiple of 8).
+// The last encrypted block of each message is written to u8_Macs (8 bytes per message).
+// The IV of this key is not used and not modified.
+bool DES::EncryptBatchCBC(const byte* u8_Msgs, int s32_MsgLen, int s32_Count, byte* u8_Macs)
+{
+    if (ms32_KeySize == 0 || s32_MsgLen < 8 || s32_MsgLen % 8)
+        return false;
+
+    DES_LONG u32_Data[DES_LANES][2];
+    while (s32_Count > 0)
+    {
+        int s32_Lanes = min(s32_Count, DES_LANES);
+        for (int L=0; L<s32_Lanes; L++)
+        {
+            u32_Data[L][0] = 0;
+            u32_Data[L][1] = 0;
+        }
+
+        // All lanes advance one block at a time, the chaining of each lane stays in u32_Data
+        for (int P=0; P<s32_MsgLen; P+=8)
+        {
+            for (int L=0; L<s32_Lanes; L++)
             {
-                ecb_encrypt((DES_cblock*)u8_In,  (DES_cblock*)u8_Out, &mk_ks3, DES_DECRYPT);
-                ecb_encrypt((DES_cblock*)u8_Out, (DES_cblock*)u8_Out, &mk_ks2, DES_ENCRYPT);
-                ecb_encrypt((DES_cblock*)u8_Out, (DES_cblock*)u8_Out, &mk_ks1, DES_DECRYPT);
+                const byte* u8_In = u8_Msgs + L * s32_MsgLen + P;
+                DES_LONG u32_Word;
+                c2l(u8_In, u32_Word); u32_Data[L][0] ^= u32_Word;
+                c2l(u8_In, u32_Word); u32_Data[L][1] ^= u32_Word;
             }
-            return true;
+            Crypt3Lanes(u32_Data, s32_Lanes, KEY_ENCIPHER);
+        }
+
+        for (int L=0; L<s32_Lanes; L++)
+        {
+            l2c(u32_Data[L][0], u8_Macs);
+            l2c(u32_Data[L][1], u8_Macs);
+        }
+        u8_Msgs   += s32_Lanes * s32_MsgLen;
+        s32_Count -= s32_Lanes;
     }
-    return false; // key not set
+    return true;
 }
 
 // The 8 bit version number is stored in the parity bit (bit 0) of the first 8 bytes of the key.
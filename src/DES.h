@@ -3,6 +3,8 @@
 
 #include "DesFireKey.h"
 
+#define DES_LANES  4  // blocks processed interleaved by the batch engine
+
 class DES : public DESFireKey
 {
 public:
@@ -10,6 +12,11 @@ public:
     ~DES();
     bool SetKeyData(const byte* u8_Key, int s32_KeySize, byte u8_Version);
     bool CryptDataBlock(byte u8_Out[8], const byte u8_In[8], DESFireCipher e_Cipher);
+    bool CryptBlocks(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In, int s32_Blocks);
+
+    // Batch engine for many independent blocks with the same key (e.g. bulk key diversification)
+    bool CryptBlocksECB (byte* u8_Out, const byte* u8_In, int s32_Count, DESFireCipher e_Cipher);
+    bool EncryptBatchCBC(const byte* u8_Msgs, int s32_MsgLen, int s32_Count, byte* u8_Macs);
 
 private:
     enum DES_MODE
@@ -34,6 +41,9 @@ private:
     static void set_key(const DES_cblock* key, DES_key_schedule* schedule);
     static void ecb_encrypt(const DES_cblock* in, DES_cblock* out, DES_key_schedule* ks, int enc);
     static void encrypt1(DES_LONG* data, DES_key_schedule* ks, int enc);
+    static void rounds(DES_LONG u32_Data[][2], int s32_Lanes, DES_key_schedule* ks, int enc);
+    void Crypt3     (DES_LONG u32_Data[2], DESFireCipher e_Cipher);
+    void Crypt3Lanes(DES_LONG u32_Data[][2], int s32_Lanes, DESFireCipher e_Cipher);
 
     DES_key_schedule mk_ks1; // first  component of a TDEA key
     DES_key_schedule mk_ks2; // second component of a TDEA key
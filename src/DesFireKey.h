@@ -47,6 +47,8 @@ public:
         ms32_BlockSize = 0;
         mu8_Version    = 0;
         me_KeyType     = DF_KEY_INVALID;
+        ms32_CmacFill  = 0;
+        mb_CmacSubkeys = false;
     }
     virtual ~DESFireKey()
     {
@@ -72,14 +74,22 @@ public:
             return false;
         }
 
+        return CryptBlocks(e_CBC, e_Cipher, u8_Out, u8_In, s32_ByteCount / ms32_BlockSize);
+    }
+
+    // The CBC chaining of CryptDataCBC() and the CMAC for s32_Blocks blocks.
+    // u8_Out may be u8_In (in place). With CBC_SEND u8_Out may be NULL: only the IV is calculated (CMAC).
+    // AES and DES override this and chain all blocks inside the cipher without a virtual call per block.
+    virtual bool CryptBlocks(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In, int s32_Blocks)
+    {
         byte u8_Temp[16];
-        for (int B=0; B<s32_ByteCount/ms32_BlockSize; B++)
+        for (int B=0; B<s32_Blocks; B++)
         {
             if (e_CBC == CBC_SEND)
             {
                 Utils::XorDataBlock(u8_Temp, u8_In, mu8_IV, ms32_BlockSize);
-                if (!CryptDataBlock(u8_Out, u8_Temp, e_Cipher)) return false;
-                memcpy(mu8_IV, u8_Out, ms32_BlockSize);
+                if (!CryptDataBlock(mu8_IV, u8_Temp, e_Cipher)) return false;
+                if (u8_Out) memcpy(u8_Out, mu8_IV, ms32_BlockSize);
             }
             else // CBC_RECEIVE
             {
@@ -88,20 +98,24 @@ public:
                 memcpy(mu8_IV, u8_In,   ms32_BlockSize);                       // Step 2 (mu8_IV can be changed now, u8_In has not yet been modified)
                 memcpy(u8_Out, u8_Temp, ms32_BlockSize);                       // Step 3 (here also u8_In is modified if u8_Out and u8_In are the same buffer)
             }
-            u8_In  += ms32_BlockSize;
-            u8_Out += ms32_BlockSize;
+            u8_In += ms32_BlockSize;
+            if (u8_Out) u8_Out += ms32_BlockSize;
         }
         return true;
     }
 
     // Generates the two subkeys mu8_Cmac1 and mu8_Cmac2 that are used for CMAC calulation with the session key
+    // The IV of the session is preserved. It must chain over all commands and responses of the session.
+    // The subkeys depend only on the key, so they are generated once after each SetKeyData().
     bool GenerateCmacSubkeys()
     {
+        if (mb_CmacSubkeys)
+            return true;
+
         uint8_t u8_R = (ms32_BlockSize == 8) ? 0x1B : 0x87;
         uint8_t u8_Data[16] = {0};
 
-        ClearIV();
-        if (!CryptDataCBC(CBC_RECEIVE, KEY_ENCIPHER, u8_Data, u8_Data, ms32_BlockSize))
+        if (!CryptDataBlock(u8_Data, u8_Data, KEY_ENCIPHER))
             return false;
 
         memcpy (mu8_Cmac1, u8_Data, ms32_BlockSize);
@@ -114,43 +128,117 @@ public:
         if (mu8_Cmac1[0] & 0x80)
             mu8_Cmac2[ms32_BlockSize-1] ^= u8_R;
 
+        mb_CmacSubkeys = true;
         return true;
     }
 
     // Calculate the CMAC (Cipher-based Message Authentication Code) from the given data.
     // The CMAC is the initialization vector (IV) after a CBC encryption of the given data.
-    // ATTENTION: The content of i_Buffer will be modified!!
+    // The content of i_Buffer is not modified.
     bool CalculateCmac(TxBuffer& i_Buffer, byte u8_Cmac[16])
     {
-        // If the data length is not a multiple of the block size -> pad the buffer with 80,00,00,00,....
-        GenerateCmacSubkeys();
-        if ((i_Buffer.GetCount() == 0) || (i_Buffer.GetCount() % ms32_BlockSize))
+        return CmacBegin() &&
+               CmacUpdate(i_Buffer.GetData(), i_Buffer.GetCount()) &&
+               CmacFinal(u8_Cmac);
+    }
+
+    // The CMAC of NXP AN10922 (key diversification): starts with a zero IV and the message is always padded to
+    // 2 blocks (the standard CMAC pads a message that fits into 1 block only to 1 block).
+    // s32_Length must not exceed 2 blocks (AES: 32 bytes, DES: 16 bytes).
+    bool CalculateDiversifyCmac(const byte* u8_Data, int s32_Length, byte u8_Cmac[16])
+    {
+        byte u8_Msg[32];
+        if (!PrepareDiversifyMsg(u8_Data, s32_Length, u8_Msg))
+            return false;
+
+        ClearIV();
+        if (!CryptBlocks(CBC_SEND, KEY_ENCIPHER, NULL, u8_Msg, 2))
+            return false;
+
+        memcpy(u8_Cmac, mu8_IV, ms32_BlockSize);
+        return true;
+    }
+
+    // The 2 blocks that CalculateDiversifyCmac() encrypts with CBC and a zero IV: padded and XOR-ed with a subkey.
+    // A batch engine can encrypt many of them with the same key (see KeyDiversifier::DiversifyBatch()).
+    bool PrepareDiversifyMsg(const byte* u8_Data, int s32_Length, byte u8_Msg[32])
+    {
+        int s32_MsgLen = 2 * ms32_BlockSize;
+        if (s32_Length < 0 || s32_Length > s32_MsgLen || !GenerateCmacSubkeys())
+            return false;
+
+        memcpy(u8_Msg, u8_Data, s32_Length);
+        if (s32_Length < s32_MsgLen) // pad with 80,00,00,00,....
+        {
+            u8_Msg[s32_Length] = 0x80;
+            memset(u8_Msg + s32_Length + 1, 0, s32_MsgLen - s32_Length - 1);
+            Utils::XorDataBlock(u8_Msg + ms32_BlockSize, mu8_Cmac2, ms32_BlockSize);
+        }
+        else
         {
-            if (!i_Buffer.AppendUint8(0x80)) {
-                Utils::Print("1");
+            Utils::XorDataBlock(u8_Msg + ms32_BlockSize, mu8_Cmac1, ms32_BlockSize);
+        }
+        return true;
+    }
+
+    // Incremental CMAC: CmacBegin(), then CmacUpdate() for each chunk of the message, then CmacFinal().
+    // The chunks may have any length. Only the last block is kept in mu8_CmacBlock because it must be
+    // XOR-ed with a subkey, all others are encrypted immediately where they are (no copy).
+    // So the message length is not limited by a buffer and it can be received in multiple frames.
+    // The calculation starts with the current IV of the session key.
+    bool CmacBegin()
+    {
+        ms32_CmacFill = 0;
+        return GenerateCmacSubkeys();
+    }
 
-                return false; // Buffer is full
+    bool CmacUpdate(const byte* u8_Data, int s32_Length)
+    {
+        while (s32_Length > 0)
+        {
+            if (ms32_CmacFill == ms32_BlockSize) // more data follows -> this is not the last block
+            {
+                if (!CmacBlock(mu8_CmacBlock))
+                    return false;
+                ms32_CmacFill = 0;
             }
 
-            while (i_Buffer.GetCount() % ms32_BlockSize)
+            // Complete blocks that are followed by more data are encrypted directly from u8_Data in one call
+            if (ms32_CmacFill == 0 && s32_Length > ms32_BlockSize)
             {
-                if (!i_Buffer.AppendUint8(0x00)) {
-                    Utils::Print("2");
-                    return false; // Buffer is full
-                }
+                int s32_Blocks = (s32_Length - 1) / ms32_BlockSize;
+                if (!CryptBlocks(CBC_SEND, KEY_ENCIPHER, NULL, u8_Data, s32_Blocks))
+                    return false;
+                u8_Data    += s32_Blocks * ms32_BlockSize;
+                s32_Length -= s32_Blocks * ms32_BlockSize;
+                continue;
             }
 
-            Utils::XorDataBlock(i_Buffer + i_Buffer.GetCount() - ms32_BlockSize, mu8_Cmac2, ms32_BlockSize);
+            int s32_Copy = min(s32_Length, ms32_BlockSize - ms32_CmacFill);
+            memcpy(mu8_CmacBlock + ms32_CmacFill, u8_Data, s32_Copy);
+            ms32_CmacFill += s32_Copy;
+            u8_Data       += s32_Copy;
+            s32_Length    -= s32_Copy;
+        }
+        return true;
+    }
+
+    bool CmacFinal(byte u8_Cmac[16])
+    {
+        if (ms32_CmacFill < ms32_BlockSize) // pad with 80,00,00,00,....
+        {
+            mu8_CmacBlock[ms32_CmacFill] = 0x80;
+            memset(mu8_CmacBlock + ms32_CmacFill + 1, 0, ms32_BlockSize - ms32_CmacFill - 1);
+            Utils::XorDataBlock(mu8_CmacBlock, mu8_Cmac2, ms32_BlockSize);
         }
         else // no padding required
         {
-            Utils::XorDataBlock(i_Buffer + i_Buffer.GetCount() - ms32_BlockSize, mu8_Cmac1, ms32_BlockSize);
+            Utils::XorDataBlock(mu8_CmacBlock, mu8_Cmac1, ms32_BlockSize);
         }
+        ms32_CmacFill = 0;
 
-        if (!CryptDataCBC(CBC_SEND, KEY_ENCIPHER, i_Buffer, i_Buffer, i_Buffer.GetCount())) {
-            Utils::Print("3");
+        if (!CmacBlock(mu8_CmacBlock))
             return false;
-        }
 
         memcpy(u8_Cmac, mu8_IV, ms32_BlockSize);
         return true;
@@ -249,6 +337,12 @@ public:
     }
 
 protected:
+    // One CBC step of the CMAC: IV = Encrypt(IV XOR block)
+    bool CmacBlock(const byte* u8_Block)
+    {
+        return CryptBlocks(CBC_SEND, KEY_ENCIPHER, NULL, u8_Block, 1);
+    }
+
     byte mu8_IV[16];  // Initialization Vector for CBC
     byte mu8_Key[24];
     int  ms32_KeySize;
@@ -258,6 +352,10 @@ protected:
 
     byte mu8_Cmac1[16]; // CMAC subkey 1
     byte mu8_Cmac2[16]; // CMAC subkey 2
+    bool mb_CmacSubkeys; // mu8_Cmac1 and mu8_Cmac2 are valid for the current key
+
+    byte mu8_CmacBlock[16]; // the last block of an incremental CMAC (CmacUpdate())
+    int  ms32_CmacFill;     // bytes in mu8_CmacBlock
 };
 
 #endif // DESFIRE_KEY_H
\ No newline at end of file
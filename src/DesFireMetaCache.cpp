@@ -0,0 +1,160 @@
+/**************************************************************************
+
+    class DesFireMetaCache: the card structure of recently seen DESFire cards (see DesFireMetaCache.h)
+
+**************************************************************************/
+
+#include "DesFireMetaCache.h"
+#include <string.h>
+
+DesFireMetaCache::DesFireMetaCache(DESFireMetaEntry* pk_Entries, int s32_Count)
+{
+    mpk_Entries = pk_Entries;
+    ms32_Count  = s32_Count;
+    Clear();
+}
+
+void DesFireMetaCache::Clear()
+{
+    memset(mpk_Entries, 0, ms32_Count * sizeof(DESFireMetaEntry));
+    mu32_Tick   = 0;
+    mu32_Hits   = 0;
+    mu32_Misses = 0;
+}
+
+DESFireMetaEntry* DesFireMetaCache::Find(const byte u8_UID[7])
+{
+    for (int i=0; i<ms32_Count; i++)
+    {
+        DESFireMetaEntry* pk_Entry = &mpk_Entries[i];
+        if (pk_Entry->u32_Used > 0 && memcmp(pk_Entry->u8_UID, u8_UID, 7) == 0)
+        {
+            pk_Entry->u32_Used = ++mu32_Tick;
+            return pk_Entry;
+        }
+    }
+    return NULL;
+}
+
+DESFireMetaEntry* DesFireMetaCache::Create(const byte u8_UID[7], uint32_t u32_FreeMemory)
+{
+    if (ms32_Count == 0)
+        return NULL;
+
+    DESFireMetaEntry* pk_Entry = Find(u8_UID);
+    if (!pk_Entry)
+    {
+        pk_Entry = &mpk_Entries[0];
+        for (int i=1; i<ms32_Count; i++)
+        {
+            if (mpk_Entries[i].u32_Used < pk_Entry->u32_Used)
+                pk_Entry = &mpk_Entries[i];
+        }
+    }
+
+    memset(pk_Entry, 0, sizeof(DESFireMetaEntry));
+    memcpy(pk_Entry->u8_UID, u8_UID, 7);
+    pk_Entry->u32_Used       = ++mu32_Tick;
+    pk_Entry->u32_FreeMemory = u32_FreeMemory;
+    return pk_Entry;
+}
+
+void DesFireMetaCache::Drop(const byte u8_UID[7])
+{
+    DESFireMetaEntry* pk_Entry = Find(u8_UID);
+    if (pk_Entry)
+        memset(pk_Entry, 0, sizeof(DESFireMetaEntry));
+}
+
+// ================================== PN532 CLASS ==================================
+
+bool DesFireMetaCache::GetAppIDs(DESFireMetaEntry* pk_Entry, uint32_t u32_IDlist[28], byte* pu8_AppCount)
+{
+    if (!pk_Entry->b_AppIDs)
+    {
+        mu32_Misses ++;
+        return false;
+    }
+
+    memcpy(u32_IDlist, pk_Entry->u32_AppIDs, pk_Entry->u8_AppCount * sizeof(uint32_t));
+    *pu8_AppCount = pk_Entry->u8_AppCount;
+    mu32_Hits ++;
+    return true;
+}
+
+bool DesFireMetaCache::GetFileIDs(DESFireMetaEntry* pk_Entry, uint32_t u32_AppID, byte* u8_FileIDs, byte* pu8_FileCount)
+{
+    for (int A=0; A<pk_Entry->u8_Apps; A++)
+    {
+        DESFireMetaApp* pk_App = &pk_Entry->k_Apps[A];
+        if (pk_App->u32_AppID == u32_AppID)
+        {
+            memcpy(u8_FileIDs, pk_App->u8_FileIDs, pk_App->u8_FileCount);
+            *pu8_FileCount = pk_App->u8_FileCount;
+            mu32_Hits ++;
+            return true;
+        }
+    }
+    mu32_Misses ++;
+    return false;
+}
+
+bool DesFireMetaCache::GetFileSettings(DESFireMetaEntry* pk_Entry, uint32_t u32_AppID, byte u8_FileID, byte* u8_Settings, int* ps32_Length)
+{
+    for (int F=0; F<pk_Entry->u8_Files; F++)
+    {
+        DESFireMetaFile* pk_File = &pk_Entry->k_Files[F];
+        if (pk_File->u32_AppID == u32_AppID && pk_File->u8_FileID == u8_FileID)
+        {
+            memcpy(u8_Settings, pk_File->u8_Settings, pk_File->u8_Length);
+            *ps32_Length = pk_File->u8_Length;
+            mu32_Hits ++;
+            return true;
+        }
+    }
+    mu32_Misses ++;
+    return false;
+}
+
+void DesFireMetaCache::PutAppIDs(DESFireMetaEntry* pk_Entry, const uint32_t* u32_IDlist, byte u8_AppCount)
+{
+    if (u8_AppCount > DESFIRE_META_APPS)
+        return;
+
+    memcpy(pk_Entry->u32_AppIDs, u32_IDlist, u8_AppCount * sizeof(uint32_t));
+    pk_Entry->u8_AppCount = u8_AppCount;
+    pk_Entry->b_AppIDs    = true;
+}
+
+void DesFireMetaCache::PutFileIDs(DESFireMetaEntry* pk_Entry, uint32_t u32_AppID, const byte* u8_FileIDs, byte u8_FileCount)
+{
+    if (u8_FileCount > DESFIRE_META_FILES || pk_Entry->u8_Apps == DESFIRE_META_APPS)
+        return;
+
+    DESFireMetaApp* pk_App = &pk_Entry->k_Apps[pk_Entry->u8_Apps++];
+    pk_App->u32_AppID    = u32_AppID;
+    pk_App->u8_FileCount = u8_FileCount;
+    memcpy(pk_App->u8_FileIDs, u8_FileIDs, u8_FileCount);
+}
+
+void DesFireMetaCache::PutFileSettings(DESFireMetaEntry* pk_Entry, uint32_t u32_AppID, byte u8_FileID, const byte* u8_Settings, int s32_Length)
+{
+    if (s32_Length > DESFIRE_META_SETTINGS || pk_Entry->u8_Files == DESFIRE_META_FILES)
+        return;
+
+    DESFireMetaFile* pk_File = &pk_Entry->k_Files[pk_Entry->u8_Files++];
+    pk_File->u32_AppID = u32_AppID;
+    pk_File->u8_FileID = u8_FileID;
+    pk_File->u8_Length = (byte)s32_Length;
+    memcpy(pk_File->u8_Settings, u8_Settings, s32_Length);
+}
+
+uint32_t DesFireMetaCache::GetHits()
+{
+    return mu32_Hits;
+}
+
+uint32_t DesFireMetaCache::GetMisses()
+{
+    return mu32_Misses;
+}
@@ -0,0 +1,119 @@
+/**************************************************************************
+
+    DesFireMetaCache: the card structure of recently seen DESFire cards
+
+    GetApplicationIDs(), GetFileIDs() and GetFileSettings() return the
+    same result every time the same card is presented. With a cache
+    attached to the PN532 class (PN532::SetMetadataCache()) they are
+    answered from RAM after the first time:
+
+        static DESFireMetaEntry k_Entries[200];
+        static DesFireMetaCache i_Cache(k_Entries, 200);
+        i_Nfc.SetMetadataCache(&i_Cache);
+
+    The cache is keyed by the 7 byte UID of the card (cards with random
+    ID are not cached). An entry stores the raw responses of the card:
+    up to DESFIRE_META_APPS application IDs, the file IDs of up to
+    DESFIRE_META_APPS applications and the settings of up to
+    DESFIRE_META_FILES standard or backup data files (the settings of
+    value and record files contain values that change with each
+    transaction). What does not fit is always read from the card.
+    If all entries are used the least recently used is replaced.
+    One cache must not be shared by several PN532 instances.
+
+    Validation: with the first cached command after each activation of
+    the card the PN532 class reads the free memory of the card (1 round
+    trip) and drops the entry if it has changed. Each created file or
+    application changes the free memory, FormatPICC restores it.
+    CreateApplication(), DeleteApplication(), CreateStdDataFile(),
+    DeleteFile() and FormatCard() of this library drop the entry directly.
+    Not detected: a file or application that another reader has deleted
+    (DESFire does not free its memory before FormatPICC) or file settings
+    changed by another reader.
+
+    A cached command returns the data even if the card would require an
+    authentication for it now. The data was returned by the same card
+    before. The free memory requires DESFire EV1 or later: on older
+    cards the cache is not used and the failed command drops the
+    authentication.
+
+**************************************************************************/
+
+#ifndef DESFIRE_META_CACHE_H
+#define DESFIRE_META_CACHE_H
+
+#include "Utils.h"
+#include <stdint.h>
+
+#ifndef DESFIRE_META_APPS
+    #define DESFIRE_META_APPS   4   // application IDs and file ID lists per card
+#endif
+#ifndef DESFIRE_META_FILES
+    #define DESFIRE_META_FILES  8   // file settings per card, file IDs per application
+#endif
+#define DESFIRE_META_SETTINGS   7   // GetFileSettings of a data file
+
+struct DESFireMetaApp
+{
+    uint32_t u32_AppID;
+    byte     u8_FileCount;
+    byte     u8_FileIDs[DESFIRE_META_FILES];
+};
+
+struct DESFireMetaFile
+{
+    uint32_t u32_AppID;
+    byte     u8_FileID;
+    byte     u8_Length;  // of u8_Settings
+    byte     u8_Settings[DESFIRE_META_SETTINGS];
+};
+
+struct DESFireMetaEntry
+{
+    byte            u8_UID[7];
+    uint32_t        u32_Used;        // DesFireMetaCache tick of the last access, 0 = empty
+    uint32_t        u32_FreeMemory;  // when the entry was created
+    bool            b_AppIDs;        // u32_AppIDs is valid
+    byte            u8_AppCount;
+    uint32_t        u32_AppIDs[DESFIRE_META_APPS];
+    byte            u8_Apps;         // valid entries in k_Apps
+    DESFireMetaApp  k_Apps [DESFIRE_META_APPS];
+    byte            u8_Files;        // valid entries in k_Files
+    DESFireMetaFile k_Files[DESFIRE_META_FILES];
+};
+
+class DesFireMetaCache
+{
+public:
+    // The entries are not copied. They must stay valid while the cache is used.
+    DesFireMetaCache(DESFireMetaEntry* pk_Entries, int s32_Count);
+    void Clear();
+
+    // Returns NULL if the card is not in the cache
+    DESFireMetaEntry* Find(const byte u8_UID[7]);
+    // Returns an empty entry for the card (the least recently used entry is replaced)
+    DESFireMetaEntry* Create(const byte u8_UID[7], uint32_t u32_FreeMemory);
+    void Drop(const byte u8_UID[7]);
+
+    // ---------- called by the PN532 class ----------
+    // Returns false if the data is not in the cache
+    bool GetAppIDs     (DESFireMetaEntry* pk_Entry, uint32_t u32_IDlist[28], byte* pu8_AppCount);
+    bool GetFileIDs    (DESFireMetaEntry* pk_Entry, uint32_t u32_AppID, byte* u8_FileIDs, byte* pu8_FileCount);
+    bool GetFileSettings(DESFireMetaEntry* pk_Entry, uint32_t u32_AppID, byte u8_FileID, byte* u8_Settings, int* ps32_Length);
+    // Store the response of the card if there is space
+    void PutAppIDs     (DESFireMetaEntry* pk_Entry, const uint32_t* u32_IDlist, byte u8_AppCount);
+    void PutFileIDs    (DESFireMetaEntry* pk_Entry, uint32_t u32_AppID, const byte* u8_FileIDs, byte u8_FileCount);
+    void PutFileSettings(DESFireMetaEntry* pk_Entry, uint32_t u32_AppID, byte u8_FileID, const byte* u8_Settings, int s32_Length);
+
+    uint32_t GetHits();
+    uint32_t GetMisses();
+
+private:
+    DESFireMetaEntry* mpk_Entries;
+    int               ms32_Count;
+    uint32_t          mu32_Tick;
+    uint32_t          mu32_Hits;
+    uint32_t          mu32_Misses;
+};
+
+#endif
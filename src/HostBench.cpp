@@ -0,0 +1,784 @@
+/**************************************************************************
+
+    Host benchmark for the native Linux build ([env:host] in platformio.ini)
+
+    Runs the host side code of the library against PN532_SIM and measures
+    the latency of the most important code paths with micros().
+    The DESFire commands run against SimDesfire, a virtual DESFire EV1 card
+    which verifies the CMAC, the CRC and the IV chaining like a real card.
+    The MIFARE Classic and NTAG commands run against SimMifareClassic and
+    SimUltralight (real Crypto1 authentication, access conditions, lock bits).
+    The simulated chip answers instantly, so the results show only the cost
+    of the host code (frame building, parsing, CMAC, CBC, debug output).
+
+    Run:  pio run -e host && .pio/build/host/program [runs]
+
+    With a USB-UART PN532 board the same benchmarks run on real hardware
+    over PN532_TTY (a card must be in the field for ReadPassiveTargetID):
+          .pio/build/host/program [runs] /dev/ttyUSB0
+    or, built with -DPROTOCOL=PROT_I2C / PROT_SPI, over PN532_I2CDEV or
+    PN532_SPIDEV (prints the bus transactions and bytes per run):
+          .pio/build/host/program [runs] /dev/i2c-1
+          .pio/build/host/program [runs] /dev/spidev0.0
+    With I2C / SPI the IRQ line of the PN532 can be connected to a GPIO:
+          .pio/build/host/program [runs] /dev/i2c-1 /dev/gpiochip0:25
+
+    To compare the transports on identical workloads build the host
+    environment once more with -DPROTOCOL=PROT_I2C or PROT_SPI instead of PROT_HSU.
+
+**************************************************************************/
+
+#ifdef PN532_HOST
+
+#include "PN532.h"
+#include "PN532_SIM.h"
+#include "PN532_LOG.h"
+#include "PN532_ASYNC.h"
+#include "PN532_TRACE.h"
+#include "PN532_TTY.h"
+#include "PN532_I2CDEV.h"
+#include "PN532_SPIDEV.h"
+#include "PN532_GPIO.h"
+#include "KeyDiversifier.h"
+#include "SimDesfire.h"
+#include "SimMifare.h"
+
+// A minimal ISO14443-4 card that answers every DESFire command with "Success" and no data.
+// It allows to measure DataExchange() without any card side processing.
+class BenchCard : public SimCard
+{
+public:
+    uint16_t GetATQA() { return 0x0344; }
+    byte     GetSAK()  { return 0x20; }
+    int GetUID(byte u8_UID[10])
+    {
+        static const byte u8_Uid[] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+        memcpy(u8_UID, u8_Uid, sizeof(u8_Uid));
+        return sizeof(u8_Uid);
+    }
+    int Transceive(const byte* u8_Command, int s32_CmdLen, byte* u8_Response, int s32_RespSize)
+    {
+        (void)u8_Command;
+        (void)s32_CmdLen;
+        (void)s32_RespSize;
+        u8_Response[0] = 0x00; // ST_Success
+        return 1;
+    }
+};
+
+static PN532_SIM gi_Sim;
+static PN532     gi_Nfc(gi_Sim);
+static bool      gb_Hardware = false;
+
+#if defined(__linux__) && PROTOCOL == PROT_HSU
+    #define HARDWARE_LINK  PN532_TTY
+#elif defined(__linux__) && PROTOCOL == PROT_I2C
+    #define HARDWARE_LINK  PN532_I2CDEV
+#elif defined(__linux__) && PROTOCOL == PROT_SPI
+    #define HARDWARE_LINK  PN532_SPIDEV
+#endif
+
+#if defined(HARDWARE_LINK) && PROTOCOL != PROT_HSU
+    static HARDWARE_LINK* gpi_BusLink = NULL; // bus statistics of the hardware run
+#endif
+
+// Calls f() s32_Count times and prints min / avg / max latency and the link statistics per call.
+template <typename F> static void RunBench(const char* s8_Name, int s32_Count, F f)
+{
+    uint32_t u32_Min = 0xFFFFFFFF;
+    uint32_t u32_Max = 0;
+    uint64_t u64_Sum = 0;
+    int      s32_Failed = 0;
+
+    gi_Sim.ResetStats();
+#if defined(HARDWARE_LINK) && PROTOCOL != PROT_HSU
+    if (gpi_BusLink) gpi_BusLink->ResetBusStats();
+#endif
+    // A single call is often shorter than 1 us, so the average is calculated from the total time of all calls.
+    uint32_t u32_Total = micros();
+    for (int i = 0; i < s32_Count; i++)
+    {
+        uint32_t u32_Start = micros();
+        if (!f()) s32_Failed ++;
+        uint32_t u32_Elapsed = micros() - u32_Start;
+
+        u32_Min = min(u32_Min, u32_Elapsed);
+        u32_Max = max(u32_Max, u32_Elapsed);
+    }
+    u64_Sum = micros() - u32_Total;
+
+    printf("%-28s %7d runs  min %7u us  avg %9.2f us  max %7u us",
+           s8_Name, s32_Count, u32_Min, (double)u64_Sum / s32_Count, u32_Max);
+
+    // The link statistics exist only for the simulated PN532
+    if (!gb_Hardware)
+    {
+        SimStats k_Stats;
+        gi_Sim.GetStats(&k_Stats);
+        printf("  frames/run %5.2f  bytes/run %7.1f  short reads %u",
+               (double)k_Stats.u32_Frames / s32_Count,
+               (double)(k_Stats.u32_BytesToChip + k_Stats.u32_BytesToHost) / s32_Count,
+               k_Stats.u32_ShortReads);
+    }
+#if defined(HARDWARE_LINK) && PROTOCOL != PROT_HSU
+    if (gpi_BusLink)
+    {
+        PN532BusStats k_Bus;
+        gpi_BusLink->GetBusStats(&k_Bus);
+        printf("  transactions/run %6.2f  bus bytes/run %7.1f  busy polls/run %6.2f",
+               (double)k_Bus.u32_Transactions / s32_Count,
+               (double)k_Bus.u32_BusBytes     / s32_Count,
+               (double)k_Bus.u32_ReadyPolls   / s32_Count);
+    }
+#endif
+    printf("%s\n", s32_Failed ? "  *** FAILED" : "");
+}
+
+// Derives the key of the AN10922 example card with the first s32_SysIdLen bytes of the System Identifier
+// "NXP Abu" and compares it with the known answer. The second call must return the same key from the cache.
+static bool CheckDiversify(KeyDiversifier* pi_Diversifier, DESFireKey* pi_Master, int s32_SysIdLen, const byte* u8_Expect)
+{
+    static const byte u8_Uid[7]   = {0x04, 0x78, 0x2E, 0x21, 0x80, 0x1D, 0x80};
+    static const byte u8_SysId[7] = {0x4E, 0x58, 0x50, 0x20, 0x41, 0x62, 0x75};
+
+    byte u8_Input[DIVERSIFY_MAX_INPUT];
+    byte u8_Key[24];
+    byte u8_Cached[24];
+    int  s32_InputLen = KeyDiversifier::BuildInput(u8_Input, u8_Uid, 7, 0xF54230, u8_SysId, s32_SysIdLen);
+    if (!pi_Diversifier->SetMasterKey(pi_Master) ||
+        !pi_Diversifier->Diversify(u8_Input, s32_InputLen, u8_Key) ||
+        !pi_Diversifier->Diversify(u8_Input, s32_InputLen, u8_Cached))
+        return false;
+
+    int s32_KeySize = pi_Diversifier->GetKeySize();
+#if DIVERSIFY_CACHE_SIZE > 0
+    if (pi_Diversifier->GetCacheMisses() != 1 || pi_Diversifier->GetCacheHits() != 1)
+        return false;
+#endif
+    return memcmp(u8_Key, u8_Expect, s32_KeySize) == 0 && memcmp(u8_Cached, u8_Expect, s32_KeySize) == 0;
+}
+
+// DiversifyBatch() must derive the same keys as Diversify() card by card.
+// A count that is not a multiple of DIVERSIFY_BATCH_UIDS and DES_LANES also tests the incomplete last batch.
+static bool CheckDiversifyBatch(KeyDiversifier* pi_Diversifier, DESFireKey* pi_Master, const byte* u8_Uids, int s32_Count)
+{
+    static const byte u8_SysId[3] = {0x4E, 0x58, 0x50};
+    static byte u8_Keys[32 * 24];
+
+    if (s32_Count > 32 || !pi_Diversifier->SetMasterKey(pi_Master) ||
+        !pi_Diversifier->DiversifyBatch(u8_Uids, 7, s32_Count, 0xF54230, u8_SysId, sizeof(u8_SysId), u8_Keys))
+        return false;
+
+    int s32_KeySize = pi_Diversifier->GetKeySize();
+    for (int i=0; i<s32_Count; i++)
+    {
+        byte u8_Input[DIVERSIFY_MAX_INPUT];
+        byte u8_Key[24];
+        int  s32_InputLen = KeyDiversifier::BuildInput(u8_Input, u8_Uids + i * 7, 7, 0xF54230, u8_SysId, sizeof(u8_SysId));
+        if (!pi_Diversifier->Diversify(u8_Input, s32_InputLen, u8_Key) ||
+            memcmp(u8_Key, u8_Keys + i * s32_KeySize, s32_KeySize) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Prints the phases of all commands measured by the PN532 class (send, ACK, ready, read)
+static void PrintMetrics(PN532* pi_Nfc)
+{
+#if PN532_METRICS
+    byte u8_Dump[4096];
+    printf("\n");
+    Serial.SetOutput(stdout);
+    pi_Nfc->GetMetrics()->Print();
+    Serial.SetOutput(NULL);
+    printf("Binary dump: %d bytes\n", pi_Nfc->GetMetrics()->Dump(u8_Dump, sizeof(u8_Dump)));
+#else
+    (void)pi_Nfc;
+#endif
+}
+
+// Prints the trace records that are still in the ring buffer (only errors with the default PN532_TRACE_LEVEL)
+static void PrintTrace()
+{
+    printf("\nTrace: %d records, %u dropped\n", PN532Trace::GetCount(), (unsigned)PN532Trace::GetDropped());
+    Serial.SetOutput(stdout);
+    PN532Trace::Print();
+    Serial.SetOutput(NULL);
+}
+
+#ifdef HARDWARE_LINK
+// Runs the chip level benchmarks with a real PN532 on a serial port (PN532_TTY), an I2C bus (PN532_I2CDEV) or SPI (PN532_SPIDEV)
+static int RunHardware(const char* s8_Device, const char* s8_Irq, int s32_Count)
+{
+    static HARDWARE_LINK i_Link(s8_Device);
+    static PN532         i_Nfc(i_Link);
+    gb_Hardware = true;
+#if PROTOCOL != PROT_HSU
+    gpi_BusLink = &i_Link;
+
+    // s8_Irq = "/dev/gpiochip0:25"
+    static PN532_GpioIrq i_Irq;
+    if (s8_Irq)
+    {
+        char s8_Chip[64];
+        const char* s8_Colon = strrchr(s8_Irq, ':');
+        int s32_Len = s8_Colon ? min((int)(s8_Colon - s8_Irq), (int)sizeof(s8_Chip) - 1) : 0;
+        memcpy(s8_Chip, s8_Irq, s32_Len);
+        s8_Chip[s32_Len] = 0;
+        if (!s8_Colon || !i_Irq.Open(s8_Chip, atoi(s8_Colon + 1)))
+        {
+            printf("Invalid IRQ line %s (expected /dev/gpiochipN:line)\n", s8_Irq);
+            return 1;
+        }
+        i_Link.SetIrq(&i_Irq);
+    }
+#else
+    (void)s8_Irq;
+#endif
+    i_Nfc.begin();
+    if (!i_Link.IsOpen() || !i_Nfc.SAMConfig())
+    {
+        printf("No PN532 found on %s\n", s8_Device);
+        return 1;
+    }
+
+    printf("PN532 host benchmark (%s%s, %d runs)\n\n", s8_Device, s8_Irq ? ", IRQ" : "", s32_Count);
+    RunBench("getFirmwareVersion", s32_Count, []()
+    {
+        return i_Nfc.getFirmwareVersion() != 0;
+    });
+
+    RunBench("ReadPassiveTargetID", s32_Count, []()
+    {
+        byte      u8_Uid[8];
+        byte      u8_UidLen;
+        eCardType e_Type;
+        return i_Nfc.ReadPassiveTargetID(u8_Uid, &u8_UidLen, &e_Type) && u8_UidLen > 0;
+    });
+    PrintMetrics(&i_Nfc);
+    PrintTrace();
+    return 0;
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    int s32_Count = (argc > 1) ? atoi(argv[1]) : 2000;
+    if (s32_Count <= 0) s32_Count = 2000;
+
+    // The debug output of the library would dominate the measurement
+    Serial.SetOutput(NULL);
+
+#ifdef HARDWARE_LINK
+    if (argc > 2)
+        return RunHardware(argv[2], (argc > 3) ? argv[3] : NULL, s32_Count);
+#endif
+
+    BenchCard i_Card;
+    gi_Sim.SetCard(&i_Card);
+    gi_Nfc.begin();
+
+    printf("PN532 host benchmark (simulated PN532, %d runs)\n\n", s32_Count);
+
+    RunBench("getFirmwareVersion", s32_Count, []()
+    {
+        return gi_Nfc.getFirmwareVersion() != 0;
+    });
+
+    RunBench("ReadPassiveTargetID", s32_Count, []()
+    {
+        byte      u8_Uid[8];
+        byte      u8_UidLen;
+        eCardType e_Type;
+        return gi_Nfc.ReadPassiveTargetID(u8_Uid, &u8_UidLen, &e_Type) && u8_UidLen == 7;
+    });
+
+    RunBench("SelectApplication", s32_Count, []()
+    {
+        return gi_Nfc.SelectApplication(0x000000);
+    });
+
+#if PROTOCOL != PROT_HSU
+    // A real PN532 needs some milliseconds for a command. WaitReady() polls the status every 10 ms,
+    // with the IRQ line the latency follows the response time of the chip.
+    gi_Sim.SetResponseDelay(5000);
+    RunBench("SelectApplication 5ms poll", max(1, s32_Count / 20), []()
+    {
+        return gi_Nfc.SelectApplication(0x000000);
+    });
+    gi_Sim.SetIrq(true);
+    RunBench("SelectApplication 5ms IRQ", max(1, s32_Count / 20), []()
+    {
+        return gi_Nfc.SelectApplication(0x000000);
+    });
+    gi_Sim.SetIrq(false);
+    gi_Sim.SetResponseDelay(0);
+#endif
+
+    // The same command with PN532_Async: the caller is free while the chip executes the command.
+    // Poll() is called in a loop here, the count of polls shows how often the main loop could do other work.
+    static PN532_Async i_Async(gi_Sim);
+    static uint32_t    u32_AsyncPolls = 0;
+    gi_Sim.SetResponseDelay(5000);
+    RunBench("SelectApplication 5ms async", max(1, s32_Count / 20), []()
+    {
+        const byte u8_Cmd[] = { 0x40, 0x01, 0x5A, 0x00, 0x00, 0x00 }; // InDataExchange: DESFire SelectApplication 000000
+        if (!i_Async.Submit(u8_Cmd, sizeof(u8_Cmd)))
+            return false;
+        while (i_Async.Poll() != ASYNC_Done)
+        {
+            if (!i_Async.IsBusy())
+                return false;
+        }
+        u32_AsyncPolls += i_Async.GetPollCount();
+        // InDataExchange status 00, DESFire status 00
+        return i_Async.GetResult() == 2 && i_Async.GetResponse()[0] == 0x00 && i_Async.GetResponse()[1] == 0x00;
+    });
+    gi_Sim.SetResponseDelay(0);
+    printf("%-28s %7.1f polls/run\n", "", (double)u32_AsyncPolls / max(1, s32_Count / 20));
+
+    static byte u8_Data[64];
+    static byte u8_Out [64];
+
+    AES i_Aes;
+    i_Aes.SetKeyData(u8_Data, 16, 0);
+    RunBench("AES CryptDataCBC 64 byte", s32_Count, [&]()
+    {
+        return i_Aes.CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Out, u8_Data, sizeof(u8_Data));
+    });
+
+#if AES_HW
+    // The same with the portable T-table code and a 1 kB decryption (4 blocks in parallel)
+    static byte u8_Cbc[1024];
+    AES::UseHardware(false);
+    RunBench("AES CryptDataCBC 64 portable", s32_Count, [&]()
+    {
+        return i_Aes.CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Out, u8_Data, sizeof(u8_Data));
+    });
+    RunBench("AES CBC decrypt 1kB portable", s32_Count, [&]()
+    {
+        return i_Aes.CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_Cbc, u8_Cbc, sizeof(u8_Cbc));
+    });
+    if (AES::UseHardware(true))
+    {
+        RunBench("AES CBC decrypt 1kB hardware", s32_Count, [&]()
+        {
+            return i_Aes.CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_Cbc, u8_Cbc, sizeof(u8_Cbc));
+        });
+    }
+#endif
+
+    DES i_Des;
+    i_Des.SetKeyData(u8_Data, 24, 0);
+    RunBench("3K3DES CryptDataCBC 64 byte", s32_Count, [&]()
+    {
+        return i_Des.CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Out, u8_Data, sizeof(u8_Data));
+    });
+    // The same 8 blocks independent of each other: DES_LANES blocks are interleaved
+    RunBench("3K3DES CryptBlocksECB 64 byte", s32_Count, [&]()
+    {
+        return i_Des.CryptBlocksECB(u8_Out, u8_Data, sizeof(u8_Data) / 8, KEY_ENCIPHER);
+    });
+
+    RunBench("AES CalculateCmac 40 byte", s32_Count, [&]()
+    {
+        TX_BUFFER(i_Buffer, 48);
+        i_Buffer.AppendBuf(u8_Data, 40);
+        byte u8_Cmac[16];
+        return i_Aes.CalculateCmac(i_Buffer, u8_Cmac);
+    });
+
+    // AN10922: UID + AID + System Identifier "NXP Abu"
+    static const byte u8_SysId[] = {0x4E, 0x58, 0x50, 0x20, 0x41, 0x62, 0x75};
+    static byte u8_Uids[1000 * 7];
+    static byte u8_Keys[1000 * 24];
+    for (int i=0; i<(int)sizeof(u8_Uids); i++)
+    {
+        u8_Uids[i] = (byte)(i * 31 + (i >> 8));
+    }
+
+    static KeyDiversifier i_Diversifier;
+
+    // The examples of AN10922 chapter 2.2 (AES-128), 2.3 (2K3DES) and 2.4 (3K3DES) with the master key
+    // 00 11 .. FF (3K3DES: || 01 02 .. 08). The DES keys are the plain CMACs, the parity bits are not adjusted.
+    static const byte u8_KatMaster[24] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB,
+                                          0xCC, 0xDD, 0xEE, 0xFF, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08};
+    static const byte u8_KatAes[16]    = {0xA8, 0xDD, 0x63, 0xA3, 0xB8, 0x9D, 0x54, 0xB3, 0x7C, 0xA8, 0x02, 0x47,
+                                          0x3F, 0xDA, 0x91, 0x75};
+    static const byte u8_Kat2K3DES[16] = {0x16, 0xF8, 0x59, 0x7C, 0x9E, 0x89, 0x10, 0xC8, 0x6B, 0x96, 0x48, 0xD0,
+                                          0x06, 0x10, 0x7D, 0xD7};
+    static const byte u8_Kat3K3DES[24] = {0x2F, 0x0D, 0xD0, 0x36, 0x75, 0xD3, 0xFB, 0x9A, 0x57, 0x05, 0xAB, 0x0B,
+                                          0xDA, 0x91, 0xCA, 0x0B, 0x55, 0xB8, 0xE0, 0x7F, 0xCD, 0xBF, 0x10, 0xEC};
+    AES i_KatAes;
+    DES i_Kat2K3DES;
+    DES i_Kat3K3DES;
+    i_KatAes   .SetKeyData(u8_KatMaster, 16, 0);
+    i_Kat2K3DES.SetKeyData(u8_KatMaster, 16, 0);
+    i_Kat3K3DES.SetKeyData(u8_KatMaster, 24, 0);
+    // System Identifier "NXP Abu" for AES, "NXP A" and "NXP" for DES (the input is limited to 15 bytes)
+    if (!CheckDiversify(&i_Diversifier, &i_KatAes,    7, u8_KatAes)    ||
+        !CheckDiversify(&i_Diversifier, &i_Kat2K3DES, 5, u8_Kat2K3DES) ||
+        !CheckDiversify(&i_Diversifier, &i_Kat3K3DES, 3, u8_Kat3K3DES))
+    {
+        printf("\nThe AN10922 key diversification failed\n");
+        return 1;
+    }
+    // 19 cards: 38 (2K3DES) or 57 (3K3DES) CMACs, the last batch of 3 cards does not fill all DES_LANES
+    if (!CheckDiversifyBatch(&i_Diversifier, &i_KatAes,    u8_Uids, 19) ||
+        !CheckDiversifyBatch(&i_Diversifier, &i_Kat2K3DES, u8_Uids, 19) ||
+        !CheckDiversifyBatch(&i_Diversifier, &i_Kat3K3DES, u8_Uids, 19))
+    {
+        printf("\nThe key diversification of a batch failed\n");
+        return 1;
+    }
+
+    i_Diversifier.SetMasterKey(&i_Aes);
+    RunBench("AES Diversify batch 1000 UIDs", max(1, s32_Count / 10), []()
+    {
+        return i_Diversifier.DiversifyBatch(u8_Uids, 7, 1000, 0xF54230, u8_SysId, sizeof(u8_SysId), u8_Keys);
+    });
+
+    // Repeated taps of the same card: the key comes from the cache
+    RunBench("AES Diversify cached", s32_Count, []()
+    {
+        byte u8_Input[DIVERSIFY_MAX_INPUT];
+        int  s32_InputLen = KeyDiversifier::BuildInput(u8_Input, u8_Uids, 7, 0xF54230, u8_SysId, sizeof(u8_SysId));
+        return i_Diversifier.Diversify(u8_Input, s32_InputLen, u8_Keys);
+    });
+
+    i_Diversifier.SetMasterKey(&i_Des);
+    RunBench("3K3DES Diversify batch 1000 UIDs", max(1, s32_Count / 10), []()
+    {
+        return i_Diversifier.DiversifyBatch(u8_Uids, 7, 1000, 0xF54230, u8_SysId, 5, u8_Keys);
+    });
+
+    // ------------------------------ virtual DESFire EV1 ------------------------------
+
+    static const byte u8_DfUid[7] = {0x04, 0x5A, 0x3C, 0x12, 0x9B, 0x2D, 0x80};
+    static SimDesfire i_Desfire(u8_DfUid);
+    gi_Sim.SetCard(&i_Desfire);
+
+    byte      u8_Uid[8];
+    byte      u8_UidLen;
+    eCardType e_Type;
+    if (!gi_Nfc.ReadPassiveTargetID(u8_Uid, &u8_UidLen, &e_Type) || e_Type != CARD_Desfire)
+    {
+        printf("\nThe virtual DESFire card was not detected\n");
+        return 1;
+    }
+
+    // The complete selftest: applications, key changes with all key types, files
+    RunBench("DESFire Selftest", max(1, s32_Count / 100), []()
+    {
+        return gi_Nfc.Selftest();
+    });
+
+    // An application with a 240 byte file. All access rights require key 0.
+    const uint32_t APP_ID    = 0x00BE0C;
+    const int      FILE_SIZE = 240;
+    i_Desfire.AddApplication(APP_ID, KS_FACTORY_DEFAULT, 2, DF_KEY_AES);
+    i_Desfire.AddDataFile(APP_ID, 1, MDFT_STANDARD_DATA_FILE, CM_PLAIN, 0x0000, FILE_SIZE);
+
+    static AES i_AppKey;
+    i_AppKey.SetKeyData(u8_Data, 16, 0);
+
+    // Without the session cache (default) every call goes to the card: 1 + 2 round trips
+    RunBench("DESFire Select + AES Auth", s32_Count, []()
+    {
+        return gi_Nfc.SelectApplication(APP_ID) && gi_Nfc.Authenticate(0, &i_AppKey);
+    });
+
+    // The application is still selected and the session key still valid: no round trip
+    gi_Nfc.SetSessionCache(true);
+    RunBench("DESFire Select + AES Auth cached", s32_Count, []()
+    {
+        return gi_Nfc.SelectApplication(APP_ID) && gi_Nfc.Authenticate(0, &i_AppKey);
+    });
+    gi_Nfc.SetSessionCache(false);
+
+    static byte u8_File[FILE_SIZE];
+    RunBench("DESFire WriteFileData 240", s32_Count, []()
+    {
+        return gi_Nfc.WriteFileData(1, 0, FILE_SIZE, u8_File);
+    });
+
+    RunBench("DESFire ReadFileData 240", s32_Count, []()
+    {
+        return gi_Nfc.ReadFileData(1, 0, FILE_SIZE, u8_File);
+    });
+
+    // A credential file of 1 kB: one DF_INS_READ_DATA + 17 frames DF_INS_ADDITIONAL_FRAME
+    const int LARGE_SIZE = 1024;
+    i_Desfire.AddDataFile(APP_ID, 2, MDFT_STANDARD_DATA_FILE, CM_PLAIN, 0x0000, LARGE_SIZE);
+    static byte u8_Large[LARGE_SIZE];
+    for (int i=0; i<LARGE_SIZE; i++)
+    {
+        u8_Large[i] = (byte)(i * 7);
+    }
+    if (!gi_Nfc.WriteFileData(2, 0, LARGE_SIZE, u8_Large))
+    {
+        printf("\nWriting the 1 kB file failed\n");
+        return 1;
+    }
+
+    RunBench("DESFire WriteFileData 1024", s32_Count, []()
+    {
+        return gi_Nfc.WriteFileData(2, 0, LARGE_SIZE, u8_Large);
+    });
+
+    RunBench("DESFire ReadFileData 1024", s32_Count, []()
+    {
+        static byte u8_Read[LARGE_SIZE];
+        return gi_Nfc.ReadFileData(2, 0, LARGE_SIZE, u8_Read) && memcmp(u8_Read, u8_Large, LARGE_SIZE) == 0;
+    });
+
+    // The same file with MACed and with encrypted communication
+    i_Desfire.AddDataFile(APP_ID, 3, MDFT_STANDARD_DATA_FILE, CM_MAC,     0x0000, LARGE_SIZE);
+    i_Desfire.AddDataFile(APP_ID, 4, MDFT_STANDARD_DATA_FILE, CM_ENCRYPT, 0x0000, LARGE_SIZE);
+
+    RunBench("DESFire Write + Read 1024 MAC", s32_Count, []()
+    {
+        static byte u8_Read[LARGE_SIZE];
+        return gi_Nfc.WriteFileData(3, 0, LARGE_SIZE, u8_Large, CM_MAC) &&
+               gi_Nfc.ReadFileData (3, 0, LARGE_SIZE, u8_Read,  CM_MAC) && memcmp(u8_Read, u8_Large, LARGE_SIZE) == 0;
+    });
+
+    RunBench("DESFire Write + Read 1024 ENC", s32_Count, []()
+    {
+        static byte u8_Read[LARGE_SIZE];
+        return gi_Nfc.WriteFileData(4, 0, LARGE_SIZE, u8_Large, CM_ENCRYPT) &&
+               gi_Nfc.ReadFileData (4, 0, LARGE_SIZE, u8_Read,  CM_ENCRYPT) && memcmp(u8_Read, u8_Large, LARGE_SIZE) == 0;
+    });
+
+    // The complete card: 2 applications (one with a DF name), 4 + 0 files
+    static const byte u8_DFName[] = {0xD2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x01};
+    i_Desfire.SetDFName(APP_ID, 0xE110, u8_DFName, sizeof(u8_DFName));
+    RunBench("DESFire GetCardInventory", s32_Count, []()
+    {
+        static DESFireCardInventory k_Inventory;
+        return gi_Nfc.GetCardInventory(&k_Inventory) && k_Inventory.b_AppIDs &&
+               k_Inventory.s32_FileCount >= 4 && k_Inventory.k_Files[3].k_Settings.e_Encrypt == CM_ENCRYPT;
+    });
+
+    // A card is presented repeatedly and its structure is read each time: the application IDs and the 4 files
+    static auto ReadStructure = []()
+    {
+        byte      u8_Uid[8];
+        byte      u8_UidLen;
+        eCardType e_Type;
+        uint32_t  u32_AppIDs[28];
+        byte      u8_AppCount;
+        byte      u8_FileIDs[32];
+        byte      u8_FileCount;
+        DESFireFileSettings k_Settings;
+        if (!gi_Nfc.ReadPassiveTargetID(u8_Uid, &u8_UidLen, &e_Type) ||
+            !gi_Nfc.GetApplicationIDs(u32_AppIDs, &u8_AppCount) ||
+            !gi_Nfc.SelectApplication(APP_ID) ||
+            !gi_Nfc.GetFileIDs(u8_FileIDs, &u8_FileCount))
+            return -1;
+
+        for (int F=0; F<u8_FileCount; F++)
+        {
+            if (!gi_Nfc.GetFileSettings(u8_FileIDs[F], &k_Settings))
+                return -1;
+        }
+        return (int)u8_FileCount;
+    };
+
+    RunBench("DESFire read structure", s32_Count, []()
+    {
+        return ReadStructure() == 4;
+    });
+
+    // After the first activation only GetFreeMemory goes to the card
+    static DESFireMetaEntry k_MetaEntries[4];
+    static DesFireMetaCache i_MetaCache(k_MetaEntries, 4);
+    gi_Nfc.SetMetadataCache(&i_MetaCache);
+    RunBench("DESFire read structure cached", s32_Count, []()
+    {
+        return ReadStructure() == 4;
+    });
+
+    // CreateStdDataFile() and DeleteFile() must drop the cached file IDs
+    DESFireFilePermissions k_Permis;
+    k_Permis.Unpack(0x0000);
+    if (!gi_Nfc.Authenticate(0, &i_AppKey) || !gi_Nfc.CreateStdDataFile(5, &k_Permis, 32) || ReadStructure() != 5 ||
+        !gi_Nfc.Authenticate(0, &i_AppKey) || !gi_Nfc.DeleteFile(5) || ReadStructure() != 4)
+    {
+        printf("\nThe metadata cache returned stale data\n");
+        return 1;
+    }
+    printf("%-28s %u cache hits, %u misses\n", "", (unsigned)i_MetaCache.GetHits(), (unsigned)i_MetaCache.GetMisses());
+    gi_Nfc.SetMetadataCache(NULL);
+
+    // With 17 and 18 applications the CMAC of GetApplicationIDs() is split over 2 frames (57 + 2 / 57 + 5 bytes).
+    // The application IDs must not contain CMAC bytes and the session key must still be in sync for GetDFNames().
+    static const byte u8_SplitUid[7] = {0x04, 0x17, 0x18, 0x12, 0x9B, 0x2D, 0x80};
+    static SimDesfire i_SplitCard(u8_SplitUid);
+    static const byte u8_Short[] = {0xA1};
+    gi_Sim.SetCard(&i_SplitCard);
+    for (int A=1; A<=18; A++)
+    {
+        i_SplitCard.AddApplication(0x100000 + A, KS_FACTORY_DEFAULT, 1, DF_KEY_AES);
+        if (A == 1) i_SplitCard.SetDFName(0x100001, 0xE101, u8_Short,  sizeof(u8_Short));
+        if (A == 2) i_SplitCard.SetDFName(0x100002, 0xE102, u8_DFName, sizeof(u8_DFName));
+        if (A == 3) i_SplitCard.SetDFName(0x100003, 0xE103, u8_Short,  sizeof(u8_Short));
+        if (A < 17)
+            continue;
+
+        uint32_t      u32_AppIDs[28];
+        byte          u8_AppCount;
+        DESFireDFName k_Names[28];
+        byte          u8_NameCount;
+        DESFireCardVersion k_Version;
+        bool b_Valid = gi_Nfc.ReadPassiveTargetID(u8_Uid, &u8_UidLen, &e_Type) &&
+                       gi_Nfc.SelectApplication(0x000000) &&
+                       gi_Nfc.Authenticate(0, &gi_Nfc.DES2_DEFAULT_KEY) &&
+                       gi_Nfc.GetApplicationIDs(u32_AppIDs, &u8_AppCount) && u8_AppCount == A &&
+                       u32_AppIDs[A - 1] == (uint32_t)(0x100000 + A) &&
+                       gi_Nfc.GetDFNames(k_Names, &u8_NameCount) && u8_NameCount == 3 &&
+                       k_Names[1].u16_IsoFileID == 0xE102 && k_Names[1].u8_NameLen == sizeof(u8_DFName) &&
+                       k_Names[2].u16_IsoFileID == 0xE103 && k_Names[2].u8_NameLen == 1 &&
+                       gi_Nfc.GetCardVersion(&k_Version) && memcmp(k_Version.uid, u8_SplitUid, 7) == 0 &&
+                       gi_Nfc.GetApplicationIDs(u32_AppIDs, &u8_AppCount) && u8_AppCount == A;
+        if (!b_Valid)
+        {
+            printf("\nThe split CMAC with %d applications failed\n", A);
+            return 1;
+        }
+    }
+    gi_Sim.SetCard(&i_Desfire);
+
+    // ------------------------------ record / replay ------------------------------
+
+    // The session is recorded once and then replayed from the log without any card or chip simulation.
+    static auto ReadSession = [](PN532& i_Nfc)
+    {
+        byte      u8_Uid[8];
+        byte      u8_UidLen;
+        eCardType e_Type;
+        return i_Nfc.ReadPassiveTargetID(u8_Uid, &u8_UidLen, &e_Type) &&
+               i_Nfc.SelectApplication(APP_ID) &&
+               i_Nfc.Authenticate(0, &i_AppKey) &&
+               i_Nfc.ReadFileData(1, 0, FILE_SIZE, u8_File);
+    };
+
+    static byte u8_Log[4096];
+    static PN532_Recorder i_Recorder(gi_Sim, u8_Log, sizeof(u8_Log));
+    static PN532          i_NfcRecord(i_Recorder);
+    int s32_LogSize;
+    if (!ReadSession(i_NfcRecord) || i_Recorder.IsOverflow())
+    {
+        printf("\nThe recording of the session failed\n");
+        return 1;
+    }
+    i_Recorder.GetLog(&s32_LogSize);
+
+    static PN532_Replay i_Replay(u8_Log, s32_LogSize);
+    static PN532        i_NfcReplay(i_Replay);
+    RunBench("Replay Auth + ReadFileData", s32_Count, []()
+    {
+        i_Replay.Rewind();
+        return ReadSession(i_NfcReplay) && i_Replay.IsFinished() &&
+               i_Replay.GetMismatches() == 0 && i_Replay.GetDesyncs() == 0;
+    });
+
+    // ------------------------------ virtual MIFARE Classic ------------------------------
+
+    static const byte u8_ClassicUid[4] = {0xB7, 0x3E, 0x55, 0x0A};
+    static SimMifareClassic i_Classic1K(u8_ClassicUid, false);
+    static SimMifareClassic i_Classic4K(u8_ClassicUid, true);
+    static SimMifareClassic* pi_Classic;
+
+    // Selects the card and reads all blocks with the factory default key A
+    static auto DumpClassic = []()
+    {
+        static const byte u8_KeyA[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        byte      u8_Uid[8];
+        byte      u8_UidLen;
+        eCardType e_Type;
+        if (!gi_Nfc.ReadPassiveTargetID(u8_Uid, &u8_UidLen, &e_Type) || u8_UidLen != 4)
+            return false;
+
+        int  s32_Size;
+        pi_Classic->GetImage(&s32_Size);
+        byte u8_Block[16];
+        for (int B=0; B<s32_Size / 16; B++)
+        {
+            if (gi_Nfc.mifareclassic_IsFirstBlock(B) &&
+               !gi_Nfc.mifareclassic_AuthenticateBlock(u8_Uid, u8_UidLen, B, 0, (uint8_t*)u8_KeyA))
+                return false;
+            if (!gi_Nfc.mifareclassic_ReadDataBlock(B, u8_Block))
+                return false;
+        }
+        return true;
+    };
+
+    pi_Classic = &i_Classic1K;
+    gi_Sim.SetCard(pi_Classic);
+    RunBench("Classic 1K dump", max(1, s32_Count / 10), DumpClassic);
+
+    pi_Classic = &i_Classic4K;
+    gi_Sim.SetCard(pi_Classic);
+    RunBench("Classic 4K dump", max(1, s32_Count / 10), DumpClassic);
+
+    // FormatNDEF changes key A of sector 0, so every run starts with a factory new card image.
+    static byte u8_Factory[SIM_MF_1K_SIZE];
+    int s32_FactorySize;
+    memcpy(u8_Factory, i_Classic1K.GetImage(&s32_FactorySize), SIM_MF_1K_SIZE);
+    gi_Sim.SetCard(&i_Classic1K);
+
+    RunBench("Classic FormatNDEF + URI", max(1, s32_Count / 10), []()
+    {
+        static const byte u8_KeyA[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        byte      u8_Uid[8];
+        byte      u8_UidLen;
+        eCardType e_Type;
+        i_Classic1K.LoadImage(u8_Factory, SIM_MF_1K_SIZE);
+        return gi_Nfc.ReadPassiveTargetID(u8_Uid, &u8_UidLen, &e_Type) &&
+               gi_Nfc.mifareclassic_AuthenticateBlock(u8_Uid, u8_UidLen, 0, 0, (uint8_t*)u8_KeyA) &&
+               gi_Nfc.mifareclassic_FormatNDEF() &&
+               gi_Nfc.mifareclassic_AuthenticateBlock(u8_Uid, u8_UidLen, 4, 0, (uint8_t*)u8_KeyA) &&
+               gi_Nfc.mifareclassic_WriteNDEFURI(1, 0x01, "github.com/pjunni/PN532");
+    });
+
+    // ------------------------------ virtual NTAG215 ------------------------------
+
+    static const byte u8_NtagUid[7] = {0x04, 0x8F, 0x21, 0x6A, 0xC2, 0x4B, 0x80};
+    static SimUltralight i_Ntag(u8_NtagUid, SIM_NTAG215_PAGES);
+    gi_Sim.SetCard(&i_Ntag);
+    if (!gi_Nfc.ReadPassiveTargetID(u8_Uid, &u8_UidLen, &e_Type) || u8_UidLen != 7)
+    {
+        printf("\nThe virtual NTAG215 was not detected\n");
+        return 1;
+    }
+
+    RunBench("NTAG215 dump (ReadPage)", max(1, s32_Count / 10), []()
+    {
+        byte u8_Page[4];
+        for (int P=0; P<SIM_NTAG215_PAGES; P++)
+        {
+            if (!gi_Nfc.mifareultralight_ReadPage(P, u8_Page))
+                return false;
+        }
+        return true;
+    });
+
+    // The user memory of the NTAG215 (page 4 .. 129)
+    RunBench("NTAG215 WritePage user mem", max(1, s32_Count / 10), []()
+    {
+        byte u8_Page[4] = {0x03, 0x00, 0xFE, 0x00};
+        for (int P=4; P<SIM_NTAG215_PAGES - 5; P++)
+        {
+            if (!gi_Nfc.mifareultralight_WritePage(P, u8_Page))
+                return false;
+        }
+        return true;
+    });
+
+    PrintMetrics(&gi_Nfc);
+    PrintTrace();
+    return 0;
+}
+
+#endif // PN532_HOST
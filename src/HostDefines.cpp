@@ -0,0 +1,50 @@
+/**************************************************************************
+
+    Arduino replacement functions for the native Linux host build.
+    See HostDefines.h
+
+**************************************************************************/
+
+#ifdef PN532_HOST
+
+#include "HostDefines.h"
+#include <time.h>
+
+HostSerial Serial;
+
+static uint64_t GetMonotonicMicros()
+{
+    struct timespec k_Time;
+    clock_gettime(CLOCK_MONOTONIC, &k_Time);
+    return (uint64_t)k_Time.tv_sec * 1000000 + k_Time.tv_nsec / 1000;
+}
+
+// Like on the Arduino the tick counters start at zero when the program starts
+static const uint64_t gu64_StartMicros = GetMonotonicMicros();
+
+uint32_t millis()
+{
+    return (uint32_t)((GetMonotonicMicros() - gu64_StartMicros) / 1000);
+}
+
+uint32_t micros()
+{
+    return (uint32_t)(GetMonotonicMicros() - gu64_StartMicros);
+}
+
+void delay(uint32_t u32_MilliSeconds)
+{
+    delayMicroseconds(u32_MilliSeconds * 1000);
+}
+
+void delayMicroseconds(uint32_t u32_MicroSeconds)
+{
+    struct timespec k_Time;
+    k_Time.tv_sec  =  u32_MicroSeconds / 1000000;
+    k_Time.tv_nsec = (u32_MicroSeconds % 1000000) * 1000;
+    while (nanosleep(&k_Time, &k_Time) != 0)
+    {
+    }
+}
+
+#endif // PN532_HOST
@@ -0,0 +1,133 @@
+/**************************************************************************
+
+    Minimal Arduino replacement for compiling this library natively on a
+    Linux host (see [env:host] in platformio.ini, which defines PN532_HOST).
+
+    It provides only what the library uses: byte, millis(), delay(), the
+    pin functions, a tiny String class and a Serial object that writes to
+    stdout. Together with PN532_SIM this allows to run and profile the
+    complete host side code (frames, DESFire commands, crypto) on a PC.
+
+**************************************************************************/
+
+#ifndef HOST_DEFINES_H
+#define HOST_DEFINES_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+#define HEX 16
+#define DEC 10
+#define OCT  8
+#define BIN  2
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+
+// Arduino defines min() and max() as macros. Templates do the same without breaking the STL headers.
+template <typename T> inline T min(T a, T b) { return (a < b) ? a : b; }
+template <typename T> inline T max(T a, T b) { return (a > b) ? a : b; }
+
+uint32_t millis();
+uint32_t micros();
+void     delay(uint32_t u32_MilliSeconds);
+void     delayMicroseconds(uint32_t u32_MicroSeconds);
+
+// There are no pins on the host. Outputs are ignored, inputs always read LOW.
+inline void pinMode(uint8_t u8_Pin, uint8_t u8_Mode)       { (void)u8_Pin; (void)u8_Mode; }
+inline void digitalWrite(uint8_t u8_Pin, uint8_t u8_Value) { (void)u8_Pin; (void)u8_Value; }
+inline int  digitalRead(uint8_t u8_Pin)                    { (void)u8_Pin; return 0; }
+
+// ESP32 LEDC (piezo) functions used by PN532::SAFE_TEST()
+enum note_t { NOTE_C, NOTE_Cs, NOTE_D, NOTE_Eb, NOTE_E, NOTE_F, NOTE_Fs, NOTE_G, NOTE_Gs, NOTE_A, NOTE_Bb, NOTE_B, NOTE_MAX };
+inline void ledcWrite(uint8_t u8_Channel, uint32_t u32_Duty)                     { (void)u8_Channel; (void)u32_Duty; }
+inline void ledcWriteNote(uint8_t u8_Channel, note_t e_Note, uint8_t u8_Octave)  { (void)u8_Channel; (void)e_Note; (void)u8_Octave; }
+
+// The small subset of the Arduino String class that is used in this library
+class String
+{
+public:
+    String()                                 {}
+    String(const char* s8_Text)              : ms_Text(s8_Text ? s8_Text : "") {}
+    String(const std::string& s_Text)        : ms_Text(s_Text) {}
+    String(char c_Char)                      : ms_Text(1, c_Char) {}
+    String(int s32_Value, int s32_Base=DEC)           { Format((long)s32_Value, s32_Base); }
+    String(unsigned int u32_Value, int s32_Base=DEC)  { Format((unsigned long)u32_Value, s32_Base); }
+    String(long s32_Value, int s32_Base=DEC)          { Format(s32_Value, s32_Base); }
+    String(unsigned long u32_Value, int s32_Base=DEC) { Format(u32_Value, s32_Base); }
+    String(unsigned char u8_Value, int s32_Base=DEC)  { Format((unsigned long)u8_Value, s32_Base); }
+
+    const char* c_str()  const { return ms_Text.c_str(); }
+    unsigned int length() const { return (unsigned int)ms_Text.length(); }
+
+    String& operator+=(const String& s_Other) { ms_Text += s_Other.ms_Text; return *this; }
+    friend String operator+(const String& s_A, const String& s_B) { return String(s_A.ms_Text + s_B.ms_Text); }
+    friend String operator+(const String& s_A, const char* s8_B)  { return String(s_A.ms_Text + s8_B); }
+
+private:
+    void Format(long s32_Value, int s32_Base)
+    {
+        if (s32_Value < 0 && s32_Base == DEC) { ms_Text = "-"; Format((unsigned long)-s32_Value, s32_Base, true); }
+        else Format((unsigned long)s32_Value, s32_Base);
+    }
+    void Format(unsigned long u32_Value, int s32_Base, bool b_Append=false)
+    {
+        char s8_Buf[72];
+        int  P = sizeof(s8_Buf) - 1;
+        s8_Buf[P] = 0;
+        do
+        {
+            s8_Buf[--P] = "0123456789ABCDEF"[u32_Value % s32_Base];
+            u32_Value /= s32_Base;
+        }
+        while (u32_Value);
+        if (b_Append) ms_Text += s8_Buf + P;
+        else          ms_Text  = s8_Buf + P;
+    }
+
+    std::string ms_Text;
+};
+
+// Serial port replacement. Everything printed goes to stdout (or to the stream set with SetOutput()).
+// Benchmarks call SetOutput(NULL) so that the debug output of the library does not distort the measurements.
+class HostSerial
+{
+public:
+    HostSerial() { mp_Out = stdout; }
+
+    void begin(uint32_t u32_Baud)  { (void)u32_Baud; }
+    int  available()               { return 0; }
+    int  read()                    { return -1; }
+    operator bool()                { return true; }
+    void SetOutput(FILE* p_Out)    { mp_Out = p_Out; }
+
+    void print(const char* s8_Text)                    { if (mp_Out) fputs(s8_Text, mp_Out); }
+    void print(const String& s_Text)                   { print(s_Text.c_str()); }
+    void print(char c_Char)                            { if (mp_Out) fputc(c_Char, mp_Out); }
+    void print(int s32_Value, int s32_Base=DEC)           { print(String(s32_Value, s32_Base)); }
+    void print(unsigned int u32_Value, int s32_Base=DEC)  { print(String(u32_Value, s32_Base)); }
+    void print(long s32_Value, int s32_Base=DEC)          { print(String(s32_Value, s32_Base)); }
+    void print(unsigned long u32_Value, int s32_Base=DEC) { print(String(u32_Value, s32_Base)); }
+    void print(unsigned char u8_Value, int s32_Base=DEC)  { print(String(u8_Value, s32_Base)); }
+
+    void println()                                     { print("\r\n"); }
+    template <typename T> void println(T t_Value)                { print(t_Value); println(); }
+    template <typename T> void println(T t_Value, int s32_Base)  { print(t_Value, s32_Base); println(); }
+
+private:
+    FILE* mp_Out;
+};
+
+extern HostSerial Serial;
+
+#endif // HOST_DEFINES_H
@@ -0,0 +1,225 @@
+/**************************************************************************
+
+    class KeyDiversifier: NXP AN10922 key diversification (see KeyDiversifier.h)
+
+**************************************************************************/
+
+#include "KeyDiversifier.h"
+
+KeyDiversifier::KeyDiversifier()
+{
+    mpi_Master = NULL;
+    ClearCache();
+}
+
+bool KeyDiversifier::SetMasterKey(DESFireKey* pi_MasterKey)
+{
+    mpi_Master = NULL;
+    ClearCache();
+
+    if (!DESFireKey::CheckValid(pi_MasterKey))
+        return false;
+
+    // A copy: the CMAC calculation modifies the IV of the key
+    DESFireKey* pi_Master = (pi_MasterKey->GetKeyType() == DF_KEY_AES) ? (DESFireKey*)&mi_Aes : (DESFireKey*)&mi_Des;
+    if (!pi_Master->SetKeyData(pi_MasterKey->Data(), pi_MasterKey->GetKeySize(16), 0))
+        return false;
+
+    mpi_Master = pi_Master;
+    return true;
+}
+
+int KeyDiversifier::GetKeySize()
+{
+    if (!mpi_Master)
+        return 0;
+    return mpi_Master->GetKeySize();
+}
+
+int KeyDiversifier::GetMaxInput()
+{
+    if (!mpi_Master)
+        return 0;
+    return 2 * mpi_Master->GetBlockSize() - 1;
+}
+
+// AN10922 chapter 2.2: the UID, the application and a System Identifier (e.g. the name of the installation)
+int KeyDiversifier::BuildInput(byte* u8_Input, const byte* u8_Uid, int s32_UidLen, uint32_t u32_AppID,
+                               const byte* u8_SysId, int s32_SysIdLen)
+{
+    if (!u8_SysId)
+        s32_SysIdLen = 0;
+
+    int s32_Len = s32_UidLen + 3 + s32_SysIdLen;
+    if (s32_UidLen < 0 || s32_SysIdLen < 0 || s32_Len > DIVERSIFY_MAX_INPUT)
+        return 0;
+
+    memcpy(u8_Input, u8_Uid, s32_UidLen);
+    u8_Input += s32_UidLen;
+    *u8_Input++ = (byte)(u32_AppID);
+    *u8_Input++ = (byte)(u32_AppID >> 8);
+    *u8_Input++ = (byte)(u32_AppID >> 16);
+    memcpy(u8_Input, u8_SysId, s32_SysIdLen);
+    return s32_Len;
+}
+
+bool KeyDiversifier::Diversify(const byte* u8_Input, int s32_InputLen, byte* u8_Key)
+{
+    if (!mpi_Master || s32_InputLen < 1 || s32_InputLen > GetMaxInput())
+        return false;
+
+    int s32_KeySize = GetKeySize();
+#if DIVERSIFY_CACHE_SIZE > 0
+    // Search the input and the least recently used entry at the same time
+    kCacheEntry* pk_Oldest = &mk_Cache[0];
+    for (int i=0; i<DIVERSIFY_CACHE_SIZE; i++)
+    {
+        kCacheEntry* pk_Entry = &mk_Cache[i];
+        if (pk_Entry->u32_Used > 0 && pk_Entry->u8_InputLen == s32_InputLen &&
+            memcmp(pk_Entry->u8_Input, u8_Input, s32_InputLen) == 0)
+        {
+            pk_Entry->u32_Used = ++mu32_Tick;
+            memcpy(u8_Key, pk_Entry->u8_Key, s32_KeySize);
+            mu32_Hits ++;
+            return true;
+        }
+        if (pk_Entry->u32_Used < pk_Oldest->u32_Used)
+            pk_Oldest = pk_Entry;
+    }
+
+    mu32_Misses ++;
+    if (!Derive(u8_Input, s32_InputLen, u8_Key))
+        return false;
+
+    pk_Oldest->u32_Used    = ++mu32_Tick;
+    pk_Oldest->u8_InputLen = (byte)s32_InputLen;
+    memcpy(pk_Oldest->u8_Input, u8_Input, s32_InputLen);
+    memcpy(pk_Oldest->u8_Key,   u8_Key,   s32_KeySize);
+    return true;
+#else
+    mu32_Misses ++;
+    return Derive(u8_Input, s32_InputLen, u8_Key);
+#endif
+}
+
+bool KeyDiversifier::DiversifyKey(const byte* u8_Input, int s32_InputLen, DESFireKey* pi_Key, byte u8_Version)
+{
+    byte u8_Key[24];
+    if (!Diversify(u8_Input, s32_InputLen, u8_Key))
+        return false;
+
+    bool b_Success = pi_Key->SetKeyData(u8_Key, GetKeySize(), u8_Version);
+    memset(u8_Key, 0, sizeof(u8_Key));
+    return b_Success;
+}
+
+// The input is built once and only the UID is replaced for each card.
+// The CMAC subkeys of the master key are generated only once (see GenerateCmacSubkeys()).
+// DES master keys use the batch engine of the DES class (see DiversifyBatchDES()).
+bool KeyDiversifier::DiversifyBatch(const byte* u8_Uids, int s32_UidLen, int s32_Count, uint32_t u32_AppID,
+                                    const byte* u8_SysId, int s32_SysIdLen, byte* u8_Keys)
+{
+    byte u8_Input[DIVERSIFY_MAX_INPUT];
+    int  s32_InputLen = BuildInput(u8_Input, u8_Uids, s32_UidLen, u32_AppID, u8_SysId, s32_SysIdLen);
+    if (!mpi_Master || s32_InputLen < 1 || s32_InputLen > GetMaxInput())
+        return false;
+
+    if (mpi_Master == &mi_Des)
+        return DiversifyBatchDES(u8_Uids, s32_UidLen, s32_Count, u8_Input, s32_InputLen, u8_Keys);
+
+    int s32_KeySize = GetKeySize();
+    for (int i=0; i<s32_Count; i++)
+    {
+        memcpy(u8_Input, u8_Uids, s32_UidLen);
+        if (!Derive(u8_Input, s32_InputLen, u8_Keys))
+            return false;
+
+        u8_Uids += s32_UidLen;
+        u8_Keys += s32_KeySize;
+    }
+    return true;
+}
+
+// The same as Derive() for a DES master key, but the CMACs of all key components of DIVERSIFY_BATCH_UIDS
+// cards are prepared first and then encrypted by the batch engine of the DES class which interleaves
+// DES_LANES independent CBC chains with the key schedules that have been computed in SetMasterKey().
+// The CMAC of each component is 8 bytes, so the results are written directly into u8_Keys.
+bool KeyDiversifier::DiversifyBatchDES(const byte* u8_Uids, int s32_UidLen, int s32_Count,
+                                       byte* u8_Input, int s32_InputLen, byte* u8_Keys)
+{
+    int  s32_Parts = GetKeySize() / 8;
+    byte u8_Const  = (mi_Des.GetKeyType() == DF_KEY_3K3DES) ? 0x31 : 0x21;
+    byte u8_Msgs[DIVERSIFY_BATCH_UIDS * 3][16];
+    byte u8_Msg[32];
+    bool b_Success = true;
+
+    while (b_Success && s32_Count > 0)
+    {
+        int s32_Uids = min(s32_Count, DIVERSIFY_BATCH_UIDS);
+        for (int i=0; b_Success && i<s32_Uids; i++)
+        {
+            memcpy(u8_Input, u8_Uids, s32_UidLen);
+            memcpy(u8_Msg + 1, u8_Input, s32_InputLen);
+            for (int P=0; b_Success && P<s32_Parts; P++)
+            {
+                u8_Msg[0] = u8_Const + P;
+                b_Success = mi_Des.PrepareDiversifyMsg(u8_Msg, s32_InputLen + 1, u8_Msgs[i * s32_Parts + P]);
+            }
+            u8_Uids += s32_UidLen;
+        }
+
+        b_Success = b_Success && mi_Des.EncryptBatchCBC(u8_Msgs[0], 16, s32_Uids * s32_Parts, u8_Keys);
+
+        u8_Keys   += s32_Uids * s32_Parts * 8;
+        s32_Count -= s32_Uids;
+    }
+    // Also on error: do not leave the CMAC messages (input XOR-ed with a subkey of the master key) on the stack
+    memset(u8_Msgs, 0, sizeof(u8_Msgs));
+    memset(u8_Msg,  0, sizeof(u8_Msg));
+    return b_Success;
+}
+
+// AN10922 chapter 2.2 (AES-128), 2.3 (2K3DES) and 2.4 (3K3DES)
+bool KeyDiversifier::Derive(const byte* u8_Input, int s32_InputLen, byte* u8_Key)
+{
+    byte u8_Msg[32];
+    memcpy(u8_Msg + 1, u8_Input, s32_InputLen);
+
+    if (mpi_Master->GetKeyType() == DF_KEY_AES)
+    {
+        u8_Msg[0] = 0x01;
+        return mpi_Master->CalculateDiversifyCmac(u8_Msg, s32_InputLen + 1, u8_Key);
+    }
+
+    // DES: one CMAC of 8 bytes per key component
+    byte u8_Const = (mpi_Master->GetKeyType() == DF_KEY_3K3DES) ? 0x31 : 0x21;
+    byte u8_Cmac[16];
+    for (int P=0; P<GetKeySize(); P+=8)
+    {
+        u8_Msg[0] = u8_Const++;
+        if (!mpi_Master->CalculateDiversifyCmac(u8_Msg, s32_InputLen + 1, u8_Cmac))
+            return false;
+        memcpy(u8_Key + P, u8_Cmac, 8);
+    }
+    return true;
+}
+
+void KeyDiversifier::ClearCache()
+{
+#if DIVERSIFY_CACHE_SIZE > 0
+    memset(mk_Cache, 0, sizeof(mk_Cache));
+    mu32_Tick = 0;
+#endif
+    mu32_Hits   = 0;
+    mu32_Misses = 0;
+}
+
+uint32_t KeyDiversifier::GetCacheHits()
+{
+    return mu32_Hits;
+}
+
+uint32_t KeyDiversifier::GetCacheMisses()
+{
+    return mu32_Misses;
+}
@@ -0,0 +1,100 @@
+/**************************************************************************
+
+    KeyDiversifier: NXP AN10922 key diversification
+
+    Each card gets its own key which is derived from a master key and
+    a diversification input M that identifies the card, usually
+
+        M = UID (7 byte) || AID (3 byte, LSB first) || System Identifier
+
+    (see BuildInput()). So the master key never leaves the reader and a
+    key that was extracted from one card is useless for all other cards.
+
+    Master key   derived key                             max length of M
+    AES-128      CMAC(K, 01 || M)                        31 byte
+    2K3DES       CMAC(K, 21 || M) || CMAC(K, 22 || M)    15 byte
+    3K3DES       CMAC(K, 31 || M) || ... (32, 33)        15 byte
+
+    The CMAC is calculated with DESFireKey::CalculateDiversifyCmac().
+
+    Diversify() keeps the last DIVERSIFY_CACHE_SIZE derived keys in a
+    small LRU cache, so a card that is presented repeatedly does not
+    cost any encryption. DiversifyBatch() derives the keys for many
+    UIDs in one loop (e.g. to personalize a batch of cards in the back
+    office) and bypasses the cache. With a DES master key it encrypts
+    the CMACs of DIVERSIFY_BATCH_UIDS cards at once with the batch
+    engine of the DES class (DES::EncryptBatchCBC()).
+
+    The cache holds derived keys in RAM. Compile with
+    -DDIVERSIFY_CACHE_SIZE=0 if this is not acceptable.
+
+**************************************************************************/
+
+#ifndef KEY_DIVERSIFIER_H
+#define KEY_DIVERSIFIER_H
+
+#include "DES.h"
+#include "AES128.h"
+
+#define DIVERSIFY_MAX_INPUT   31  // AES: 2 blocks - the constant byte
+#ifndef DIVERSIFY_CACHE_SIZE
+    #define DIVERSIFY_CACHE_SIZE  8
+#endif
+#define DIVERSIFY_BATCH_UIDS  8  // DES: cards per call of the batch engine (3 CMACs each for 3K3DES)
+
+class KeyDiversifier
+{
+public:
+    KeyDiversifier();
+
+    // Copies the master key (AES, 2K3DES or 3K3DES). Clears the cache.
+    bool SetMasterKey(DESFireKey* pi_MasterKey);
+    // 16 (AES, 2K3DES) or 24 (3K3DES) bytes, 0 if no master key is set
+    int  GetKeySize();
+    // The maximum length of the diversification input for the master key
+    int  GetMaxInput();
+
+    // Writes M = UID || AID (LSB first) || System Identifier into u8_Input (DIVERSIFY_MAX_INPUT bytes).
+    // u8_SysId may be NULL. Returns the length of M.
+    static int BuildInput(byte* u8_Input, const byte* u8_Uid, int s32_UidLen, uint32_t u32_AppID,
+                          const byte* u8_SysId = NULL, int s32_SysIdLen = 0);
+
+    // Derives the key for the input M into u8_Key (GetKeySize() bytes). Uses the cache.
+    bool Diversify(const byte* u8_Input, int s32_InputLen, byte* u8_Key);
+    // Same as Diversify() but stores the derived key into pi_Key (for Authenticate() or ChangeKey())
+    bool DiversifyKey(const byte* u8_Input, int s32_InputLen, DESFireKey* pi_Key, byte u8_Version);
+
+    // Derives the keys for s32_Count UIDs of s32_UidLen bytes each (stored one after the other in u8_Uids)
+    // with the same AID and System Identifier. u8_Keys receives s32_Count * GetKeySize() bytes.
+    bool DiversifyBatch(const byte* u8_Uids, int s32_UidLen, int s32_Count, uint32_t u32_AppID,
+                        const byte* u8_SysId, int s32_SysIdLen, byte* u8_Keys);
+
+    void     ClearCache();
+    uint32_t GetCacheHits();
+    uint32_t GetCacheMisses();
+
+private:
+    bool Derive(const byte* u8_Input, int s32_InputLen, byte* u8_Key);
+    bool DiversifyBatchDES(const byte* u8_Uids, int s32_UidLen, int s32_Count,
+                           byte* u8_Input, int s32_InputLen, byte* u8_Keys);
+
+    DESFireKey* mpi_Master; // points to mi_Aes or mi_Des, NULL if no master key is set
+    AES         mi_Aes;
+    DES         mi_Des;
+
+#if DIVERSIFY_CACHE_SIZE > 0
+    struct kCacheEntry
+    {
+        uint32_t u32_Used;  // mu32_Tick of the last access, 0 = empty
+        byte     u8_InputLen;
+        byte     u8_Input[DIVERSIFY_MAX_INPUT];
+        byte     u8_Key[24];
+    };
+    kCacheEntry mk_Cache[DIVERSIFY_CACHE_SIZE];
+    uint32_t    mu32_Tick;
+#endif
+    uint32_t    mu32_Hits;
+    uint32_t    mu32_Misses;
+};
+
+#endif
@@ -6,26 +6,41 @@
 */
 /**************************************************************************/
 
-#include "Arduino.h"
 #include "PN532.h"
 #include "PN532_debug.h"
 #include "Secrets.h"
 #include <string.h>
 #include "Utils.h"
+#include "PN532_TRACE.h"
 
 #define HAL(func)   (_interface->func)
 
+// Calls a function of PN532Metrics if the metrics are compiled in (see PN532_METRICS.h)
+#if PN532_METRICS
+    #define METRIC(call)   mi_Metrics.call
+#else
+    #define METRIC(call)
+#endif
+
 #define FELICA false
 #define PN532_I2C_ADDRESS (0x48 >> 1)
 #define PN532_I2C_READY 0x01
 #define PN532_I2C_TIMEOUT  1000
 
-PN532::PN532(PN532Interface &interface) : mi_CmacBuffer(mu8_CmacBuffer_Data, sizeof(mu8_CmacBuffer_Data)) {
+PN532::PN532(PN532Interface &interface) {
     _interface = &interface;
     mpi_SessionKey = NULL;
     mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
     mu8_LastPN532Error = 0;
     mu32_LastApplication = 0x000000; // No application selected
+    mb_AppSelected = false;
+    mb_SessionCache = false;
+    me_SessionKeyType = DF_KEY_INVALID;
+    mpi_MetaCache = NULL;
+    mpk_MetaEntry = NULL;
+    mb_MetaUID = false;
+    mb_MetaChecked = false;
+    ms32_RxHold = 0;
 
     // The PICC master key on an empty card is a simple DES key filled with 8 zeros
     const uint8_t ZERO_KEY[24] = {0};
@@ -131,16 +146,16 @@ uint32_t PN532::getFirmwareVersion(void) {
 
     pn532_packetbuffer[0] = PN532_COMMAND_GETFIRMWAREVERSION;
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 1)) {
-        Serial.println("write failed");
+    if (HalWriteCommand(pn532_packetbuffer, 1)) {
+        TRACE_ERROR(PN532_COMMAND_GETFIRMWAREVERSION, TRE_WriteCommand, 0);
         return 0;
     }
 
     // read data packet
-    int16_t status = HAL(readResponse)(PN532_COMMAND_GETFIRMWAREVERSION, pn532_packetbuffer,
+    int16_t status = HalReadResponse(PN532_COMMAND_GETFIRMWAREVERSION, pn532_packetbuffer,
                                        sizeof(pn532_packetbuffer));
     if (0 > status) {
-        Serial.println("read failed");
+        TRACE_ERROR(PN532_COMMAND_GETFIRMWAREVERSION, TRE_ReadResponse, status);
         return 0;
     }
 
@@ -172,12 +187,12 @@ uint32_t PN532::readRegister(uint16_t reg) {
     pn532_packetbuffer[1] = (reg >> 8) & 0xFF;
     pn532_packetbuffer[2] = reg & 0xFF;
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 3)) {
+    if (HalWriteCommand(pn532_packetbuffer, 3)) {
         return 0;
     }
 
     // read data packet
-    int16_t status = HAL(readResponse)(PN532_COMMAND_READREGISTER, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    int16_t status = HalReadResponse(PN532_COMMAND_READREGISTER, pn532_packetbuffer, sizeof(pn532_packetbuffer));
     if (0 > status) {
         return 0;
     }
@@ -206,12 +221,12 @@ uint32_t PN532::writeRegister(uint16_t reg, uint8_t val) {
     pn532_packetbuffer[3] = val;
 
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 4)) {
+    if (HalWriteCommand(pn532_packetbuffer, 4)) {
         return 0;
     }
 
     // read data packet
-    int16_t status = HAL(readResponse)(PN532_COMMAND_WRITEREGISTER, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    int16_t status = HalReadResponse(PN532_COMMAND_WRITEREGISTER, pn532_packetbuffer, sizeof(pn532_packetbuffer));
     if (0 > status) {
         return 0;
     }
@@ -254,10 +269,10 @@ bool PN532::writeGPIO(uint8_t pinstate) {
     DMSG("\n");
 
     // Send the WRITEGPIO command (0x0E)
-    if (HAL(writeCommand)(pn532_packetbuffer, 3))
+    if (HalWriteCommand(pn532_packetbuffer, 3))
         return 0;
 
-    return (0 < HAL(readResponse)(PN532_COMMAND_WRITEGPIO, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
+    return (0 < HalReadResponse(PN532_COMMAND_WRITEGPIO, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
 }
 
 /**************************************************************************/
@@ -278,10 +293,10 @@ uint8_t PN532::readGPIO(void) {
     pn532_packetbuffer[0] = PN532_COMMAND_READGPIO;
 
     // Send the READGPIO command (0x0C)
-    if (HAL(writeCommand)(pn532_packetbuffer, 1))
+    if (HalWriteCommand(pn532_packetbuffer, 1))
         return 0x0;
 
-    HAL(readResponse)(PN532_COMMAND_READGPIO, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    HalReadResponse(PN532_COMMAND_READGPIO, pn532_packetbuffer, sizeof(pn532_packetbuffer));
 
     /* READGPIO response without prefix and suffix should be in the following format:
 
@@ -314,10 +329,10 @@ bool PN532::SAMConfig(void) {
 
     DMSG("SAMConfig\n");
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 4))
+    if (HalWriteCommand(pn532_packetbuffer, 4))
         return false;
 
-    return (0 < HAL(readResponse)(PN532_COMMAND_SAMCONFIGURATION, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
+    return (0 <= HalReadResponse(PN532_COMMAND_SAMCONFIGURATION, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
 }
 
 /**************************************************************************/
@@ -332,10 +347,10 @@ bool PN532::powerDownMode() {
 
     DMSG("POWERDOWN\n");
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 4))
+    if (HalWriteCommand(pn532_packetbuffer, 4))
         return false;
 
-    return (0 < HAL(readResponse)(PN532_COMMAND_POWERDOWN, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
+    return (0 < HalReadResponse(PN532_COMMAND_POWERDOWN, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
 }
 
 /**************************************************************************/
@@ -355,10 +370,10 @@ bool PN532::setPassiveActivationRetries(uint8_t maxRetries) {
     pn532_packetbuffer[3] = 0x01; // MxRtyPSL (default = 0x01)
     pn532_packetbuffer[4] = maxRetries;
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 5))
+    if (HalWriteCommand(pn532_packetbuffer, 5))
         return 0x0;  // no ACK
 
-    return (0 < HAL(readResponse)(PN532_COMMAND_RFCONFIGURATION, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
+    return (0 < HalReadResponse(PN532_COMMAND_RFCONFIGURATION, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
 }
 
 /**************************************************************************/
@@ -382,17 +397,18 @@ bool PN532::setRFField(uint8_t autoRFCA, uint8_t rFOnOff) {
     if (rFOnOff == 0) { // if RF field is switched off
         mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
         mu32_LastApplication = 0x000000; // No application selected
+        mb_AppSelected = false;
     }
 
     pn532_packetbuffer[0] = PN532_COMMAND_RFCONFIGURATION;
     pn532_packetbuffer[1] = 1;
     pn532_packetbuffer[2] = 0x00 | autoRFCA | rFOnOff;
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 3)) {
+    if (HalWriteCommand(pn532_packetbuffer, 3)) {
         return 0x0;  // command failed
     }
 
-    return (0 < HAL(readResponse)(PN532_COMMAND_RFCONFIGURATION, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
+    return (0 < HalReadResponse(PN532_COMMAND_RFCONFIGURATION, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
 }
 
 /***** ISO14443A Commands ******/
@@ -413,6 +429,8 @@ bool PN532::setRFField(uint8_t autoRFCA, uint8_t rFOnOff) {
 */
 /**************************************************************************/
 bool PN532::readPassiveTargetID(uint8_t cardbaudrate, uint8_t *uid, uint8_t *uidLength, uint16_t timeout, bool inlist) {
+    InvalidateSession(); // a new activation resets the card
+    mb_MetaUID = false;
     pn532_packetbuffer[0] = PN532_COMMAND_INLISTPASSIVETARGET;
     pn532_packetbuffer[1] = 1;  // max 1 cards at once (we can set this to 2 later)
     pn532_packetbuffer[2] = cardbaudrate;
@@ -424,20 +442,15 @@ bool PN532::readPassiveTargetID(uint8_t cardbaudrate, uint8_t *uid, uint8_t *uid
     }
 */
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 3)) {
-        Serial.println("writeCommand failed");
+    int16_t s16_Result = HalWriteCommand(pn532_packetbuffer, 3);
+    if (s16_Result) {
+        TRACE_ERROR(PN532_COMMAND_INLISTPASSIVETARGET, TRE_WriteCommand, s16_Result);
         return false;  // command failed
     }
 
-    Serial.print("pn532_packetbuffer after write command: ");
-    for (int i = 0; i < 16; i++) {
-        DMSG_HEX(pn532_packetbuffer[i]);
-    }
-    DMSG("\n");
-
-    if (0 >
-        HAL(readResponse)(PN532_COMMAND_INLISTPASSIVETARGET, pn532_packetbuffer, sizeof(pn532_packetbuffer), timeout)) {
-        Serial.println("readResponse failed");
+    s16_Result = HalReadResponse(PN532_COMMAND_INLISTPASSIVETARGET, pn532_packetbuffer, sizeof(pn532_packetbuffer), timeout);
+    if (0 > s16_Result) {
+        TRACE_ERROR(PN532_COMMAND_INLISTPASSIVETARGET, TRE_ReadResponse, s16_Result);
         return false;
     }
 
@@ -456,7 +469,7 @@ bool PN532::readPassiveTargetID(uint8_t cardbaudrate, uint8_t *uid, uint8_t *uid
 
     // if no tags were found
     if (pn532_packetbuffer[2] != 1) {
-        PRINT_DEBUG("pn532_packetbuffer[2] failed");
+        TRACE_ERROR(PN532_COMMAND_INLISTPASSIVETARGET, TRE_NoTarget, pn532_packetbuffer[2]);
         return false;
     }
 
@@ -471,36 +484,9 @@ bool PN532::readPassiveTargetID(uint8_t cardbaudrate, uint8_t *uid, uint8_t *uid
     uint16_t ATQA = ((uint16_t) pn532_packetbuffer[4] << 8) | pn532_packetbuffer[5];
     byte SAK = pn532_packetbuffer[6];
 
-    DMSG("ATQA: 0x");  DMSG_HEX(ATQA);
-    DMSG("SAK: 0x");  DMSG_HEX(SAK);
-    DMSG("\n");
-
-#ifdef DEBUG
-    Serial.println(uidLen);
-    Serial.println(uid[0]);
-    Serial.println(ATQA);
-    Serial.println(SAK);
-
-    if (uidLen == 7 && uid[0] != 0x80 && ATQA == 0x68 && SAK == 0x0) {
-        Serial.println("Ultralight");
-    }
-
-    if (uidLen == 4 && uid[0] != 0x80 && ATQA == 0x4 && SAK == 0x8) {
-        Serial.println("Classic 1K");
-    }
-
-    if (uidLen == 4 && uid[0] != 0x80 && ATQA == 0x2 && SAK == 0x18) {
-        Serial.println("Classic 4K");
-    }
-
-    if (uidLen == 7 && uid[0] != 0x80 && ATQA == 0x0344 && SAK == 0x20) {
-        Serial.println("DESFire");
-    }
-
-    if (uidLen == 4 && uid[0] == 0x80 && ATQA == 0x0304 && SAK == 0x20) {
-        Serial.println("DESFIRE RANDOM");
-    }
-#endif
+    // Ultralight: uidLen 7, ATQA 0x0068, SAK 0x00    Classic 1K: uidLen 4, ATQA 0x0004, SAK 0x08
+    // Classic 4K: uidLen 4, ATQA 0x0002, SAK 0x18    DESFire:    uidLen 7, ATQA 0x0344, SAK 0x20 (random ID: uid[0] = 0x80)
+    TRACE_INFO(TRC_Target, PN532_COMMAND_INLISTPASSIVETARGET, ATQA, SAK, uid, uidLen);
 
     if (inlist) {
         inListedTag = pn532_packetbuffer[3];
@@ -528,11 +514,15 @@ bool PN532::ReadPassiveTargetID(byte *u8_UidBuffer, byte *pu8_UidLength, eCardTy
     *pe_CardType = CARD_Unknown;
     memset(u8_UidBuffer, 0, 8);
 
+    // InListPassiveTarget activates the card anew (or another card): the card has forgotten the application and the authentication.
+    InvalidateSession();
+    mb_MetaUID = false;
+
     pn532_packetbuffer[0] = PN532_COMMAND_INLISTPASSIVETARGET;
     pn532_packetbuffer[1] = 1;  // read data of 1 card (The PN532 can read max 2 targets at the same time)
     pn532_packetbuffer[2] = CARD_TYPE_106KB_ISO14443A; // This function currently does not support other card types.
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 3)) {
+    if (HalWriteCommand(pn532_packetbuffer, 3)) {
         return false; // Error (no valid ACK received or timeout)
     }
 
@@ -553,7 +543,7 @@ bool PN532::ReadPassiveTargetID(byte *u8_UidBuffer, byte *pu8_UidLength, eCardTy
     nn..Length-1     ATS data bytes (Desfire only)
     */
 
-    if (0 > HAL(readResponse)(PN532_COMMAND_INLISTPASSIVETARGET, pn532_packetbuffer, sizeof(pn532_packetbuffer))) {
+    if (0 > HalReadResponse(PN532_COMMAND_INLISTPASSIVETARGET, pn532_packetbuffer, sizeof(pn532_packetbuffer))) {
         Utils::Print("ReadPassiveTargetID failed\r\n");
         return false;
     }
@@ -576,12 +566,22 @@ bool PN532::ReadPassiveTargetID(byte *u8_UidBuffer, byte *pu8_UidLength, eCardTy
     memcpy(u8_UidBuffer, pn532_packetbuffer + 8, u8_IdLength);
     *pu8_UidLength = u8_IdLength;
 
+    // After the activation a Desfire card has the PICC level selected
+    mu32_LastApplication = 0x000000;
+    mb_AppSelected = true;
+
     // See "Mifare Identification & Card Types.pdf" in the ZIP file
     uint16_t u16_ATQA = ((uint16_t) pn532_packetbuffer[4] << 8) | pn532_packetbuffer[5];
     byte u8_SAK = pn532_packetbuffer[6];
 
     if (u8_IdLength == 7 && u8_UidBuffer[0] != 0x80 && u16_ATQA == 0x0344 && u8_SAK == 0x20)
         *pe_CardType = CARD_Desfire;
+
+    // The metadata cache is keyed by the UID. A random ID changes with each activation.
+    if (*pe_CardType == CARD_Desfire) {
+        memcpy(mu8_MetaUID, u8_UidBuffer, 7);
+        mb_MetaUID = true;
+    }
     if (u8_IdLength == 4 && u8_UidBuffer[0] == 0x80 && u16_ATQA == 0x0304 && u8_SAK == 0x20)
         *pe_CardType = CARD_DesRandom;
 
@@ -677,16 +677,17 @@ uint8_t PN532::mifareclassic_AuthenticateBlock(uint8_t *uid, uint8_t uidLen, uin
         pn532_packetbuffer[10 + i] = _uid[i];              /* 4 bytes card ID */
     }
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 10 + _uidLen))
+    if (HalWriteCommand(pn532_packetbuffer, 10 + _uidLen))
         return 0;
 
     // Read the response packet
-    HAL(readResponse)(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    int16_t status = HalReadResponse(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
 
     // Check if the response is valid and we are authenticated???
     // for an auth success it should be bytes 5-7: 0xD5 0x41 0x00
     // Mifare auth error is technically byte 7: 0x14 but anything other and 0x00 is not good
-    if (pn532_packetbuffer[0] != 0x00) {
+    // readResponse() returns the data from [2], so the status byte is at [2]
+    if (status < 1 || pn532_packetbuffer[2] != 0x00) {
         DMSG("Authentification failed\n");
         return 0;
     }
@@ -718,21 +719,22 @@ uint8_t PN532::mifareclassic_ReadDataBlock(uint8_t blockNumber, uint8_t *data) {
     pn532_packetbuffer[3] = blockNumber;            /* Block Number (0..63 for 1K, 0..255 for 4K) */
 
     /* Send the command */
-    if (HAL(writeCommand)(pn532_packetbuffer, 4)) {
+    if (HalWriteCommand(pn532_packetbuffer, 4)) {
         return 0;
     }
 
     /* Read the response packet */
-    HAL(readResponse)(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    int16_t status = HalReadResponse(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
 
     /* If byte 8 isn't 0x00 we probably have an error */
-    if (pn532_packetbuffer[0] != 0x00) {
+    /* (readResponse() returns the data from [2])     */
+    if (status < 17 || pn532_packetbuffer[2] != 0x00) {
         return 0;
     }
 
     /* Copy the 16 data bytes to the output buffer        */
     /* Block content starts at byte 9 of a valid response */
-    memcpy(data, pn532_packetbuffer + 1, 16);
+    memcpy(data, pn532_packetbuffer + 3, 16);
 
     return 1;
 }
@@ -758,12 +760,13 @@ uint8_t PN532::mifareclassic_WriteDataBlock(uint8_t blockNumber, uint8_t *data)
     memcpy(pn532_packetbuffer + 4, data, 16);        /* Data Payload */
 
     /* Send the command */
-    if (HAL(writeCommand)(pn532_packetbuffer, 20)) {
+    if (HalWriteCommand(pn532_packetbuffer, 20)) {
         return 0;
     }
 
-    /* Read the response packet */
-    return (0 < HAL(readResponse)(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
+    /* Read the response packet, a NAK of the card is returned in the status byte */
+    int16_t status = HalReadResponse(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    return (0 < status && pn532_packetbuffer[2] == 0x00);
 }
 
 /**************************************************************************/
@@ -898,21 +901,22 @@ uint8_t PN532::mifareultralight_ReadPage(uint8_t page, uint8_t *buffer) {
     pn532_packetbuffer[3] = page;                /* Page Number (0..63 in most cases) */
 
     /* Send the command */
-    if (HAL(writeCommand)(pn532_packetbuffer, 4)) {
+    if (HalWriteCommand(pn532_packetbuffer, 4)) {
         return 0;
     }
 
     /* Read the response packet */
-    HAL(readResponse)(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    int16_t status = HalReadResponse(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
 
     /* If byte 8 isn't 0x00 we probably have an error */
-    if (pn532_packetbuffer[0] == 0x00) {
+    /* (readResponse() returns the data from [2])     */
+    if (status >= 5 && pn532_packetbuffer[2] == 0x00) {
         /* Copy the 4 data bytes to the output buffer         */
         /* Block content starts at byte 9 of a valid response */
         /* Note that the command actually reads 16 bytes or 4  */
         /* pages at a time ... we simply discard the last 12  */
         /* bytes                                              */
-        memcpy(buffer, pn532_packetbuffer + 1, 4);
+        memcpy(buffer, pn532_packetbuffer + 3, 4);
     } else {
         return 0;
     }
@@ -941,12 +945,13 @@ uint8_t PN532::mifareultralight_WritePage(uint8_t page, uint8_t *buffer) {
     memcpy(pn532_packetbuffer + 4, buffer, 4);          /* Data Payload */
 
     /* Send the command */
-    if (HAL(writeCommand)(pn532_packetbuffer, 8)) {
+    if (HalWriteCommand(pn532_packetbuffer, 8)) {
         return 0;
     }
 
-    /* Read the response packet */
-    return (0 < HAL(readResponse)(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer)));
+    /* Read the response packet, a NAK of the card is returned in the status byte */
+    int16_t status = HalReadResponse(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    return (0 < status && pn532_packetbuffer[2] == 0x00);
 }
 
 /**************************************************************************/
@@ -965,11 +970,11 @@ bool PN532::inDataExchange(uint8_t *send, uint8_t sendLength, uint8_t *response,
     pn532_packetbuffer[0] = 0x40; // PN532_COMMAND_INDATAEXCHANGE;
     pn532_packetbuffer[1] = inListedTag;
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 2, send, sendLength)) {
+    if (HalWriteCommand(pn532_packetbuffer, 2, send, sendLength)) {
         return false;
     }
 
-    int16_t status = HAL(readResponse)(PN532_COMMAND_INDATAEXCHANGE, response, *responseLength, 1000);
+    int16_t status = HalReadResponse(PN532_COMMAND_INDATAEXCHANGE, response, *responseLength, 1000);
     if (status < 0) {
         return false;
     }
@@ -1001,17 +1006,19 @@ bool PN532::inDataExchange(uint8_t *send, uint8_t sendLength, uint8_t *response,
 */
 /**************************************************************************/
 bool PN532::inListPassiveTarget() {
+    InvalidateSession();
+    mb_MetaUID = false;
     pn532_packetbuffer[0] = PN532_COMMAND_INLISTPASSIVETARGET;
     pn532_packetbuffer[1] = 1;
     pn532_packetbuffer[2] = 0;
 
     DMSG("inList passive target\n");
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 3)) {
+    if (HalWriteCommand(pn532_packetbuffer, 3)) {
         return false;
     }
 
-    int16_t status = HAL(readResponse)(PN532_COMMAND_INLISTPASSIVETARGET, pn532_packetbuffer,
+    int16_t status = HalReadResponse(PN532_COMMAND_INLISTPASSIVETARGET, pn532_packetbuffer,
                                        sizeof(pn532_packetbuffer), 30000);
     if (status < 0) {
         return false;
@@ -1028,12 +1035,12 @@ bool PN532::inListPassiveTarget() {
 
 int8_t PN532::tgInitAsTarget(const uint8_t *command, const uint8_t len, const uint16_t timeout) {
 
-    int8_t status = HAL(writeCommand)(command, len);
+    int8_t status = HalWriteCommand(command, len);
     if (status < 0) {
         return -1;
     }
 
-    status = HAL(readResponse)(command[0], pn532_packetbuffer, sizeof(pn532_packetbuffer), timeout);
+    status = HalReadResponse(command[0], pn532_packetbuffer, sizeof(pn532_packetbuffer), timeout);
     if (status > 0) {
         return 1;
     } else if (PN532_TIMEOUT == status) {
@@ -1067,14 +1074,14 @@ int8_t PN532::tgInitAsTarget(uint16_t timeout) {
     return tgInitAsTarget(command, sizeof(command), timeout);
 }
 
-int16_t PN532::tgGetData(uint8_t *buf, uint8_t len) {
+int16_t PN532::tgGetData(uint8_t *buf, uint16_t len) {
     buf[0] = PN532_COMMAND_TGGETDATA;
 
-    if (HAL(writeCommand)(buf, 1)) {
+    if (HalWriteCommand(buf, 1)) {
         return -1;
     }
 
-    int16_t status = HAL(readResponse)(PN532_COMMAND_TGGETDATA, buf, len, 3000);
+    int16_t status = HalReadResponse(PN532_COMMAND_TGGETDATA, buf, len, 3000);
     if (0 >= status) {
         return status;
     }
@@ -1087,14 +1094,14 @@ int16_t PN532::tgGetData(uint8_t *buf, uint8_t len) {
         return -5;
     }
 
-    for (uint8_t i = 0; i < length; i++) {
+    for (uint16_t i = 0; i < length; i++) {
         buf[i] = buf[i + 1];
     }
 
     return length;
 }
 
-bool PN532::tgSetData(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint8_t blen) {
+bool PN532::tgSetData(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen) {
     if (hlen > (sizeof(pn532_packetbuffer) - 1)) {
         if ((body != 0) || (header == pn532_packetbuffer)) {
             DMSG("tgSetData:buffer too small\n");
@@ -1102,21 +1109,21 @@ bool PN532::tgSetData(const uint8_t *header, uint8_t hlen, const uint8_t *body,
         }
 
         pn532_packetbuffer[0] = PN532_COMMAND_TGSETDATA;
-        if (HAL(writeCommand)(pn532_packetbuffer, 1, header, hlen)) {
+        if (HalWriteCommand(pn532_packetbuffer, 1, header, hlen)) {
             return false;
         }
     } else {
-        for (int8_t i = hlen - 1; i >= 0; i--) {
+        for (int i = hlen - 1; i >= 0; i--) {
             pn532_packetbuffer[i + 1] = header[i];
         }
         pn532_packetbuffer[0] = PN532_COMMAND_TGSETDATA;
 
-        if (HAL(writeCommand)(pn532_packetbuffer, hlen + 1, body, blen)) {
+        if (HalWriteCommand(pn532_packetbuffer, hlen + 1, body, blen)) {
             return false;
         }
     }
 
-    if (0 > HAL(readResponse)(PN532_COMMAND_TGSETDATA, pn532_packetbuffer, sizeof(pn532_packetbuffer), 3000)) {
+    if (0 > HalReadResponse(PN532_COMMAND_TGSETDATA, pn532_packetbuffer, sizeof(pn532_packetbuffer), 3000)) {
         return false;
     }
 
@@ -1132,38 +1139,40 @@ int16_t PN532::inSelectCard(const uint8_t relevantTarget) {
     pn532_packetbuffer[0] = PN532_COMMAND_INSELECT;
     pn532_packetbuffer[1] = relevantTarget;
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 2)) {
+    if (HalWriteCommand(pn532_packetbuffer, 2)) {
         return 0;
     }
 
     // read data packet
-    return HAL(readResponse)(PN532_COMMAND_INSELECT, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    return HalReadResponse(PN532_COMMAND_INSELECT, pn532_packetbuffer, sizeof(pn532_packetbuffer));
 }
 
 int16_t PN532::inDeselectCard(const uint8_t relevantTarget) {
+    InvalidateSession();
 
     pn532_packetbuffer[0] = PN532_COMMAND_INDESELECT;
     pn532_packetbuffer[1] = relevantTarget;
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 2)) {
+    if (HalWriteCommand(pn532_packetbuffer, 2)) {
         return 0;
     }
 
     // read data packet
-    return HAL(readResponse)(PN532_COMMAND_INDESELECT, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    return HalReadResponse(PN532_COMMAND_INDESELECT, pn532_packetbuffer, sizeof(pn532_packetbuffer));
 }
 
 int16_t PN532::inRelease(const uint8_t relevantTarget) {
+    InvalidateSession();
 
     pn532_packetbuffer[0] = PN532_COMMAND_INRELEASE;
     pn532_packetbuffer[1] = relevantTarget;
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 2)) {
+    if (HalWriteCommand(pn532_packetbuffer, 2)) {
         return 0;
     }
 
     // read data packet
-    return HAL(readResponse)(PN532_COMMAND_INRELEASE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
+    return HalReadResponse(PN532_COMMAND_INRELEASE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
 }
 
 #if FELICA
@@ -1197,12 +1206,12 @@ int8_t PN532::felica_Polling(uint16_t systemCode, uint8_t requestCode, uint8_t *
     pn532_packetbuffer[6] = requestCode;
     pn532_packetbuffer[7] = 0;
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 8)) {
+    if (HalWriteCommand(pn532_packetbuffer, 8)) {
         DMSG("Could not send Polling command\n");
         return -1;
     }
 
-    int16_t status = HAL(readResponse)(PN532_COMMAND_INLISTPASSIVETARGET, pn532_packetbuffer, 22, timeout);
+    int16_t status = HalReadResponse(PN532_COMMAND_INLISTPASSIVETARGET, pn532_packetbuffer, 22, timeout);
     if (status < 0) {
         DMSG("Could not receive response\n");
         return -2;
@@ -1269,13 +1278,13 @@ PN532::felica_SendCommand(const uint8_t *command, uint8_t commandlength, uint8_t
     pn532_packetbuffer[1] = inListedTag;
     pn532_packetbuffer[2] = commandlength + 1;
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 3, command, commandlength)) {
+    if (HalWriteCommand(pn532_packetbuffer, 3, command, commandlength)) {
         DMSG("Could not send FeliCa command\n");
         return -2;
     }
 
     // Wait card response
-    int16_t status = HAL(readResponse)(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer),
+    int16_t status = HalReadResponse(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer),
                                        200);
     if (status < 0) {
         DMSG("Could not receive response\n");
@@ -1583,13 +1592,13 @@ int8_t PN532::felica_Release() {
     pn532_packetbuffer[1] = 0x00;   // All target
     DMSG("Release all FeliCa target\n");
 
-    if (HAL(writeCommand)(pn532_packetbuffer, 2)) {
+    if (HalWriteCommand(pn532_packetbuffer, 2)) {
         DMSG("No ACK\n");
         return -1;  // no ACK
     }
 
     // Wait card response
-    int16_t frameLength = HAL(readResponse)(PN532_COMMAND_INRELEASE, pn532_packetbuffer, sizeof(pn532_packetbuffer),
+    int16_t frameLength = HalReadResponse(PN532_COMMAND_INRELEASE, pn532_packetbuffer, sizeof(pn532_packetbuffer),
                                             1000);
     if (frameLength < 0) {
         DMSG("Could not receive response\n");
@@ -1634,7 +1643,7 @@ bool PN532::EnableRandomIDForever() {
     i_Params.AppendUint8(0x02); // 0x02 = enable random ID, 0x01 = disable format
 
     // The TX CMAC must not be calculated here because a CBC encryption operation has already been executed
-    return (0 == DataExchange(&i_Command, &i_Params, NULL, 0, NULL, MAC_TcryptRmac));
+    return (0 == DataExchange<MAC_TcryptRmac>(&i_Command, &i_Params, NULL, 0, NULL));
 }
 
 /**************************************************************************
@@ -1653,7 +1662,7 @@ bool PN532::GetRealCardID(byte u8_UID[7]) {
     }
 
     RX_BUFFER(i_Data, 16);
-    if (16 != DataExchange(DFEV1_INS_GET_CARD_UID, NULL, i_Data, 16, NULL, MAC_TmacRcrypt))
+    if (16 != DataExchange<MAC_TmacRcrypt>(DFEV1_INS_GET_CARD_UID, NULL, i_Data, 16, NULL))
         return false;
 
     // The card returns UID[7] + CRC32[4] encrypted with the session key
@@ -1674,6 +1683,7 @@ bool PN532::GetRealCardID(byte u8_UID[7]) {
 
     if (u32_Crc1 != u32_Crc2) {
         //Utils::Print("Invalid CRC\r\n");
+        InvalidateSession();
         return false;
     }
 
@@ -1702,752 +1712,368 @@ byte PN532::GetLastPN532Error() {
 
 /**************************************************************************
     Sends data to the card and receives the response.
+    MAC           = defines the CMAC calculation and encryption (template parameter)
     u8_Command    = Desfire command without additional paramaters
     pi_Command    = Desfire command + possible additional paramaters that will not be encrypted
     pi_Params     = Desfire command parameters that may be encrypted (MAC_Tcrypt). This paramater may also be null.
     u8_RecvBuf    = buffer that receives the received data (should be the size of the expected recv data)
    s32_RecvSize   = buffer size of u8_RecvBuf
     pe_Status     = if (!= NULL) -> receives the status byte
-    e_Mac         = defines CMAC calculation
     returns the byte count that has been read into u8_RecvBuf or -1 on error
+
+    The exchange runs through these stages:
+    MAC_Tcrypt -> EncryptParams()  append the CRC32 and encrypt pi_Params
+    MAC_Tmac   -> CalcTxCmac()     calculate the TX CMAC (keeps the IV up to date)
+                  Transceive()     build the INDATAEXCHANGE frame, send it, check the status bytes
+    MAC_Rmac   -> VerifyRxCmac()   remove the CMAC from the response and verify it
+    MAC_Rcrypt -> decrypt the response with the session key
+    MAC is a compile time constant, so each call site only contains the stages it uses.
 **************************************************************************/
-int
-PN532::DataExchange(byte u8_Command, TxBuffer *pi_Params, byte *u8_RecvBuf, int s32_RecvSize, DESFireStatus *pe_Status,
-                    DESFireCmac e_Mac) {
+template <DESFireCmac MAC>
+int PN532::DataExchange(byte u8_Command, TxBuffer *pi_Params, byte *u8_RecvBuf, int s32_RecvSize, DESFireStatus *pe_Status) {
     TX_BUFFER(i_Command, 1);
     i_Command.AppendUint8(u8_Command);
 
-    return DataExchange(&i_Command, pi_Params, u8_RecvBuf, s32_RecvSize, pe_Status, e_Mac);
+    return DataExchange<MAC>(&i_Command, pi_Params, u8_RecvBuf, s32_RecvSize, pe_Status);
 }
 
-int PN532::DataExchangeOLD(TxBuffer *pi_Command,               // in (command + params that are not encrypted)
-                           TxBuffer *pi_Params,                // in (parameters that may be encrypted)
-                           byte *u8_RecvBuf, int s32_RecvSize, // out
-                           DESFireStatus *pe_Status,           // out
-                           DESFireCmac e_Mac)               // in
+template <DESFireCmac MAC>
+int PN532::DataExchange(TxBuffer *pi_Command,               // in (command + params that are not encrypted)
+                        TxBuffer *pi_Params,                // in (parameters that may be encrypted)
+                        byte *u8_RecvBuf, int s32_RecvSize, // out
+                        DESFireStatus *pe_Status)           // out
 {
     if (pe_Status) *pe_Status = ST_Success;
     mu8_LastPN532Error = 0;
+
     TX_BUFFER(i_Empty, 1);
     if (pi_Params == NULL)
         pi_Params = &i_Empty;
+
     // The response for INDATAEXCHANGE is always:
     // - 0xD5
     // - 0x41
     // - Status byte from PN532        (0 if no error)
     // - Status byte from Desfire card (0 if no error)
     // - data bytes ...
-    int s32_Overhead = 11; // Overhead added to payload = 11 bytes = 7 bytes for PN532 frame + 3 bytes for INDATAEXCHANGE response + 1 card status byte
-    if (e_Mac & MAC_Rmac) s32_Overhead += 8; // + 8 bytes for CMAC
+    // Overhead added to payload = 11 bytes = 7 bytes for PN532 frame + 3 bytes for INDATAEXCHANGE response + 1 card status byte
+    // + 8 bytes for CMAC
+    // + 3 bytes if the response needs an extended frame (length > 255)
+    int s32_Overhead = (MAC & MAC_Rmac) ? 19 : 11;
+    if (s32_Overhead - 7 + s32_RecvSize > PN532_NORMAL_FRAME_LEN)
+        s32_Overhead += 3;
+
     // pn532_packetbuffer is used for input and output
     if (2 + pi_Command->GetCount() + pi_Params->GetCount() > PN532_PACKBUFFSIZE ||
         s32_Overhead + s32_RecvSize > PN532_PACKBUFFSIZE) {
         Utils::Print("DataExchange(): Invalid parameters\r\n");
         return -1;
     }
-    if (e_Mac & (MAC_Tcrypt | MAC_Rcrypt)) {
-        if (mu8_LastAuthKeyNo == NOT_AUTHENTICATED) {
-            Utils::Print("Not authenticated\r\n");
-            return -1;
-        }
-    }
-    if (e_Mac & MAC_Tcrypt) // CRC and encrypt pi_Params
-    {
-        if (mu8_DebugLevel > 0) {
-            Utils::Print("* Sess Key IV: ");
-            mpi_SessionKey->PrintIV(LF);
-        }
-        // The CRC is calculated over the command (which is not encrypted) and the parameters to be encrypted.
-        uint32_t u32_Crc = Utils::CalcCrc32(pi_Command->GetData(), pi_Command->GetCount(), pi_Params->GetData(),
-                                            pi_Params->GetCount());
-        if (!pi_Params->AppendUint32(u32_Crc))
-            return -1; // buffer overflow
-        int s32_CryptCount = mpi_SessionKey->CalcPaddedBlockSize(pi_Params->GetCount());
-        if (!pi_Params->SetCount(s32_CryptCount))
-            return -1; // buffer overflow
-        if (mu8_DebugLevel > 0) {
-            Utils::Print("* CRC Params:  0x");
-            Utils::PrintHex32(u32_Crc, LF);
-            Utils::Print("* Params:      ");
-            Utils::PrintHexBuf(pi_Params->GetData(), s32_CryptCount, LF);
-        }
-        if (!mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, pi_Params->GetData(), pi_Params->GetData(),
-                                          s32_CryptCount))
-            return -1;
-        if (mu8_DebugLevel > 0) {
-            Utils::Print("* Params_enc:  ");
-            Utils::PrintHexBuf(pi_Params->GetData(), s32_CryptCount, LF);
-        }
-    }
-    byte u8_Command = pi_Command->GetData()[0];
-    byte u8_CalcMac[16];
-    if ((e_Mac & MAC_Tmac) &&                       // Calculate the TX CMAC only if the caller requests it
-        (u8_Command != DF_INS_ADDITIONAL_FRAME) &&
-        // In case of DF_INS_ADDITIONAL_FRAME there are never parameters passed -> nothing to do here
-        (mu8_LastAuthKeyNo != NOT_AUTHENTICATED))   // No session key -> no CMAC calculation possible
-    {
-        mi_CmacBuffer.Clear();
-        if (!mi_CmacBuffer.AppendBuf(pi_Command->GetData(), pi_Command->GetCount()) ||
-            !mi_CmacBuffer.AppendBuf(pi_Params->GetData(), pi_Params->GetCount()))
-            return -1;
-        // The CMAC must be calculated here although it is not transmitted, because it maintains the IV up to date.
-        // The initialization vector must always be correct otherwise the card will give an integrity error the next time the session key is used.
-        if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac))
-            return -1;
-        /*
-
-1A 2A 0F 0D 49 D2 FF 14 48 E3 F2 5F F3 63 1F 89 (TX CMAC)
-Sending:  00 00 FF 0B F5 <D4 40 01 BD 01 00 00 00 0A 00 00> 23 00
-Response: 00 00 FF 14 EC <D5 41 00 00 F1 DA 99 E6 5F AF 90 6E B8 39 17 02 D7 43 FF 82> EF 00 E4 E0
-f1 da 99 e6 5f af 90 6e b8 39 17  2 d7 43 ff 82 (pn532_packetbuffer)
-F1 DA 99 E6 5F AF 90 6E 00 (mi_CmacBuffer 2)
-1D 72 F8 47 43 27 D0 0A A2 C4 A1 CB AB 44 6E 04 (RX CMAC)
-B8 39 17 02 D7 43 FF 82 E0 B1 E4 E0 B1 3C 39 2E (u8_RxMac)
-
-         */
-
 
-        if (mu8_DebugLevel > 1) {
-            Utils::Print("TX CMAC:  ");
-            Utils::PrintHexBuf(u8_CalcMac, mpi_SessionKey->GetBlockSize(), LF);
-        }
-    }
-    int P = 0;
-    pn532_packetbuffer[P++] = PN532_COMMAND_INDATAEXCHANGE;
-    pn532_packetbuffer[P++] = 1; // Card number (Logical target number)
-    memcpy(pn532_packetbuffer + P, pi_Command->GetData(), pi_Command->GetCount());
-    P += pi_Command->GetCount();
-    memcpy(pn532_packetbuffer + P, pi_Params->GetData(), pi_Params->GetCount());
-    P += pi_Params->GetCount();
-    if (!SendCommandCheckAck(pn532_packetbuffer, P))
-        return -1;
-    byte s32_Len = ReadData(pn532_packetbuffer, s32_RecvSize + s32_Overhead);
-    // ReadData() returns 3 byte if status error from the PN532
-    // ReadData() returns 4 byte if status error from the Desfire card
-    if (s32_Len < 3 || pn532_packetbuffer[1] != PN532_COMMAND_INDATAEXCHANGE + 1) {
-        PRINT_DEBUG("DataExchange() failed")
+    if ((MAC & (MAC_Tcrypt | MAC_Rcrypt)) && mu8_LastAuthKeyNo == NOT_AUTHENTICATED) {
+        Utils::Print("Not authenticated\r\n");
         return -1;
     }
-    // Here we get two status bytes that must be checked
-    byte u8_PN532Status = pn532_packetbuffer[2]; // contains errors from the PN532
-    byte u8_CardStatus = pn532_packetbuffer[3]; // contains errors from the Desfire card
 
-    Serial.println();
-    Serial.println("4B + CmacBuf + RxMac");
-    Serial.print(String("pn532_packetbuffer 3: "));
-    for (int i = 0; i < s32_Len; i++) {
-        Serial.print(String(pn532_packetbuffer[i], HEX) + " ");
+    byte u8_Command = pi_Command->GetData()[0];
+
+    // After any failure of the secure messaging the IV of the session key is no longer in sync with the card.
+    // InvalidateSession() makes sure that the next SelectApplication() and Authenticate() go to the card.
+    if ((MAC & MAC_Tcrypt) && !EncryptParams(pi_Command, pi_Params)) {
+        InvalidateSession();
+        return -1;
     }
-    Serial.println();
 
-    mu8_LastPN532Error = u8_PN532Status;
-    if (!CheckPN532Status(u8_PN532Status) || s32_Len < 4)
+    if ((MAC & MAC_Tmac) && !CalcTxCmac(pi_Command, pi_Params)) {
+        InvalidateSession();
         return -1;
-    // After any error that the card has returned the authentication is invalidated.
-    // The card does not send any CMAC anymore until authenticated anew.
-    if (u8_CardStatus != ST_Success && u8_CardStatus != ST_MoreFrames) {
-        mu8_LastAuthKeyNo = NOT_AUTHENTICATED; // A new authentication is required now
     }
-    if (!CheckCardStatus((DESFireStatus) u8_CardStatus))
+
+    byte u8_CardStatus;
+    int s32_Len = Transceive(pi_Command, pi_Params, s32_RecvSize + s32_Overhead, &u8_CardStatus);
+    if (s32_Len < 0)
         return -1;
+
     if (pe_Status)
         *pe_Status = (DESFireStatus) u8_CardStatus;
-    s32_Len -= 4; // 3 bytes for INDATAEXCHANGE response + 1 byte card status
-    // A CMAC may be appended to the end of the frame.
-    // The CMAC calculation is important because it maintains the IV of the session key up to date.
-    // If the IV is out of sync with the IV in the card, the next encryption with the session key will result in an Integrity Error.
-    if ((e_Mac & MAC_Rmac) &&// Calculate RX CMAC only if the caller requests it
-        (u8_CardStatus == ST_Success || u8_CardStatus == ST_MoreFrames) &&
-        // In case of an error there is no CMAC in the response
-        (mu8_LastAuthKeyNo !=
-         NOT_AUTHENTICATED))                          // No session key -> no CMAC calculation possible
-    {
-        // For example GetCardVersion() calls DataExchange() 3 times:
-        // 1. u8_Command = DF_INS_GET_VERSION      -> clear CMAC buffer + append received data
-        // 2. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
-        // 3. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
-        if (u8_Command != DF_INS_ADDITIONAL_FRAME) {
-            mi_CmacBuffer.Clear();
-        }
-        // This is an intermediate frame. More frames will follow. There is no CMAC in the response yet.
-        if (u8_CardStatus == ST_MoreFrames) {
-            Serial.println("ST_MoreFrames");
-            if (!mi_CmacBuffer.AppendBuf(pn532_packetbuffer + 4, s32_Len))
-                return -1;
-        }
-        if ((s32_Len >= 8) &&             // If the response is shorter than 8 bytes it surely does not contain a CMAC
-            (u8_CardStatus == ST_Success)) // Response contains CMAC only in case of success
-        {
-            s32_Len -= 8; // Do not return the received CMAC to the caller and do not include it into the CMAC calculation
-            byte *u8_RxMac = pn532_packetbuffer + 4 + s32_Len;
-
-            // The CMAC is calculated over the RX data + the status byte appended to the END of the RX data!
-            if (!mi_CmacBuffer.AppendBuf(pn532_packetbuffer + 4, s32_Len) ||
-                !mi_CmacBuffer.AppendUint8(u8_CardStatus)) {
-                return -1;
-            }
-
-            Serial.print("mi_CmacBuffer 2: ");
-            Utils::PrintHexBuf(mi_CmacBuffer.GetData(), mi_CmacBuffer.GetCount(), LF);
-
-            if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac)) {
-                return -1;
-            }
-
-            if (mu8_DebugLevel > 1) {
-                Utils::Print("RX CMAC:  ");
-                Utils::PrintHexBuf(u8_CalcMac, mpi_SessionKey->GetBlockSize(), LF);
-            }
 
-            // For AES the CMAC is 16 byte, but only 8 are transmitted
-            if (memcmp(u8_RxMac, u8_CalcMac, 8) != 0) {
-                PRINT_DEBUG("CMAC Mismatch\r\n");
-                Serial.print("u8_RxMac: ");
-                Utils::PrintHexBuf(u8_RxMac, mpi_SessionKey->GetBlockSize(), LF);
-                return -1;
-            }
+    if (MAC & MAC_Rmac) {
+        s32_Len = VerifyRxCmac(u8_Command, u8_CardStatus, s32_Len);
+        if (s32_Len < 0) {
+            InvalidateSession();
+            return -1;
         }
     }
 
     if (s32_Len > s32_RecvSize) {
+        TRACE_ERROR(u8_Command, TRE_Overflow, s32_Len);
         Utils::Print("DataExchange() Buffer overflow\r\n");
+        InvalidateSession();
         return -1;
     }
 
     if (u8_RecvBuf && s32_Len) {
-        memcpy(u8_RecvBuf, pn532_packetbuffer + 4, s32_Len);
-        if (e_Mac & MAC_Rcrypt) // decrypt received data with session key
+        if (MAC & MAC_Rcrypt) // decrypt received data with session key directly into the buffer of the caller
         {
-            if (!mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_RecvBuf, u8_RecvBuf, s32_Len))
+            if (!mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_RecvBuf, pn532_packetbuffer + 4, s32_Len)) {
+                TRACE_ERROR(u8_Command, TRE_Decrypt, s32_Len);
+                InvalidateSession();
                 return -1;
+            }
+            TRACE_DEBUG(TRC_Decrypt, u8_Command, s32_Len, 0, u8_RecvBuf, s32_Len);
+
             if (mu8_DebugLevel > 1) {
                 Utils::Print("Decrypt:  ");
                 Utils::PrintHexBuf(u8_RecvBuf, s32_Len, LF);
             }
         }
+        else {
+            memcpy(u8_RecvBuf, pn532_packetbuffer + 4, s32_Len);
+        }
     }
     return s32_Len;
 }
 
-int PN532::DataExchangeReadFile(byte u8_Command, TxBuffer *pi_Params, byte *u8_RecvBuf, int s32_RecvSize,
-                                DESFireStatus *pe_Status, DESFireCmac e_Mac) {
-    TX_BUFFER(i_Command, 1);
-    i_Command.AppendUint8(u8_Command);
-
-    return DataExchangeReadFile(&i_Command, pi_Params, u8_RecvBuf, s32_RecvSize, pe_Status, e_Mac);
-}
-
-int PN532::DataExchangeReadFile(TxBuffer *pi_Command,               // in (command + params that are not encrypted)
-                                TxBuffer *pi_Params,                // in (parameters that may be encrypted)
-                                byte *u8_RecvBuf, int s32_RecvSize, // out
-                                DESFireStatus *pe_Status,
-                                DESFireCmac e_Mac)               // in
-{
-    if (pe_Status) *pe_Status = ST_Success;
-    mu8_LastPN532Error = 0;
-
-    TX_BUFFER(i_Empty, 1);
-    if (pi_Params == NULL)
-        pi_Params = &i_Empty;
-
-    int s32_Overhead = 11; // Overhead added to payload = 11 bytes = 7 bytes for PN532 frame + 3 bytes for INDATAEXCHANGE response + 1 card status byte
-    if (e_Mac & MAC_Rmac) s32_Overhead += 8; // + 8 bytes for CMAC
-
-    if (2 + pi_Command->GetCount() + pi_Params->GetCount() > PN532_PACKBUFFSIZE ||
-        s32_Overhead + s32_RecvSize > PN532_PACKBUFFSIZE) {
-        Utils::Print("DataExchange(): Invalid parameters\r\n");
-        return -1;
-    }
-
-    if (e_Mac & (MAC_Tcrypt | MAC_Rcrypt)) {
-        if (mu8_LastAuthKeyNo == NOT_AUTHENTICATED) {
-            Utils::Print("Not authenticated\r\n");
-            return -1;
-        }
+/**************************************************************************
+    DataExchange() stage MAC_Tcrypt: appends the CRC32 to the parameters,
+    pads them to the block size and encrypts them with the session key.
+**************************************************************************/
+bool PN532::EncryptParams(TxBuffer *pi_Command, TxBuffer *pi_Params) {
+    if (mu8_DebugLevel > 0) {
+        Utils::Print("* Sess Key IV: ");
+        mpi_SessionKey->PrintIV(LF);
     }
 
-    if (e_Mac & MAC_Tcrypt) // CRC and encrypt pi_Params
-    {
-        // The CRC is calculated over the command (which is not encrypted) and the parameters to be encrypted.
-        uint32_t u32_Crc = Utils::CalcCrc32(pi_Command->GetData(), pi_Command->GetCount(), pi_Params->GetData(),
-                                            pi_Params->GetCount());
-        if (!pi_Params->AppendUint32(u32_Crc))
-            return -1; // buffer overflow
+    // The CRC is calculated over the command (which is not encrypted) and the parameters to be encrypted.
+    uint32_t u32_Crc = Utils::CalcCrc32(pi_Command->GetData(), pi_Command->GetCount(), pi_Params->GetData(),
+                                        pi_Params->GetCount());
+    if (!pi_Params->AppendUint32(u32_Crc))
+        return false; // buffer overflow
 
-        int s32_CryptCount = mpi_SessionKey->CalcPaddedBlockSize(pi_Params->GetCount());
-        if (!pi_Params->SetCount(s32_CryptCount))
-            return -1; // buffer overflow
+    int s32_CryptCount = mpi_SessionKey->CalcPaddedBlockSize(pi_Params->GetCount());
+    if (!pi_Params->SetCount(s32_CryptCount))
+        return false; // buffer overflow
 
-        if (mu8_DebugLevel > 0) {
-            Utils::Print("* CRC Params:  0x");
-            Utils::PrintHex32(u32_Crc, LF);
-            Utils::Print("* Params:      ");
-            Utils::PrintHexBuf(pi_Params->GetData(), s32_CryptCount, LF);
-        }
+    if (mu8_DebugLevel > 0) {
+        Utils::Print("* CRC Params:  0x");
+        Utils::PrintHex32(u32_Crc, LF);
+        Utils::Print("* Params:      ");
+        Utils::PrintHexBuf(pi_Params->GetData(), s32_CryptCount, LF);
+    }
 
-        if (!mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, pi_Params->GetData(), pi_Params->GetData(),
-                                          s32_CryptCount))
-            return -1;
+    if (!mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, pi_Params->GetData(), pi_Params->GetData(),
+                                      s32_CryptCount))
+        return false;
 
-        if (mu8_DebugLevel > 0) {
-            Utils::Print("* Params_enc:  ");
-            Utils::PrintHexBuf(pi_Params->GetData(), s32_CryptCount, LF);
-        }
+    if (mu8_DebugLevel > 0) {
+        Utils::Print("* Params_enc:  ");
+        Utils::PrintHexBuf(pi_Params->GetData(), s32_CryptCount, LF);
     }
+    return true;
+}
 
-    byte u8_Command = pi_Command->GetData()[0];
+/**************************************************************************
+    DataExchange() stage MAC_Tmac: calculates the CMAC over the command and the parameters.
+    The CMAC must be calculated here although it is not transmitted, because it maintains the IV up to date.
+    The initialization vector must always be correct otherwise the card will give an integrity error the next time the session key is used.
+    u8_Data = optional data that follows the parameters in DF_INS_ADDITIONAL_FRAME frames (see WriteFileData())
+    u8_Cmac = optional, receives the CMAC (16 bytes) if it must be transmitted (CM_MAC)
+**************************************************************************/
+bool PN532::CalcTxCmac(TxBuffer *pi_Command, TxBuffer *pi_Params, const byte *u8_Data, int s32_DataLen, byte *u8_Cmac) {
+    // In case of DF_INS_ADDITIONAL_FRAME there are never parameters passed -> nothing to do here
+    // No session key -> no CMAC calculation possible
+    if (pi_Command->GetData()[0] == DF_INS_ADDITIONAL_FRAME || mu8_LastAuthKeyNo == NOT_AUTHENTICATED)
+        return true;
 
+    // The CMAC is calculated directly over both buffers without copying them
     byte u8_CalcMac[16];
-    if ((e_Mac & MAC_Tmac) &&                       // Calculate the TX CMAC only if the caller requests it
-        (u8_Command != DF_INS_ADDITIONAL_FRAME) &&
-        // In case of DF_INS_ADDITIONAL_FRAME there are never parameters passed -> nothing to do here
-        (mu8_LastAuthKeyNo != NOT_AUTHENTICATED))   // No session key -> no CMAC calculation possible
-    {
-        mi_CmacBuffer.Clear();
-        if (!mi_CmacBuffer.AppendBuf(pi_Command->GetData(), pi_Command->GetCount()) ||
-            !mi_CmacBuffer.AppendBuf(pi_Params->GetData(), pi_Params->GetCount()))
-            return -1;
+    if (!mpi_SessionKey->CmacBegin() ||
+        !mpi_SessionKey->CmacUpdate(pi_Command->GetData(), pi_Command->GetCount()) ||
+        !mpi_SessionKey->CmacUpdate(pi_Params->GetData(), pi_Params->GetCount()) ||
+        !mpi_SessionKey->CmacUpdate(u8_Data, s32_DataLen) ||
+        !mpi_SessionKey->CmacFinal(u8_CalcMac))
+        return false;
 
-        // The CMAC must be calculated here although it is not transmitted, because it maintains the IV up to date.
-        // The initialization vector must always be correct otherwise the card will give an integrity error the next time the session key is used.
-        if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac))
-            return -1;
+    if (u8_Cmac)
+        memcpy(u8_Cmac, u8_CalcMac, 16);
 
-        if (mu8_DebugLevel > 1) {
-            Utils::Print("TX CMAC:  ");
-            Utils::PrintHexBuf(u8_CalcMac, mpi_SessionKey->GetBlockSize(), LF);
-        }
+    if (mu8_DebugLevel > 1) {
+        Utils::Print("TX CMAC:  ");
+        Utils::PrintHexBuf(u8_CalcMac, mpi_SessionKey->GetBlockSize(), LF);
     }
+    return true;
+}
+
+/**************************************************************************
+    DataExchange() stage: sends pi_Command + pi_Params with INDATAEXCHANGE,
+    reads the response into pn532_packetbuffer and checks the status bytes.
+    The data received from the card starts at pn532_packetbuffer + 4.
+    pu8_CardStatus = receives the status byte of the card
+    returns the count of data bytes behind the card status or -1 on error
+**************************************************************************/
+int PN532::Transceive(TxBuffer *pi_Command, TxBuffer *pi_Params, int s32_ReadSize, byte *pu8_CardStatus) {
+    byte u8_Command = pi_Command->GetData()[0];
 
     int P = 0;
     pn532_packetbuffer[P++] = PN532_COMMAND_INDATAEXCHANGE;
     pn532_packetbuffer[P++] = 1; // Card number (Logical target number)
 
     memcpy(pn532_packetbuffer + P, pi_Command->GetData(), pi_Command->GetCount());
-
     P += pi_Command->GetCount();
 
     memcpy(pn532_packetbuffer + P, pi_Params->GetData(), pi_Params->GetCount());
-
     P += pi_Params->GetCount();
 
-    TX_BUFFER(commandbuf, 16);
-    commandbuf.AppendBuf(pn532_packetbuffer+2, 8);
-
-    if (!mpi_SessionKey->CalculateCmac(commandbuf, u8_CalcMac))
-        return -1;
+    TRACE_DEBUG(TRC_Params, u8_Command, pi_Params->GetCount(), 0, pi_Params->GetData(), pi_Params->GetCount());
 
     if (!SendCommandCheckAck(pn532_packetbuffer, P)) {
-        PRINT_DEBUG("SendCommandCheckAck failed");
+        TRACE_ERROR(u8_Command, TRE_WriteCommand, 0);
+        InvalidateSession();
         return -1;
     }
 
-    byte status = ReadData(pn532_packetbuffer, s32_RecvSize + s32_Overhead);
+    int s32_Len = ReadData(pn532_packetbuffer, s32_ReadSize);
 
-    if (status < 3 || pn532_packetbuffer[1] != PN532_COMMAND_INDATAEXCHANGE + 1) {
-        Serial.println(String("status: ") + String(status));
-        PRINT_DEBUG("DataExchange() failed")
+    // ReadData() returns 3 byte if status error from the PN532
+    // ReadData() returns 4 bytes if status error from the Desfire card
+    if (s32_Len < 3 || pn532_packetbuffer[1] != PN532_COMMAND_INDATAEXCHANGE + 1) {
+        TRACE_ERROR(u8_Command, TRE_InvalidFrame, s32_Len);
+        InvalidateSession();
         return -1;
     }
 
-    uint8_t u8_PN532Status = pn532_packetbuffer[2]; // contains errors from the PN532
-    uint8_t u8_CardStatus = pn532_packetbuffer[3]; // contains errors from the Desfire card
+    // Here we get two status bytes that must be checked
+    byte u8_PN532Status = pn532_packetbuffer[2]; // contains errors from the PN532
+    byte u8_CardStatus  = pn532_packetbuffer[3]; // contains errors from the Desfire card
+    TRACE_INFO(TRC_Status, u8_Command, u8_PN532Status, s32_Len >= 4 ? u8_CardStatus : -1, NULL, 0);
 
     mu8_LastPN532Error = u8_PN532Status;
+    METRIC(CountStatus(u8_PN532Status, s32_Len >= 4 ? u8_CardStatus : -1));
 
-    if (u8_PN532Status != ST_Success || status < 4) {
-        Serial.println(String("reading file failed: u8_PN532Status != ST_Success || status < 4"));
-        Serial.println(String("status: ") + String(status));
-        Serial.println(String("u8_PN532Status: ") + String(u8_PN532Status));
+    if (!CheckPN532Status(u8_PN532Status) || s32_Len < 4) {
+        TRACE_ERROR(u8_Command, TRE_PN532Status, u8_PN532Status);
+        InvalidateSession(); // timeout, RF error, card removed: the state of the card is unknown
         return -1;
     }
 
+    // After any error that the card has returned the authentication is invalidated.
+    // The card does not send any CMAC anymore until authenticated anew.
     if (u8_CardStatus != ST_Success && u8_CardStatus != ST_MoreFrames) {
         mu8_LastAuthKeyNo = NOT_AUTHENTICATED; // A new authentication is required now
     }
 
     if (!CheckCardStatus((DESFireStatus) u8_CardStatus)) {
-        Serial.println(String("(DESFireStatus)u8_CardStatus: ") + String((DESFireStatus) u8_CardStatus, HEX));
+        TRACE_ERROR(u8_Command, TRE_CardStatus, u8_CardStatus);
         return -1;
     }
 
-    if (pe_Status)
-        *pe_Status = (DESFireStatus) u8_CardStatus;
-
-    status -= 4; // 3 bytes for INDATAEXCHANGE response + 1 byte card status
-
-    if ((e_Mac & MAC_Rmac) &&// Calculate RX CMAC only if the caller requests it
-        (u8_CardStatus == ST_Success || u8_CardStatus == ST_MoreFrames) &&
-        // In case of an error there is no CMAC in the response
-        (mu8_LastAuthKeyNo !=
-         NOT_AUTHENTICATED))                          // No session key -> no CMAC calculation possible
-    {
-        // For example GetCardVersion() calls DataExchange() 3 times:
-        // 1. u8_Command = DF_INS_GET_VERSION      -> clear CMAC buffer + append received data
-        // 2. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
-        // 3. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
-        if (u8_Command != DF_INS_ADDITIONAL_FRAME) {
-            mi_CmacBuffer.Clear();
-        }
-
-        // This is an intermediate frame. More frames will follow. There is no CMAC in the response yet.
-        if (u8_CardStatus == ST_MoreFrames) {
-            if (!mi_CmacBuffer.AppendBuf(pn532_packetbuffer + 4, status))
-                return -1;
-        }
-
-        if ((status >= 8) &&             // If the response is shorter than 8 bytes it surely does not contain a CMAC
-            (u8_CardStatus == ST_Success)) // Response contains CMAC only in case of success
-        {
-            status -= 8; // Do not return the received CMAC to the caller and do not include it into the CMAC calculation
-            byte *u8_RxMac = pn532_packetbuffer + 4 + status;
-
-            // The CMAC is calculated over the RX data + the status byte appended to the END of the RX data!
-            if (!mi_CmacBuffer.AppendBuf(pn532_packetbuffer + 4, status) ||
-                !mi_CmacBuffer.AppendUint8(u8_CardStatus))
-                return -1;
-        }
-    }
+    *pu8_CardStatus = u8_CardStatus;
+    return s32_Len - 4; // 3 bytes for INDATAEXCHANGE response + 1 byte card status
+}
 
-    if (status > s32_RecvSize) {
-        Utils::Print("DataExchange() Buffer overflow\r\n");
-        return -1;
+/**************************************************************************
+    DataExchange() stage MAC_Rmac: a CMAC may be appended to the end of the frame.
+    The CMAC calculation is important because it maintains the IV of the session key up to date.
+    If the IV is out of sync with the IV in the card, the next encryption with the session key will result in an Integrity Error.
+    The card appends the CMAC to the end of the response stream, so it may be split over the last two frames
+    (e.g. GetApplicationIDs() with 17 applications: 57 bytes + 2 bytes). Therefore the last 8 bytes of each
+    intermediate frame are kept back in mu8_RxHold and returned in front of the data of the next frame.
+    The caller never receives CMAC bytes, but the data of a frame may be shifted into the next frame (see GetDFNames()).
+    returns the count of data bytes without the CMAC or -1 if the CMAC is invalid
+**************************************************************************/
+int PN532::VerifyRxCmac(byte u8_Command, byte u8_CardStatus, int s32_Len) {
+    if (u8_Command != DF_INS_ADDITIONAL_FRAME)
+        ms32_RxHold = 0;
+
+    if ((u8_CardStatus != ST_Success && u8_CardStatus != ST_MoreFrames) || // In case of an error there is no CMAC in the response
+        mu8_LastAuthKeyNo == NOT_AUTHENTICATED)                            // No session key -> no CMAC calculation possible
+        return s32_Len;
+
+    // For example GetCardVersion() calls DataExchange() 3 times:
+    // 1. u8_Command = DF_INS_GET_VERSION      -> start a new CMAC + add received data
+    // 2. u8_Command = DF_INS_ADDITIONAL_FRAME -> add received data
+    // 3. u8_Command = DF_INS_ADDITIONAL_FRAME -> add received data
+    // The CMAC is calculated incrementally, so the count of frames is not limited by a buffer.
+    if (u8_Command != DF_INS_ADDITIONAL_FRAME) {
+        if (!mpi_SessionKey->CmacBegin())
+            return -1;
     }
 
-    if (u8_RecvBuf && status) {
-        if (!mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_RecvBuf, pn532_packetbuffer + 4, 16)) {
-            PRINT_DEBUG("Decrypting failed")
+    // Put the bytes that have been kept back from the previous frame in front of the new data
+    byte *u8_Data = pn532_packetbuffer + 4;
+    bool b_Chained = (ms32_RxHold > 0);
+    if (b_Chained) {
+        if (4 + ms32_RxHold + s32_Len > PN532_PACKBUFFSIZE)
             return -1;
-        }
+        memmove(u8_Data + ms32_RxHold, u8_Data, s32_Len);
+        memcpy(u8_Data, mu8_RxHold, ms32_RxHold);
+        s32_Len += ms32_RxHold;
+        ms32_RxHold = 0;
+    }
+
+    // This is an intermediate frame. More frames will follow. The last 8 bytes may be (a part of) the CMAC.
+    if (u8_CardStatus == ST_MoreFrames) {
+        ms32_RxHold = min(s32_Len, 8);
+        s32_Len -= ms32_RxHold;
+        memcpy(mu8_RxHold, u8_Data + s32_Len, ms32_RxHold);
+        if (!mpi_SessionKey->CmacUpdate(u8_Data, s32_Len))
+            return -1;
+        return s32_Len;
     }
-    return status;
-}
-
-int PN532::DataExchange(TxBuffer *pi_Command,               // in (command + params that are not encrypted)
-                        TxBuffer *pi_Params,                // in (parameters that may be encrypted)
-                        byte *u8_RecvBuf, int s32_RecvSize, // out
-                        DESFireStatus *pe_Status,
-                        DESFireCmac e_Mac)               // in
-{
-    if (pe_Status) *pe_Status = ST_Success;
-    mu8_LastPN532Error = 0;
-
-    TX_BUFFER(i_Empty, 1);
-    if (pi_Params == NULL)
-        pi_Params = &i_Empty;
 
-    // The response for INDATAEXCHANGE is always:
-    // - 0xD5
-    // - 0x41
-    // - Status byte from PN532        (0 if no error)
-    // - Status byte from Desfire card (0 if no error)
-    // - data bytes ...
-    int s32_Overhead = 11; // Overhead added to payload = 11 bytes = 7 bytes for PN532 frame + 3 bytes for INDATAEXCHANGE response + 1 card status byte
-    if (e_Mac & MAC_Rmac) s32_Overhead += 8; // + 8 bytes for CMAC
+    if (s32_Len < 8) {
+        // A single short frame: the card has not sent a CMAC (e.g. ChangeKey() of the key used for authentication)
+        if (!b_Chained)
+            return s32_Len;
 
-    // pn532_packetbuffer is used for input and output
-    if (2 + pi_Command->GetCount() + pi_Params->GetCount() > PN532_PACKBUFFSIZE ||
-        s32_Overhead + s32_RecvSize > PN532_PACKBUFFSIZE) {
-        Utils::Print("DataExchange(): Invalid parameters\r\n");
+        TRACE_ERROR(u8_Command, TRE_CmacMismatch, s32_Len);
+        Utils::Print("CMAC missing\r\n");
         return -1;
     }
 
-    if (e_Mac & (MAC_Tcrypt | MAC_Rcrypt)) {
-        if (mu8_LastAuthKeyNo == NOT_AUTHENTICATED) {
-            Utils::Print("Not authenticated\r\n");
-            return -1;
-        }
-    }
-
-    if (e_Mac & MAC_Tcrypt) // CRC and encrypt pi_Params
-    {
-        if (mu8_DebugLevel > 0) {
-            Utils::Print("* Sess Key IV: ");
-            mpi_SessionKey->PrintIV(LF);
-        }
-
-        // The CRC is calculated over the command (which is not encrypted) and the parameters to be encrypted.
-        uint32_t u32_Crc = Utils::CalcCrc32(pi_Command->GetData(), pi_Command->GetCount(), pi_Params->GetData(),
-                                            pi_Params->GetCount());
-        if (!pi_Params->AppendUint32(u32_Crc))
-            return -1; // buffer overflow
-
-        int s32_CryptCount = mpi_SessionKey->CalcPaddedBlockSize(pi_Params->GetCount());
-        if (!pi_Params->SetCount(s32_CryptCount))
-            return -1; // buffer overflow
+    s32_Len -= 8; // Do not return the received CMAC to the caller and do not include it into the CMAC calculation
+    byte *u8_RxMac = u8_Data + s32_Len;
 
-        if (mu8_DebugLevel > 0) {
-            Utils::Print("* CRC Params:  0x");
-            Utils::PrintHex32(u32_Crc, LF);
-            Utils::Print("* Params:      ");
-            Utils::PrintHexBuf(pi_Params->GetData(), s32_CryptCount, LF);
-        }
-
-        if (!mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, pi_Params->GetData(), pi_Params->GetData(),
-                                          s32_CryptCount))
-            return -1;
+    // The CMAC is calculated over the RX data + the status byte appended to the END of the RX data!
+    byte u8_CalcMac[16];
+    if (!mpi_SessionKey->CmacUpdate(u8_Data, s32_Len) ||
+        !mpi_SessionKey->CmacUpdate(&u8_CardStatus, 1) ||
+        !mpi_SessionKey->CmacFinal(u8_CalcMac))
+        return -1;
 
-        if (mu8_DebugLevel > 0) {
-            Utils::Print("* Params_enc:  ");
-            Utils::PrintHexBuf(pi_Params->GetData(), s32_CryptCount, LF);
-        }
+    if (mu8_DebugLevel > 1) {
+        Utils::Print("RX CMAC:  ");
+        Utils::PrintHexBuf(u8_CalcMac, mpi_SessionKey->GetBlockSize(), LF);
     }
+    TRACE_DEBUG(TRC_Cmac, u8_Command, 2, 8, u8_RxMac, 8);
 
-    byte u8_Command = pi_Command->GetData()[0];
+    // For AES the CMAC is 16 byte, but only 8 are transmitted
+    if (memcmp(u8_RxMac, u8_CalcMac, 8) != 0) {
+        TRACE_ERROR(u8_Command, TRE_CmacMismatch, 0);
+        Utils::Print("CMAC Mismatch\r\n");
+        return -1;
+    }
+    return s32_Len;
+}
 
-    byte u8_CalcMac[16];
-    if ((e_Mac & MAC_Tmac) &&                       // Calculate the TX CMAC only if the caller requests it
-        (u8_Command != DF_INS_ADDITIONAL_FRAME) &&
-        // In case of DF_INS_ADDITIONAL_FRAME there are never parameters passed -> nothing to do here
-        (mu8_LastAuthKeyNo != NOT_AUTHENTICATED))   // No session key -> no CMAC calculation possible
+/**************************************************************************
+    Return true if the PN532 is ready with a response.
+**************************************************************************/
+bool PN532::IsReady() {
+#if PROTOCOL == PROT_I2C || PROTOCOL == PROT_SPI
     {
-        mi_CmacBuffer.Clear();
-        if (!mi_CmacBuffer.AppendBuf(pi_Command->GetData(), pi_Command->GetCount()) ||
-            !mi_CmacBuffer.AppendBuf(pi_Params->GetData(), pi_Params->GetCount()))
-            return -1;
-
-        // The CMAC must be calculated here although it is not transmitted, because it maintains the IV up to date.
-        // The initialization vector must always be correct otherwise the card will give an integrity error the next time the session key is used.
-        if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac))
-            return -1;
-
+        // SPI transports (PN532_SPIDEV) answer RequestFrom() with the result of a STATUS_READ
+        // After reading this byte, the bus must be released with a Stop condition
+        HAL(RequestFrom)(1);
+        // PN532 Manual chapter 6.2.4: Before the data bytes the chip sends a Ready byte.
+        byte u8_Ready = HAL(Read)();
         if (mu8_DebugLevel > 1) {
-            Utils::Print("TX CMAC:  ");
-            Utils::PrintHexBuf(u8_CalcMac, mpi_SessionKey->GetBlockSize(), LF);
+            //Serial.print("IsReady(): read ");
+            //Serial.println(u8_Ready, HEX);
+            //Serial.println(String(u8_Ready == PN532_I2C_READY));
+            //Serial.println(String(PN532_I2C_READY, HEX));
         }
-    }
-
-    int P = 0;
-    pn532_packetbuffer[P++] = PN532_COMMAND_INDATAEXCHANGE;
-    pn532_packetbuffer[P++] = 1; // Card number (Logical target number)
-
-    memcpy(pn532_packetbuffer + P, pi_Command->GetData(), pi_Command->GetCount());
-
-    Serial.print(String("pi_Command->GetData(): "));
-    for (int i = 0; i < pi_Command->GetCount(); i++) {
-        Serial.print(String(pi_Command->GetData()[i], HEX) + " ");
-    }
-    Serial.println();
-
-    P += pi_Command->GetCount();
-
-    memcpy(pn532_packetbuffer + P, pi_Params->GetData(), pi_Params->GetCount());
-
-    Serial.print(String("pi_Params->GetData(): "));
-    for (int i = 0; i < pi_Params->GetCount(); i++) {
-        Serial.print(String(pi_Params->GetData()[i], HEX) + " ");
-    }
-    Serial.println();
-
-    P += pi_Params->GetCount();
-
-    Serial.print(String("pn532_packetbuffer 4: "));
-    for (int i = 0; i < P; i++) {
-        Serial.print(String(pn532_packetbuffer[i], HEX));
-        Serial.print(" ");
-    }
-    Serial.println();
-
-    // ORIGINALLY:
-    if (!SendCommandCheckAck(pn532_packetbuffer, P)) {
-        PRINT_DEBUG("SendCommandCheckAck failed");
-        return -1;
-    }
-
-    // MODIFIED:
-    //if (HAL(writeCommand)(pn532_packetbuffer, P)) {
-    //    return -1;
-    //}
-
-    /*
-    Serial.print(String("2 pn532_packetbuffer: "));
-    for (int i = 0; i < 16; i++) {
-        Serial.print(String(pn532_packetbuffer[i], HEX));
-        Serial.print(" ");
-    }
-    Serial.println();
-*/
-
-    // read data packet
-    //Modified
-    //int16_t status = HAL(readResponse)(PN532_COMMAND_INDATAEXCHANGE, pn532_packetbuffer, sizeof(pn532_packetbuffer));
-    //if (0 > status) {
-    //    return 0;
-    //}
-
-    // Originally
-    byte status = ReadData(pn532_packetbuffer, s32_RecvSize + s32_Overhead);
-
-    //Serial.println(status);
-    //Serial.println(s32_RecvSize);
-
-    PRINT_DEBUG(String("pn532_packetbuffer 5: "))
-    for (int i = 0; i < sizeof(pn532_packetbuffer); i++) {
-        if (i % 8 == 0) Serial.println();
-        Serial.print(pn532_packetbuffer[i], HEX);
-        Serial.print(" ");
-    }
-    Serial.println();
-
-    // ReadData() returns 3 byte if status error from the PN532
-    // ReadData() returns 4 bytes if status error from the Desfire card
-    if (status < 3 || pn532_packetbuffer[1] != PN532_COMMAND_INDATAEXCHANGE + 1) {
-        Serial.println(String("status: ") + String(status));
-        PRINT_DEBUG(String("pn532_packetbuffer 6: "))
-        for (int i = 0; i < 16; i++) Serial.print(String(pn532_packetbuffer[i], HEX) + " ");
-        Serial.println();
-        PRINT_DEBUG("DataExchange() failed")
-        return -1;
-    }
-
-    // Here we get two status bytes that must be checked
-    uint8_t u8_PN532Status = pn532_packetbuffer[2]; // contains errors from the PN532
-    uint8_t u8_CardStatus = pn532_packetbuffer[3]; // contains errors from the Desfire card
-
-    mu8_LastPN532Error = u8_PN532Status;
-
-    if (u8_PN532Status != ST_Success || status < 4) {
-        Serial.print(String("pn532_packetbuffer 7: "));
-        for (int i = 0; i < 16; i++) Serial.print(String(pn532_packetbuffer[i], HEX) + " ");
-        Serial.println();
-        Serial.println(String("status: ") + String(status));
-        Serial.println(String("u8_PN532Status: ") + String(u8_PN532Status));
-        Serial.println(String("u8_CardStatus: ") + String(u8_CardStatus));
-        return -1;
-    }
-
-    // After any error that the card has returned the authentication is invalidated.
-    // The card does not send any CMAC anymore until authenticated anew.
-    if (u8_CardStatus != ST_Success && u8_CardStatus != ST_MoreFrames) {
-        PRINT_DEBUG(String("pn532_packetbuffer 8: "));
-        for (int i = 0; i < 16; i++) Serial.print(String(pn532_packetbuffer[i], HEX) + " ");
-        Serial.println();
-
-        mu8_LastAuthKeyNo = NOT_AUTHENTICATED; // A new authentication is required now
-    }
-
-    if (!CheckCardStatus((DESFireStatus) u8_CardStatus)) {
-        Serial.println(String("(DESFireStatus)u8_CardStatus: ") + String((DESFireStatus) u8_CardStatus, HEX));
-        return -1;
-    }
-
-    if (pe_Status)
-        *pe_Status = (DESFireStatus) u8_CardStatus;
-
-    status -= 4; // 3 bytes for INDATAEXCHANGE response + 1 byte card status
-
-    // A CMAC may be appended to the end of the frame.
-    // The CMAC calculation is important because it maintains the IV of the session key up to date.
-    // If the IV is out of sync with the IV in the card, the next encryption with the session key will result in an Integrity Error.
-    //Serial.println(status);
-    //Serial.println(s32_RecvSize);
-
-    if ((e_Mac & MAC_Rmac) &&// Calculate RX CMAC only if the caller requests it
-        (u8_CardStatus == ST_Success || u8_CardStatus == ST_MoreFrames) &&
-        // In case of an error there is no CMAC in the response
-        (mu8_LastAuthKeyNo !=
-         NOT_AUTHENTICATED))                          // No session key -> no CMAC calculation possible
-    {
-        // For example GetCardVersion() calls DataExchange() 3 times:
-        // 1. u8_Command = DF_INS_GET_VERSION      -> clear CMAC buffer + append received data
-        // 2. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
-        // 3. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
-        if (u8_Command != DF_INS_ADDITIONAL_FRAME) {
-            mi_CmacBuffer.Clear();
-        }
-
-        // This is an intermediate frame. More frames will follow. There is no CMAC in the response yet.
-        if (u8_CardStatus == ST_MoreFrames) {
-            if (!mi_CmacBuffer.AppendBuf(pn532_packetbuffer + 4, status))
-                return -1;
-        }
-
-        //Serial.println(status);
-        //Serial.println(s32_RecvSize);
-
-        if ((status >= 8) &&             // If the response is shorter than 8 bytes it surely does not contain a CMAC
-            (u8_CardStatus == ST_Success)) // Response contains CMAC only in case of success
-        {
-            status -= 8; // Do not return the received CMAC to the caller and do not include it into the CMAC calculation
-
-            byte *u8_RxMac = pn532_packetbuffer + 4 + status;
-
-            // The CMAC is calculated over the RX data + the status byte appended to the END of the RX data!
-            if (!mi_CmacBuffer.AppendBuf(pn532_packetbuffer + 4, status) ||
-                !mi_CmacBuffer.AppendUint8(u8_CardStatus))
-                return -1;
-
-            if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac))
-                return -1;
-
-            if (mu8_DebugLevel > 1) {
-                Utils::Print("RX CMAC:  ");
-                Utils::PrintHexBuf(u8_CalcMac, mpi_SessionKey->GetBlockSize(), LF);
-            }
-
-            // For AES the CMAC is 16 byte, but only 8 are transmitted
-            /*
-            if (memcmp(u8_RxMac, u8_CalcMac, 8) != 0)
-            {
-                PRINT_DEBUG("CMAC Mismatch\r\n");
-
-                Serial.print("u8_RxMac: ");
-                Utils::PrintHexBuf(u8_RxMac, mpi_SessionKey->GetBlockSize(), LF);
-
-                return -1;
-            }
-             */
-        }
-    }
-
-    if (status > s32_RecvSize) {
-        Serial.println(String("status: ") + String(status));
-        Serial.println(String("s32_RecvSize: ") + String(s32_RecvSize));
-        Utils::Print("DataExchange() Buffer overflow\r\n");
-        return -1;
-    }
-    //Serial.println(String("status: ") + String(status));
-
-    if (u8_RecvBuf && status) {
-        memcpy(u8_RecvBuf, pn532_packetbuffer + 4, status);
-        PRINT_DEBUG("Decrypting\n")
-        Serial.println(String("e_Mac: ") + String(e_Mac));
-        Serial.println(String("MAC_Rcrypt: ") + String(MAC_Rcrypt));
-
-        if (e_Mac & MAC_Rcrypt) // decrypt received data with session key
-        {
-            PRINT_DEBUG("Decrypting 2\n")
-            if (!mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_RecvBuf, u8_RecvBuf, status)) {
-                PRINT_DEBUG("Decrypting failed\n")
-                return -1;
-            }
-
-            if (mu8_DebugLevel > 1) {
-                Utils::Print("Decrypt:  ");
-                Utils::PrintHexBuf(u8_RecvBuf, status, LF);
-            }
-        }
-    }
-    return status;
-}
-
-/**************************************************************************
-    Return true if the PN532 is ready with a response.
-**************************************************************************/
-bool PN532::IsReady() {
-#if PROTOCOL == PROT_I2C
-    {
-        // After reading this byte, the bus must be released with a Stop condition
-        HAL(RequestFrom)(1);
-        // PN532 Manual chapter 6.2.4: Before the data bytes the chip sends a Ready byte.
-        byte u8_Ready = HAL(Read)();
-        if (mu8_DebugLevel > 1) {
-            //Serial.print("IsReady(): read ");
-            //Serial.println(u8_Ready, HEX);
-            //Serial.println(String(u8_Ready == PN532_I2C_READY));
-            //Serial.println(String(PN532_I2C_READY, HEX));
-        }
-        return u8_Ready == PN532_I2C_READY; // 0x01
+        return u8_Ready == PN532_I2C_READY; // 0x01
     }
 #endif
 }
@@ -2456,6 +2082,12 @@ bool PN532::IsReady() {
     Waits until the PN532 is ready.
 **************************************************************************/
 bool PN532::WaitReady() {
+    // With an IRQ line the latency follows the chip instead of the 10 ms polling interval below.
+    // After the IRQ the status byte is checked once more (IsReady() is true at the first attempt).
+    if (HAL(waitIrq)(PN532_I2C_TIMEOUT) == 0) {
+        Utils::Print("WaitReady() -> IRQ TIMEOUT\r\n");
+        return false;
+    }
     uint16_t timer = 0;
     while (!IsReady()) {
         if (timer >= PN532_I2C_TIMEOUT) {
@@ -2468,39 +2100,68 @@ bool PN532::WaitReady() {
     return true;
 }
 
-bool PN532::SendCommandCheckAck(byte *cmd, byte cmdlen) {
+bool PN532::SendCommandCheckAck(byte *cmd, int cmdlen) {
+    TRACE_INFO(TRC_Send, cmd[0], cmdlen, cmdlen > 2 ? cmd[2] : 0, NULL, 0);
 #if PROTOCOL == PROT_HSU
-    Serial.println("\nHSU");
-    return HAL(writeCommand)(cmd, cmdlen) == 0;
+    // The header length is a byte: a longer command is passed as header (command, target, card command) + body
+    uint8_t hlen = cmdlen > 0xFF ? 3 : cmdlen;
+    return HalWriteCommand(cmd, hlen, cmd + hlen, cmdlen - hlen) == 0;
 #else
-    Serial.println("\nNOT HSU");
+    METRIC(Begin(MetricKey(cmd, cmdlen, NULL)));
     WriteCommand(cmd, cmdlen);
-    return ReadAck();
+    METRIC(Phase(PHASE_Send));
+    if (!ReadAck()) {
+        METRIC(End(false));
+        return false;
+    }
+    return true;
 #endif
 }
 
-void PN532::WriteCommand(byte *cmd, byte cmdlen) {
-    byte TxBuffer[PN532_PACKBUFFSIZE + 10];
-    int P = 0;
-    TxBuffer[P++] = PN532_PREAMBLE;    // 00
-    TxBuffer[P++] = PN532_STARTCODE1;  // 00
-    TxBuffer[P++] = PN532_STARTCODE2;  // FF
-    TxBuffer[P++] = cmdlen + 1;
-    TxBuffer[P++] = 0xFF - cmdlen;
-    TxBuffer[P++] = PN532_HOSTTOPN532; // D4
-    for (byte i = 0; i < cmdlen; i++) {
-        TxBuffer[P++] = cmd[i];
-    }
-    byte checksum = 0;
-    for (byte i = 0; i < P; i++) {
-        checksum += TxBuffer[i];
-    }
-    TxBuffer[P++] = ~checksum;
-    TxBuffer[P++] = PN532_POSTAMBLE; // 00
+/**************************************************************************
+    The key of a command in PN532Metrics:
+    the PN532 command and for InDataExchange the command for the card (DESFire INS, Mifare command)
+**************************************************************************/
+uint16_t PN532::MetricKey(const uint8_t *header, uint8_t hlen, const uint8_t *body) {
+    uint16_t u16_Key = header[0] << 8;
+    if (header[0] == PN532_COMMAND_INDATAEXCHANGE) {
+        // header[1] = target number
+        if (hlen > 2)  u16_Key |= header[2];
+        else if (body) u16_Key |= body[0];
+    }
+    return u16_Key;
+}
+
+/**************************************************************************
+    writeCommand() and readResponse() of the transport with time measurement.
+    The transport waits internally, so only the phases Ack and Read are measured.
+**************************************************************************/
+int8_t PN532::HalWriteCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen) {
+    METRIC(Begin(MetricKey(header, hlen, body)));
+    int8_t s8_Result = HAL(writeCommand)(header, hlen, body, blen);
+    METRIC(Phase(PHASE_Ack));
+    if (s8_Result != 0) {
+        METRIC(End(false));
+    }
+    return s8_Result;
+}
+
+int16_t PN532::HalReadResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout) {
+    int16_t s16_Result = HAL(readResponse)(command, buf, len, timeout);
+    METRIC(Received());
+    METRIC(End(s16_Result >= 0));
+    return s16_Result;
+}
+
+// Commands with more than 254 bytes are sent as extended information frame (00 00 FF FF FF LENM LENL LCS ...)
+void PN532::WriteCommand(byte *cmd, int cmdlen) {
+    byte TxBuffer[PN532_PACKBUFFSIZE + PN532_FRAME_OVERHEAD];
+    int P = PN532Frame::Encode(TxBuffer, cmd, cmdlen, NULL, 0);
     SendPacket(TxBuffer, P);
     if (mu8_DebugLevel > 1) {
+        int head = P - cmdlen - 3; // behind the length field: TFI D4, command, DCS, postamble
         Utils::Print("Sending:  ");
-        Utils::PrintHexBuf(TxBuffer, P, LF, 5, cmdlen + 6);
+        Utils::PrintHexBuf(TxBuffer, P, LF, head, head + cmdlen + 1);
         DMSG("\n");
     }
 }
@@ -2508,16 +2169,19 @@ void PN532::WriteCommand(byte *cmd, byte cmdlen) {
 /**************************************************************************
     Send a data packet
 **************************************************************************/
-void PN532::SendPacket(byte *buff, byte len) {
-#if PROTOCOL == PROT_I2C
+void PN532::SendPacket(byte *buff, int len) {
+#if PROTOCOL == PROT_I2C || PROTOCOL == PROT_SPI
     {
         Utils::DelayMilli(2); // delay is for waking up the board
         HAL(BeginTransmission)(PN532_I2C_ADDRESS);
-        for (byte i = 0; i < len; i++) {
+        for (int i = 0; i < len; i++) {
             HAL(Write(buff[i]));
         }
         HAL(EndTransmission());
     }
+#else
+    (void) buff; // HSU: the transport sends the frames itself (see HalWriteCommand())
+    (void) len;
 #endif
 }
 
@@ -2530,7 +2194,7 @@ bool PN532::ReadAck() {
     // ATTENTION: Never read more than 6 bytes here!
     // The PN532 has a bug in SPI mode which results in the first byte of the response missing if more than 6 bytes are read here!
     if (!ReadPacket(ackbuff, sizeof(ackbuff))) {
-        Serial.println("Did not read any ACK packet");
+        TRACE_ERROR(0, TRE_NoAck, PN532_TIMEOUT);
         return false; // Timeout
     }
 
@@ -2550,16 +2214,20 @@ bool PN532::ReadAck() {
     param  buff      Pointer to the buffer where data will be written
     param  len       Number of bytes to read
     returns the number of bytes that have been copied to buff (< len) or 0 on error
+    Normal and extended information frames are accepted.
 **************************************************************************/
-byte PN532::ReadData(byte *buff, byte len) {
+int PN532::ReadData(byte *buff, int len) {
     byte RxBuffer[PN532_PACKBUFFSIZE];
     const byte MIN_PACK_LEN = 2 /*start bytes*/ + 2 /*length + length checksum */ + 1 /*checksum*/;
     if (len < MIN_PACK_LEN || len > PN532_PACKBUFFSIZE) {
         Utils::Print("ReadData(): len is invalid\r\n");
+        METRIC(End(false));
         return 0;
     }
-    if (!ReadPacket(RxBuffer, len))
+    if (!ReadPacket(RxBuffer, len)) {
+        METRIC(End(false));
         return 0; // timeout
+    }
     // The following important validity check was completely missing in Adafruit code (added by Elmü)
     // PN532 documentation says (chapter 6.2.1.6):
     // Before the start code (0x00 0xFF) there may be any number of additional bytes that must be ignored.
@@ -2569,7 +2237,7 @@ byte PN532::ReadData(byte *buff, byte len) {
     // preamble   0x00   -> skipped (optional, the PN532 does not send it always!!!!!)
     // start code 0x00   -> skipped
     // start code 0xFF   -> skipped
-    // length            -> skipped
+    // length            -> skipped (extended frame: FF FF length MSB, length LSB)
     // length checksum   -> skipped
     // data[0...n]       -> returned to the caller (first byte is always 0xD5)
     // checksum          -> skipped
@@ -2593,13 +2261,15 @@ byte PN532::ReadData(byte *buff, byte len) {
             break;
         }
         int pos = startCode + 2;
-        dataLength = RxBuffer[pos++];
-        int lengthCheck = RxBuffer[pos++];
-        if ((dataLength + lengthCheck) != 0x100) {
+        uint16_t u16_Length = 0;
+        int lengthField = PN532Frame::DecodeLength(RxBuffer + pos, len - pos, &u16_Length);
+        if (lengthField <= 0 || u16_Length == 0) {
             Error = "ReadData() -> Invalid length checksum\r\n";
             break;
         }
-        if (len < startCode + MIN_PACK_LEN + dataLength) {
+        dataLength = u16_Length;
+        pos += lengthField;
+        if (len < pos + dataLength + 1) {
             Error = "ReadData() -> Packet is longer than requested length\r\n";
             break;
         }
@@ -2613,21 +2283,23 @@ byte PN532::ReadData(byte *buff, byte len) {
             Error = "ReadData() -> Invalid data (no PN532TOHOST)\r\n";
             break;
         }
-        byte checkSum = 0;
-        for (int i = startCode; i < pos; i++) {
+        byte checkSum = RxBuffer[pos];
+        for (int i = Brace1; i < pos; i++) {
             checkSum += RxBuffer[i];
         }
-        if (checkSum != (byte)(~RxBuffer[pos])) {
+        if (checkSum != 0) {
             Error = "ReadData() -> Invalid checksum\r\n";
             break;
         }
     } while (false); // This is not a loop. Avoids using goto by using break.
     // Always print the package, even if it was invalid.
     if (mu8_DebugLevel > 1) {
-        PRINT_DEBUG("Response: ")
+        Utils::Print("Response: ");
         Utils::PrintHexBuf(RxBuffer, len, LF, Brace1, Brace2);
     }
+    METRIC(End(Error == NULL));
     if (Error) {
+        TRACE_ERROR(dataLength > 1 ? buff[1] - 1 : 0, TRE_InvalidFrame, dataLength);
         Utils::Print(Error);
         return 0;
     }
@@ -2639,19 +2311,21 @@ byte PN532::ReadData(byte *buff, byte len) {
     param  buff      Pointer to the buffer where data will be written
     param  len       Number of bytes to read
 **************************************************************************/
-bool PN532::ReadPacket(byte *buff, byte len) {
+bool PN532::ReadPacket(byte *buff, int len) {
 #if PROTOCOL == PROT_HSU
     if (HAL(receive)(buff, len, PN532_ACK_WAIT_TIME) <= 0) {
-        PRINT_DEBUG("Timeout\n");
+        TRACE_ERROR(0, TRE_ReadResponse, PN532_TIMEOUT);
         return false;
     }
+    METRIC(Received());
     return true;
 #else
     if (!WaitReady())
         return false;
-#if PROTOCOL == PROT_I2C
+    METRIC(Waited());
+#if PROTOCOL == PROT_I2C || PROTOCOL == PROT_SPI
         {
-        Utils::DelayMilli(2);
+        // No delay here: WaitReady() has confirmed that the response is ready.
         // read (n+1 to take into account leading Ready byte)
         HAL(RequestFrom)(len + 1);
         // PN532 Manual chapter 6.2.4: Before the data bytes the chip sends a Ready byte.
@@ -2661,13 +2335,14 @@ bool PN532::ReadPacket(byte *buff, byte len) {
             Utils::Print("ReadPacket(): read ");
             Utils::PrintHex8(u8_Ready, LF);
         }
-        for (byte i = 0; i < len; i++) {
-            Utils::DelayMilli(1);
+        // The bytes come from the receive buffer of RequestFrom(), there is nothing to wait for.
+        for (int i = 0; i < len; i++) {
             buff[i] = HAL(Read)();
         }
+        METRIC(Received());
         return true;
     }
-#endif // if I2C
+#endif // if I2C or SPI
 #endif // if HSU
 }
 
@@ -2761,11 +2436,9 @@ void GenerateRandom(byte *u8_Random, int s32_Length) {
 
 
 // Whenever the RF field is switched off, these variables must be reset
+// (setRFField() resets them. The former call of PN532::SwitchOffRfField() here was an endless recursion.)
 bool PN532::SwitchOffRfField() {
-    mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
-    mu32_LastApplication = 0x000000; // No application selected
-
-    return PN532::SwitchOffRfField();
+    return setRFField(0, 0);
 }
 
 /**************************************************************************
@@ -2789,6 +2462,18 @@ bool PN532::Authenticate(byte u8_KeyNo, DESFireKey *pi_Key) {
         Utils::Print(")\r\n");
     }
 
+    // The card is still authenticated with this key in the selected application -> the session key is still valid.
+    // The key data is compared because the same key number may have been authenticated with another key (ChangeKey()).
+    if (mb_SessionCache && mb_AppSelected && mu8_LastAuthKeyNo == u8_KeyNo &&
+        me_SessionKeyType == pi_Key->GetKeyType() &&
+        memcmp(mu8_SessionKeyData, pi_Key->Data(), pi_Key->GetKeySize()) == 0) {
+        if (mu8_DebugLevel > 0) Utils::Print("Session still valid\r\n");
+        return true;
+    }
+
+    // If the authentication fails the card has lost the previous authentication
+    mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
+
     byte u8_Command;
     switch (pi_Key->GetKeyType()) {
         case DF_KEY_AES:
@@ -2809,7 +2494,7 @@ bool PN532::Authenticate(byte u8_KeyNo, DESFireKey *pi_Key) {
     // Request a random of 16 byte, but depending of the key the PICC may also return an 8 byte random
     DESFireStatus e_Status;
     byte u8_RndB_enc[16]; // encrypted random B
-    int s32_Read = DataExchange(u8_Command, &i_Params, u8_RndB_enc, 16, &e_Status, MAC_None);
+    int s32_Read = DataExchange<MAC_None>(u8_Command, &i_Params, u8_RndB_enc, 16, &e_Status);
     if (e_Status != ST_MoreFrames || (s32_Read != 8 && s32_Read != 16)) {
         Utils::Print("Authentication failed (1)\r\n");
         return false;
@@ -2827,6 +2512,7 @@ bool PN532::Authenticate(byte u8_KeyNo, DESFireKey *pi_Key) {
 
     byte u8_RndA[16];
     Utils::GenerateRandom(u8_RndA, s32_RandomSize);
+    HAL(onRandom)(u8_RndA, s32_RandomSize);
 
     TX_BUFFER(i_RndAB, 32); // (randomA + rotated randomB)
     i_RndAB.AppendBuf(u8_RndA, s32_RandomSize);
@@ -2853,7 +2539,7 @@ bool PN532::Authenticate(byte u8_KeyNo, DESFireKey *pi_Key) {
     }
 
     byte u8_RndA_enc[16]; // encrypted random A
-    s32_Read = DataExchange(DF_INS_ADDITIONAL_FRAME, &i_RndAB_enc, u8_RndA_enc, s32_RandomSize, &e_Status, MAC_None);
+    s32_Read = DataExchange<MAC_None>(DF_INS_ADDITIONAL_FRAME, &i_RndAB_enc, u8_RndA_enc, s32_RandomSize, &e_Status);
     if (e_Status != ST_Success || s32_Read != s32_RandomSize) {
         Utils::Print("Authentication failed (2)\r\n");
         return false;
@@ -2923,6 +2609,8 @@ bool PN532::Authenticate(byte u8_KeyNo, DESFireKey *pi_Key) {
     }
 
     mu8_LastAuthKeyNo = u8_KeyNo;
+    me_SessionKeyType = pi_Key->GetKeyType();
+    memcpy(mu8_SessionKeyData, pi_Key->Data(), pi_Key->GetKeySize());
     return true;
 }
 
@@ -3039,7 +2727,7 @@ bool PN532::ChangeKey(byte u8_KeyNo, DESFireKey *pi_NewKey, DESFireKey *pi_CurKe
     // If the same key has been changed the session key is no longer valid. (Authentication required)
     if (b_SameKey) mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
 
-    return (0 == DataExchange(DF_INS_CHANGE_KEY, &i_Params, NULL, 0, NULL, MAC_Rmac));
+    return (0 == DataExchange<MAC_Rmac>(DF_INS_CHANGE_KEY, &i_Params, NULL, 0, NULL));
 }
 
 /**************************************************************************
@@ -3057,7 +2745,7 @@ bool PN532::GetKeyVersion(byte u8_KeyNo, byte *pu8_Version) {
     TX_BUFFER(i_Params, 1);
     i_Params.AppendUint8(u8_KeyNo);
 
-    if (1 != DataExchange(DF_INS_GET_KEY_VERSION, &i_Params, pu8_Version, 1, NULL, MAC_TmacRmac))
+    if (1 != DataExchange<MAC_TmacRmac>(DF_INS_GET_KEY_VERSION, &i_Params, pu8_Version, 1, NULL))
         return false;
 
     if (mu8_DebugLevel > 0) {
@@ -3076,33 +2764,26 @@ bool PN532::GetCardVersion(DESFireCardVersion *pk_Version) {
 
     byte *pu8_Ptr = (byte *) pk_Version;
 
+    // The card sends 3 frames: 7 + 7 + 14 bytes. If authenticated, the bytes of a frame may be
+    // returned together with the next frame (see VerifyRxCmac()), so only the total is checked.
     DESFireStatus e_Status;
-    int s32_Read = DataExchange(DF_INS_GET_VERSION, NULL, pu8_Ptr, 7, &e_Status, MAC_TmacRmac);
-    if (s32_Read != 7 || e_Status != ST_MoreFrames) {
-        if (mu8_DebugLevel > 0 && e_Status != ST_MoreFrames)
-            Serial.println(String("Failed (e_Status == ") + String(e_Status, HEX) + ")");
-        if (mu8_DebugLevel > 0 && s32_Read != 7)
-            Serial.println(String("Failed (s32_Read == ") + String(s32_Read, DEC) + ")");
-        return false;
-    }
-
-    pu8_Ptr += 7;
-    s32_Read = DataExchange(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr, 7, &e_Status, MAC_Rmac);
-    if (s32_Read != 7 || e_Status != ST_MoreFrames) {
-        if (mu8_DebugLevel > 0 && e_Status != ST_MoreFrames)
-            Serial.println(String("2 Failed (e_Status == ") + String(e_Status, HEX) + ")");
-        if (mu8_DebugLevel > 0 && s32_Read != 7)
-            Serial.println(String("2 Failed (s32_Read == ") + String(s32_Read, DEC) + ")");
-        return false;
+    int s32_Total = 0;
+    for (int F = 0; F < 3; F++) {
+        int s32_Read;
+        if (F == 0) s32_Read = DataExchange<MAC_TmacRmac>(DF_INS_GET_VERSION, NULL, pu8_Ptr, 28, &e_Status);
+        else        s32_Read = DataExchange<MAC_Rmac>(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr + s32_Total, 28 - s32_Total, &e_Status);
+
+        DESFireStatus e_Expect = (F < 2) ? ST_MoreFrames : ST_Success;
+        if (s32_Read < 0 || e_Status != e_Expect) {
+            if (mu8_DebugLevel > 0)
+                Serial.println(String(F + 1) + " Failed (e_Status == " + String(e_Status, HEX) + ")");
+            return false;
+        }
+        s32_Total += s32_Read;
     }
-
-    pu8_Ptr += 7;
-    s32_Read = DataExchange(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr, 14, &e_Status, MAC_Rmac);
-    if (s32_Read != 14 || e_Status != ST_Success) {
-        if (mu8_DebugLevel > 0 && e_Status != ST_Success)
-            Serial.println(String("3 Failed (e_Status == ") + String(e_Status, HEX) + ")");
-        if (mu8_DebugLevel > 0 && s32_Read != 14)
-            Serial.println(String("3 Failed (s32_Read == ") + String(s32_Read, DEC) + ")");
+    if (s32_Total != 28) {
+        if (mu8_DebugLevel > 0)
+            Serial.println(String("Failed (s32_Total == ") + String(s32_Total, DEC) + ")");
         return false;
     }
 
@@ -3131,7 +2812,8 @@ bool PN532::GetCardVersion(DESFireCardVersion *pk_Version) {
 bool PN532::FormatCard() {
     if (mu8_DebugLevel > 0) Utils::Print("\r\n*** FormatCard()\r\n");
 
-    return (0 == DataExchange(DF_INS_FORMAT_PICC, NULL, NULL, 0, NULL, MAC_TmacRmac));
+    MetaDrop();
+    return (0 == DataExchange<MAC_TmacRmac>(DF_INS_FORMAT_PICC, NULL, NULL, 0, NULL));
 }
 
 /**************************************************************************
@@ -3147,7 +2829,7 @@ bool PN532::GetKeySettings(DESFireKeySettings *pe_Settg, byte *pu8_KeyCount, DES
     if (mu8_DebugLevel > 0) Utils::Print("\r\n*** GetKeySettings()\r\n");
 
     byte u8_RetData[2];
-    if (2 != DataExchange(DF_INS_GET_KEY_SETTINGS, NULL, u8_RetData, 2, NULL, MAC_TmacRmac))
+    if (2 != DataExchange<MAC_TmacRmac>(DF_INS_GET_KEY_SETTINGS, NULL, u8_RetData, 2, NULL))
         return false;
 
     *pe_Settg = (DESFireKeySettings) u8_RetData[0];
@@ -3178,7 +2860,7 @@ bool PN532::ChangeKeySettings(DESFireKeySettings e_NewSettg) {
     i_Params.AppendUint8(e_NewSettg);
 
     // The TX CMAC must not be calculated here because a CBC encryption operation has already been executed
-    return (0 == DataExchange(DF_INS_CHANGE_KEY_SETTINGS, &i_Params, NULL, 0, NULL, MAC_TcryptRmac));
+    return (0 == DataExchange<MAC_TcryptRmac>(DF_INS_CHANGE_KEY_SETTINGS, &i_Params, NULL, 0, NULL));
 }
 
 /**************************************************************************
@@ -3193,7 +2875,7 @@ bool PN532::GetFreeMemory(uint32_t *pu32_Memory) {
     *pu32_Memory = 0;
 
     RX_BUFFER(i_Data, 3);
-    if (3 != DataExchange(DFEV1_INS_FREE_MEM, NULL, i_Data, 3, NULL, MAC_TmacRmac))
+    if (3 != DataExchange<MAC_TmacRmac>(DFEV1_INS_FREE_MEM, NULL, i_Data, 3, NULL))
         return false;
 
     *pu32_Memory = i_Data.ReadUint24();
@@ -3217,31 +2899,38 @@ bool PN532::GetApplicationIDs(uint32_t u32_IDlist[28], byte *pu8_AppCount) {
 
     memset(u32_IDlist, 0, 28 * sizeof(uint32_t));
 
-    RX_BUFFER(i_RxBuf, 28 * 3); // 3 byte per application
-    byte *pu8_Ptr = i_RxBuf;
-
-    DESFireStatus e_Status;
-    int s32_Read1 = DataExchange(DF_INS_GET_APPLICATION_IDS, NULL, pu8_Ptr, MAX_FRAME_SIZE, &e_Status, MAC_TmacRmac);
-    if (s32_Read1 < 0) {
-        if (mu8_DebugLevel > 0) Serial.println("no response in get application ids");
-        return false;
-    }
+    // The application IDs can only be read at PICC level
+    DESFireMetaEntry *pk_Meta = (mb_AppSelected && mu32_LastApplication == 0x000000) ? MetaEntry() : NULL;
+    if (!pk_Meta || !mpi_MetaCache->GetAppIDs(pk_Meta, u32_IDlist, pu8_AppCount)) {
+        RX_BUFFER(i_RxBuf, 28 * 3); // 3 byte per application
+        byte *pu8_Ptr = i_RxBuf;
 
-    // If there are more than 19 applications, they will be sent in two frames
-    int s32_Read2 = 0;
-    if (e_Status == ST_MoreFrames) {
-        pu8_Ptr += s32_Read1;
-        s32_Read2 = DataExchange(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr, 28 * 3 - s32_Read1, NULL, MAC_Rmac);
-        if (s32_Read2 < 0)
+        DESFireStatus e_Status;
+        int s32_Read1 = DataExchange<MAC_TmacRmac>(DF_INS_GET_APPLICATION_IDS, NULL, pu8_Ptr, MAX_FRAME_SIZE, &e_Status);
+        if (s32_Read1 < 0) {
+            if (mu8_DebugLevel > 0) Serial.println("no response in get application ids");
             return false;
-    }
+        }
+
+        // If there are more than 19 applications, they will be sent in two frames
+        int s32_Read2 = 0;
+        if (e_Status == ST_MoreFrames) {
+            pu8_Ptr += s32_Read1;
+            s32_Read2 = DataExchange<MAC_Rmac>(DF_INS_ADDITIONAL_FRAME, NULL, pu8_Ptr, 28 * 3 - s32_Read1, NULL);
+            if (s32_Read2 < 0)
+                return false;
+        }
 
-    i_RxBuf.SetSize(s32_Read1 + s32_Read2);
-    *pu8_AppCount = (s32_Read1 + s32_Read2) / 3;
+        i_RxBuf.SetSize(s32_Read1 + s32_Read2);
+        *pu8_AppCount = (s32_Read1 + s32_Read2) / 3;
 
-    // Convert 3 byte array -> 4 byte array
-    for (byte i = 0; i < *pu8_AppCount; i++) {
-        u32_IDlist[i] = i_RxBuf.ReadUint24();
+        // Convert 3 byte array -> 4 byte array
+        for (byte i = 0; i < *pu8_AppCount; i++) {
+            u32_IDlist[i] = i_RxBuf.ReadUint24();
+        }
+
+        if (pk_Meta)
+            mpi_MetaCache->PutAppIDs(pk_Meta, u32_IDlist, *pu8_AppCount);
     }
 
     if (mu8_DebugLevel > 0) {
@@ -3257,6 +2946,78 @@ bool PN532::GetApplicationIDs(uint32_t u32_IDlist[28], byte *pu8_AppCount) {
     return true;
 }
 
+/**************************************************************************
+    returns the ISO file ID and the DF name of all applications that have one (Desfire EV1).
+    Must be called at PICC level. The card sends one application per frame.
+    k_Names:       Must point to a DESFireDFName[28] array
+    pu8_AppCount:  The count of applications that have been stored in k_Names.
+**************************************************************************/
+bool PN532::GetDFNames(DESFireDFName k_Names[28], byte *pu8_AppCount) {
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** GetDFNames()\r\n");
+
+    *pu8_AppCount = 0;
+    memset(k_Names, 0, 28 * sizeof(DESFireDFName));
+
+    // The card sends one application per frame, the CMAC is appended to the last frame.
+    // If authenticated, VerifyRxCmac() keeps back the last 8 bytes of each frame and returns them with the next frame.
+    // So the received bytes are collected in u8_Stream and an application is parsed when its frame is complete.
+    byte u8_Stream[2 * MAX_FRAME_SIZE + 8];
+    int  s32_Ends[4];  // the positions in u8_Stream where the received frames end
+    int  s32_EndCount = 0;
+    int  s32_Len = 0;  // bytes in u8_Stream
+
+    DESFireStatus e_Status;
+    int s32_Read = DataExchange<MAC_TmacRmac>(DFEV1_INS_GET_DF_NAMES, NULL, u8_Stream, MAX_FRAME_SIZE, &e_Status);
+    while (true) {
+        if (s32_Read < 0 || s32_EndCount == 4)
+            return false;
+
+        s32_Len += s32_Read;
+        s32_Ends[s32_EndCount++] = s32_Len + ms32_RxHold;
+
+        int s32_Start = 0;
+        int E = 0;
+        for (; E < s32_EndCount && s32_Ends[E] <= s32_Len; E++) {
+            const byte *u8_Frame = u8_Stream + s32_Start;
+            int s32_Frame = s32_Ends[E] - s32_Start;
+            s32_Start = s32_Ends[E];
+
+            // AID (3) + ISO file ID (2) + DF name (1...16)
+            if (s32_Frame < 6)
+                continue;
+            if (*pu8_AppCount == 28)
+                return false;
+
+            DESFireDFName *pk_Name = &k_Names[(*pu8_AppCount)++];
+            pk_Name->u32_AppID     = u8_Frame[0] | (u8_Frame[1] << 8) | ((uint32_t) u8_Frame[2] << 16);
+            pk_Name->u16_IsoFileID = u8_Frame[3] | (u8_Frame[4] << 8);
+            pk_Name->u8_NameLen    = min(s32_Frame - 5, 16);
+            memcpy(pk_Name->u8_Name, u8_Frame + 5, pk_Name->u8_NameLen);
+
+            if (mu8_DebugLevel > 0) {
+                char s8_Buf[80];
+                sprintf(s8_Buf, "Application 0x%06X, ISO FID 0x%04X, DF name: ", (unsigned int) pk_Name->u32_AppID, pk_Name->u16_IsoFileID);
+                Utils::Print(s8_Buf);
+                Utils::PrintHexBuf(pk_Name->u8_Name, pk_Name->u8_NameLen, LF);
+            }
+        }
+
+        // Keep the frames that are not yet complete
+        memmove(u8_Stream, u8_Stream + s32_Start, s32_Len - s32_Start);
+        s32_Len -= s32_Start;
+        s32_EndCount -= E;
+        for (int i = 0; i < s32_EndCount; i++) {
+            s32_Ends[i] = s32_Ends[E + i] - s32_Start;
+        }
+
+        if (e_Status != ST_MoreFrames)
+            return true;
+
+        s32_Read = DataExchange<MAC_Rmac>(DF_INS_ADDITIONAL_FRAME, NULL, u8_Stream + s32_Len,
+                                          min((int) sizeof(u8_Stream) - s32_Len, MAX_FRAME_SIZE), &e_Status);
+    }
+}
+
 /**************************************************************************
     Creates a new application
     You must call SelectApplication(0x000000) before and authenticate with the PICC master key!
@@ -3284,7 +3045,8 @@ PN532::CreateApplication(uint32_t u32_AppID, DESFireKeySettings e_Settg, byte u8
     i_Params.AppendUint8(e_Settg);
     i_Params.AppendUint8(u8_KeyCount | e_KeyType);
 
-    return (0 == DataExchange(DF_INS_CREATE_APPLICATION, &i_Params, NULL, 0, NULL, MAC_TmacRmac));
+    MetaDrop();
+    return (0 == DataExchange<MAC_TmacRmac>(DF_INS_CREATE_APPLICATION, &i_Params, NULL, 0, NULL));
 }
 
 /**************************************************************************
@@ -3324,12 +3086,23 @@ bool PN532::DeleteApplication(uint32_t u32_AppID) {
     TX_BUFFER(i_Params, 3);
     i_Params.AppendUint24(u32_AppID);
 
-    return (0 == DataExchange(DF_INS_DELETE_APPLICATION, &i_Params, NULL, 0, NULL, MAC_TmacRmac));
+    MetaDrop();
+    if (0 != DataExchange<MAC_TmacRmac>(DF_INS_DELETE_APPLICATION, &i_Params, NULL, 0, NULL))
+        return false;
+
+    // Deleting the selected application selects the PICC level
+    if (u32_AppID == mu32_LastApplication) {
+        mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
+        mu32_LastApplication = 0x000000;
+    }
+    return true;
 }
 
 /**************************************************************************
     Selects an application
     If u8_AppID is 0x000000 the PICC level is selected
+    If the application is already selected in the card nothing is sent and the authentication remains valid
+    (see SetSessionCache()). Selecting the application in the card would invalidate the authentication.
 **************************************************************************/
 bool PN532::SelectApplication(uint32_t u32_AppID) {
     if (mu8_DebugLevel > 0) {
@@ -3338,18 +3111,86 @@ bool PN532::SelectApplication(uint32_t u32_AppID) {
         Utils::Print(s8_Buf);
     }
 
+    if (mb_SessionCache && mb_AppSelected && mu32_LastApplication == u32_AppID)
+        return true;
+
     TX_BUFFER(i_Params, 3);
     i_Params.AppendUint24(u32_AppID);
 
+    // The card drops the authentication also if the selection fails
+    mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
+    mb_AppSelected = false;
+
     // This command does not return a CMAC because after selecting another application the session key is no longer valid. (Authentication required)
-    if (0 != DataExchange(DF_INS_SELECT_APPLICATION, &i_Params, NULL, 0, NULL, MAC_None))
+    if (0 != DataExchange<MAC_None>(DF_INS_SELECT_APPLICATION, &i_Params, NULL, 0, NULL))
         return false;
 
-    mu8_LastAuthKeyNo = NOT_AUTHENTICATED; // set to invalid value (the selected app requires authentication)
     mu32_LastApplication = u32_AppID;
+    mb_AppSelected = true;
     return true;
 }
 
+/**************************************************************************
+    The session cache is disabled by default: SelectApplication() and Authenticate() always go to the card,
+    so a redundant call resynchronizes the card (e.g. SelectApplication() to drop the authentication).
+    If enabled, the cache remembers the application selected in the card and the key of the last authentication
+    until the card reports an error, the communication or the secure messaging fails, the card is activated anew
+    or the RF field is switched off. Then SelectApplication() and Authenticate() return immediately if they would
+    not change anything in the card. This saves 1 round trip for SelectApplication() and 2 for Authenticate()
+    when the same application is accessed repeatedly.
+**************************************************************************/
+void PN532::SetSessionCache(bool b_Enable) {
+    mb_SessionCache = b_Enable;
+}
+
+// Call this if the card may have been exchanged without the PN532 class noticing it.
+void PN532::InvalidateSession() {
+    mu8_LastAuthKeyNo = NOT_AUTHENTICATED;
+    mb_AppSelected = false;
+    mb_MetaChecked = false; // the card may have been changed by another reader
+    ms32_RxHold = 0;
+}
+
+/**************************************************************************
+    Attaches a cache for GetApplicationIDs(), GetFileIDs() and GetFileSettings() (see DesFireMetaCache.h).
+    The cache is used for Desfire cards with a 7 byte UID that have been activated with ReadPassiveTargetID().
+    With the first cached command after each activation the free memory of the card is compared with the cache.
+    pi_Cache = NULL detaches the cache.
+**************************************************************************/
+void PN532::SetMetadataCache(DesFireMetaCache *pi_Cache) {
+    mpi_MetaCache = pi_Cache;
+    mb_MetaChecked = false;
+}
+
+// Returns the cache entry of the activated card or NULL if the cache cannot be used
+DESFireMetaEntry *PN532::MetaEntry() {
+    if (!mpi_MetaCache || !mb_MetaUID)
+        return NULL;
+
+    if (!mb_MetaChecked) {
+        uint32_t u32_FreeMemory;
+        if (!GetFreeMemory(&u32_FreeMemory)) {
+            mb_MetaUID = false; // Desfire EV0 or communication error: do not try again in this activation
+            return NULL;
+        }
+
+        // A created application or file or a formatted card changes the free memory
+        mpk_MetaEntry = mpi_MetaCache->Find(mu8_MetaUID);
+        if (!mpk_MetaEntry || mpk_MetaEntry->u32_FreeMemory != u32_FreeMemory)
+            mpk_MetaEntry = mpi_MetaCache->Create(mu8_MetaUID, u32_FreeMemory);
+
+        mb_MetaChecked = true;
+    }
+    return mpk_MetaEntry;
+}
+
+// Called before a command that changes the applications or files of the card
+void PN532::MetaDrop() {
+    if (mpi_MetaCache && mb_MetaUID)
+        mpi_MetaCache->Drop(mu8_MetaUID);
+    mb_MetaChecked = false;
+}
+
 /**************************************************************************
     returns all File ID's for the selected application.
     Desfire EV1: maximum = 32 files per application.
@@ -3359,18 +3200,24 @@ bool PN532::SelectApplication(uint32_t u32_AppID) {
 bool PN532::GetFileIDs(byte *u8_FileIDs, byte *pu8_FileCount) {
     if (mu8_DebugLevel > 0) Utils::Print("\r\n*** GetFileIDs()\r\n");
 
-    int s32_Read = DataExchange(DF_INS_GET_FILE_IDS, NULL, u8_FileIDs, 32, NULL, MAC_TmacRmac);
-    if (s32_Read < 0)
-        return false;
+    DESFireMetaEntry *pk_Meta = mb_AppSelected ? MetaEntry() : NULL;
+    if (!pk_Meta || !mpi_MetaCache->GetFileIDs(pk_Meta, mu32_LastApplication, u8_FileIDs, pu8_FileCount)) {
+        int s32_Read = DataExchange<MAC_TmacRmac>(DF_INS_GET_FILE_IDS, NULL, u8_FileIDs, 32, NULL);
+        if (s32_Read < 0)
+            return false;
 
-    *pu8_FileCount = s32_Read;
+        *pu8_FileCount = s32_Read;
+
+        if (pk_Meta)
+            mpi_MetaCache->PutFileIDs(pk_Meta, mu32_LastApplication, u8_FileIDs, *pu8_FileCount);
+    }
 
     if (mu8_DebugLevel > 0) {
         if (*pu8_FileCount == 0) {
             Utils::Print("No files.\r\n");
         } else {
             Utils::Print("File ID's: ");
-            Utils::PrintHexBuf(u8_FileIDs, s32_Read, LF);
+            Utils::PrintHexBuf(u8_FileIDs, *pu8_FileCount, LF);
         }
     }
     return true;
@@ -3388,13 +3235,22 @@ bool PN532::GetFileSettings(byte u8_FileID, DESFireFileSettings *pk_Settings) {
 
     memset(pk_Settings, 0, sizeof(DESFireFileSettings));
 
-    TX_BUFFER(i_Params, 1);
-    i_Params.AppendUint8(u8_FileID);
-
     RX_BUFFER(i_RetData, 20);
-    int s32_Read = DataExchange(DF_INS_GET_FILE_SETTINGS, &i_Params, i_RetData, 20, NULL, MAC_TmacRmac);
-    if (s32_Read < 7)
-        return false;
+    int s32_Read;
+
+    DESFireMetaEntry *pk_Meta = mb_AppSelected ? MetaEntry() : NULL;
+    if (!pk_Meta || !mpi_MetaCache->GetFileSettings(pk_Meta, mu32_LastApplication, u8_FileID, i_RetData, &s32_Read)) {
+        TX_BUFFER(i_Params, 1);
+        i_Params.AppendUint8(u8_FileID);
+
+        s32_Read = DataExchange<MAC_TmacRmac>(DF_INS_GET_FILE_SETTINGS, &i_Params, i_RetData, 20, NULL);
+        if (s32_Read < 7)
+            return false;
+
+        // Value and record files report values that change with each transaction
+        if (pk_Meta && (i_RetData[0] == MDFT_STANDARD_DATA_FILE || i_RetData[0] == MDFT_BACKUP_DATA_FILE))
+            mpi_MetaCache->PutFileSettings(pk_Meta, mu32_LastApplication, u8_FileID, i_RetData, s32_Read);
+    }
 
     i_RetData.SetSize(s32_Read);
 
@@ -3473,7 +3329,8 @@ bool PN532::CreateStdDataFile(byte u8_FileID, DESFireFilePermissions *pk_Permis,
     i_Params.AppendUint16(u16_Permis);
     i_Params.AppendUint24(s32_FileSize); // only the low 3 bytes are used
 
-    return (0 == DataExchange(DF_INS_CREATE_STD_DATA_FILE, &i_Params, NULL, 0, NULL, MAC_TmacRmac));
+    MetaDrop();
+    return (0 == DataExchange<MAC_TmacRmac>(DF_INS_CREATE_STD_DATA_FILE, &i_Params, NULL, 0, NULL));
 
 }
 
@@ -3490,7 +3347,8 @@ bool PN532::DeleteFile(byte u8_FileID) {
     TX_BUFFER(i_Params, 1);
     i_Params.AppendUint8(u8_FileID);
 
-    return (0 == DataExchange(DF_INS_DELETE_FILE, &i_Params, NULL, 0, NULL, MAC_TmacRmac));
+    MetaDrop();
+    return (0 == DataExchange<MAC_TmacRmac>(DF_INS_DELETE_FILE, &i_Params, NULL, 0, NULL));
 }
 
 /**************************************************************************
@@ -3498,33 +3356,154 @@ bool PN532::DeleteFile(byte u8_FileID) {
     If (s32_Offset + s32_Length > file length) you will get a LimitExceeded error.
     If the file permissions are not set to AR_FREE you must authenticate either
     with the key in e_ReadAccess or the key in e_ReadAndWriteAccess.
+    e_Encrypt is the communication mode of the file (see GetFileSettings()).
 **************************************************************************/
-bool PN532::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte *u8_DataBuffer) {
+bool PN532::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte *u8_DataBuffer, DESFireFileEncryption e_Encrypt) {
     if (mu8_DebugLevel > 0) {
         char s8_Buf[80];
         sprintf(s8_Buf, "\r\n*** ReadFileData(ID= %d, Offset= %d, Length= %d)\r\n", u8_FileID, s32_Offset, s32_Length);
+        Utils::Print(s8_Buf);
     }
 
-    // With intention this command does not use DF_INS_ADDITIONAL_FRAME because the CMAC must be calculated over all frames received.
-    // When reading a lot of data this could lead to a buffer overflow in mi_CmacBuffer.
-    while (s32_Length > 0) {
-        int s32_Count = min(s32_Length,
-                            48); // the maximum that can be transferred in one frame (must be a multiple of 16 if encryption is used)
+    if (s32_Length <= 0)
+        return true;
 
-        TX_BUFFER(i_Params, 7);
-        i_Params.AppendUint8(u8_FileID);
-        i_Params.AppendUint24(s32_Offset); // only the low 3 bytes are used
-        i_Params.AppendUint24(s32_Count);  // only the low 3 bytes are used
+    // Without authentication the card can only send plain data (file with free read access)
+    if (mu8_LastAuthKeyNo == NOT_AUTHENTICATED)
+        e_Encrypt = CM_PLAIN;
 
-        DESFireStatus e_Status;
-        int s32_Read = DataExchangeReadFile(DF_INS_READ_DATA, &i_Params, u8_DataBuffer, s32_Count, &e_Status, MAC_TmacRmac)+2;
+    TX_BUFFER(i_Params, 7);
+    i_Params.AppendUint8(u8_FileID);
+    i_Params.AppendUint24(s32_Offset); // only the low 3 bytes are used
+    i_Params.AppendUint24(s32_Length); // only the low 3 bytes are used
+
+    // The data is read with one DF_INS_READ_DATA command. The card sends the response stream in frames of up to
+    // MAX_FRAME_SIZE - 1 bytes and each further frame is requested with DF_INS_ADDITIONAL_FRAME.
+    // Depending on e_Encrypt the response stream is:
+    // CM_PLAIN, CM_MAC: data + RX CMAC (8 bytes, only if authenticated)
+    // CM_ENCRYPT:       enc(data + CRC32 + zero padding) without CMAC (the CRC32 is calculated over the data + the status byte)
+    // The frames are not aligned to the data: the CMAC may be split over two frames and encrypted blocks over several frames.
+    // The stream is received directly into u8_DataBuffer and the data is added to the RX CMAC or decrypted as soon as it
+    // has arrived. Only the bytes behind s32_Direct (CMAC or the last encrypted blocks) are collected in u8_Tail.
+    bool b_Mac = (e_Encrypt != CM_ENCRYPT && mu8_LastAuthKeyNo != NOT_AUTHENTICATED);
+    int s32_BlockSize = 1;
+    int s32_Direct    = s32_Length;
+    int s32_Total     = s32_Length + (b_Mac ? 8 : 0);
+    if (e_Encrypt == CM_ENCRYPT) {
+        s32_BlockSize = mpi_SessionKey->GetBlockSize();
+        s32_Direct    = s32_Length - (s32_Length % s32_BlockSize);
+        s32_Total     = mpi_SessionKey->CalcPaddedBlockSize(s32_Length + 4);
+    }
+    byte u8_Tail[32];
+
+    DESFireStatus e_Status;
+    int s32_Received = 0;
+    int s32_Done     = 0; // bytes in u8_DataBuffer that have been added to the CMAC or decrypted
+    int s32_Frame = DataExchange<MAC_Tmac>(DF_INS_READ_DATA, &i_Params, NULL, min(s32_Total, MAX_FRAME_SIZE - 1), &e_Status);
+    if (b_Mac && !mpi_SessionKey->CmacBegin()) { // after the TX CMAC
+        InvalidateSession();
+        return false;
+    }
 
-        if (e_Status != ST_Success || s32_Read <= 0)
-            return false; // ST_MoreFrames is not allowed here!
+    while (true) {
+        if (s32_Frame < 0)
+            return false;
+
+        // DataExchange() has left the frame in pn532_packetbuffer
+        const byte *u8_Frame = pn532_packetbuffer + 4;
+        int s32_Copy = min(s32_Frame, max(s32_Direct - s32_Received, 0));
+        memcpy(u8_DataBuffer + s32_Received, u8_Frame, s32_Copy);
+        if (s32_Frame > s32_Copy)
+            memcpy(u8_Tail + s32_Received + s32_Copy - s32_Direct, u8_Frame + s32_Copy, s32_Frame - s32_Copy);
+        s32_Received += s32_Frame;
+
+        int s32_Ready = min(s32_Received - (s32_Received % s32_BlockSize), s32_Direct);
+        if (s32_Ready > s32_Done) {
+            byte *u8_Data = u8_DataBuffer + s32_Done;
+            bool b_Valid = (e_Encrypt == CM_ENCRYPT)
+                         ? mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_Data, u8_Data, s32_Ready - s32_Done)
+                         : (!b_Mac || mpi_SessionKey->CmacUpdate(u8_Data, s32_Ready - s32_Done));
+            if (!b_Valid) {
+                InvalidateSession();
+                return false;
+            }
+            s32_Done = s32_Ready;
+        }
+
+        if (e_Status != ST_MoreFrames)
+            break;
 
-        s32_Length -= s32_Read;
-        s32_Offset += s32_Read;
-        u8_DataBuffer += s32_Read;
+        s32_Frame = DataExchange<MAC_None>(DF_INS_ADDITIONAL_FRAME, NULL, NULL,
+                                           min(s32_Total - s32_Received, MAX_FRAME_SIZE - 1), &e_Status);
+    }
+
+    // The card has sent less or more than expected, the CRC or the CMAC is invalid: the session is no longer in sync
+    if (e_Status != ST_Success || s32_Received != s32_Total) {
+        InvalidateSession();
+        return false;
+    }
+
+    if (e_Encrypt == CM_ENCRYPT) {
+        if (!CheckEncryptedTail(u8_DataBuffer, s32_Length, s32_Direct, u8_Tail, s32_Total - s32_Direct)) {
+            InvalidateSession();
+            return false;
+        }
+        return true;
+    }
+
+    if (b_Mac) {
+        // The CMAC is calculated over the RX data + the status byte
+        byte u8_Status = ST_Success;
+        byte u8_CalcMac[16];
+        if (!mpi_SessionKey->CmacUpdate(&u8_Status, 1) ||
+            !mpi_SessionKey->CmacFinal(u8_CalcMac)) {
+            InvalidateSession();
+            return false;
+        }
+
+        TRACE_DEBUG(TRC_Cmac, DF_INS_READ_DATA, 2, 8, u8_Tail, 8);
+        if (memcmp(u8_Tail, u8_CalcMac, 8) != 0) {
+            TRACE_ERROR(DF_INS_READ_DATA, TRE_CmacMismatch, 0);
+            Utils::Print("CMAC Mismatch\r\n");
+            InvalidateSession();
+            return false;
+        }
+    }
+    return true;
+}
+
+/**************************************************************************
+    ReadFileData() for CM_ENCRYPT: decrypts the last blocks in u8_Tail (the rest of the data,
+    the CRC32 and the padding), copies the rest of the data behind s32_Direct into u8_DataBuffer
+    and checks the CRC32 over the data + the status byte and the zero padding.
+**************************************************************************/
+bool PN532::CheckEncryptedTail(byte *u8_DataBuffer, int s32_Length, int s32_Direct, byte *u8_Tail, int s32_TailLen) {
+    if (!mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_Tail, u8_Tail, s32_TailLen))
+        return false;
+
+    int s32_Rest = s32_Length - s32_Direct;
+    memcpy(u8_DataBuffer + s32_Direct, u8_Tail, s32_Rest);
+
+    byte u8_Status = ST_Success;
+    uint32_t u32_Crc = Utils::CalcCrc32(u8_DataBuffer, s32_Length, &u8_Status, 1);
+
+    bool b_Valid = true;
+    for (int i=s32_Rest; i<s32_TailLen; i++) {
+        int s32_Crc = i - s32_Rest; // byte index in CRC32 + padding
+        byte u8_Expect = (s32_Crc < 4) ? (byte)(u32_Crc >> (8 * s32_Crc)) : 0x00;
+        if (u8_Tail[i] != u8_Expect)
+            b_Valid = false;
+    }
+    if (!b_Valid) {
+        TRACE_ERROR(DF_INS_READ_DATA, TRE_Decrypt, s32_Length);
+        Utils::Print("CRC Mismatch\r\n");
+        return false;
+    }
+
+    TRACE_DEBUG(TRC_Decrypt, DF_INS_READ_DATA, s32_Length, 0, u8_DataBuffer, s32_Length);
+    if (mu8_DebugLevel > 1) {
+        Utils::Print("Decrypt:  ");
+        Utils::PrintHexBuf(u8_DataBuffer, s32_Length, LF);
     }
     return true;
 }
@@ -3533,36 +3512,126 @@ bool PN532::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte *u
     Writes data to a Standard Data File or a Backup Data File.
     If the file permissins are not set to AR_FREE you must authenticate either
     with the key in e_WriteAccess or the key in e_ReadAndWriteAccess.
+    e_Encrypt is the communication mode of the file (see GetFileSettings()).
 **************************************************************************/
-bool PN532::WriteFileData(byte u8_FileID, int s32_Offset, int s32_Length, const byte *u8_DataBuffer) {
+bool PN532::WriteFileData(byte u8_FileID, int s32_Offset, int s32_Length, const byte *u8_DataBuffer, DESFireFileEncryption e_Encrypt) {
     if (mu8_DebugLevel > 0) {
         char s8_Buf[80];
         sprintf(s8_Buf, "\r\n*** WriteFileData(ID= %d, Offset= %d, Length= %d)\r\n", u8_FileID, s32_Offset, s32_Length);
         Utils::Print(s8_Buf);
     }
 
-    // With intention this command does not use DF_INS_ADDITIONAL_FRAME because the CMAC must be calculated over all frames sent.
-    // When writing a lot of data this could lead to a buffer overflow in mi_CmacBuffer.
-    while (s32_Length > 0) {
-        int s32_Count = min(s32_Length,
-                            MAX_FRAME_SIZE - 8); // DF_INS_WRITE_DATA + u8_FileID + s32_Offset + s32_Count = 8 bytes
+    if (s32_Length <= 0)
+        return true;
 
-        TX_BUFFER(i_Params, MAX_FRAME_SIZE);
-        i_Params.AppendUint8(u8_FileID);
-        i_Params.AppendUint24(s32_Offset); // only the low 3 bytes are used
-        i_Params.AppendUint24(s32_Count);  // only the low 3 bytes are used
-        i_Params.AppendBuf(u8_DataBuffer, s32_Count);
+    // Without authentication the card accepts only plain data (file with free write access)
+    if (mu8_LastAuthKeyNo == NOT_AUTHENTICATED)
+        e_Encrypt = CM_PLAIN;
+
+    // The data is sent with one DF_INS_WRITE_DATA command. The first frame carries the parameters and
+    // MAX_FRAME_SIZE - 8 data bytes, the rest follows in DF_INS_ADDITIONAL_FRAME frames of MAX_FRAME_SIZE - 1 bytes.
+    // The card answers each frame with ST_MoreFrames until it has received all data and then commits it once.
+    // Depending on e_Encrypt the data that is sent is:
+    // CM_PLAIN:   data                               (the TX CMAC is calculated only to update the IV)
+    // CM_MAC:     data + TX CMAC (8 bytes)
+    // CM_ENCRYPT: enc(data + CRC32 + zero padding)   (the CRC32 is calculated over the command + parameters + data)
+    // The CMAC and the CRC are calculated before the first frame is sent and the frames are filled
+    // directly from u8_DataBuffer. Encrypted blocks are created one by one while the frames are filled.
+    TX_BUFFER(i_Command, 8);
+    i_Command.AppendUint8(DF_INS_WRITE_DATA);
+    i_Command.AppendUint8(u8_FileID);
+    i_Command.AppendUint24(s32_Offset); // only the low 3 bytes are used
+    i_Command.AppendUint24(s32_Length); // only the low 3 bytes are used
+
+    TX_BUFFER(i_Frame, MAX_FRAME_SIZE - 1);
+
+    byte u8_Mac[16];
+    uint32_t u32_Crc  = 0;
+    int s32_BlockSize = 0;
+    int s32_Wrapped   = s32_Length;
+    switch (e_Encrypt) {
+        case CM_ENCRYPT:
+            u32_Crc       = Utils::CalcCrc32(i_Command.GetData(), i_Command.GetCount(), u8_DataBuffer, s32_Length);
+            s32_BlockSize = mpi_SessionKey->GetBlockSize();
+            s32_Wrapped   = mpi_SessionKey->CalcPaddedBlockSize(s32_Length + 4);
+            break;
+        case CM_MAC:
+            if (!CalcTxCmac(&i_Command, &i_Frame, u8_DataBuffer, s32_Length, u8_Mac)) {
+                InvalidateSession();
+                return false;
+            }
+            s32_Wrapped += 8; // For AES the CMAC is 16 byte, but only 8 are transmitted
+            break;
+        default:
+            if (!CalcTxCmac(&i_Command, &i_Frame, u8_DataBuffer, s32_Length)) {
+                InvalidateSession();
+                return false;
+            }
+            break;
+    }
 
-        DESFireStatus e_Status;
-        int s32_Read = DataExchange(DF_INS_WRITE_DATA, &i_Params, NULL, 0, &e_Status, MAC_TmacRmac);
-        if (e_Status != ST_Success || s32_Read != 0)
-            return false; // ST_MoreFrames is not allowed here!
+    byte u8_Block[16]; // CM_ENCRYPT: the current encrypted block
+    int s32_Sent = 0;
+    int s32_Read;
+    DESFireStatus e_Status;
+    for (bool b_First = true; ; b_First = false) {
+        int s32_Room = b_First ? MAX_FRAME_SIZE - 8 : MAX_FRAME_SIZE - 1;
+        i_Frame.Clear();
+        while (s32_Sent < s32_Wrapped && i_Frame.GetCount() < s32_Room) {
+            const byte *u8_Src;
+            int s32_Avail;
+            if (e_Encrypt == CM_ENCRYPT) {
+                int s32_Pos = s32_Sent % s32_BlockSize;
+                if (s32_Pos == 0 && !EncryptWriteBlock(u8_Block, u8_DataBuffer, s32_Length, s32_Sent, u32_Crc)) {
+                    InvalidateSession();
+                    return false;
+                }
+                u8_Src    = u8_Block + s32_Pos;
+                s32_Avail = s32_BlockSize - s32_Pos;
+            }
+            else if (s32_Sent < s32_Length) {
+                u8_Src    = u8_DataBuffer + s32_Sent;
+                s32_Avail = s32_Length - s32_Sent;
+            }
+            else { // CM_MAC
+                u8_Src    = u8_Mac + s32_Sent - s32_Length;
+                s32_Avail = s32_Wrapped - s32_Sent;
+            }
+            int s32_Copy = min(s32_Avail, s32_Room - i_Frame.GetCount());
+            i_Frame.AppendBuf(u8_Src, s32_Copy);
+            s32_Sent += s32_Copy;
+        }
+
+        if (b_First)
+            s32_Read = DataExchange<MAC_Rmac>(&i_Command, &i_Frame, NULL, 0, &e_Status);
+        else
+            s32_Read = DataExchange<MAC_Rmac>(DF_INS_ADDITIONAL_FRAME, &i_Frame, NULL, 0, &e_Status);
 
-        s32_Length -= s32_Count;
-        s32_Offset += s32_Count;
-        u8_DataBuffer += s32_Count;
+        if (s32_Read != 0 || e_Status != ST_MoreFrames || s32_Sent == s32_Wrapped)
+            break;
     }
-    return true;
+    if (s32_Read == 0 && e_Status == ST_Success && s32_Sent == s32_Wrapped)
+        return true;
+
+    InvalidateSession(); // the card has aborted the write or answered unexpectedly: the IV is no longer in sync
+    return false;
+}
+
+/**************************************************************************
+    WriteFileData() for CM_ENCRYPT: creates the plain block at s32_Pos of (data + CRC32 + zero padding)
+    and encrypts it into u8_Block with the session key.
+**************************************************************************/
+bool PN532::EncryptWriteBlock(byte *u8_Block, const byte *u8_Data, int s32_Length, int s32_Pos, uint32_t u32_Crc) {
+    int s32_BlockSize = mpi_SessionKey->GetBlockSize();
+    int s32_Data = min(max(s32_Length - s32_Pos, 0), s32_BlockSize);
+
+    byte u8_Plain[16];
+    memcpy(u8_Plain, u8_Data + s32_Pos, s32_Data);
+    for (int i=s32_Data; i<s32_BlockSize; i++) {
+        int s32_Crc = s32_Pos + i - s32_Length; // byte index in CRC32 + padding
+        u8_Plain[i] = (s32_Crc < 4) ? (byte)(u32_Crc >> (8 * s32_Crc)) : 0x00;
+    }
+    return mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Block, u8_Plain, s32_BlockSize);
 }
 
 /**************************************************************************
@@ -3573,13 +3642,121 @@ bool PN532::ReadFileValue(byte u8_FileID, uint32_t *pu32_Value) {
     i_Params.AppendUint8(u8_FileID);
 
     RX_BUFFER(i_RetData, 4);
-    if (4 != DataExchange(DF_INS_GET_VALUE, &i_Params, i_RetData, 4, NULL, MAC_TmacRmac))
+    if (4 != DataExchange<MAC_TmacRmac>(DF_INS_GET_VALUE, &i_Params, i_RetData, 4, NULL))
         return false;
 
     *pu32_Value = i_RetData.ReadUint32();
     return true;
 }
 
+/**************************************************************************
+    Reads everything that can be read from the card without changing it:
+    version, free memory, PICC key settings, all applications with DF name,
+    key settings, file IDs and the settings of all files.
+    Each application is selected only once and all its commands follow each other.
+    The debug output is switched off while the inventory is read.
+    If the PICC master key settings require authentication for listing, call Authenticate()
+    with the PICC master key before. Applications are read without authentication:
+    what the card denies is marked with b_xxx = false in pk_Inventory.
+    returns false if the communication with the card fails or GetCardVersion() fails (not a Desfire card).
+    The last application of the card remains selected.
+**************************************************************************/
+bool PN532::GetCardInventory(DESFireCardInventory *pk_Inventory) {
+    if (mu8_DebugLevel > 0) Utils::Print("\r\n*** GetCardInventory()\r\n");
+
+    byte u8_DebugLevel = mu8_DebugLevel;
+    mu8_DebugLevel = 0;
+    bool b_Success = ReadInventory(pk_Inventory);
+    mu8_DebugLevel = u8_DebugLevel;
+
+    if (mu8_DebugLevel > 0) {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "%s: %d applications, %d files\r\n", b_Success ? "Inventory" : "Inventory failed",
+                pk_Inventory->u8_AppCount, pk_Inventory->s32_FileCount);
+        Utils::Print(s8_Buf);
+    }
+    return b_Success;
+}
+
+// A command that fails with a card error (permission denied, authentication required) leaves the application selected.
+// If the communication has failed, the session is invalidated (mb_AppSelected = false) and the inventory is aborted.
+bool PN532::ReadInventory(DESFireCardInventory *pk_Inventory) {
+    memset(pk_Inventory, 0, sizeof(DESFireCardInventory));
+
+    // ---------------- PICC level ----------------
+    // If the PICC level is already selected it is not selected again, because that would drop a PICC authentication
+    bool b_Picc = mb_AppSelected && mu32_LastApplication == 0x000000;
+    if ((!b_Picc && !SelectApplication(0x000000)) || !GetCardVersion(&pk_Inventory->k_Version))
+        return false;
+
+    pk_Inventory->b_FreeMemory = GetFreeMemory(&pk_Inventory->u32_FreeMemory);
+    if (!mb_AppSelected)
+        return false;
+
+    pk_Inventory->b_KeySettings = GetKeySettings(&pk_Inventory->e_KeySettings, &pk_Inventory->u8_KeyCount, &pk_Inventory->e_KeyType);
+    if (!mb_AppSelected)
+        return false;
+
+    uint32_t u32_AppIDs[28];
+    pk_Inventory->b_AppIDs = GetApplicationIDs(u32_AppIDs, &pk_Inventory->u8_AppCount);
+    if (!mb_AppSelected)
+        return false;
+    if (!pk_Inventory->b_AppIDs)
+        return true; // listing requires the PICC master key
+
+    DESFireDFName k_Names[28];
+    byte u8_NameCount = 0;
+    if (!GetDFNames(k_Names, &u8_NameCount) && !mb_AppSelected)
+        return false;
+
+    for (int A = 0; A < pk_Inventory->u8_AppCount; A++) {
+        DESFireAppInventory *pk_App = &pk_Inventory->k_Apps[A];
+        pk_App->u32_AppID = u32_AppIDs[A];
+        for (int N = 0; N < u8_NameCount; N++) {
+            if (k_Names[N].u32_AppID == pk_App->u32_AppID) {
+                pk_App->u16_IsoFileID = k_Names[N].u16_IsoFileID;
+                pk_App->u8_DFNameLen  = k_Names[N].u8_NameLen;
+                memcpy(pk_App->u8_DFName, k_Names[N].u8_Name, k_Names[N].u8_NameLen);
+            }
+        }
+    }
+
+    // ---------------- Application level ----------------
+    for (int A = 0; A < pk_Inventory->u8_AppCount; A++) {
+        DESFireAppInventory *pk_App = &pk_Inventory->k_Apps[A];
+        pk_App->s32_FirstFile = pk_Inventory->s32_FileCount;
+
+        // The application has just been listed by the card
+        if (!SelectApplication(pk_App->u32_AppID))
+            return false;
+
+        pk_App->b_KeySettings = GetKeySettings(&pk_App->e_KeySettings, &pk_App->u8_KeyCount, &pk_App->e_KeyType);
+        if (!mb_AppSelected)
+            return false;
+
+        byte u8_FileIDs[32];
+        byte u8_FileCount = 0;
+        pk_App->b_FileIDs = GetFileIDs(u8_FileIDs, &u8_FileCount);
+        if (!mb_AppSelected)
+            return false;
+
+        for (int F = 0; F < u8_FileCount; F++) {
+            if (pk_Inventory->s32_FileCount == DESFIRE_INVENTORY_FILES) {
+                pk_Inventory->b_Truncated = true;
+                break;
+            }
+
+            DESFireFileInventory *pk_File = &pk_Inventory->k_Files[pk_Inventory->s32_FileCount++];
+            pk_File->u8_FileID  = u8_FileIDs[F];
+            pk_File->b_Settings = GetFileSettings(u8_FileIDs[F], &pk_File->k_Settings);
+            if (!mb_AppSelected)
+                return false;
+            pk_App->u8_FileCount++;
+        }
+    }
+    return true;
+}
+
 // ########################################################################
 // ####                      LOW LEVEL FUNCTIONS                      #####
 // ########################################################################
@@ -3699,7 +3876,7 @@ bool PN532::SAFE_TEST() {
 
     byte u8_RxData[16];
     //bool PN532::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer)
-    if (!ReadFileData(1, 0, FILE_LENGTH, u8_RxData)) {
+    if (!ReadFileData(1, 0, FILE_LENGTH, u8_RxData, k_Settings.e_Encrypt)) {
         Utils::Print("ReadFileData failed\r\n");
         return false;
     }
@@ -15,6 +15,8 @@
 #include "PN532.h"
 #include "DES.h"
 #include "AES128.h"
+#include "PN532_METRICS.h"
+#include "DesFireMetaCache.h"
 
 // DESFIRE CONTENT STARTS HERE
 
@@ -229,8 +231,8 @@ struct DESFireFilePermissions
 enum DESFireFileEncryption
 {
     CM_PLAIN   = 0x00,
-    CM_MAC     = 0x01,   // not implemented (Plain data transfer with additional MAC)
-    CM_ENCRYPT = 0x03,   // not implemented (Does not make data stored on the card more secure. Only encrypts the transfer between Teensy and the card)
+    CM_MAC     = 0x01,   // Plain data transfer with additional MAC
+    CM_ENCRYPT = 0x03,   // Does not make data stored on the card more secure. Only encrypts the transfer between Teensy and the card
 };
 
 enum DESFireFileType
@@ -263,6 +265,59 @@ struct DESFireFileSettings
     uint32_t  u32_CurrentNumberRecords;
 };
 
+// An application that has an ISO file ID and a DF name (GetDFNames)
+struct DESFireDFName
+{
+    uint32_t u32_AppID;
+    uint16_t u16_IsoFileID;
+    byte     u8_Name[16];
+    byte     u8_NameLen;
+};
+
+#ifndef DESFIRE_INVENTORY_FILES
+    #define DESFIRE_INVENTORY_FILES  64 // the files of all applications together (GetCardInventory)
+#endif
+
+// GetCardInventory(): all the b_xxx flags are false if the card has denied the command (authentication required)
+struct DESFireFileInventory
+{
+    byte                u8_FileID;
+    bool                b_Settings;
+    DESFireFileSettings k_Settings;
+};
+
+struct DESFireAppInventory
+{
+    uint32_t            u32_AppID;
+    uint16_t            u16_IsoFileID;  // only if u8_DFNameLen > 0
+    byte                u8_DFName[16];
+    byte                u8_DFNameLen;
+    bool                b_KeySettings;
+    DESFireKeySettings  e_KeySettings;
+    byte                u8_KeyCount;
+    DESFireKeyType      e_KeyType;
+    bool                b_FileIDs;
+    byte                u8_FileCount;   // the files stored in DESFireCardInventory::k_Files
+    int                 s32_FirstFile;  // index in DESFireCardInventory::k_Files
+};
+
+struct DESFireCardInventory
+{
+    DESFireCardVersion   k_Version;
+    bool                 b_FreeMemory;  // false for DESFire EV0
+    uint32_t             u32_FreeMemory;
+    bool                 b_KeySettings; // PICC master key
+    DESFireKeySettings   e_KeySettings;
+    byte                 u8_KeyCount;
+    DESFireKeyType       e_KeyType;
+    bool                 b_AppIDs;
+    bool                 b_Truncated;   // the card has more than DESFIRE_INVENTORY_FILES files
+    byte                 u8_AppCount;
+    DESFireAppInventory  k_Apps[28];
+    int                  s32_FileCount;
+    DESFireFileInventory k_Files[DESFIRE_INVENTORY_FILES];
+};
+
 enum DESFireCmac
 {
     MAC_None   = 0,
@@ -398,7 +453,13 @@ enum DESFireCmac
 #define FELICA_WRITE_MAX_BLOCK_NUM          10 // for typical FeliCa card
 #define FELICA_REQ_SERVICE_MAX_NODE_NUM     32
 
-#define PN532_PACKBUFFSIZE                  80
+// The size of the packet buffer limits the length of the commands and responses.
+// Responses with more than 254 data bytes arrive as extended frames: to use the full
+// 264 byte payload of the PN532 compile with -DPN532_PACKBUFFSIZE=280 (and a transport with
+// buffers that are large enough, see PN532_ASYNC_FRAME_SIZE).
+#ifndef PN532_PACKBUFFSIZE
+    #define PN532_PACKBUFFSIZE              80
+#endif
 
 enum eCardType
 {
@@ -435,8 +496,8 @@ public:
     int8_t tgInitAsTarget(uint16_t timeout = 0);
     int8_t tgInitAsTarget(const uint8_t* command, const uint8_t len, const uint16_t timeout = 0);
 
-    int16_t tgGetData(uint8_t *buf, uint8_t len);
-    bool tgSetData(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint8_t blen = 0);
+    int16_t tgGetData(uint8_t *buf, uint16_t len);
+    bool tgSetData(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
 
     int16_t inRelease(const uint8_t relevantTarget = 0);
     int16_t inSelectCard(const uint8_t relevantTarget = 0);
@@ -449,12 +510,12 @@ public:
     bool inDataExchange(uint8_t *send, uint8_t sendLength, uint8_t *response, uint8_t *responseLength);
 
     // NEW functions
-    bool SendCommandCheckAck(byte *cmd, byte cmdlen);
-    void WriteCommand(byte* cmd, byte cmdlen);
-    void SendPacket(byte* buff, byte len);
+    bool SendCommandCheckAck(byte *cmd, int cmdlen);
+    void WriteCommand(byte* cmd, int cmdlen);
+    void SendPacket(byte* buff, int len);
     bool ReadAck();
-    byte ReadData(byte* buff, byte len);
-    bool ReadPacket(byte* buff, byte len);
+    int  ReadData(byte* buff, int len);
+    bool ReadPacket(byte* buff, int len);
     bool WaitReady();
     bool IsReady();
 
@@ -472,6 +533,7 @@ public:
     bool ChangeKeySettings(DESFireKeySettings e_NewSettg);
     // ---------------------
     bool GetApplicationIDs(uint32_t u32_IDlist[28], byte* pu8_AppCount);
+    bool GetDFNames       (DESFireDFName k_Names[28], byte* pu8_AppCount);
     bool CreateApplication(uint32_t u32_AppID, DESFireKeySettings e_Settg, byte u8_KeyCount, DESFireKeyType e_KeyType);
     bool SelectApplication(uint32_t u32_AppID);
     bool DeleteApplication(uint32_t u32_AppID);
@@ -481,14 +543,25 @@ public:
     bool GetFileSettings  (byte u8_FileID, DESFireFileSettings* pk_Settings);
     bool DeleteFile       (byte u8_FileID);
     bool CreateStdDataFile(byte u8_FileID, DESFireFilePermissions* pk_Permis, int s32_FileSize);
-    bool ReadFileData     (byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer);
-    bool WriteFileData    (byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer);
+    bool ReadFileData     (byte u8_FileID, int s32_Offset, int s32_Length, byte* u8_DataBuffer, DESFireFileEncryption e_Encrypt = CM_PLAIN);
+    bool WriteFileData    (byte u8_FileID, int s32_Offset, int s32_Length, const byte* u8_DataBuffer, DESFireFileEncryption e_Encrypt = CM_PLAIN);
     bool ReadFileValue    (byte u8_FileID, uint32_t* pu32_Value);
     // ---------------------
+    bool GetCardInventory (DESFireCardInventory* pk_Inventory);
+    // ---------------------
     bool SwitchOffRfField();  // overrides PN532::SwitchOffRfField()
+    // Session cache (off by default): SelectApplication() and Authenticate() skip the card if the application / key is still active
+    void SetSessionCache(bool b_Enable);
+    void InvalidateSession(); // the next SelectApplication() and Authenticate() go to the card
+    // Metadata cache: GetApplicationIDs(), GetFileIDs(), GetFileSettings() per card UID (see DesFireMetaCache.h), NULL = off
+    void SetMetadataCache(DesFireMetaCache* pi_Cache);
     bool SAFE_TEST();
     bool Selftest();
     byte GetLastPN532Error(); // See comment for this function in CPP file
+#if PN532_METRICS
+    // Latency histograms, failures and status codes of all commands sent (see PN532_METRICS.h)
+    PN532Metrics* GetMetrics() { return &mi_Metrics; }
+#endif
 
     // Mifare Classic functions
     bool mifareclassic_IsFirstBlock (uint32_t uiBlock);
@@ -527,26 +600,43 @@ public:
     AES   AES_DEFAULT_KEY; // AES    key with 16 zeroes
 
 private:
-    int  DataExchange(uint8_t      u8_Command, TxBuffer* pi_Params, uint8_t* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac);
-    int  DataExchange(TxBuffer* pi_Command, TxBuffer* pi_Params, uint8_t* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac);
-    int  DataExchangeOLD(TxBuffer* pi_Command, TxBuffer* pi_Params, uint8_t* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac);
-    int  DataExchangeReadFile(uint8_t      u8_Command, TxBuffer* pi_Params, uint8_t* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac);
-    int  DataExchangeReadFile(TxBuffer* pi_Command, TxBuffer* pi_Params, uint8_t* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status, DESFireCmac e_Mac);
+    // The MAC mode is a template parameter: each call site compiles only the stages it needs (defined in PN532.cpp)
+    template <DESFireCmac MAC> int DataExchange(uint8_t      u8_Command, TxBuffer* pi_Params, uint8_t* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status);
+    template <DESFireCmac MAC> int DataExchange(TxBuffer* pi_Command, TxBuffer* pi_Params, uint8_t* u8_RecvBuf, int s32_RecvSize, DESFireStatus* pe_Status);
+    bool EncryptParams(TxBuffer* pi_Command, TxBuffer* pi_Params);
+    bool CalcTxCmac(TxBuffer* pi_Command, TxBuffer* pi_Params, const uint8_t* u8_Data = NULL, int s32_DataLen = 0, uint8_t* u8_Cmac = NULL);
+    int  Transceive(TxBuffer* pi_Command, TxBuffer* pi_Params, int s32_ReadSize, uint8_t* pu8_CardStatus);
+    int  VerifyRxCmac(uint8_t u8_Command, uint8_t u8_CardStatus, int s32_Len);
+    bool CheckEncryptedTail(uint8_t* u8_DataBuffer, int s32_Length, int s32_Direct, uint8_t* u8_Tail, int s32_TailLen);
+    bool EncryptWriteBlock(uint8_t* u8_Block, const uint8_t* u8_Data, int s32_Length, int s32_Pos, uint32_t u32_Crc);
     bool CheckCardStatus(DESFireStatus e_Status);
     bool CheckPN532Status(byte u8_Status);
+    int8_t  HalWriteCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t HalReadResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout = 1000);
+    static uint16_t MetricKey(const uint8_t *header, uint8_t hlen, const uint8_t *body);
+    bool ReadInventory(DESFireCardInventory* pk_Inventory);
+    DESFireMetaEntry* MetaEntry();
+    void MetaDrop();
     bool SelftestKeyChange(uint32_t u32_Application, DESFireKey* pi_DefaultKey, DESFireKey* pi_NewKeyA, DESFireKey* pi_NewKeyB);
 
     uint8_t       mu8_LastAuthKeyNo; // The last key which did a successful authetication (0xFF if not yet authenticated)
     uint32_t      mu32_LastApplication;
+    bool          mb_AppSelected;        // mu32_LastApplication is known to be selected in the card
+    bool          mb_SessionCache;       // see SetSessionCache()
+    DESFireKeyType me_SessionKeyType;    // the key of the last successful authentication
+    uint8_t       mu8_SessionKeyData[24];
+    DesFireMetaCache* mpi_MetaCache;     // see SetMetadataCache()
+    DESFireMetaEntry* mpk_MetaEntry;     // the entry of the current card, valid if mb_MetaChecked
+    bool          mb_MetaUID;            // mu8_MetaUID is the 7 byte UID of the activated Desfire card
+    bool          mb_MetaChecked;        // the free memory has been compared in this activation
+    uint8_t       mu8_MetaUID[7];
     uint8_t       mu8_LastPN532Error;
+    uint8_t       mu8_RxHold[8];         // the last bytes of an intermediate frame that may belong to the CMAC (see VerifyRxCmac())
+    int           ms32_RxHold;
     DESFireKey*   mpi_SessionKey;
     AES           mi_AesSessionKey;
     DES           mi_DesSessionKey;
 
-    // Must have enough space to hold the entire response from DF_INS_GET_APPLICATION_IDS (84 byte) + CMAC padding
-    uint8_t       mu8_CmacBuffer_Data[120];
-    TxBuffer      mi_CmacBuffer;
-
     uint8_t _uid[7];  // ISO14443A uid
     uint8_t _uidLen;  // uid len
     uint8_t _key[6];  // Mifare Classic key
@@ -558,6 +648,9 @@ private:
     uint8_t pn532_packetbuffer[PN532_PACKBUFFSIZE];
 
     PN532Interface *_interface;
+#if PN532_METRICS
+    PN532Metrics    mi_Metrics;
+#endif
 };
 
 #endif
@@ -17,6 +17,13 @@
 // TODO 100ms is empirically shown to work here, lower than that times out
 #define PN532_ACK_WAIT_TIME           (100)  // ms, timeout of waiting for ACK
 
+// PN532 Manual chapter 6.2.1.2: an extended information frame carries up to 265 bytes (TFI + 264 data bytes)
+//   normal:   00 00 FF LEN LCS TFI PD0 ... PDn DCS 00              (LEN <= 255)
+//   extended: 00 00 FF FF FF LENM LENL LCS TFI PD0 ... PDn DCS 00
+#define PN532_NORMAL_FRAME_LEN        (255)  // max LEN of a normal frame (TFI + data)
+#define PN532_EXTENDED_FRAME_LEN      (265)  // max LEN of an extended frame (TFI + data)
+#define PN532_FRAME_OVERHEAD          (11)   // preamble + start code + extended length field + TFI + DCS + postamble
+
 #define PN532_INVALID_ACK             (-1)
 #define PN532_TIMEOUT                 (-2)
 #define PN532_INVALID_FRAME           (-3)
@@ -26,6 +33,106 @@
                                       b = (b & 0xCC) >> 2 | (b & 0x33) << 2; \
                                       b = (b & 0xAA) >> 1 | (b & 0x55) << 1
 
+#if PROTOCOL != PROT_HSU
+// Bus statistics of the I2C and SPI transports (PN532_I2C, PN532_I2CDEV, PN532_SPIDEV)
+struct PN532BusStats
+{
+    uint32_t u32_Commands;     // writeCommand() calls
+    uint32_t u32_Transactions; // read and write transactions (one address byte or SPI command byte each)
+    uint32_t u32_ReadyPolls;   // status byte reads that returned "not ready" (SPI: batches of status reads)
+    uint32_t u32_BusBytes;     // all bytes on the bus including the address / SPI command bytes
+};
+#endif
+
+// Encodes information frames and decodes the length field of normal and extended information frames.
+// Used by PN532::WriteCommand() / ReadData() and by the transports that build the frame themselves.
+class PN532Frame
+{
+public:
+    // Writes preamble, start code and the length field for u16_Len bytes (TFI + data).
+    // A frame with more than 255 bytes is sent as extended frame.
+    // Returns the count of bytes written to u8_Out: 5 (normal) or 8 (extended)
+    static inline int EncodeHead(uint8_t* u8_Out, uint16_t u16_Len)
+    {
+        u8_Out[0] = PN532_PREAMBLE;
+        u8_Out[1] = PN532_STARTCODE1;
+        u8_Out[2] = PN532_STARTCODE2;
+        if (u16_Len <= PN532_NORMAL_FRAME_LEN)
+        {
+            u8_Out[3] = (uint8_t)u16_Len;
+            u8_Out[4] = (uint8_t)(~u16_Len + 1);
+            return 5;
+        }
+        u8_Out[3] = 0xFF;
+        u8_Out[4] = 0xFF;
+        u8_Out[5] = (uint8_t)(u16_Len >> 8);
+        u8_Out[6] = (uint8_t)(u16_Len);
+        u8_Out[7] = (uint8_t)(~(u8_Out[5] + u8_Out[6]) + 1);
+        return 8;
+    }
+
+    // Writes the complete frame host -> PN532: preamble, start code, length field, TFI,
+    // header, body, checksum and postamble. u8_Body may be NULL if u16_BodyLen is 0.
+    // u8_Out must have space for u16_HeadLen + u16_BodyLen + PN532_FRAME_OVERHEAD bytes.
+    // Returns the count of bytes written to u8_Out.
+    static inline int Encode(uint8_t* u8_Out, const uint8_t* u8_Header, uint16_t u16_HeadLen,
+                             const uint8_t* u8_Body, uint16_t u16_BodyLen)
+    {
+        int     P = EncodeHead(u8_Out, u16_HeadLen + u16_BodyLen + 1); // length of data field: TFI + DATA
+        uint8_t u8_Sum = PN532_HOSTTOPN532;
+
+        u8_Out[P++] = PN532_HOSTTOPN532;
+        for (uint16_t i=0; i<u16_HeadLen; i++)
+        {
+            u8_Out[P++] = u8_Header[i];
+            u8_Sum += u8_Header[i];
+        }
+        for (uint16_t i=0; i<u16_BodyLen; i++)
+        {
+            u8_Out[P++] = u8_Body[i];
+            u8_Sum += u8_Body[i];
+        }
+        u8_Out[P++] = ~u8_Sum + 1;
+        u8_Out[P++] = PN532_POSTAMBLE;
+        return P;
+    }
+
+    // Decodes the length field that follows the start code 00 FF.
+    // u8_In points behind the start code, s32_Avail is the count of valid bytes there.
+    // pu16_Len receives the length (TFI + data), 0 for an ACK frame.
+    // Returns the size of the length field (2 normal / ACK, 5 extended),
+    // 0 if more bytes are needed or PN532_INVALID_FRAME (checksum error, NACK, length > 265).
+    static inline int DecodeLength(const uint8_t* u8_In, int s32_Avail, uint16_t* pu16_Len)
+    {
+        if (s32_Avail < 2)
+            return 0;
+
+        if (u8_In[0] == 0xFF && u8_In[1] == 0xFF) // extended frame
+        {
+            if (s32_Avail < 5)
+                return 0;
+            uint16_t u16_Len = (u8_In[2] << 8) | u8_In[3];
+            if ((uint8_t)(u8_In[2] + u8_In[3] + u8_In[4]) != 0 || u16_Len > PN532_EXTENDED_FRAME_LEN)
+                return PN532_INVALID_FRAME;
+
+            *pu16_Len = u16_Len;
+            return 5;
+        }
+
+        if (u8_In[0] == 0x00 && u8_In[1] == 0xFF) // ACK frame
+        {
+            *pu16_Len = 0;
+            return 2;
+        }
+        // A NACK (FF 00) fails the checksum as well
+        if ((uint8_t)(u8_In[0] + u8_In[1]) != 0)
+            return PN532_INVALID_FRAME;
+
+        *pu16_Len = u8_In[0];
+        return 2;
+    }
+};
+
 class PN532Interface
 {
 public:
@@ -41,7 +148,7 @@ public:
     * @return   0       success
     *           not 0   failed
     */
-    virtual int8_t writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint8_t blen = 0) = 0;
+    virtual int8_t writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0) = 0;
 
     /**
     * @brief    read the response of a command, strip prefix and suffix
@@ -51,17 +158,67 @@ public:
     * @return   >=0     length of response without prefix and suffix
     *           <0      failed to read response
     */
-    virtual int16_t readResponse(uint8_t command, uint8_t buf[], uint8_t len, uint16_t timeout = 1000) = 0;
+    virtual int16_t readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout = 1000) = 0;
+
+    /**
+    * @brief    called after the host has generated a random (RndA of the authentication)
+    *           A transport that records or replays the communication (PN532_LOG) stores or replaces it.
+    * @param    buf     the random
+    * @param    len     length of the random
+    */
+    virtual void onRandom(uint8_t *buf, int len)
+    {
+        (void)buf;
+        (void)len;
+    }
+
+    /**
+    * @brief    wait until the PN532 pulls its IRQ line low (ACK or response ready)
+    *           The default implementation has no IRQ line and the caller polls the status byte.
+    * @param    timeout max time to wait in ms, 0 means no timeout
+    * @return   1       the IRQ line is asserted
+    *           0       timeout
+    *           -1      no IRQ line available
+    */
+    virtual int8_t waitIrq(uint16_t timeout)
+    {
+        (void)timeout;
+        return -1;
+    }
 
 #if PROTOCOL == PROT_HSU
-    virtual int16_t readResponse(uint8_t buf[], uint8_t len, uint16_t timeout = 1000) = 0;
-    virtual int8_t receive(uint8_t *buf, int len, uint16_t timeout);
+    virtual int16_t readResponse(uint8_t buf[], uint16_t len, uint16_t timeout = 1000) = 0;
+    virtual int16_t receive(uint8_t *buf, int len, uint16_t timeout) = 0;
+
+    /**
+    * @brief    write a command frame without waiting for the ACK (used by PN532_Async)
+    *           The default implementation calls writeCommand() which waits for the ACK.
+    * @return   0       sent, the ACK must be read with receiveAvailable()
+    *           1       sent and the ACK has already been read
+    *           <0      failed
+    */
+    virtual int8_t sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0)
+    {
+        int8_t s8_Result = writeCommand(header, hlen, body, blen);
+        return s8_Result == 0 ? 1 : s8_Result;
+    }
+
+    /**
+    * @brief    read the bytes that have already been received without waiting for more (used by PN532_Async)
+    *           The default implementation waits up to 1 ms.
+    * @return   count of bytes copied to buf, 0 if nothing has been received
+    */
+    virtual int16_t receiveAvailable(uint8_t *buf, int len)
+    {
+        int16_t s16_Count = receive(buf, len, 1);
+        return s16_Count > 0 ? s16_Count : 0;
+    }
 #else
-    virtual uint8_t RequestFrom(uint8_t u8_Quantity);
-    virtual int Read();
-    virtual void BeginTransmission(uint8_t u8_Address);
-    virtual void Write(uint8_t u8_Data);
-    virtual void EndTransmission();
+    virtual uint16_t RequestFrom(uint16_t u16_Quantity) = 0;
+    virtual int Read() = 0;
+    virtual void BeginTransmission(uint8_t u8_Address) = 0;
+    virtual void Write(uint8_t u8_Data) = 0;
+    virtual void EndTransmission() = 0;
 #endif
 };
 
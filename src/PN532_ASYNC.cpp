@@ -0,0 +1,313 @@
+/**************************************************************************
+
+    PN532_Async: non-blocking command engine for firmware and host builds
+    See PN532_ASYNC.h
+
+**************************************************************************/
+
+#include "PN532_ASYNC.h"
+
+#define ASYNC_I2C_ADDRESS  (0x48 >> 1)
+#define ASYNC_I2C_READY    0x01
+
+// return values of ParseFrame()
+#define FRAME_Incomplete   0
+#define FRAME_Ack          1
+#define FRAME_Data         2
+#define FRAME_Invalid      3
+
+static const byte ASYNC_ACK[] = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+
+PN532_Async::PN532_Async(PN532Interface& i_Interface)
+{
+    mpi_Interface = &i_Interface;
+    me_State      = ASYNC_Idle;
+    mu8_Command   = 0;
+    ms16_Result   = 0;
+    mu16_Timeout  = 0;
+    mu32_Start    = 0;
+    mu32_Polls    = 0;
+    mf_Callback   = NULL;
+    mp_Context    = NULL;
+    ms32_FrameLen = 0;
+    ms32_Data     = 0;
+}
+
+bool PN532_Async::Submit(const byte* u8_Cmd, byte u8_CmdLen, uint16_t u16_Timeout, AsyncCallback f_Callback, void* p_Context)
+{
+    if (IsBusy() || u8_CmdLen == 0)
+        return false;
+
+    mu8_Command   = u8_Cmd[0];
+    mu16_Timeout  = u16_Timeout;
+    mf_Callback   = f_Callback;
+    mp_Context    = p_Context;
+    mu32_Polls    = 0;
+    ms16_Result   = 0;
+    ms32_FrameLen = 0;
+    ms32_Data     = 0;
+    mu32_Start    = millis();
+
+#if PROTOCOL == PROT_HSU
+    int8_t s8_Result = mpi_Interface->sendCommand(u8_Cmd, u8_CmdLen);
+    if (s8_Result < 0)
+    {
+        me_State    = ASYNC_Error;
+        ms16_Result = s8_Result;
+        return false;
+    }
+    // The default sendCommand() of the interface has already read the ACK
+    me_State = (s8_Result == 1) ? ASYNC_Acked : ASYNC_Sent;
+#else
+    byte u8_Frame[255 + PN532_FRAME_OVERHEAD]; // u8_CmdLen is at most 255
+    int  s32_Frame = PN532Frame::Encode(u8_Frame, u8_Cmd, u8_CmdLen, NULL, 0);
+
+    mpi_Interface->BeginTransmission(ASYNC_I2C_ADDRESS);
+    for (int i=0; i<s32_Frame; i++)
+    {
+        mpi_Interface->Write(u8_Frame[i]);
+    }
+    mpi_Interface->EndTransmission();
+
+    me_State = ASYNC_Sent;
+#endif
+    return true;
+}
+
+eAsyncState PN532_Async::Poll()
+{
+    if (!IsBusy())
+        return me_State;
+
+    mu32_Polls ++;
+
+#if PROTOCOL == PROT_HSU
+    if (!ReceiveHsu())
+        return me_State;
+#else
+    if (me_State == ASYNC_Sent)
+    {
+        if (!IsReady())
+        {
+            if (CheckTimeout(PN532_ACK_WAIT_TIME)) Finish(PN532_TIMEOUT);
+            return me_State;
+        }
+
+        // Read the ready byte + 6 bytes. Never more: the PN532 drops the first response byte in SPI mode otherwise.
+        byte u8_Ack[sizeof(ASYNC_ACK)];
+        mpi_Interface->RequestFrom(sizeof(ASYNC_ACK) + 1);
+        mpi_Interface->Read();
+        for (int i=0; i<(int)sizeof(ASYNC_ACK); i++)
+        {
+            u8_Ack[i] = mpi_Interface->Read();
+        }
+        if (memcmp(u8_Ack, ASYNC_ACK, sizeof(ASYNC_ACK)) != 0)
+        {
+            Finish(PN532_INVALID_ACK);
+            return me_State;
+        }
+
+        me_State   = ASYNC_Acked;
+        mu32_Start = millis();
+        return me_State; // the chip needs at least some hundred microseconds for the command
+    }
+
+    if (me_State == ASYNC_Acked)
+    {
+        if (!IsReady())
+        {
+            if (CheckTimeout(mu16_Timeout)) Finish(PN532_TIMEOUT);
+            return me_State;
+        }
+        me_State = ASYNC_Ready;
+    }
+
+    // ASYNC_Ready: the ready byte and the entire frame in one transfer, the chip pads with zeroes behind the postamble.
+    mpi_Interface->RequestFrom(PN532_ASYNC_FRAME_SIZE + 1);
+    mpi_Interface->Read(); // ready byte
+    for (int i=0; i<PN532_ASYNC_FRAME_SIZE; i++)
+    {
+        mu8_Frame[i] = mpi_Interface->Read();
+    }
+    ms32_FrameLen = PN532_ASYNC_FRAME_SIZE;
+#endif
+
+    int s32_End;
+    switch (ParseFrame(&s32_End))
+    {
+        case FRAME_Data:
+            Finish(ms16_Result);
+            break;
+        case FRAME_Incomplete:
+            Finish(PN532_NO_SPACE); // I2C / SPI: the frame is longer than PN532_ASYNC_FRAME_SIZE
+            break;
+        default:
+            Finish(PN532_INVALID_FRAME);
+            break;
+    }
+    return me_State;
+}
+
+#if PROTOCOL == PROT_HSU
+// Appends the received bytes to mu8_Frame and removes the ACK frame.
+// Returns true if a response frame is complete (or invalid) and must be parsed.
+bool PN532_Async::ReceiveHsu()
+{
+    int16_t s16_Count = mpi_Interface->receiveAvailable(mu8_Frame + ms32_FrameLen, sizeof(mu8_Frame) - ms32_FrameLen);
+    if (s16_Count > 0)
+        ms32_FrameLen += s16_Count;
+
+    int s32_End;
+    int s32_Frame = ParseFrame(&s32_End);
+
+    if (me_State == ASYNC_Sent)
+    {
+        if (s32_Frame == FRAME_Incomplete)
+        {
+            if (CheckTimeout(PN532_ACK_WAIT_TIME)) Finish(PN532_TIMEOUT);
+            return false;
+        }
+        if (s32_Frame != FRAME_Ack)
+        {
+            Finish(PN532_INVALID_ACK);
+            return false;
+        }
+
+        // The response may have been received in the same chunk as the ACK
+        ms32_FrameLen -= s32_End;
+        memmove(mu8_Frame, mu8_Frame + s32_End, ms32_FrameLen);
+        me_State   = ASYNC_Acked;
+        mu32_Start = millis();
+        s32_Frame  = ParseFrame(&s32_End);
+    }
+
+    if (s32_Frame == FRAME_Incomplete)
+    {
+        if (ms32_FrameLen >= (int)sizeof(mu8_Frame))
+            Finish(PN532_NO_SPACE);
+        else if (CheckTimeout(mu16_Timeout))
+            Finish(PN532_TIMEOUT);
+        return false;
+    }
+
+    me_State = ASYNC_Ready;
+    return true;
+}
+#else
+// PN532 Manual chapter 6.2.4: the status byte is 0x01 when the ACK or the response is ready
+bool PN532_Async::IsReady()
+{
+    mpi_Interface->RequestFrom(1);
+    return mpi_Interface->Read() == ASYNC_I2C_READY;
+}
+#endif
+
+// Searches mu8_Frame for the first frame (any leading bytes are skipped).
+// Normal and extended information frames are accepted.
+// ps32_End receives the index behind the frame.
+// FRAME_Data: the response data starts at ms32_Data and ms16_Result is its length.
+int PN532_Async::ParseFrame(int* ps32_End)
+{
+    int P = 0;
+    while (P + 1 < ms32_FrameLen && !(mu8_Frame[P] == PN532_STARTCODE1 && mu8_Frame[P+1] == PN532_STARTCODE2))
+    {
+        P++;
+    }
+    if (P + 2 > ms32_FrameLen)
+        return FRAME_Incomplete;
+
+    uint16_t u16_Length;
+    int s32_Field = PN532Frame::DecodeLength(mu8_Frame + P + 2, ms32_FrameLen - P - 2, &u16_Length);
+    if (s32_Field == 0)
+        return FRAME_Incomplete;
+    if (s32_Field < 0)
+        return FRAME_Invalid; // NACK or corrupt length
+    if (u16_Length == 0)
+    {
+        *ps32_End = min(P + 5, ms32_FrameLen); // 00 FF 00 FF + postamble
+        return FRAME_Ack;
+    }
+    if (u16_Length < 2)
+        return FRAME_Invalid; // error frame (7F)
+
+    // start code + length field + data + data checksum (the postamble is optional)
+    int s32_Start = P + 2 + s32_Field;
+    if (s32_Start + u16_Length + 1 > ms32_FrameLen)
+        return FRAME_Incomplete;
+
+    const byte* u8_Data = mu8_Frame + s32_Start;
+    if (u8_Data[0] != PN532_PN532TOHOST || u8_Data[1] != (byte)(mu8_Command + 1))
+        return FRAME_Invalid;
+
+    byte u8_Sum = 0;
+    for (int i=0; i<=u16_Length; i++) // including the data checksum
+    {
+        u8_Sum += u8_Data[i];
+    }
+    if (u8_Sum != 0)
+        return FRAME_Invalid;
+
+    *ps32_End   = s32_Start + u16_Length + 1;
+    ms32_Data   = s32_Start + 2;
+    ms16_Result = u16_Length - 2;
+    return FRAME_Data;
+}
+
+bool PN532_Async::CheckTimeout(uint32_t u32_Timeout)
+{
+    return u32_Timeout > 0 && (millis() - mu32_Start) > u32_Timeout;
+}
+
+void PN532_Async::Finish(int16_t s16_Result)
+{
+    ms16_Result = s16_Result;
+    me_State    = (s16_Result >= 0) ? ASYNC_Done : ASYNC_Error;
+
+    if (mf_Callback)
+        mf_Callback(mp_Context, mu8_Command, ms16_Result, GetResponse());
+}
+
+void PN532_Async::Abort()
+{
+    if (!IsBusy())
+        return;
+
+#if PROTOCOL != PROT_HSU
+    // PN532 Manual chapter 6.2.1.3: an ACK frame sent by the host aborts the current command
+    mpi_Interface->BeginTransmission(ASYNC_I2C_ADDRESS);
+    for (int i=0; i<(int)sizeof(ASYNC_ACK); i++)
+    {
+        mpi_Interface->Write(ASYNC_ACK[i]);
+    }
+    mpi_Interface->EndTransmission();
+#endif
+    // HSU: the transport discards the late response before it sends the next command
+    me_State      = ASYNC_Idle;
+    ms16_Result   = PN532_TIMEOUT;
+    ms32_FrameLen = 0;
+}
+
+bool PN532_Async::IsBusy()
+{
+    return me_State == ASYNC_Sent || me_State == ASYNC_Acked || me_State == ASYNC_Ready;
+}
+
+eAsyncState PN532_Async::GetState()
+{
+    return me_State;
+}
+
+int16_t PN532_Async::GetResult()
+{
+    return ms16_Result;
+}
+
+const byte* PN532_Async::GetResponse()
+{
+    return mu8_Frame + ms32_Data;
+}
+
+uint32_t PN532_Async::GetPollCount()
+{
+    return mu32_Polls;
+}
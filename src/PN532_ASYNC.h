@@ -0,0 +1,110 @@
+/**************************************************************************
+
+    PN532_Async: non-blocking command engine on top of PN532Interface
+
+    All commands of the PN532 class block: writeCommand() waits for the
+    ACK, readResponse() waits until the chip has finished the command,
+    which takes milliseconds for RF commands. A firmware that must serve
+    other tasks meanwhile (display, network, a second reader) can instead
+    submit a command here and call Poll() from its main loop.
+
+    Poll() never waits. Every call checks the chip once and advances the
+    state machine as far as possible:
+
+    ASYNC_Sent   the command frame has been written, waiting for the ACK
+    ASYNC_Acked  the ACK has been received, the chip executes the command
+    ASYNC_Ready  the chip has the response ready (I2C / SPI: status byte)
+    ASYNC_Done   the response frame has been read and validated
+    ASYNC_Error  timeout, invalid ACK or invalid response frame
+
+    When the command has finished (Done or Error) the callback is called
+    once from Poll(). The response stays available with GetResponse()
+    until the next Submit().
+
+    I2C / SPI: the status byte is polled with RequestFrom(1) and the frame
+    is read with one RequestFrom() transfer. HSU: the transport must
+    implement sendCommand() and receiveAvailable() (PN532_HSU, PN532_TTY,
+    PN532_SIM, PN532_LOG) otherwise the default implementations block for
+    the ACK and up to 1 ms per Poll().
+
+    Only one command can be pending at a time (the PN532 executes one
+    command at a time). Do not call the blocking PN532 functions while a
+    command is pending, they use the same transport.
+
+**************************************************************************/
+
+#ifndef __PN532_ASYNC_H__
+#define __PN532_ASYNC_H__
+
+#include "PN532Interface.h"
+
+// The largest response frame that can be received (preamble ... postamble).
+// Extended frames need up to 275 bytes (PN532_EXTENDED_FRAME_LEN + PN532_FRAME_OVERHEAD - 1).
+#ifndef PN532_ASYNC_FRAME_SIZE
+    #define PN532_ASYNC_FRAME_SIZE   96
+#endif
+
+enum eAsyncState
+{
+    ASYNC_Idle = 0,
+    ASYNC_Sent,
+    ASYNC_Acked,
+    ASYNC_Ready,
+    ASYNC_Done,
+    ASYNC_Error,
+};
+
+// s16_Result = the length of u8_Data (the response data behind D5 xx) or a negative error (PN532_TIMEOUT, ...)
+typedef void (*AsyncCallback)(void* p_Context, byte u8_Command, int16_t s16_Result, const byte* u8_Data);
+
+class PN532_Async
+{
+public:
+    PN532_Async(PN532Interface& i_Interface);
+
+    // Sends a command (u8_Cmd[0] = the command code, followed by the parameters) without waiting for the ACK.
+    // u16_Timeout = the max time in ms that the chip may need for the response (after the ACK), 0 = no timeout.
+    // Returns false if another command is still pending or the frame could not be sent.
+    bool Submit(const byte* u8_Cmd, byte u8_CmdLen, uint16_t u16_Timeout = 1000,
+                AsyncCallback f_Callback = NULL, void* p_Context = NULL);
+
+    // Advances the pending command, never waits. Returns the new state.
+    eAsyncState Poll();
+    // Cancels the pending command. I2C / SPI: the PN532 aborts the command when it receives an ACK frame.
+    void Abort();
+
+    bool        IsBusy();
+    eAsyncState GetState();
+    // The length of the response data or a negative error (valid in ASYNC_Done and ASYNC_Error)
+    int16_t     GetResult();
+    // The response data behind D5 xx
+    const byte* GetResponse();
+    // The count of Poll() calls for the last command (how often the chip was not ready)
+    uint32_t    GetPollCount();
+
+private:
+    bool CheckTimeout(uint32_t u32_Timeout);
+    int  ParseFrame(int* ps32_End);
+    void Finish(int16_t s16_Result);
+#if PROTOCOL == PROT_HSU
+    bool ReceiveHsu();
+#else
+    bool IsReady();
+#endif
+
+    PN532Interface* mpi_Interface;
+    eAsyncState   me_State;
+    byte          mu8_Command;
+    int16_t       ms16_Result;
+    uint16_t      mu16_Timeout;
+    uint32_t      mu32_Start;     // millis() when the command was sent or acknowledged
+    uint32_t      mu32_Polls;
+    AsyncCallback mf_Callback;
+    void*         mp_Context;
+
+    byte          mu8_Frame[PN532_ASYNC_FRAME_SIZE + 1]; // I2C / SPI: ready byte + frame, HSU: received bytes
+    int           ms32_FrameLen;
+    int           ms32_Data;      // index of the response data in mu8_Frame
+};
+
+#endif
@@ -0,0 +1,109 @@
+/**************************************************************************
+
+    PN532_GpioIrq: the IRQ line of the PN532 on a Linux GPIO
+    See PN532_GPIO.h
+
+**************************************************************************/
+
+#include "PN532_GPIO.h"
+
+#if defined(PN532_HOST) && defined(__linux__)
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+PN532_GpioIrq::PN532_GpioIrq()
+{
+    ms32_Fd = -1;
+}
+
+PN532_GpioIrq::~PN532_GpioIrq()
+{
+    Close();
+}
+
+bool PN532_GpioIrq::Open(const char* s8_Chip, uint32_t u32_Line)
+{
+    Close();
+    int s32_Chip = open(s8_Chip, O_RDWR | O_CLOEXEC);
+    if (s32_Chip < 0)
+    {
+        Utils::Print("PN532_GpioIrq: Cannot open ");
+        Utils::Print(s8_Chip, LF);
+        return false;
+    }
+
+    struct gpioevent_request k_Request;
+    memset(&k_Request, 0, sizeof(k_Request));
+    k_Request.lineoffset  = u32_Line;
+    k_Request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    k_Request.eventflags  = GPIOEVENT_REQUEST_FALLING_EDGE;
+    strncpy(k_Request.consumer_label, "PN532 IRQ", sizeof(k_Request.consumer_label) - 1);
+
+    bool b_Ok = ioctl(s32_Chip, GPIO_GET_LINEEVENT_IOCTL, &k_Request) == 0;
+    close(s32_Chip); // the line event fd stays valid
+    if (!b_Ok)
+    {
+        Utils::Print("PN532_GpioIrq: Cannot request the line events\r\n");
+        return false;
+    }
+
+    ms32_Fd = k_Request.fd;
+    fcntl(ms32_Fd, F_SETFL, fcntl(ms32_Fd, F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+void PN532_GpioIrq::Close()
+{
+    if (ms32_Fd >= 0) close(ms32_Fd);
+    ms32_Fd = -1;
+}
+
+bool PN532_GpioIrq::IsOpen()
+{
+    return ms32_Fd >= 0;
+}
+
+bool PN532_GpioIrq::IsAsserted()
+{
+    struct gpiohandle_data k_Data;
+    memset(&k_Data, 0, sizeof(k_Data));
+    if (ioctl(ms32_Fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &k_Data) < 0)
+        return false;
+    return k_Data.values[0] == 0;
+}
+
+// Removes the edges of previous frames from the event queue
+void PN532_GpioIrq::DrainEvents()
+{
+    struct gpioevent_data k_Event;
+    while (read(ms32_Fd, &k_Event, sizeof(k_Event)) == sizeof(k_Event))
+    {
+    }
+}
+
+int8_t PN532_GpioIrq::Wait(uint16_t u16_Timeout)
+{
+    if (!IsOpen())
+        return -1;
+
+    // An edge that arrives after DrainEvents() is either seen by IsAsserted() or queued for poll()
+    DrainEvents();
+    if (IsAsserted())
+        return 1;
+
+    struct pollfd k_Poll;
+    k_Poll.fd     = ms32_Fd;
+    k_Poll.events = POLLIN | POLLPRI;
+    int s32_Res = poll(&k_Poll, 1, u16_Timeout ? (int)u16_Timeout : -1);
+    if (s32_Res <= 0)
+        return IsAsserted() ? 1 : 0;
+
+    DrainEvents();
+    return 1;
+}
+
+#endif // PN532_HOST && __linux__
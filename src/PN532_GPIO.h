@@ -0,0 +1,45 @@
+/**************************************************************************
+
+    PN532_GpioIrq: the IRQ line of the PN532 on a Linux GPIO (/dev/gpiochipN)
+
+    The PN532 pulls P70_IRQ low when an ACK or a response is ready and
+    releases it when the host has read the frame. PN532_GpioIrq requests
+    falling edge events from the GPIO character device and sleeps in poll()
+    until the edge arrives. The PN532 latency then follows the chip instead
+    of the interval of the status byte polling.
+
+    Used by PN532_I2CDEV and PN532_SPIDEV (SetIrq()).
+    Only available in the host build (PN532_HOST) on Linux.
+
+**************************************************************************/
+
+#ifndef __PN532_GPIO_H__
+#define __PN532_GPIO_H__
+
+#if defined(PN532_HOST) && defined(__linux__)
+
+#include "Utils.h"
+
+class PN532_GpioIrq
+{
+public:
+    PN532_GpioIrq();
+    ~PN532_GpioIrq();
+
+    // s8_Chip = "/dev/gpiochip0", u32_Line = the line offset on this chip (e.g. BCM GPIO number on a Raspberry Pi)
+    bool   Open(const char* s8_Chip, uint32_t u32_Line);
+    void   Close();
+    bool   IsOpen();
+    // true while the PN532 pulls the line low
+    bool   IsAsserted();
+    // Waits until the line is low. Returns 1 = asserted, 0 = timeout (ms, 0 = no timeout), -1 = not open
+    int8_t Wait(uint16_t u16_Timeout);
+
+private:
+    void   DrainEvents();
+
+    int ms32_Fd; // line event file descriptor
+};
+
+#endif // PN532_HOST && __linux__
+#endif
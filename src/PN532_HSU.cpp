@@ -17,8 +17,8 @@ void PN532_HSU::write(uint8_t data) {
     DMSG_HEX(data);
 }
 
-void PN532_HSU::write(const uint8_t *data, uint8_t len) {
-    for (uint8_t i = 0; i < len; i++) write(data[i]);
+void PN532_HSU::write(const uint8_t *data, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) write(data[i]);
 }
 
 void PN532_HSU::begin() {
@@ -43,7 +43,13 @@ void PN532_HSU::wakeup() {
     DMSG("\n");
 }
 
-int8_t PN532_HSU::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint8_t blen) {
+int8_t PN532_HSU::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen) {
+    sendCommand(header, hlen, body, blen);
+    return readAckFrame();
+}
+
+// Writes the frame without waiting for the ACK
+int8_t PN532_HSU::sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen) {
     if (_serial->available()) DMSG("Dump serial buffer: ");
 
     while (_serial->available()) {
@@ -52,16 +58,13 @@ int8_t PN532_HSU::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_
     }
 
     command = header[0];
-    uint8_t length = hlen + blen + 1; // length of data field: TFI + DATA
+    uint8_t head[8];
+    int headlen = PN532Frame::EncodeHead(head, hlen + blen + 1); // length of data field: TFI + DATA
     uint8_t sum = PN532_HOSTTOPN532; // sum of TFI + DATA
 
     DMSG("Sending: ");
 
-    write(uint8_t(PN532_PREAMBLE));
-    write(uint8_t(PN532_STARTCODE1));
-    write(uint8_t(PN532_STARTCODE2));
-    write(length);
-    write(~length + 1); // checksum of length
+    write(head, headlen); // preamble, start code, length (normal or extended frame)
     write(PN532_HOSTTOPN532);
     DMSG(", H:");
     write(header, hlen);
@@ -72,7 +75,7 @@ int8_t PN532_HSU::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_
         sum += header[i];
     }
 
-    for (uint8_t i = 0; i < blen; i++) {
+    for (uint16_t i = 0; i < blen; i++) {
         sum += body[i];
     }
 
@@ -81,14 +84,23 @@ int8_t PN532_HSU::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_
     write(uint8_t(PN532_POSTAMBLE));
 
     DMSG("\n");
-    return readAckFrame();
+    return 0;
 }
 
-int16_t PN532_HSU::readResponse(uint8_t command, uint8_t buf[], uint8_t len, uint16_t timeout) {
+// Returns the bytes in the receive buffer of the UART, never waits
+int16_t PN532_HSU::receiveAvailable(uint8_t *buf, int len) {
+    int count = 0;
+    while (count < len && _serial->available()) {
+        buf[count++] = (uint8_t) _serial->read();
+    }
+    return count;
+}
+
+int16_t PN532_HSU::readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout) {
     return readResponse(buf, len, timeout);
 }
 
-int16_t PN532_HSU::readResponse(uint8_t buf[], uint8_t len, uint16_t timeout) {
+int16_t PN532_HSU::readResponse(uint8_t buf[], uint16_t len, uint16_t timeout) {
     uint8_t tmp[3];
     DMSG("Read:  ");
 
@@ -102,18 +114,23 @@ int16_t PN532_HSU::readResponse(uint8_t buf[], uint8_t len, uint16_t timeout) {
         return PN532_INVALID_FRAME;
     }
 
-    /** receive length and check */
-    uint8_t length[2];
-    if (receive(length, 2, timeout) <= 0) {
+    /** receive length and check (extended frame: FF FF LENM LENL LCS) */
+    uint8_t lenfield[5];
+    if (receive(lenfield, 2, timeout) <= 0) {
+        DMSG("Timeout 2");
+        return PN532_TIMEOUT;
+    }
+    if (lenfield[0] == 0xFF && lenfield[1] == 0xFF && receive(lenfield + 2, 3, timeout) <= 0) {
         DMSG("Timeout 2");
         return PN532_TIMEOUT;
     }
-    if (0 != (uint8_t)(length[0] + length[1])) {
+    uint16_t length;
+    if (PN532Frame::DecodeLength(lenfield, sizeof(lenfield), &length) <= 0 || length < 2) {
         DMSG("Length error");
         return PN532_INVALID_FRAME;
     }
-    length[0] -= 2;
-    if (length[0] > len) {
+    length -= 2;
+    if (length + 2 > len) { // the data is stored from buf[2]
         DMSG("No space error");
         return PN532_NO_SPACE;
     }
@@ -129,13 +146,13 @@ int16_t PN532_HSU::readResponse(uint8_t buf[], uint8_t len, uint16_t timeout) {
         return PN532_INVALID_FRAME;
     }
 
-    if (receive(buf+2, length[0], timeout) != length[0]) {
+    if (receive(buf+2, length, timeout) != length) {
         DMSG("Timeout 4");
         return PN532_TIMEOUT;
     }
     uint8_t sum = PN532_PN532TOHOST + cmd;
     int offset = 2;
-    for (uint8_t i = 0 + offset; i < length[0] + offset; i++) {
+    for (uint16_t i = 0 + offset; i < length + offset; i++) {
         sum += buf[i];
     }
 
@@ -150,7 +167,7 @@ int16_t PN532_HSU::readResponse(uint8_t buf[], uint8_t len, uint16_t timeout) {
         return PN532_INVALID_FRAME;
     }
 
-    return length[0];
+    return length;
 }
 
 int8_t PN532_HSU::readAckFrame() {
@@ -178,7 +195,7 @@ int8_t PN532_HSU::readAckFrame() {
            timeout --> time of reveiving
     @retval number of received bytes, 0 means no data received.
 */
-int8_t PN532_HSU::receive(uint8_t *buf, int len, uint16_t timeout) {
+int16_t PN532_HSU::receive(uint8_t *buf, int len, uint16_t timeout) {
     int read_bytes = 0;
     int ret;
     unsigned long start_millis;
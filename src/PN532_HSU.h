@@ -16,9 +16,11 @@ public:
 
     void begin();
     void wakeup();
-    virtual int8_t writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint8_t blen = 0);
-    int16_t readResponse(uint8_t buf[], uint8_t len, uint16_t timeout);
-    int16_t readResponse(uint8_t command, uint8_t buf[], uint8_t len, uint16_t timeout);
+    virtual int8_t writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t readResponse(uint8_t buf[], uint16_t len, uint16_t timeout);
+    int16_t readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout);
+    int8_t sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t receiveAvailable(uint8_t *buf, int len);
 
     /*
     virtual uint8_t RequestFrom(uint8_t u8_Quantity);
@@ -35,9 +37,9 @@ private:
     int8_t rx_pin;
 
     void write(uint8_t data);
-    void write(const uint8_t *data, uint8_t len);
+    void write(const uint8_t *data, uint16_t len);
     int8_t readAckFrame();
-    int8_t receive(uint8_t *buf, int len, uint16_t timeout = PN532_HSU_READ_TIMEOUT);
+    int16_t receive(uint8_t *buf, int len, uint16_t timeout = PN532_HSU_READ_TIMEOUT);
 };
 
 #endif
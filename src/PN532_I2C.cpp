@@ -5,26 +5,45 @@
 #include "PN532_I2C.h"
 #include <PN532_debug.h>
 #include "Arduino.h"
+#include "PN532_TRACE.h"
 
 #define PN532_I2C_ADDRESS (0x48 >> 1)
 
-PN532_I2C::PN532_I2C(TwoWire &wire)
+PN532_I2C::PN532_I2C(TwoWire &wire, int8_t irq)
 {
     _wire = &wire;
+    _irq = irq;
     command_x = 0;
+    ResetBusStats();
 }
 
 void PN532_I2C::begin()
 {
     _wire->begin(21,22);
+    if (_irq >= 0) pinMode(_irq, INPUT_PULLUP);
+}
+
+// The PN532 pulls P70_IRQ low while an ACK or a response is ready.
+// Waiting for the pin needs no bus traffic and returns as soon as the chip is ready (no delay(1) granularity).
+int8_t PN532_I2C::waitIrq(uint16_t timeout) {
+    if (_irq < 0) return -1;
+
+    uint32_t start = millis();
+    while (digitalRead(_irq) != LOW) {
+        if ((0 != timeout) && (millis() - start > timeout)) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 void PN532_I2C::wakeup() {
     delay(500); // wait for all ready to manipulate pn532
 }
 
-uint8_t PN532_I2C::RequestFrom(uint8_t u8_Quantity) {
-    return _wire->requestFrom((uint8_t) PN532_I2C_ADDRESS, u8_Quantity);
+uint16_t PN532_I2C::RequestFrom(uint16_t u16_Quantity) {
+    countBus(u16_Quantity);
+    return _wire->requestFrom((int) PN532_I2C_ADDRESS, (int) u16_Quantity);
 }
 
 // Read one uint8_t from the buffer that has been read when calling RequestFrom()
@@ -35,28 +54,31 @@ int PN532_I2C::Read() {
 
 void PN532_I2C::BeginTransmission(uint8_t u8_Address) {
     Wire.beginTransmission(u8_Address);
+    countBus(0);
 }
 
 void PN532_I2C::Write(uint8_t u8_Data) {
     Wire.write(u8_Data);
+    stats.u32_BusBytes++;
 }
 
 void PN532_I2C::EndTransmission() {
     Wire.endTransmission();
 }
 
-int8_t PN532_I2C::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint8_t blen) {
+int8_t PN532_I2C::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen) {
     command_x = header[0];
-    _wire->beginTransmission(PN532_I2C_ADDRESS);
+    stats.u32_Commands++;
 
-    Serial.print(String("Sending: "));
-    write(PN532_PREAMBLE);
-    write(PN532_STARTCODE1);
-    write(PN532_STARTCODE2);
+    uint8_t head[8];
+    uint8_t headlen = PN532Frame::EncodeHead(head, hlen + blen + 1); // length of data field: TFI + DATA
+    countBus(headlen + hlen + blen + 3);
+    _wire->beginTransmission(PN532_I2C_ADDRESS);
 
-    uint8_t length = hlen + blen + 1; // length of data field: TFI + DATA
-    write(length);
-    write(~length + 1); // checksum of length
+    TRACE_INFO(TRC_Send, command_x, hlen + blen, 0, header, hlen);
+    for (uint8_t i = 0; i < headlen; i++) {
+        write(head[i]); // preamble, start code, length (normal or extended frame)
+    }
 
     write(PN532_HOSTTOPN532);
     uint8_t sum = PN532_HOSTTOPN532; // sum of TFI + DATA
@@ -68,17 +90,19 @@ int8_t PN532_I2C::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_
         }
         else {
             DMSG("\nToo many data to send, I2C doesn't support such a big packet\n"); // I2C max packet: 32 bytes
+            TRACE_ERROR(command_x, TRE_WriteCommand, PN532_INVALID_FRAME);
             return PN532_INVALID_FRAME;
         }
     }
 
-    for (uint8_t i = 0; i < blen; i++) {
+    for (uint16_t i = 0; i < blen; i++) {
         if (write(body[i])) {
             sum += body[i];
             DMSG_HEX(body[i]);
         }
         else {
             DMSG("\nToo many data to send, I2C doesn't support such a big packet\n"); // I2C max packet: 32 bytes
+            TRACE_ERROR(command_x, TRE_WriteCommand, PN532_INVALID_FRAME);
             return PN532_INVALID_FRAME;
         }
     }
@@ -93,16 +117,23 @@ int8_t PN532_I2C::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_
     return readAckFrame();
 }
 
-int16_t PN532_I2C::getResponseLength(uint8_t buf[], uint8_t len, uint16_t timeout) {
+// [RDY] 00 00 FF LEN LCS or [RDY] 00 00 FF FF FF LENM LENL LCS (extended frame)
+int16_t PN532_I2C::getResponseLength(uint8_t buf[], uint16_t len, uint16_t timeout) {
     const uint8_t PN532_NACK[] = {0, 0, 0xFF, 0xFF, 0, 0};
     uint16_t time = 0;
 
+    if (0 == waitIrq(timeout)) {
+        return -1;
+    }
+
     do {
-        if (_wire->requestFrom(PN532_I2C_ADDRESS, 6)) {
+        countBus(9);
+        if (_wire->requestFrom(PN532_I2C_ADDRESS, 9)) {
             if (read() & 1) {          // check first uint8_t --- status
                 break; // PN532 is ready
             }
         }
+        stats.u32_ReadyPolls++;
 
         delay(1);
         time++;
@@ -120,9 +151,17 @@ int16_t PN532_I2C::getResponseLength(uint8_t buf[], uint8_t len, uint16_t timeou
         return PN532_INVALID_FRAME;
     }
 
-    uint8_t length = read();
+    uint8_t lenfield[5];
+    for (uint8_t i = 0; i < sizeof(lenfield); i++) {
+        lenfield[i] = read();
+    }
+    uint16_t length;
+    if (PN532Frame::DecodeLength(lenfield, sizeof(lenfield), &length) <= 0) {
+        return PN532_INVALID_FRAME;
+    }
 
     // request for last respond msg again
+    countBus(sizeof(PN532_NACK));
     _wire->beginTransmission(PN532_I2C_ADDRESS);
     for (uint16_t i = 0; i < sizeof(PN532_NACK); ++i)
     {
@@ -133,20 +172,27 @@ int16_t PN532_I2C::getResponseLength(uint8_t buf[], uint8_t len, uint16_t timeou
     return length;
 }
 
-int16_t PN532_I2C::readResponse(uint8_t command, uint8_t buf[], uint8_t len, uint16_t timeout) {
+int16_t PN532_I2C::readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout) {
     uint16_t time = 0;
-    uint8_t length;
     DMSG("readResponse");
 
-    length = getResponseLength(buf, len, timeout);
+    int16_t result = getResponseLength(buf, len, timeout);
+    if (result < 0) {
+        return result;
+    }
+    uint16_t length = result;
 
     // [RDY] 00 00 FF LEN LCS (TFI PD0 ... PDn) DCS 00
+    // [RDY] 00 00 FF FF FF LENM LENL LCS (TFI PD0 ... PDn) DCS 00
+    uint8_t headlen = (length > PN532_NORMAL_FRAME_LEN) ? 8 : 5;
     do {
-        if (_wire->requestFrom(PN532_I2C_ADDRESS, 6 + length + 2)) {
+        countBus(1 + headlen + length + 2);
+        if (_wire->requestFrom((int) PN532_I2C_ADDRESS, (int) (1 + headlen + length + 2))) {
             if (read() & 1) {          // check first uint8_t --- status
                 break; // PN532 is ready
             }
         }
+        stats.u32_ReadyPolls++;
 
         delay(1);
         time++;
@@ -163,9 +209,11 @@ int16_t PN532_I2C::readResponse(uint8_t command, uint8_t buf[], uint8_t len, uin
         return PN532_INVALID_FRAME;
     }
 
-    length = read();
-
-    if (0 != (uint8_t)(length + read())) { // checksum of length
+    uint8_t lenfield[5];
+    for (uint8_t i = 0; i < headlen - 3; i++) {
+        lenfield[i] = read();
+    }
+    if (PN532Frame::DecodeLength(lenfield, headlen - 3, &length) <= 0) { // checksum of length
         DMSG("2 PN532_INVALID_FRAME");
         return PN532_INVALID_FRAME;
     }
@@ -186,7 +234,7 @@ int16_t PN532_I2C::readResponse(uint8_t command, uint8_t buf[], uint8_t len, uin
     //DMSG_HEX(cmd);
 
     uint8_t sum = PN532_PN532TOHOST + cmd;
-    for (uint8_t i = 2; i < length; i++) {
+    for (uint16_t i = 2; i < length; i++) {
         buf[i] = read();
         sum += buf[i];
 
@@ -210,13 +258,20 @@ int8_t PN532_I2C::readAckFrame() {
 
     DMSG("Ack: ");
 
+    if (0 == waitIrq(PN532_ACK_WAIT_TIME)) {
+        DMSG("Time out when waiting for ACK\n");
+        return PN532_TIMEOUT;
+    }
+
     uint16_t time = 0;
     do {
+        countBus(sizeof(PN532_ACK) + 1);
         if (_wire->requestFrom(PN532_I2C_ADDRESS, sizeof(PN532_ACK) + 1)) {
             if (read() & 1) {          // check first uint8_t --- status
                 break; // PN532 is ready
             }
         }
+        stats.u32_ReadyPolls++;
 
         delay(1);
         time++;
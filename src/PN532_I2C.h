@@ -12,25 +12,39 @@
 
 class PN532_I2C : public PN532Interface {
 public:
-    PN532_I2C(TwoWire &wire);
+    // irq = the pin connected to P70_IRQ of the PN532 or -1 to poll the status byte
+    PN532_I2C(TwoWire &wire, int8_t irq = -1);
 
     void begin();
     void wakeup();
-    virtual int8_t writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint8_t blen = 0);
-    int16_t readResponse(uint8_t command, uint8_t buf[], uint8_t len, uint16_t timeout);
+    virtual int8_t writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout);
+    int8_t waitIrq(uint16_t timeout);
 
-    uint8_t RequestFrom(uint8_t u8_Quantity);
+    uint16_t RequestFrom(uint16_t u16_Quantity);
     int Read();
     void BeginTransmission(uint8_t u8_Address);
     void Write(uint8_t u8_Data);
     void EndTransmission();
 
+    // bus statistics, compare with PN532_I2CDEV
+    void GetBusStats(PN532BusStats* pk_Stats) { *pk_Stats = stats; }
+    void ResetBusStats() { memset(&stats, 0, sizeof(stats)); }
+
 private:
     TwoWire *_wire;
     uint8_t command_x;
+    int8_t _irq;
+    PN532BusStats stats;
+
+    // one transaction: the address byte + u16_Bytes
+    inline void countBus(uint16_t u16_Bytes) {
+        stats.u32_Transactions++;
+        stats.u32_BusBytes += 1 + u16_Bytes;
+    }
 
     int8_t readAckFrame();
-    int16_t getResponseLength(uint8_t buf[], uint8_t len, uint16_t timeout);
+    int16_t getResponseLength(uint8_t buf[], uint16_t len, uint16_t timeout);
 
     inline uint8_t write(uint8_t data)
     {
@@ -0,0 +1,284 @@
+/**************************************************************************
+
+    PN532_I2CDEV: I2C transport for Linux
+    See PN532_I2CDEV.h
+
+**************************************************************************/
+
+#include "PN532_I2CDEV.h"
+
+#if defined(PN532_HOST) && defined(__linux__) && PROTOCOL == PROT_I2C
+
+#include "PN532_debug.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+static const byte I2CDEV_ACK[]  = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+static const byte I2CDEV_NACK[] = {0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00};
+
+PN532_I2CDEV::PN532_I2CDEV(const char* s8_Device, uint8_t u8_Address)
+{
+    strncpy(ms8_Device, s8_Device, sizeof(ms8_Device) - 1);
+    ms8_Device[sizeof(ms8_Device) - 1] = 0;
+    mu8_Address   = u8_Address;
+    ms32_Fd       = -1;
+    mu8_Command   = 0;
+    ms32_ReadLen  = 0;
+    ms32_ReadPos  = 0;
+    ms32_WriteLen = 0;
+    mpi_Irq       = NULL;
+    ResetBusStats();
+}
+
+PN532_I2CDEV::~PN532_I2CDEV()
+{
+    if (ms32_Fd >= 0) close(ms32_Fd);
+}
+
+bool PN532_I2CDEV::IsOpen()
+{
+    return ms32_Fd >= 0;
+}
+
+void PN532_I2CDEV::GetBusStats(PN532BusStats* pk_Stats)
+{
+    *pk_Stats = mk_Stats;
+}
+
+void PN532_I2CDEV::ResetBusStats()
+{
+    memset(&mk_Stats, 0, sizeof(mk_Stats));
+}
+
+void PN532_I2CDEV::SetIrq(PN532_GpioIrq* pi_Irq)
+{
+    mpi_Irq = pi_Irq;
+}
+
+int8_t PN532_I2CDEV::waitIrq(uint16_t timeout)
+{
+    if (!mpi_Irq)
+        return -1;
+    return mpi_Irq->Wait(timeout);
+}
+
+void PN532_I2CDEV::begin()
+{
+    if (IsOpen())
+        return;
+
+    ms32_Fd = open(ms8_Device, O_RDWR | O_CLOEXEC);
+    if (ms32_Fd < 0)
+    {
+        Utils::Print("PN532_I2CDEV: Cannot open ");
+        Utils::Print(ms8_Device, LF);
+    }
+}
+
+void PN532_I2CDEV::wakeup()
+{
+    delay(500); // wait for all ready to manipulate pn532 (same as PN532_I2C)
+}
+
+// ---------------------------------------------------------------------------------------------
+
+// One I2C transaction: START, address, data, STOP
+bool PN532_I2CDEV::Transfer(bool b_Read, byte* u8_Data, int s32_Len)
+{
+    if (!IsOpen())
+        return false;
+
+    struct i2c_msg k_Msg;
+    k_Msg.addr  = mu8_Address;
+    k_Msg.flags = b_Read ? I2C_M_RD : 0;
+    k_Msg.len   = s32_Len;
+    k_Msg.buf   = u8_Data;
+
+    struct i2c_rdwr_ioctl_data k_Data;
+    k_Data.msgs  = &k_Msg;
+    k_Data.nmsgs = 1;
+
+    mk_Stats.u32_Transactions ++;
+    mk_Stats.u32_BusBytes += 1 + s32_Len;
+    return ioctl(ms32_Fd, I2C_RDWR, &k_Data) == 1;
+}
+
+// Waits for the IRQ line or polls the status byte until the PN532 is ready. u16_Timeout in ms, 0 waits forever.
+bool PN532_I2CDEV::WaitReady(uint16_t u16_Timeout)
+{
+    // With the IRQ line the status is read once after the edge (ready at the first attempt)
+    if (waitIrq(u16_Timeout) == 0)
+        return false;
+
+    uint32_t u32_Start = millis();
+    while (true)
+    {
+        byte u8_Status = 0;
+        if (Transfer(true, &u8_Status, 1) && (u8_Status & 1))
+            return true;
+
+        mk_Stats.u32_ReadyPolls ++;
+        if (u16_Timeout && millis() - u32_Start > u16_Timeout)
+            return false;
+        delayMicroseconds(PN532_I2CDEV_POLL_US);
+    }
+}
+
+int8_t PN532_I2CDEV::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    if (hlen + blen + 1 > PN532_EXTENDED_FRAME_LEN)
+        return PN532_NO_SPACE;
+
+    mu8_Command = header[0];
+    mk_Stats.u32_Commands ++;
+
+    byte u8_Frame[PN532_I2CDEV_IO_SIZE];
+    int  P = PN532Frame::Encode(u8_Frame, header, hlen, body, blen);
+
+    if (!Transfer(false, u8_Frame, P))
+        return PN532_TIMEOUT;
+
+    return readAckFrame();
+}
+
+int8_t PN532_I2CDEV::readAckFrame()
+{
+    if (!WaitReady(PN532_ACK_WAIT_TIME))
+    {
+        DMSG("Time out when waiting for ACK\n");
+        return PN532_TIMEOUT;
+    }
+
+    byte u8_Ack[1 + sizeof(I2CDEV_ACK)];
+    if (!Transfer(true, u8_Ack, sizeof(u8_Ack)))
+        return PN532_TIMEOUT;
+
+    if (memcmp(u8_Ack + 1, I2CDEV_ACK, sizeof(I2CDEV_ACK)) != 0)
+    {
+        DMSG("Invalid ACK\n");
+        return PN532_INVALID_ACK;
+    }
+    return 0;
+}
+
+// Same behaviour as PN532_HSU::readResponse(): the data behind D5 xx is stored at buf + 2 and its length returned.
+int16_t PN532_I2CDEV::readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout)
+{
+    // [RDY] 00 00 FF LEN LCS D5 CMD (data) DCS 00
+    // [RDY] 00 00 FF FF FF LENM LENL LCS D5 CMD (data) DCS 00  (extended frame, LEN > 255)
+    // Read the largest frame that fits into buf in one transaction. LEN includes D5 CMD.
+    int  s32_Head     = (len > PN532_NORMAL_FRAME_LEN) ? 8 : 5;
+    int  s32_ReadSize = min(1 + s32_Head + (int)len + 2, PN532_I2CDEV_IO_SIZE);
+    byte u8_Frame[PN532_I2CDEV_IO_SIZE];
+    for (int s32_Try=0; s32_Try<2; s32_Try++)
+    {
+        if (!WaitReady(timeout) || !Transfer(true, u8_Frame, s32_ReadSize))
+            return PN532_TIMEOUT;
+
+        // The preamble is optional: search the start code 00 FF
+        int P = 1;
+        if (u8_Frame[P] == PN532_PREAMBLE && u8_Frame[P + 1] == PN532_PREAMBLE) P++;
+        if (u8_Frame[P] != PN532_STARTCODE1 || u8_Frame[P + 1] != PN532_STARTCODE2)
+        {
+            DMSG("PN532_INVALID_FRAME");
+            return PN532_INVALID_FRAME;
+        }
+
+        uint16_t u16_Length;
+        int s32_Field = PN532Frame::DecodeLength(u8_Frame + P + 2, s32_ReadSize - P - 2, &u16_Length);
+        if (s32_Field <= 0)
+        {
+            DMSG("Invalid length checksum");
+            return PN532_INVALID_FRAME;
+        }
+        if (u16_Length < 2)
+            return PN532_INVALID_FRAME; // error frame
+
+        int s32_Start = P + 2 + s32_Field;
+        if (s32_Start + u16_Length + 1 > s32_ReadSize)
+        {
+            if (u16_Length > len)
+                return PN532_NO_SPACE;
+
+            // The frame was longer than expected: ask the PN532 to send it again (PN532 manual chapter 6.2.1.4)
+            memcpy(u8_Frame, I2CDEV_NACK, sizeof(I2CDEV_NACK));
+            Transfer(false, u8_Frame, sizeof(I2CDEV_NACK));
+            s32_ReadSize = min(s32_Start + u16_Length + 2, PN532_I2CDEV_IO_SIZE);
+            continue;
+        }
+
+        const byte* u8_Data = u8_Frame + s32_Start; // D5 CMD ...
+        byte u8_Sum = 0;
+        for (int i=0; i<=u16_Length; i++) // data + DCS
+        {
+            u8_Sum += u8_Data[i];
+        }
+        if (u8_Sum != 0)
+        {
+            DMSG("checksum is not ok\n");
+            return PN532_INVALID_FRAME;
+        }
+        if (u8_Data[0] != PN532_PN532TOHOST || u8_Data[1] != (byte)(command + 1))
+            return PN532_INVALID_FRAME;
+
+        if (u16_Length > len)
+            return PN532_NO_SPACE;
+
+        memcpy(buf, u8_Data, u16_Length);
+        return u16_Length - 2;
+    }
+    return PN532_INVALID_FRAME;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+uint16_t PN532_I2CDEV::RequestFrom(uint16_t u16_Quantity)
+{
+    ms32_ReadPos = 0;
+    ms32_ReadLen = 0;
+    u16_Quantity = min((int)u16_Quantity, PN532_I2CDEV_IO_SIZE);
+    if (!Transfer(true, mu8_ReadBuf, u16_Quantity))
+        return 0;
+
+    ms32_ReadLen = u16_Quantity;
+    if (u16_Quantity == 1 && !(mu8_ReadBuf[0] & 1))
+        mk_Stats.u32_ReadyPolls ++;
+    return u16_Quantity;
+}
+
+int PN532_I2CDEV::Read()
+{
+    if (ms32_ReadPos >= ms32_ReadLen)
+        return -1;
+    return mu8_ReadBuf[ms32_ReadPos++];
+}
+
+void PN532_I2CDEV::BeginTransmission(uint8_t u8_Address)
+{
+    (void)u8_Address; // always mu8_Address
+    ms32_WriteLen = 0;
+}
+
+void PN532_I2CDEV::Write(uint8_t u8_Data)
+{
+    if (ms32_WriteLen < PN532_I2CDEV_IO_SIZE)
+        mu8_WriteBuf[ms32_WriteLen++] = u8_Data;
+}
+
+void PN532_I2CDEV::EndTransmission()
+{
+    // PN532::SendPacket() writes a complete command frame (normal or extended)
+    int s32_Tfi = (ms32_WriteLen > 4 && mu8_WriteBuf[3] == 0xFF && mu8_WriteBuf[4] == 0xFF) ? 8 : 5;
+    if (ms32_WriteLen > s32_Tfi + 1 && mu8_WriteBuf[s32_Tfi] == PN532_HOSTTOPN532)
+    {
+        mu8_Command = mu8_WriteBuf[s32_Tfi + 1];
+        mk_Stats.u32_Commands ++;
+    }
+    Transfer(false, mu8_WriteBuf, ms32_WriteLen);
+    ms32_WriteLen = 0;
+}
+
+#endif // PN532_HOST && __linux__
@@ -0,0 +1,84 @@
+/**************************************************************************
+
+    PN532_I2CDEV: I2C transport for Linux (/dev/i2c-N)
+
+    PN532_I2C (Arduino Wire) reads every response twice: getResponseLength()
+    reads 6 bytes to get the length, sends a NACK frame to make the PN532
+    repeat the response and then reads the entire frame again.
+
+    A PN532 read transaction always starts with the status (ready) byte,
+    followed by the frame, and it consumes the frame. PN532_I2CDEV
+    therefore polls the status with 1 byte reads and then reads the ready
+    byte, the header and the payload in one I2C_RDWR message sized for the
+    largest response that fits into the caller's buffer. The PN532 pads
+    with zeroes behind the postamble. The NACK / re-read is only needed if
+    the response is larger than the caller's buffer.
+
+    Every bus transfer is a single I2C_RDWR ioctl (no I2C_SLAVE setup, no
+    separate read() / write() syscalls). GetBusStats() counts the
+    transactions and bus bytes, PN532_I2C counts the same for the Wire path.
+
+    Only available in the host build (PN532_HOST) on Linux with PROT_I2C.
+
+**************************************************************************/
+
+#ifndef __PN532_I2CDEV_H__
+#define __PN532_I2CDEV_H__
+
+#if defined(PN532_HOST) && defined(__linux__) && PROTOCOL == PROT_I2C
+
+#include "PN532Interface.h"
+#include "PN532_GPIO.h"
+
+#define PN532_I2CDEV_ADDRESS   (0x48 >> 1)
+#define PN532_I2CDEV_POLL_US   250   // interval of the status byte polling
+#define PN532_I2CDEV_IO_SIZE   (PN532_EXTENDED_FRAME_LEN + PN532_FRAME_OVERHEAD) // ready byte + the largest (extended) frame
+
+class PN532_I2CDEV : public PN532Interface
+{
+public:
+    // s8_Device = "/dev/i2c-1"
+    PN532_I2CDEV(const char* s8_Device, uint8_t u8_Address = PN532_I2CDEV_ADDRESS);
+    ~PN532_I2CDEV();
+
+    bool    IsOpen();
+    void    GetBusStats(PN532BusStats* pk_Stats);
+    void    ResetBusStats();
+    // Optional: wait for the IRQ line instead of polling the status (pi_Irq must be open)
+    void    SetIrq(PN532_GpioIrq* pi_Irq);
+
+    void    begin();
+    void    wakeup();
+    int8_t  writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout = 1000);
+    int8_t  waitIrq(uint16_t timeout);
+
+    // Low level access used by PN532::ReadPacket() and PN532::SendPacket()
+    uint16_t RequestFrom(uint16_t u16_Quantity);
+    int     Read();
+    void    BeginTransmission(uint8_t u8_Address);
+    void    Write(uint8_t u8_Data);
+    void    EndTransmission();
+
+private:
+    bool    Transfer(bool b_Read, byte* u8_Data, int s32_Len);
+    bool    WaitReady(uint16_t u16_Timeout);
+    int8_t  readAckFrame();
+
+    char     ms8_Device[64];
+    uint8_t  mu8_Address;
+    int      ms32_Fd;
+    byte     mu8_Command;
+
+    byte     mu8_ReadBuf[PN532_I2CDEV_IO_SIZE];  // RequestFrom() -> Read()
+    int      ms32_ReadLen;
+    int      ms32_ReadPos;
+    byte     mu8_WriteBuf[PN532_I2CDEV_IO_SIZE]; // BeginTransmission() -> EndTransmission()
+    int      ms32_WriteLen;
+
+    PN532_GpioIrq* mpi_Irq;
+    PN532BusStats mk_Stats;
+};
+
+#endif // PN532_HOST && __linux__
+#endif
@@ -0,0 +1,484 @@
+/**************************************************************************
+
+    PN532_LOG: Recording and replay of the communication with the PN532.
+    See PN532_LOG.h
+
+**************************************************************************/
+
+#include "PN532_LOG.h"
+
+#ifdef PN532_HOST
+    #include <stdio.h>
+#endif
+
+static const byte LOG_MAGIC[4] = {'P', 'N', 'L', 'G'};
+
+static void WriteHeader(byte* u8_Log)
+{
+    memcpy(u8_Log, LOG_MAGIC, 4);
+    u8_Log[4] = PN532_LOG_VERSION;
+    u8_Log[5] = PROTOCOL;
+}
+
+// ============================================================================================
+//                                         Recorder
+// ============================================================================================
+
+PN532_Recorder::PN532_Recorder(PN532Interface& i_Transport, byte* u8_Buffer, int s32_Size)
+{
+    mpi_Transport = &i_Transport;
+    mu8_Log       = u8_Buffer;
+    ms32_Size     = s32_Size;
+    mu8_Command   = 0;
+#if PROTOCOL != PROT_HSU
+    ms32_IoLen    = 0;
+    ms32_IoPos    = 0;
+#endif
+    Clear();
+}
+
+void PN532_Recorder::Clear()
+{
+    mb_Overflow = ms32_Size < PN532_LOG_HEADER_SIZE;
+    ms32_Used   = 0;
+    if (!mb_Overflow)
+    {
+        WriteHeader(mu8_Log);
+        ms32_Used = PN532_LOG_HEADER_SIZE;
+    }
+    mu32_Start = micros();
+}
+
+const byte* PN532_Recorder::GetLog(int* ps32_Size)
+{
+    *ps32_Size = ms32_Used;
+    return mu8_Log;
+}
+
+// true if the buffer was too small. The log contains all entries up to the first one that did not fit.
+bool PN532_Recorder::IsOverflow()
+{
+    return mb_Overflow;
+}
+
+#ifdef PN532_HOST
+bool PN532_Recorder::SaveFile(const char* s8_Path)
+{
+    FILE* pk_File = fopen(s8_Path, "wb");
+    if (!pk_File)
+        return false;
+
+    bool b_Ok = (int)fwrite(mu8_Log, 1, ms32_Used, pk_File) == ms32_Used;
+    fclose(pk_File);
+    return b_Ok;
+}
+#endif
+
+void PN532_Recorder::Append(byte u8_Type, byte u8_Command, int16_t s16_Result,
+                            const byte* u8_Data1, int s32_Len1, const byte* u8_Data2, int s32_Len2)
+{
+    int s32_Len = s32_Len1 + s32_Len2;
+    if (mb_Overflow || ms32_Used + PN532_LOG_ENTRY_SIZE + s32_Len > ms32_Size)
+    {
+        mb_Overflow = true;
+        return;
+    }
+
+    uint32_t u32_Time = micros() - mu32_Start;
+    byte* u8_Entry = mu8_Log + ms32_Used;
+    u8_Entry[0] = u8_Type;
+    u8_Entry[1] = u8_Command;
+    u8_Entry[2] = (byte)s16_Result;
+    u8_Entry[3] = (byte)(s16_Result >> 8);
+    u8_Entry[4] = (byte)u32_Time;
+    u8_Entry[5] = (byte)(u32_Time >> 8);
+    u8_Entry[6] = (byte)(u32_Time >> 16);
+    u8_Entry[7] = (byte)(u32_Time >> 24);
+    u8_Entry[8] = (byte)s32_Len;
+    u8_Entry[9] = (byte)(s32_Len >> 8);
+    if (s32_Len1 > 0) memcpy(u8_Entry + PN532_LOG_ENTRY_SIZE,            u8_Data1, s32_Len1);
+    if (s32_Len2 > 0) memcpy(u8_Entry + PN532_LOG_ENTRY_SIZE + s32_Len1, u8_Data2, s32_Len2);
+    ms32_Used += PN532_LOG_ENTRY_SIZE + s32_Len;
+}
+
+void PN532_Recorder::begin()
+{
+    mpi_Transport->begin();
+}
+
+void PN532_Recorder::wakeup()
+{
+    mpi_Transport->wakeup();
+}
+
+int8_t PN532_Recorder::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    mu8_Command = header[0];
+    int8_t s8_Result = mpi_Transport->writeCommand(header, hlen, body, blen);
+    Append(LOG_WriteCommand, mu8_Command, s8_Result, header, hlen, body, blen);
+    return s8_Result;
+}
+
+// The transport stores D5 xx at buf[0..1] and the data behind it at buf + 2 (the return value is the length of the data).
+// Only the data is recorded: D5 xx follows from the command, so PN532_Replay::readResponse() rebuilds it.
+int16_t PN532_Recorder::readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout)
+{
+    int16_t s16_Result = mpi_Transport->readResponse(command, buf, len, timeout);
+    Append(LOG_ReadResponse, command, s16_Result, buf + 2, max(0, (int)s16_Result));
+    return s16_Result;
+}
+
+void PN532_Recorder::onRandom(uint8_t *buf, int len)
+{
+    mpi_Transport->onRandom(buf, len);
+    Append(LOG_Random, mu8_Command, len, buf, len);
+}
+
+int8_t PN532_Recorder::waitIrq(uint16_t timeout)
+{
+    return mpi_Transport->waitIrq(timeout);
+}
+
+#if PROTOCOL == PROT_HSU
+
+int16_t PN532_Recorder::readResponse(uint8_t buf[], uint16_t len, uint16_t timeout)
+{
+    int16_t s16_Result = mpi_Transport->readResponse(buf, len, timeout);
+    Append(LOG_ReadResponse, mu8_Command, s16_Result, buf + 2, max(0, (int)s16_Result));
+    return s16_Result;
+}
+
+int16_t PN532_Recorder::receive(uint8_t *buf, int len, uint16_t timeout)
+{
+    int16_t s16_Result = mpi_Transport->receive(buf, len, timeout);
+    Append(LOG_Receive, mu8_Command, s16_Result, buf, max(0, (int)s16_Result));
+    return s16_Result;
+}
+
+// The frame is recorded like writeCommand(), but the result tells the replay that the ACK has not been read yet.
+int8_t PN532_Recorder::sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    mu8_Command = header[0];
+    int8_t s8_Result = mpi_Transport->sendCommand(header, hlen, body, blen);
+    Append(LOG_WriteCommand, mu8_Command, s8_Result, header, hlen, body, blen);
+    return s8_Result;
+}
+
+// PN532_Async polls this function. Only the polls that returned data are recorded.
+int16_t PN532_Recorder::receiveAvailable(uint8_t *buf, int len)
+{
+    int16_t s16_Result = mpi_Transport->receiveAvailable(buf, len);
+    if (s16_Result > 0)
+        Append(LOG_Receive, mu8_Command, s16_Result, buf, s16_Result);
+    return s16_Result;
+}
+
+#else // I2C
+
+// All bytes of the transfer are read here from the transport, so that the entire transfer is one log entry.
+uint16_t PN532_Recorder::RequestFrom(uint16_t u16_Quantity)
+{
+    uint16_t u16_Result = mpi_Transport->RequestFrom(u16_Quantity);
+    ms32_IoLen = 0;
+    ms32_IoPos = 0;
+    while (ms32_IoLen < u16_Result && ms32_IoLen < PN532_LOG_IO_SIZE)
+    {
+        int s32_Byte = mpi_Transport->Read();
+        if (s32_Byte < 0)
+            break;
+        mu8_IoBuf[ms32_IoLen++] = (byte)s32_Byte;
+    }
+    Append(LOG_I2cRead, mu8_Command, u16_Result, mu8_IoBuf, ms32_IoLen);
+    return u16_Result;
+}
+
+int PN532_Recorder::Read()
+{
+    if (ms32_IoPos >= ms32_IoLen)
+        return -1;
+    return mu8_IoBuf[ms32_IoPos++];
+}
+
+void PN532_Recorder::BeginTransmission(uint8_t u8_Address)
+{
+    mpi_Transport->BeginTransmission(u8_Address);
+    ms32_IoLen = 0;
+    ms32_IoPos = 0;
+}
+
+void PN532_Recorder::Write(uint8_t u8_Data)
+{
+    mpi_Transport->Write(u8_Data);
+    if (ms32_IoLen < PN532_LOG_IO_SIZE)
+        mu8_IoBuf[ms32_IoLen++] = u8_Data;
+}
+
+// The frame is 00 00 FF LEN LCS D4 CMD ... or 00 00 FF FF FF LENM LENL LCS D4 CMD ... (extended frame)
+void PN532_Recorder::EndTransmission()
+{
+    mpi_Transport->EndTransmission();
+    int s32_Tfi = (ms32_IoLen > 4 && mu8_IoBuf[3] == 0xFF && mu8_IoBuf[4] == 0xFF) ? 8 : 5;
+    if (ms32_IoLen > s32_Tfi + 1 && mu8_IoBuf[s32_Tfi] == PN532_HOSTTOPN532)
+        mu8_Command = mu8_IoBuf[s32_Tfi + 1];
+    Append(LOG_I2cWrite, mu8_Command, 0, mu8_IoBuf, ms32_IoLen);
+    ms32_IoLen = 0;
+}
+
+#endif
+
+// ============================================================================================
+//                                          Replay
+// ============================================================================================
+
+PN532_Replay::PN532_Replay(const byte* u8_Log, int s32_Size)
+{
+    mu8_Log     = u8_Log;
+    ms32_Size   = s32_Size;
+    mu8_Command = 0;
+    Rewind();
+}
+
+bool PN532_Replay::IsValid()
+{
+    return ms32_Size >= PN532_LOG_HEADER_SIZE &&
+           memcmp(mu8_Log, LOG_MAGIC, 4) == 0 &&
+           mu8_Log[4] == PN532_LOG_VERSION &&
+           mu8_Log[5] == PROTOCOL;
+}
+
+void PN532_Replay::Rewind()
+{
+    ms32_Pos        = IsValid() ? PN532_LOG_HEADER_SIZE : ms32_Size;
+    ms32_Mismatches = 0;
+    ms32_Desyncs    = 0;
+#if PROTOCOL != PROT_HSU
+    mu8_ReadData    = NULL;
+    ms32_ReadLen    = 0;
+    ms32_ReadPos    = 0;
+    ms32_WriteLen   = 0;
+#endif
+}
+
+bool PN532_Replay::IsFinished()
+{
+    return ms32_Pos >= ms32_Size;
+}
+
+int PN532_Replay::GetMismatches()
+{
+    return ms32_Mismatches;
+}
+
+int PN532_Replay::GetDesyncs()
+{
+    return ms32_Desyncs;
+}
+
+#ifdef PN532_HOST
+bool PN532_Replay::LoadFile(const char* s8_Path, byte* u8_Buffer, int s32_Size)
+{
+    FILE* pk_File = fopen(s8_Path, "rb");
+    if (!pk_File)
+        return false;
+
+    mu8_Log   = u8_Buffer;
+    ms32_Size = fread(u8_Buffer, 1, s32_Size, pk_File);
+    fclose(pk_File);
+    Rewind();
+    return IsValid();
+}
+#endif
+
+// Returns the next entry if it has the expected type.
+// Otherwise the host has left the recorded call sequence: the entry is not consumed and the call fails.
+bool PN532_Replay::NextEntry(byte u8_Type, byte* pu8_Command, int16_t* ps16_Result, const byte** pu8_Data, int* ps32_Len)
+{
+    if (ms32_Pos + PN532_LOG_ENTRY_SIZE > ms32_Size)
+    {
+        Utils::Print("Replay: End of log\r\n");
+        ms32_Desyncs ++;
+        return false;
+    }
+
+    const byte* u8_Entry = mu8_Log + ms32_Pos;
+    int s32_Len = u8_Entry[8] | (u8_Entry[9] << 8);
+    if (u8_Entry[0] != u8_Type || ms32_Pos + PN532_LOG_ENTRY_SIZE + s32_Len > ms32_Size)
+    {
+        Utils::Print("Replay: The call does not match the log\r\n");
+        ms32_Desyncs ++;
+        return false;
+    }
+
+    *pu8_Command = u8_Entry[1];
+    *ps16_Result = (int16_t)(u8_Entry[2] | (u8_Entry[3] << 8));
+    *pu8_Data    = u8_Entry + PN532_LOG_ENTRY_SIZE;
+    *ps32_Len    = s32_Len;
+    ms32_Pos += PN532_LOG_ENTRY_SIZE + s32_Len;
+    return true;
+}
+
+void PN532_Replay::Compare(const byte* u8_Recorded, int s32_RecLen, const byte* u8_Data1, int s32_Len1,
+                           const byte* u8_Data2, int s32_Len2)
+{
+    if (s32_RecLen != s32_Len1 + s32_Len2 ||
+        memcmp(u8_Recorded, u8_Data1, s32_Len1) != 0 ||
+        (s32_Len2 > 0 && memcmp(u8_Recorded + s32_Len1, u8_Data2, s32_Len2) != 0))
+    {
+        Utils::Print("Replay: The frame differs from the log\r\n");
+        ms32_Mismatches ++;
+    }
+}
+
+void PN532_Replay::begin()
+{
+}
+
+void PN532_Replay::wakeup()
+{
+}
+
+int8_t PN532_Replay::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    byte        u8_Cmd;
+    int16_t     s16_Result;
+    const byte* u8_Data;
+    int         s32_Len;
+
+    mu8_Command = header[0];
+    if (!NextEntry(LOG_WriteCommand, &u8_Cmd, &s16_Result, &u8_Data, &s32_Len))
+        return PN532_TIMEOUT;
+
+    Compare(u8_Data, s32_Len, header, hlen, body, blen);
+    return (int8_t)s16_Result;
+}
+
+int16_t PN532_Replay::readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout)
+{
+    byte        u8_Cmd;
+    int16_t     s16_Result;
+    const byte* u8_Data;
+    int         s32_Len;
+
+    (void)timeout;
+    if (!NextEntry(LOG_ReadResponse, &u8_Cmd, &s16_Result, &u8_Data, &s32_Len))
+        return PN532_TIMEOUT;
+
+    if (u8_Cmd != command)
+    {
+        Utils::Print("Replay: The response belongs to another command\r\n");
+        ms32_Mismatches ++;
+    }
+    if (s32_Len + 2 > len)
+        return PN532_NO_SPACE;
+
+    buf[0] = PN532_PN532TOHOST;
+    buf[1] = command + 1;
+    memcpy(buf + 2, u8_Data, s32_Len);
+    return s16_Result;
+}
+
+// Replaces the random of the host with the recorded random
+void PN532_Replay::onRandom(uint8_t *buf, int len)
+{
+    byte        u8_Cmd;
+    int16_t     s16_Result;
+    const byte* u8_Data;
+    int         s32_Len;
+
+    if (NextEntry(LOG_Random, &u8_Cmd, &s16_Result, &u8_Data, &s32_Len))
+        memcpy(buf, u8_Data, min(len, s32_Len));
+}
+
+#if PROTOCOL == PROT_HSU
+
+int16_t PN532_Replay::readResponse(uint8_t buf[], uint16_t len, uint16_t timeout)
+{
+    return readResponse(mu8_Command, buf, len, timeout);
+}
+
+int16_t PN532_Replay::receive(uint8_t *buf, int len, uint16_t timeout)
+{
+    byte        u8_Cmd;
+    int16_t     s16_Result;
+    const byte* u8_Data;
+    int         s32_Len;
+
+    (void)timeout;
+    if (!NextEntry(LOG_Receive, &u8_Cmd, &s16_Result, &u8_Data, &s32_Len))
+        return PN532_TIMEOUT;
+
+    memcpy(buf, u8_Data, min(len, s32_Len));
+    return s16_Result;
+}
+
+int8_t PN532_Replay::sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    return writeCommand(header, hlen, body, blen);
+}
+
+// The empty polls have not been recorded: nothing has been received until the next entry is a LOG_Receive entry.
+int16_t PN532_Replay::receiveAvailable(uint8_t *buf, int len)
+{
+    byte        u8_Cmd;
+    int16_t     s16_Result;
+    const byte* u8_Data;
+    int         s32_Len;
+
+    if (ms32_Pos + PN532_LOG_ENTRY_SIZE > ms32_Size || mu8_Log[ms32_Pos] != LOG_Receive)
+        return 0;
+
+    if (!NextEntry(LOG_Receive, &u8_Cmd, &s16_Result, &u8_Data, &s32_Len))
+        return 0;
+
+    s32_Len = min(len, s32_Len);
+    memcpy(buf, u8_Data, s32_Len);
+    return s32_Len;
+}
+
+#else // I2C
+
+uint16_t PN532_Replay::RequestFrom(uint16_t u16_Quantity)
+{
+    byte        u8_Cmd;
+    int16_t     s16_Result;
+
+    (void)u16_Quantity;
+    ms32_ReadLen = 0;
+    ms32_ReadPos = 0;
+    if (!NextEntry(LOG_I2cRead, &u8_Cmd, &s16_Result, &mu8_ReadData, &ms32_ReadLen))
+        return 0;
+    return (uint16_t)s16_Result;
+}
+
+int PN532_Replay::Read()
+{
+    if (ms32_ReadPos >= ms32_ReadLen)
+        return -1;
+    return mu8_ReadData[ms32_ReadPos++];
+}
+
+void PN532_Replay::BeginTransmission(uint8_t u8_Address)
+{
+    (void)u8_Address;
+    ms32_WriteLen = 0;
+}
+
+void PN532_Replay::Write(uint8_t u8_Data)
+{
+    if (ms32_WriteLen < PN532_LOG_IO_SIZE)
+        mu8_WriteBuf[ms32_WriteLen++] = u8_Data;
+}
+
+void PN532_Replay::EndTransmission()
+{
+    byte        u8_Cmd;
+    int16_t     s16_Result;
+    const byte* u8_Data;
+    int         s32_Len;
+
+    if (NextEntry(LOG_I2cWrite, &u8_Cmd, &s16_Result, &u8_Data, &s32_Len))
+        Compare(u8_Data, s32_Len, mu8_WriteBuf, ms32_WriteLen);
+    ms32_WriteLen = 0;
+}
+
+#endif
@@ -0,0 +1,168 @@
+/**************************************************************************
+
+    PN532_LOG: Recording and replay of the communication with the PN532.
+
+    PN532_Recorder is a decorator for any PN532Interface (PN532_HSU,
+    PN532_I2C, PN532_SIM, ...). It passes all calls to the real transport
+    and writes every frame sent to the PN532 and every response read from
+    it into a compact binary log with a timestamp and the command code.
+
+    PN532_Replay is a PN532Interface without any hardware that serves a
+    recorded log back to the PN532 class. The frames sent by the host are
+    compared with the recorded frames and the recorded responses are
+    returned instantly. Rewind() restarts the replay, so a session that was
+    recorded once with a real reader (e.g. the Authenticate + ReadFileData
+    sequence of SAFE_TEST) can be replayed thousands of times to profile the
+    host side parsing, CMAC and CBC.
+
+    The random of the host (RndA of the authentication) is recorded and
+    replayed as well (PN532Interface::onRandom), otherwise the recorded
+    card answers would not match a new authentication.
+
+    A log can only be replayed with the same PROTOCOL that was used for
+    the recording, because HSU and I2C read the responses differently.
+
+    Log format (all values little endian):
+    Header:  "PNLG", version (1 byte), PROTOCOL (1 byte)
+    Entry:   type (1 byte), command (1 byte), result (int16),
+             time (uint32, microseconds since the start of the recording
+             when the call returned), data length (uint16), data
+
+**************************************************************************/
+
+#ifndef __PN532_LOG_H__
+#define __PN532_LOG_H__
+
+#include "PN532Interface.h"
+
+#define PN532_LOG_VERSION        1
+#define PN532_LOG_HEADER_SIZE    6
+#define PN532_LOG_ENTRY_SIZE     10   // entry header without the data
+#define PN532_LOG_IO_SIZE        300  // the largest I2C transfer (extended frame + ready byte)
+
+enum ePN532LogType
+{
+    LOG_WriteCommand = 1, // writeCommand(): header + body,    result = return value
+    LOG_ReadResponse = 2, // readResponse(): data after D5 xx, result = return value
+    LOG_Receive      = 3, // receive() (HSU): raw bytes,      result = return value
+    LOG_I2cRead      = 4, // RequestFrom() + Read() (I2C):    result = return value of RequestFrom()
+    LOG_I2cWrite     = 5, // BeginTransmission() ... EndTransmission() (I2C)
+    LOG_Random       = 6, // onRandom(): the random generated by the host
+};
+
+class PN532_Recorder : public PN532Interface
+{
+public:
+    // u8_Buffer receives the log. If it is full the recording stops (see IsOverflow()).
+    PN532_Recorder(PN532Interface& i_Transport, byte* u8_Buffer, int s32_Size);
+
+    // Discards the log and starts a new recording
+    void        Clear();
+    const byte* GetLog(int* ps32_Size);
+    bool        IsOverflow();
+#ifdef PN532_HOST
+    bool        SaveFile(const char* s8_Path);
+#endif
+
+    void    begin();
+    void    wakeup();
+    int8_t  writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout = 1000);
+    void    onRandom(uint8_t *buf, int len);
+    // not recorded: the replay reads the ready byte that follows the IRQ
+    int8_t  waitIrq(uint16_t timeout);
+
+#if PROTOCOL == PROT_HSU
+    int16_t readResponse(uint8_t buf[], uint16_t len, uint16_t timeout = 1000);
+    int16_t receive(uint8_t *buf, int len, uint16_t timeout);
+    int8_t  sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t receiveAvailable(uint8_t *buf, int len);
+#else
+    uint16_t RequestFrom(uint16_t u16_Quantity);
+    int     Read();
+    void    BeginTransmission(uint8_t u8_Address);
+    void    Write(uint8_t u8_Data);
+    void    EndTransmission();
+#endif
+
+private:
+    void Append(byte u8_Type, byte u8_Command, int16_t s16_Result,
+                const byte* u8_Data1, int s32_Len1, const byte* u8_Data2 = NULL, int s32_Len2 = 0);
+
+    PN532Interface* mpi_Transport;
+    byte*    mu8_Log;
+    int      ms32_Size;
+    int      ms32_Used;
+    bool     mb_Overflow;
+    uint32_t mu32_Start;    // micros() at the start of the recording
+    byte     mu8_Command;   // the last command sent with writeCommand()
+
+#if PROTOCOL != PROT_HSU
+    byte     mu8_IoBuf[PN532_LOG_IO_SIZE]; // RequestFrom() -> Read() or BeginTransmission() -> EndTransmission()
+    int      ms32_IoLen;
+    int      ms32_IoPos;
+#endif
+};
+
+class PN532_Replay : public PN532Interface
+{
+public:
+    // The log is not copied. It must stay valid while the replay is used.
+    PN532_Replay(const byte* u8_Log, int s32_Size);
+
+    // Checks the header. Returns false if the log is invalid or was recorded with another PROTOCOL.
+    bool IsValid();
+    // Restarts the replay at the first entry
+    void Rewind();
+    // true if all entries have been served
+    bool IsFinished();
+    // The count of frames sent by the host that differ from the recorded frames
+    // and the count of calls that did not match the recorded call sequence.
+    int  GetMismatches();
+    int  GetDesyncs();
+#ifdef PN532_HOST
+    // Loads a log into u8_Buffer and uses it for the replay
+    bool LoadFile(const char* s8_Path, byte* u8_Buffer, int s32_Size);
+#endif
+
+    void    begin();
+    void    wakeup();
+    int8_t  writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout = 1000);
+    void    onRandom(uint8_t *buf, int len);
+
+#if PROTOCOL == PROT_HSU
+    int16_t readResponse(uint8_t buf[], uint16_t len, uint16_t timeout = 1000);
+    int16_t receive(uint8_t *buf, int len, uint16_t timeout);
+    int8_t  sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t receiveAvailable(uint8_t *buf, int len);
+#else
+    uint16_t RequestFrom(uint16_t u16_Quantity);
+    int     Read();
+    void    BeginTransmission(uint8_t u8_Address);
+    void    Write(uint8_t u8_Data);
+    void    EndTransmission();
+#endif
+
+private:
+    bool NextEntry(byte u8_Type, byte* pu8_Command, int16_t* ps16_Result, const byte** pu8_Data, int* ps32_Len);
+    void Compare(const byte* u8_Recorded, int s32_RecLen, const byte* u8_Data1, int s32_Len1,
+                 const byte* u8_Data2 = NULL, int s32_Len2 = 0);
+
+    const byte* mu8_Log;
+    int      ms32_Size;
+    int      ms32_Pos;
+    int      ms32_Mismatches;
+    int      ms32_Desyncs;
+    byte     mu8_Command;
+
+#if PROTOCOL != PROT_HSU
+    const byte* mu8_ReadData;   // the recorded data of the last RequestFrom()
+    int      ms32_ReadLen;
+    int      ms32_ReadPos;
+    byte     mu8_WriteBuf[PN532_LOG_IO_SIZE];
+    int      ms32_WriteLen;
+#endif
+};
+
+#endif
@@ -0,0 +1,305 @@
+/**************************************************************************
+
+    class PN532Metrics: per-command latency histograms (see PN532_METRICS.h)
+
+**************************************************************************/
+
+#include "PN532_METRICS.h"
+#include <string.h>
+
+#if PN532_METRICS
+
+PN532Metrics::PN532Metrics()
+{
+    Reset();
+}
+
+void PN532Metrics::Reset()
+{
+    memset(mk_Commands,    0, sizeof(mk_Commands));
+    memset(mk_PN532Status, 0, sizeof(mk_PN532Status));
+    memset(mk_CardStatus,  0, sizeof(mk_CardStatus));
+    ms32_Commands = 0;
+    mpk_Current   = NULL;
+    mu32_Mark     = 0;
+    mu8_Touched   = 0;
+    mb_Acked      = false;
+}
+
+// ================================== MEASUREMENT ==================================
+
+void PN532Metrics::Begin(uint16_t u16_Key)
+{
+    mpk_Current = FindCommand(u16_Key, true);
+    memset(mu32_Elapsed, 0, sizeof(mu32_Elapsed));
+    mu8_Touched = 0;
+    mb_Acked    = false;
+    mu32_Mark   = micros();
+}
+
+void PN532Metrics::Phase(eMetricPhase e_Phase)
+{
+    if (!mpk_Current)
+        return;
+
+    uint32_t u32_Now = micros();
+    mu32_Elapsed[e_Phase] += u32_Now - mu32_Mark;
+    mu8_Touched |= 1 << e_Phase;
+    mu32_Mark    = u32_Now;
+
+    if (e_Phase == PHASE_Ack)
+        mb_Acked = true;
+}
+
+void PN532Metrics::Waited()
+{
+    if (!mpk_Current)
+        return;
+
+    // Do not set mb_Acked yet: the ACK frame must still be read
+    uint32_t u32_Now = micros();
+    eMetricPhase e_Phase = mb_Acked ? PHASE_Ready : PHASE_Ack;
+    mu32_Elapsed[e_Phase] += u32_Now - mu32_Mark;
+    mu8_Touched |= 1 << e_Phase;
+    mu32_Mark    = u32_Now;
+}
+
+void PN532Metrics::Received()
+{
+    Phase(mb_Acked ? PHASE_Read : PHASE_Ack);
+}
+
+void PN532Metrics::End(bool b_Success)
+{
+    if (!mpk_Current)
+        return;
+
+    mpk_Current->u32_Count ++;
+    if (!b_Success)
+        mpk_Current->u32_Failures ++;
+
+    for (int P=0; P<PHASE_Count; P++)
+    {
+        if ((mu8_Touched & (1 << P)) == 0)
+            continue;
+
+        uint32_t u32_Elapsed = mu32_Elapsed[P];
+        PN532PhaseMetrics* pk_Phase = &mpk_Current->k_Phase[P];
+        pk_Phase->u32_TotalUs += u32_Elapsed;
+        pk_Phase->u32_MaxUs    = max(pk_Phase->u32_MaxUs, u32_Elapsed);
+
+        int B = 0;
+        while (B < PN532_METRICS_BUCKETS - 1 && u32_Elapsed >= GetBucketLimit(B))
+        {
+            B++;
+        }
+        if (pk_Phase->u16_Buckets[B] < 0xFFFF) // saturate instead of wrapping around
+            pk_Phase->u16_Buckets[B] ++;
+    }
+    mpk_Current = NULL;
+}
+
+// s16_CardStatus = -1 if the card has not sent a status byte
+void PN532Metrics::CountStatus(uint8_t u8_PN532Status, int s16_CardStatus)
+{
+    CountStatus(mk_PN532Status, u8_PN532Status);
+    if (s16_CardStatus >= 0)
+        CountStatus(mk_CardStatus, (uint8_t)s16_CardStatus);
+}
+
+// If the table is full the last entry counts all further status codes
+void PN532Metrics::CountStatus(PN532StatusCount* pk_Table, uint8_t u8_Status)
+{
+    int i = 0;
+    while (i < PN532_METRICS_STATUS - 1 && pk_Table[i].u32_Count > 0 && pk_Table[i].u8_Status != u8_Status)
+    {
+        i++;
+    }
+    if (pk_Table[i].u32_Count == 0)
+        pk_Table[i].u8_Status = u8_Status;
+    pk_Table[i].u32_Count ++;
+}
+
+PN532CommandMetrics* PN532Metrics::FindCommand(uint16_t u16_Key, bool b_Create)
+{
+    for (int i=0; i<ms32_Commands; i++)
+    {
+        if (mk_Commands[i].u16_Key == u16_Key)
+            return &mk_Commands[i];
+    }
+    if (!b_Create)
+        return NULL;
+
+    if (ms32_Commands == PN532_METRICS_COMMANDS)
+        return &mk_Commands[PN532_METRICS_COMMANDS - 1]; // already the overflow slot
+
+    PN532CommandMetrics* pk_Cmd = &mk_Commands[ms32_Commands++];
+    pk_Cmd->u16_Key = (ms32_Commands == PN532_METRICS_COMMANDS) ? 0xFFFF : u16_Key;
+    return pk_Cmd;
+}
+
+// ================================== EVALUATION ==================================
+
+const PN532CommandMetrics* PN532Metrics::GetCommand(uint16_t u16_Key)
+{
+    return FindCommand(u16_Key, false);
+}
+
+const PN532CommandMetrics* PN532Metrics::GetCommandAt(int s32_Index)
+{
+    if (s32_Index < 0 || s32_Index >= ms32_Commands)
+        return NULL;
+    return &mk_Commands[s32_Index];
+}
+
+int PN532Metrics::GetCommandCount()
+{
+    return ms32_Commands;
+}
+
+uint32_t PN532Metrics::GetPN532StatusCount(uint8_t u8_Status)
+{
+    for (int i=0; i<PN532_METRICS_STATUS && mk_PN532Status[i].u32_Count; i++)
+    {
+        if (mk_PN532Status[i].u8_Status == u8_Status)
+            return mk_PN532Status[i].u32_Count;
+    }
+    return 0;
+}
+
+uint32_t PN532Metrics::GetCardStatusCount(uint8_t u8_Status)
+{
+    for (int i=0; i<PN532_METRICS_STATUS && mk_CardStatus[i].u32_Count; i++)
+    {
+        if (mk_CardStatus[i].u8_Status == u8_Status)
+            return mk_CardStatus[i].u32_Count;
+    }
+    return 0;
+}
+
+uint32_t PN532Metrics::GetBucketLimit(int s32_Bucket)
+{
+    return 64u << s32_Bucket;
+}
+
+static int StatusEntries(const PN532StatusCount* pk_Table)
+{
+    int s32_Count = 0;
+    while (s32_Count < PN532_METRICS_STATUS && pk_Table[s32_Count].u32_Count > 0)
+    {
+        s32_Count++;
+    }
+    return s32_Count;
+}
+
+int PN532Metrics::GetDumpSize()
+{
+    const int PHASE_SIZE   = 4 + 4 + 2 * PN532_METRICS_BUCKETS;
+    const int COMMAND_SIZE = 2 + 4 + 4 + PHASE_Count * PHASE_SIZE;
+    return 8 + 5 * (StatusEntries(mk_PN532Status) + StatusEntries(mk_CardStatus)) + ms32_Commands * COMMAND_SIZE;
+}
+
+static uint8_t* Put16(uint8_t* u8_Out, uint16_t u16_Value)
+{
+    *u8_Out++ = (uint8_t)(u16_Value);
+    *u8_Out++ = (uint8_t)(u16_Value >> 8);
+    return u8_Out;
+}
+
+static uint8_t* Put32(uint8_t* u8_Out, uint32_t u32_Value)
+{
+    u8_Out = Put16(u8_Out, (uint16_t)u32_Value);
+    return   Put16(u8_Out, (uint16_t)(u32_Value >> 16));
+}
+
+// Binary format (all values little-endian):
+// header:   'P' 'M' version phases buckets commands pn532status cardstatus   (8 x uint8)
+// status:   pn532status x {status uint8, count uint32}, then cardstatus x {status uint8, count uint32}
+// command:  commands x {key uint16, count uint32, failures uint32,
+//                       phases x {total us uint32, max us uint32, buckets x uint16}}
+int PN532Metrics::Dump(uint8_t* u8_Buffer, int s32_Size)
+{
+    if (s32_Size < GetDumpSize())
+        return -1;
+
+    int s32_PN532Status = StatusEntries(mk_PN532Status);
+    int s32_CardStatus  = StatusEntries(mk_CardStatus);
+
+    uint8_t* u8_Out = u8_Buffer;
+    *u8_Out++ = 'P';
+    *u8_Out++ = 'M';
+    *u8_Out++ = PN532_METRICS_VERSION;
+    *u8_Out++ = PHASE_Count;
+    *u8_Out++ = PN532_METRICS_BUCKETS;
+    *u8_Out++ = (uint8_t)ms32_Commands;
+    *u8_Out++ = (uint8_t)s32_PN532Status;
+    *u8_Out++ = (uint8_t)s32_CardStatus;
+
+    for (int i=0; i<s32_PN532Status; i++)
+    {
+        *u8_Out++ = mk_PN532Status[i].u8_Status;
+        u8_Out = Put32(u8_Out, mk_PN532Status[i].u32_Count);
+    }
+    for (int i=0; i<s32_CardStatus; i++)
+    {
+        *u8_Out++ = mk_CardStatus[i].u8_Status;
+        u8_Out = Put32(u8_Out, mk_CardStatus[i].u32_Count);
+    }
+    for (int C=0; C<ms32_Commands; C++)
+    {
+        const PN532CommandMetrics* pk_Cmd = &mk_Commands[C];
+        u8_Out = Put16(u8_Out, pk_Cmd->u16_Key);
+        u8_Out = Put32(u8_Out, pk_Cmd->u32_Count);
+        u8_Out = Put32(u8_Out, pk_Cmd->u32_Failures);
+        for (int P=0; P<PHASE_Count; P++)
+        {
+            u8_Out = Put32(u8_Out, pk_Cmd->k_Phase[P].u32_TotalUs);
+            u8_Out = Put32(u8_Out, pk_Cmd->k_Phase[P].u32_MaxUs);
+            for (int B=0; B<PN532_METRICS_BUCKETS; B++)
+            {
+                u8_Out = Put16(u8_Out, pk_Cmd->k_Phase[P].u16_Buckets[B]);
+            }
+        }
+    }
+    return (int)(u8_Out - u8_Buffer);
+}
+
+// Output:
+// Cmd   Count Fail    Send     Ack   Ready    Read (average us)
+// 405A     10    0      12     130    4870      95
+void PN532Metrics::Print()
+{
+    char s8_Buf[80];
+
+    Utils::Print("Cmd   Count Fail    Send     Ack   Ready    Read (average us)", LF);
+    for (int C=0; C<ms32_Commands; C++)
+    {
+        const PN532CommandMetrics* pk_Cmd = &mk_Commands[C];
+        sprintf(s8_Buf, "%04X %6u %4u", pk_Cmd->u16_Key, (unsigned)pk_Cmd->u32_Count, (unsigned)pk_Cmd->u32_Failures);
+        Utils::Print(s8_Buf);
+        for (int P=0; P<PHASE_Count; P++)
+        {
+            uint32_t u32_Avg = pk_Cmd->u32_Count ? pk_Cmd->k_Phase[P].u32_TotalUs / pk_Cmd->u32_Count : 0;
+            sprintf(s8_Buf, " %7u", (unsigned)u32_Avg);
+            Utils::Print(s8_Buf);
+        }
+        Utils::Print(LF);
+    }
+
+    Utils::Print("PN532 status:");
+    for (int i=0; i<StatusEntries(mk_PN532Status); i++)
+    {
+        sprintf(s8_Buf, " %02X=%u", mk_PN532Status[i].u8_Status, (unsigned)mk_PN532Status[i].u32_Count);
+        Utils::Print(s8_Buf);
+    }
+    Utils::Print(LF);
+    Utils::Print("Card status: ");
+    for (int i=0; i<StatusEntries(mk_CardStatus); i++)
+    {
+        sprintf(s8_Buf, " %02X=%u", mk_CardStatus[i].u8_Status, (unsigned)mk_CardStatus[i].u32_Count);
+        Utils::Print(s8_Buf);
+    }
+    Utils::Print(LF);
+}
+
+#endif // PN532_METRICS
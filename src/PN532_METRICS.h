@@ -0,0 +1,135 @@
+/**************************************************************************
+
+    PN532Metrics: per-command latency metrics of the PN532 class
+
+    Every command that the PN532 class sends is measured with micros()
+    in up to four phases:
+
+    PHASE_Send   writing the command frame (I2C / SPI only)
+    PHASE_Ack    waiting for the ACK and reading it
+                 (HSU and the transport's writeCommand(): including the send)
+    PHASE_Ready  waiting until the response is ready (I2C / SPI only)
+    PHASE_Read   reading and checking the response frame
+                 (HSU and the transport's readResponse(): including the wait)
+
+    The commands are counted per key: the PN532 command code in the high
+    byte and, for InDataExchange, the card command in the low byte (the
+    DESFire INS or the Mifare command). So a DESFire SelectApplication
+    (0x405A) and a ReadFileData (0x40BD) have separate histograms.
+
+    Each phase has a histogram with logarithmic buckets: bucket 0 counts
+    durations below 64 us, bucket n below 64 << n us, the last bucket all
+    longer ones. In addition the PN532 status byte (GetLastPN532Error())
+    and the DESFire status of every InDataExchange are counted.
+
+    Dump() writes everything in a compact little-endian binary format
+    (see PN532Metrics::Dump()) that can be sent over a serial line or
+    the network and decoded offline.
+
+    Compile with -DPN532_METRICS=0 to remove the measurement.
+
+**************************************************************************/
+
+#ifndef __PN532_METRICS_H__
+#define __PN532_METRICS_H__
+
+#include "Utils.h"
+#include <stdint.h>
+
+#ifndef PN532_METRICS
+    #define PN532_METRICS  1
+#endif
+
+#if PN532_METRICS
+
+#define PN532_METRICS_VERSION    1
+#ifndef PN532_METRICS_COMMANDS
+    #define PN532_METRICS_COMMANDS   16  // the last slot collects all further commands (key 0xFFFF)
+#endif
+#define PN532_METRICS_STATUS     16  // distinct status codes per table
+#define PN532_METRICS_BUCKETS    14  // 64 us ... 256 ms, > 256 ms
+
+enum eMetricPhase
+{
+    PHASE_Send = 0,
+    PHASE_Ack,
+    PHASE_Ready,
+    PHASE_Read,
+    PHASE_Count,
+};
+
+struct PN532PhaseMetrics
+{
+    uint32_t u32_TotalUs;
+    uint32_t u32_MaxUs;
+    uint16_t u16_Buckets[PN532_METRICS_BUCKETS];
+};
+
+struct PN532CommandMetrics
+{
+    uint16_t u16_Key;       // PN532 command << 8 | card command (InDataExchange)
+    uint32_t u32_Count;
+    uint32_t u32_Failures;  // transport errors, invalid frames, missing ACK
+    PN532PhaseMetrics k_Phase[PHASE_Count];
+};
+
+struct PN532StatusCount
+{
+    uint8_t  u8_Status;
+    uint32_t u32_Count;
+};
+
+class PN532Metrics
+{
+public:
+    PN532Metrics();
+    void Reset();
+
+    // ---------- measurement (called by the PN532 class) ----------
+    // Starts the measurement of a command
+    void Begin(uint16_t u16_Key);
+    // Adds the time since the last call to e_Phase
+    void Phase(eMetricPhase e_Phase);
+    // The PN532 is ready (ACK or response): the wait is attributed to PHASE_Ack or PHASE_Ready
+    void Waited();
+    // A frame has been read: the ACK (PHASE_Ack) or the response (PHASE_Read)
+    void Received();
+    // Finishes the command and adds the phases to the histograms
+    void End(bool b_Success);
+    void CountStatus(uint8_t u8_PN532Status, int s16_CardStatus);
+
+    // ---------- evaluation ----------
+    // Returns the metrics of a command or NULL if the command has never been sent
+    const PN532CommandMetrics* GetCommand(uint16_t u16_Key);
+    // Index = 0 ... GetCommandCount() - 1
+    const PN532CommandMetrics* GetCommandAt(int s32_Index);
+    int      GetCommandCount();
+    uint32_t GetPN532StatusCount(uint8_t u8_Status);
+    uint32_t GetCardStatusCount(uint8_t u8_Status);
+    // The upper limit of a histogram bucket in us
+    static uint32_t GetBucketLimit(int s32_Bucket);
+
+    // Writes all metrics to u8_Buffer. Returns the count of bytes written or -1 if the buffer is too small.
+    int  Dump(uint8_t* u8_Buffer, int s32_Size);
+    int  GetDumpSize();
+    // Prints a table with count, failures and the average of each phase per command
+    void Print();
+
+private:
+    PN532CommandMetrics* FindCommand(uint16_t u16_Key, bool b_Create);
+    void CountStatus(PN532StatusCount* pk_Table, uint8_t u8_Status);
+
+    PN532CommandMetrics  mk_Commands[PN532_METRICS_COMMANDS];
+    int                  ms32_Commands;
+    PN532StatusCount     mk_PN532Status[PN532_METRICS_STATUS];
+    PN532StatusCount     mk_CardStatus [PN532_METRICS_STATUS];
+
+    PN532CommandMetrics* mpk_Current;   // the command being measured, NULL if none
+    uint32_t             mu32_Mark;     // micros() at the end of the last phase
+    uint32_t             mu32_Elapsed[PHASE_Count];
+    uint8_t              mu8_Touched;   // bit mask of the phases measured for the current command
+    bool                 mb_Acked;
+};
+
+#endif // PN532_METRICS
+#endif
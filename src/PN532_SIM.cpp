@@ -0,0 +1,604 @@
+/**************************************************************************
+
+    PN532_SIM: A simulated PN532 behind the PN532Interface.
+    See PN532_SIM.h
+
+**************************************************************************/
+
+#ifdef PN532_HOST
+
+#include "PN532_SIM.h"
+#include "PN532.h"
+#include "PN532_debug.h"
+
+static const byte SIM_ACK[]   = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+static const byte SIM_NACK[]  = {0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00};
+// PN532 manual chapter 6.2.1.5: the application level error frame (syntax error)
+static const byte SIM_ERROR[] = {0x00, 0x00, 0xFF, 0x01, 0xFF, 0x7F, 0x81, 0x00};
+
+PN532_SIM::PN532_SIM()
+{
+    mpi_Card        = NULL;
+    mb_TargetActive = false;
+    mb_FieldOn      = false;
+    mu8_Command     = 0;
+    ms32_QueueHead  = 0;
+    ms32_QueueTail  = 0;
+    ms32_LastRespLen = 0;
+    mb_Irq          = false;
+    mu32_RespDelay  = 0;
+    mb_RespPending  = false;
+    mu32_RespReadyAt = 0;
+#if PROTOCOL != PROT_HSU
+    ms32_WriteLen   = 0;
+    ms32_ReadLen    = 0;
+    ms32_ReadPos    = 0;
+#endif
+    ResetStats();
+}
+
+// Puts a card into the RF field (or removes it with NULL).
+// Like on real hardware the host must call ReadPassiveTargetID() again to activate a new card.
+void PN532_SIM::SetCard(SimCard* pi_Card)
+{
+    mpi_Card        = pi_Card;
+    mb_TargetActive = false;
+}
+
+void PN532_SIM::GetStats(SimStats* pk_Stats)
+{
+    *pk_Stats = mk_Stats;
+}
+
+void PN532_SIM::ResetStats()
+{
+    memset(&mk_Stats, 0, sizeof(mk_Stats));
+}
+
+void PN532_SIM::SetResponseDelay(uint32_t u32_Micros)
+{
+    mu32_RespDelay = u32_Micros;
+}
+
+void PN532_SIM::SetIrq(bool b_Enable)
+{
+    mb_Irq = b_Enable;
+}
+
+void PN532_SIM::begin()
+{
+}
+
+void PN532_SIM::wakeup()
+{
+    // PN532_HSU sends 55 55 00 00 00 to wake up the chip from power down
+    mk_Stats.u32_BytesToChip += 5;
+    ms32_QueueHead = 0;
+    ms32_QueueTail = 0;
+}
+
+// ================================== HOST SIDE ==================================
+
+int8_t PN532_SIM::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    WriteFrame(header, hlen, body, blen);
+    return readAckFrame();
+}
+
+void PN532_SIM::WriteFrame(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    // Like PN532_HSU: dump all bytes that the host did not read
+    ms32_QueueHead = 0;
+    ms32_QueueTail = 0;
+
+    if (hlen + blen + 1 > PN532_EXTENDED_FRAME_LEN)
+        return; // the host runs into a timeout
+
+    mu8_Command = header[0];
+    byte u8_Frame[PN532_SIM_FRAME_SIZE];
+    int  P = PN532Frame::Encode(u8_Frame, header, hlen, body, blen);
+
+    ChipReceive(u8_Frame, P);
+}
+
+int8_t PN532_SIM::readAckFrame()
+{
+    byte u8_AckBuf[sizeof(SIM_ACK)];
+    if (ReadBytes(u8_AckBuf, sizeof(SIM_ACK)) != sizeof(SIM_ACK))
+    {
+        DMSG("Ack: Timeout\n");
+        return PN532_TIMEOUT;
+    }
+    if (memcmp(u8_AckBuf, SIM_ACK, sizeof(SIM_ACK)) != 0)
+    {
+        DMSG("Ack: Invalid\n");
+        return PN532_INVALID_ACK;
+    }
+    return 0;
+}
+
+// Same behaviour as PN532_HSU::readResponse():
+// buf[0] = D5, buf[1] = command + 1, the payload is stored at buf + 2 and its length is returned.
+int16_t PN532_SIM::readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout)
+{
+    (void)timeout;
+    byte u8_Head[8];
+    if (ReadBytes(u8_Head, 5) != 5)
+        return PN532_TIMEOUT;
+
+    if (u8_Head[0] != 0 || u8_Head[1] != 0 || u8_Head[2] != 0xFF)
+        return PN532_INVALID_FRAME;
+
+    // extended frame: 00 00 FF FF FF LENM LENL LCS
+    if (u8_Head[3] == 0xFF && u8_Head[4] == 0xFF && ReadBytes(u8_Head + 5, 3) != 3)
+        return PN532_TIMEOUT;
+
+    uint16_t u16_Length;
+    if (PN532Frame::DecodeLength(u8_Head + 3, 5, &u16_Length) <= 0)
+        return PN532_INVALID_FRAME;
+
+    if (u16_Length < 2)
+        return PN532_INVALID_FRAME; // error frame
+
+    int s32_Length = u16_Length - 2;
+    if (s32_Length + 2 > len)
+        return PN532_NO_SPACE;
+
+    if (ReadBytes(buf, 2) != 2)
+        return PN532_TIMEOUT;
+
+    if (buf[0] != PN532_PN532TOHOST || buf[1] != (uint8_t)(command + 1))
+        return PN532_INVALID_FRAME;
+
+    if (ReadBytes(buf + 2, s32_Length) != s32_Length)
+        return PN532_TIMEOUT;
+
+    uint8_t u8_Sum = 0;
+    for (int i = 0; i < s32_Length + 2; i++)
+    {
+        u8_Sum += buf[i];
+    }
+
+    byte u8_Tail[2];
+    if (ReadBytes(u8_Tail, 2) != 2)
+        return PN532_TIMEOUT;
+
+    if ((uint8_t)(u8_Sum + u8_Tail[0]) != 0 || u8_Tail[1] != 0)
+        return PN532_INVALID_FRAME;
+
+    return s32_Length;
+}
+
+// The IRQ line is low while the chip has queued bytes for the host
+int8_t PN532_SIM::waitIrq(uint16_t timeout)
+{
+    (void)timeout;
+    if (!mb_Irq)
+        return -1;
+
+    ChipPoll();
+    if (ms32_QueueTail == ms32_QueueHead && mb_RespPending)
+    {
+        // sleep until the chip has finished the command
+        int32_t s32_Wait = (int32_t)(mu32_RespReadyAt - micros());
+        if (s32_Wait > 0) delayMicroseconds(s32_Wait);
+        ChipPoll();
+    }
+    return ms32_QueueTail > ms32_QueueHead ? 1 : 0;
+}
+
+// Pops bytes that the chip has queued for the host.
+// Returns the count of bytes copied which is less than s32_Len if the chip did not send enough.
+int PN532_SIM::ReadBytes(uint8_t* u8_Buf, int s32_Len)
+{
+    ChipPoll();
+    if (ms32_QueueTail - ms32_QueueHead < s32_Len && mb_RespPending)
+    {
+        // A UART read blocks until the chip sends the response
+        int32_t s32_Wait = (int32_t)(mu32_RespReadyAt - micros());
+        if (s32_Wait > 0) delayMicroseconds(s32_Wait);
+        ChipPoll();
+    }
+
+    int s32_Avail = ms32_QueueTail - ms32_QueueHead;
+    int s32_Count = min(s32_Avail, s32_Len);
+
+    memcpy(u8_Buf, mu8_Queue + ms32_QueueHead, s32_Count);
+    ms32_QueueHead += s32_Count;
+    mk_Stats.u32_BytesToHost += s32_Count;
+
+    if (s32_Count < s32_Len)
+        mk_Stats.u32_ShortReads ++;
+
+    return s32_Count;
+}
+
+#if PROTOCOL == PROT_HSU
+
+int16_t PN532_SIM::readResponse(uint8_t buf[], uint16_t len, uint16_t timeout)
+{
+    return readResponse(mu8_Command, buf, len, timeout);
+}
+
+// Same return values as PN532_HSU::receive():
+// the count of bytes received (may be less than len after a timeout) or PN532_TIMEOUT if nothing was received.
+int16_t PN532_SIM::receive(uint8_t *buf, int len, uint16_t timeout)
+{
+    (void)timeout;
+    int s32_Count = ReadBytes(buf, len);
+    return s32_Count ? s32_Count : PN532_TIMEOUT;
+}
+
+// Writes the frame, the ACK is read with receiveAvailable()
+int8_t PN532_SIM::sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    WriteFrame(header, hlen, body, blen);
+    return 0;
+}
+
+// Copies the bytes that the chip has already sent. Unlike ReadBytes() this does not wait for a delayed response.
+int16_t PN532_SIM::receiveAvailable(uint8_t *buf, int len)
+{
+    ChipPoll();
+    int s32_Count = min(len, ms32_QueueTail - ms32_QueueHead);
+    memcpy(buf, mu8_Queue + ms32_QueueHead, s32_Count);
+    ms32_QueueHead += s32_Count;
+    mk_Stats.u32_BytesToHost += s32_Count;
+    return s32_Count;
+}
+
+#else // I2C
+
+uint16_t PN532_SIM::RequestFrom(uint16_t u16_Quantity)
+{
+    // PN532 manual chapter 6.2.4: Every read starts with the ready byte.
+    ChipPoll();
+    bool b_Ready  = ms32_QueueTail > ms32_QueueHead;
+    ms32_ReadPos  = 0;
+    ms32_ReadLen  = 0;
+    mu8_ReadBuf[ms32_ReadLen++] = b_Ready ? 0x01 : 0x00;
+
+    u16_Quantity = min((int)u16_Quantity, PN532_SIM_QUEUE_SIZE);
+    if (b_Ready && u16_Quantity > 1)
+    {
+        // A read transaction always consumes the entire frame, even if the host reads less bytes.
+        // The chip pads with zeroes if the host reads more.
+        const byte* u8_Frame = mu8_Queue + ms32_QueueHead;
+        int s32_FrameLen = 6; // ACK (00 FF), NACK (FF 00)
+        if (u8_Frame[3] == 0xFF && u8_Frame[4] == 0xFF)
+            s32_FrameLen = ((u8_Frame[5] << 8) | u8_Frame[6]) + 10; // extended frame
+        else if ((byte)(u8_Frame[3] + u8_Frame[4]) == 0)
+            s32_FrameLen = u8_Frame[3] + 7; // LEN 255 has the same first byte as a NACK
+        s32_FrameLen = min(s32_FrameLen, ms32_QueueTail - ms32_QueueHead);
+
+        int s32_Copy = min(s32_FrameLen, (int)u16_Quantity - 1);
+        memcpy(mu8_ReadBuf + ms32_ReadLen, u8_Frame, s32_Copy);
+        ms32_ReadLen += s32_Copy;
+        while (ms32_ReadLen < u16_Quantity)
+        {
+            mu8_ReadBuf[ms32_ReadLen++] = 0x00;
+        }
+        ms32_QueueHead += s32_FrameLen;
+        mk_Stats.u32_BytesToHost += s32_Copy;
+    }
+    return u16_Quantity;
+}
+
+int PN532_SIM::Read()
+{
+    if (ms32_ReadPos >= ms32_ReadLen)
+        return 0;
+    return mu8_ReadBuf[ms32_ReadPos++];
+}
+
+void PN532_SIM::BeginTransmission(uint8_t u8_Address)
+{
+    (void)u8_Address;
+    ms32_WriteLen = 0;
+}
+
+void PN532_SIM::Write(uint8_t u8_Data)
+{
+    if (ms32_WriteLen < PN532_SIM_FRAME_SIZE)
+        mu8_WriteBuf[ms32_WriteLen++] = u8_Data;
+}
+
+void PN532_SIM::EndTransmission()
+{
+    ChipReceive(mu8_WriteBuf, ms32_WriteLen);
+    ms32_WriteLen = 0;
+}
+
+#endif // PROTOCOL
+
+// ================================== CHIP SIDE ==================================
+
+// Processes one block of bytes that the host has sent (a command frame, an ACK or a NACK)
+void PN532_SIM::ChipReceive(const byte* u8_Data, int s32_Len)
+{
+    mk_Stats.u32_BytesToChip += s32_Len;
+
+    // The host sends an ACK to abort the current command
+    if (s32_Len >= (int)sizeof(SIM_ACK) && memcmp(u8_Data, SIM_ACK, sizeof(SIM_ACK)) == 0)
+    {
+        mb_RespPending = false;
+        ms32_QueueHead = 0;
+        ms32_QueueTail = 0;
+        return;
+    }
+    // The host sends a NACK to request the last response again
+    if (s32_Len >= (int)sizeof(SIM_NACK) && memcmp(u8_Data, SIM_NACK, sizeof(SIM_NACK)) == 0)
+    {
+        ChipQueue(mu8_LastResp, ms32_LastRespLen);
+        return;
+    }
+    ChipProcessFrame(u8_Data, s32_Len);
+}
+
+// Validates a normal or extended information frame like the PN532 does (chapter 6.2.1.1 and 6.2.1.2).
+// Invalid frames are ignored: the chip does not send an ACK and the host runs into a timeout.
+void PN532_SIM::ChipProcessFrame(const byte* u8_Data, int s32_Len)
+{
+    int P = 0;
+    // skip the optional preamble and any leading bytes
+    while (P + 1 < s32_Len && !(u8_Data[P] == PN532_STARTCODE1 && u8_Data[P + 1] == PN532_STARTCODE2))
+    {
+        P++;
+    }
+    P += 2;
+
+    uint16_t u16_Len = 0;
+    int s32_Field = (P < s32_Len) ? PN532Frame::DecodeLength(u8_Data + P, s32_Len - P, &u16_Len) : 0;
+    P += max(s32_Field, 0);
+    if (s32_Field <= 0 || u16_Len < 2 || P + u16_Len + 1 > s32_Len || u8_Data[P] != PN532_HOSTTOPN532)
+    {
+        mk_Stats.u32_BadFrames ++;
+        return;
+    }
+
+    byte u8_Sum = 0;
+    for (int i = 0; i <= u16_Len; i++) // TFI + data + DCS
+    {
+        u8_Sum += u8_Data[P + i];
+    }
+    if (u8_Sum != 0)
+    {
+        mk_Stats.u32_BadFrames ++;
+        return;
+    }
+
+    mk_Stats.u32_Frames ++;
+    mb_RespPending = false; // a new command aborts the current one
+    ChipQueue(SIM_ACK, sizeof(SIM_ACK));
+
+    byte u8_Resp[PN532_SIM_FRAME_SIZE];
+    int s32_RespLen = ChipExecute(u8_Data + P + 1, u16_Len - 1, u8_Resp);
+    if (s32_RespLen < 0)
+    {
+        memcpy(mu8_LastResp, SIM_ERROR, sizeof(SIM_ERROR));
+        ms32_LastRespLen = sizeof(SIM_ERROR);
+    }
+    else ChipQueueFrame(u8_Resp, s32_RespLen);
+
+    // The ACK is sent immediately, the response after the processing time
+    if (mu32_RespDelay)
+    {
+        mb_RespPending   = true;
+        mu32_RespReadyAt = micros() + mu32_RespDelay;
+        return;
+    }
+    ChipQueue(mu8_LastResp, ms32_LastRespLen);
+}
+
+// Builds the response frame around u8_Data (command + 1, payload) in mu8_LastResp.
+// Responses with more than 254 bytes are sent as extended frame.
+void PN532_SIM::ChipQueueFrame(const byte* u8_Data, int s32_Len)
+{
+    int  P = PN532Frame::EncodeHead(mu8_LastResp, s32_Len + 1); // TFI + data
+    byte u8_Sum = PN532_PN532TOHOST;
+
+    mu8_LastResp[P++] = PN532_PN532TOHOST;
+    for (int i = 0; i < s32_Len; i++)
+    {
+        mu8_LastResp[P++] = u8_Data[i];
+        u8_Sum += u8_Data[i];
+    }
+    mu8_LastResp[P++] = ~u8_Sum + 1;
+    mu8_LastResp[P++] = PN532_POSTAMBLE;
+
+    ms32_LastRespLen = P;
+}
+
+// Queues the delayed response when the processing time set with SetResponseDelay() has passed
+void PN532_SIM::ChipPoll()
+{
+    if (mb_RespPending && (int32_t)(micros() - mu32_RespReadyAt) >= 0)
+    {
+        mb_RespPending = false;
+        ChipQueue(mu8_LastResp, ms32_LastRespLen);
+    }
+}
+
+void PN532_SIM::ChipQueue(const byte* u8_Data, int s32_Len)
+{
+    // Compact the queue if the new data does not fit behind the unread bytes
+    if (ms32_QueueTail + s32_Len > PN532_SIM_QUEUE_SIZE)
+    {
+        int s32_Unread = ms32_QueueTail - ms32_QueueHead;
+        memmove(mu8_Queue, mu8_Queue + ms32_QueueHead, s32_Unread);
+        ms32_QueueHead = 0;
+        ms32_QueueTail = s32_Unread;
+    }
+    s32_Len = min(s32_Len, PN532_SIM_QUEUE_SIZE - ms32_QueueTail);
+    memcpy(mu8_Queue + ms32_QueueTail, u8_Data, s32_Len);
+    ms32_QueueTail += s32_Len;
+}
+
+void PN532_SIM::ChipFieldOff()
+{
+    mb_FieldOn      = false;
+    mb_TargetActive = false;
+    if (mpi_Card) mpi_Card->Reset();
+}
+
+// Executes a command. u8_Cmd[0] is the command code.
+// Writes the response (command + 1, payload) to u8_Resp and returns its length or -1 for a syntax error.
+int PN532_SIM::ChipExecute(const byte* u8_Cmd, int s32_CmdLen, byte* u8_Resp)
+{
+    const byte* u8_Params = u8_Cmd + 1;
+    int s32_ParamLen = s32_CmdLen - 1;
+    int P = 0;
+
+    u8_Resp[P++] = u8_Cmd[0] + 1;
+    switch (u8_Cmd[0])
+    {
+        case PN532_COMMAND_GETFIRMWAREVERSION:
+            u8_Resp[P++] = 0x32; // IC = PN532
+            u8_Resp[P++] = 0x01; // Version
+            u8_Resp[P++] = 0x06; // Revision
+            u8_Resp[P++] = 0x07; // Support: ISO18092, ISO14443 type A and B
+            return P;
+
+        case PN532_COMMAND_GETGENERALSTATUS:
+            u8_Resp[P++] = 0x00; // last error
+            u8_Resp[P++] = mb_FieldOn ? 1 : 0;
+            u8_Resp[P++] = mb_TargetActive ? 1 : 0;
+            if (mb_TargetActive)
+            {
+                u8_Resp[P++] = 0x01; // Tg
+                u8_Resp[P++] = 0x00; // BrRx 106 kbps
+                u8_Resp[P++] = 0x00; // BrTx 106 kbps
+                u8_Resp[P++] = 0x00; // Type A
+            }
+            u8_Resp[P++] = 0x00; // SAM status
+            return P;
+
+        case PN532_COMMAND_READREGISTER:
+            // There are no real registers. Every register reads as zero.
+            for (int i = 0; i + 1 < s32_ParamLen; i += 2)
+            {
+                u8_Resp[P++] = 0x00;
+            }
+            return P;
+
+        case PN532_COMMAND_READGPIO:
+            u8_Resp[P++] = 0xFF; // P3
+            u8_Resp[P++] = 0xFF; // P7
+            u8_Resp[P++] = 0x00; // I0I1
+            return P;
+
+        case PN532_COMMAND_WRITEREGISTER:
+        case PN532_COMMAND_WRITEGPIO:
+        case PN532_COMMAND_SETSERIALBAUDRATE:
+        case PN532_COMMAND_SETPARAMETERS:
+        case PN532_COMMAND_SAMCONFIGURATION:
+            return P;
+
+        case PN532_COMMAND_POWERDOWN:
+            u8_Resp[P++] = 0x00; // status
+            return P;
+
+        case PN532_COMMAND_RFCONFIGURATION:
+            // CfgItem 1 = RF field, bit 0 = RF on
+            if (s32_ParamLen >= 2 && u8_Params[0] == 0x01)
+            {
+                if (u8_Params[1] & 0x01) mb_FieldOn = true;
+                else                     ChipFieldOff();
+            }
+            return P;
+
+        case PN532_COMMAND_INLISTPASSIVETARGET:
+            if (s32_ParamLen < 2)
+                return -1;
+            return P + ChipListTarget(u8_Params, s32_ParamLen, u8_Resp + P);
+
+        case PN532_COMMAND_INDATAEXCHANGE:
+            if (s32_ParamLen < 1)
+                return -1;
+            if (!mb_TargetActive || (u8_Params[0] & 0x0F) != 1)
+            {
+                u8_Resp[P++] = PN532_SIM_ERR_NOT_ACCEPT;
+                return P;
+            }
+            return P + ChipExchange(u8_Params + 1, s32_ParamLen - 1, u8_Resp + P);
+
+        case PN532_COMMAND_INCOMMUNICATETHRU:
+            if (!mb_TargetActive)
+            {
+                u8_Resp[P++] = PN532_SIM_ERR_NOT_ACCEPT;
+                return P;
+            }
+            return P + ChipExchange(u8_Params, s32_ParamLen, u8_Resp + P);
+
+        case PN532_COMMAND_INSELECT:
+            mb_TargetActive = (mpi_Card != NULL);
+            u8_Resp[P++] = mb_TargetActive ? 0x00 : PN532_SIM_ERR_NOT_ACCEPT;
+            return P;
+
+        case PN532_COMMAND_INDESELECT:
+            u8_Resp[P++] = 0x00;
+            return P;
+
+        case PN532_COMMAND_INRELEASE:
+            mb_TargetActive = false;
+            u8_Resp[P++] = 0x00;
+            return P;
+
+        default:
+            return -1;
+    }
+}
+
+// INLISTPASSIVETARGET: only ISO14443A at 106 kbps is supported
+// Response: NbTg [Tg, SENS_RES(2), SEL_RES, NFCIDLength, NFCID, ATS]
+int PN532_SIM::ChipListTarget(const byte* u8_Params, int s32_Len, byte* u8_Resp)
+{
+    (void)s32_Len;
+    int P = 0;
+    mb_FieldOn      = true;
+    mb_TargetActive = false;
+
+    if (mpi_Card == NULL || u8_Params[1] != CARD_TYPE_106KB_ISO14443A)
+    {
+        u8_Resp[P++] = 0; // no target found
+        return P;
+    }
+
+    mpi_Card->Reset();
+    mb_TargetActive = true;
+
+    uint16_t u16_ATQA = mpi_Card->GetATQA();
+    u8_Resp[P++] = 1;    // NbTg
+    u8_Resp[P++] = 1;    // Tg
+    u8_Resp[P++] = (byte)(u16_ATQA >> 8);
+    u8_Resp[P++] = (byte)(u16_ATQA);
+    u8_Resp[P++] = mpi_Card->GetSAK();
+
+    byte u8_UID[10];
+    int  s32_UidLen = mpi_Card->GetUID(u8_UID);
+    u8_Resp[P++] = s32_UidLen;
+    memcpy(u8_Resp + P, u8_UID, s32_UidLen);
+    P += s32_UidLen;
+
+    P += mpi_Card->GetATS(u8_Resp + P, 32);
+    return P;
+}
+
+// INDATAEXCHANGE / INCOMMUNICATETHRU: passes the data to the card.
+// Response: Status [card data]
+int PN532_SIM::ChipExchange(const byte* u8_Data, int s32_Len, byte* u8_Resp)
+{
+    mk_Stats.u32_Exchanges ++;
+
+    // The (extended) response frame has a maximum of 265 bytes: TFI, command + 1, status and the card data
+    int s32_CardLen = mpi_Card->Transceive(u8_Data, s32_Len, u8_Resp + 1, PN532_EXTENDED_FRAME_LEN - 3);
+    if (s32_CardLen < 0)
+    {
+        u8_Resp[0] = mpi_Card->GetError();
+        return 1;
+    }
+    u8_Resp[0] = 0x00;
+    return 1 + s32_CardLen;
+}
+
+#endif // PN532_HOST
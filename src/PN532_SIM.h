@@ -0,0 +1,168 @@
+/**************************************************************************
+
+    PN532_SIM: A simulated PN532 behind the PN532Interface.
+
+    The host side (writeCommand, readResponse, receive) behaves exactly like
+    PN532_HSU: every command is sent as a real frame (preamble, length,
+    checksums) and the ACK and the response frames are read back byte by byte.
+    The chip side parses and validates these frames like the PN532 does and
+    answers GETFIRMWAREVERSION, INLISTPASSIVETARGET, INDATAEXCHANGE and the
+    other commands used by this library.
+
+    A card in the RF field is represented by a SimCard. Without a card
+    INLISTPASSIVETARGET reports zero targets.
+
+    This allows to run and measure the complete host side code path of
+    PN532 (DataExchange, ReadData, CMAC, CBC, ...) without hardware.
+
+    Only available in the host build (PN532_HOST), like the cards in
+    SimDesfire and SimMifare.
+
+**************************************************************************/
+
+#ifndef __PN532_SIM_H__
+#define __PN532_SIM_H__
+
+#include "PN532Interface.h"
+
+// The maximum count of bytes that the simulated chip can queue for the host (ACK + extended response frame)
+#define PN532_SIM_QUEUE_SIZE      300
+// The maximum size of a frame that the host can send to the simulated chip (extended frame: 275 bytes)
+#define PN532_SIM_FRAME_SIZE      300
+
+// The PN532 error codes that the simulation returns in the status byte of INDATAEXCHANGE
+#define PN532_SIM_ERR_TIMEOUT     0x01 // The card did not answer
+#define PN532_SIM_ERR_MIFARE      0x14 // Mifare authentication error or NAK of the card
+#define PN532_SIM_ERR_NOT_ACCEPT  0x27 // The command is not acceptable in the current context (no target)
+
+// A card (PICC) in the RF field of the simulated PN532.
+// Derived classes implement the card protocol (DESFire, Mifare Classic, Ultralight, ...)
+class SimCard
+{
+public:
+    virtual ~SimCard()
+    {
+    }
+
+    // ISO14443A activation data returned by INLISTPASSIVETARGET
+    virtual uint16_t GetATQA() = 0;
+    virtual byte     GetSAK()  = 0;
+    // returns the UID length (4 or 7)
+    virtual int      GetUID(byte u8_UID[10]) = 0;
+    // returns the length of the ATS including the length byte TL (0 if the card is not ISO14443-4 compliant)
+    virtual int      GetATS(byte* u8_ATS, int s32_MaxLen)
+    {
+        (void)u8_ATS;
+        (void)s32_MaxLen;
+        return 0;
+    }
+
+    // Called when the card is activated by INLISTPASSIVETARGET and when the RF field is switched off.
+    // The card must return to its idle state (no application selected, not authenticated)
+    virtual void Reset()
+    {
+    }
+
+    // Exchanges data with the card (INDATAEXCHANGE, INCOMMUNICATETHRU)
+    // returns the count of bytes written to u8_Response or -1 if the card does not answer.
+    virtual int Transceive(const byte* u8_Command, int s32_CmdLen, byte* u8_Response, int s32_RespSize) = 0;
+
+    // The PN532 error code that INDATAEXCHANGE returns when Transceive() returned -1
+    virtual byte GetError()
+    {
+        return PN532_SIM_ERR_TIMEOUT;
+    }
+};
+
+// Counters of the simulated link, see PN532_SIM::GetStats()
+struct SimStats
+{
+    uint32_t u32_Frames;      // valid command frames received by the chip
+    uint32_t u32_BadFrames;   // frames with invalid length or data checksum (ignored like a real PN532 does)
+    uint32_t u32_BytesToChip; // all bytes sent by the host (frames, ACK, wakeup)
+    uint32_t u32_BytesToHost; // all bytes read by the host
+    uint32_t u32_ShortReads;  // reads that requested more bytes than available (on a real UART this costs the full timeout)
+    uint32_t u32_Exchanges;   // INDATAEXCHANGE / INCOMMUNICATETHRU commands passed to the card
+};
+
+class PN532_SIM : public PN532Interface
+{
+public:
+    PN532_SIM();
+
+    // Puts a card into the RF field. NULL removes the card.
+    void SetCard(SimCard* pi_Card);
+    void GetStats(SimStats* pk_Stats);
+    void ResetStats();
+    // The processing time of the chip: the response is available u32_Micros after the ACK (default 0).
+    // In HSU mode the host blocks in receive() like on a UART, in I2C / SPI mode the ready byte stays 0.
+    void SetResponseDelay(uint32_t u32_Micros);
+    // Simulates a connected IRQ line: waitIrq() returns exactly when the response is ready.
+    void SetIrq(bool b_Enable);
+
+    void begin();
+    void wakeup();
+    int8_t  writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout = 1000);
+    int8_t  waitIrq(uint16_t timeout);
+
+#if PROTOCOL == PROT_HSU
+    int16_t readResponse(uint8_t buf[], uint16_t len, uint16_t timeout = 1000);
+    int16_t receive(uint8_t *buf, int len, uint16_t timeout = PN532_ACK_WAIT_TIME);
+    int8_t  sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t receiveAvailable(uint8_t *buf, int len);
+#else
+    // I2C style access: a read always starts with the ready byte, a write sends a complete frame.
+    uint16_t RequestFrom(uint16_t u16_Quantity);
+    int     Read();
+    void    BeginTransmission(uint8_t u8_Address);
+    void    Write(uint8_t u8_Data);
+    void    EndTransmission();
+#endif
+
+private:
+    // ---------------- host side ----------------
+    void    WriteFrame(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen);
+    int8_t  readAckFrame();
+    int     ReadBytes(uint8_t* u8_Buf, int s32_Len);
+
+    // ---------------- chip side ----------------
+    void    ChipReceive(const byte* u8_Data, int s32_Len);
+    void    ChipProcessFrame(const byte* u8_Data, int s32_Len);
+    int     ChipExecute(const byte* u8_Cmd, int s32_CmdLen, byte* u8_Resp);
+    int     ChipListTarget(const byte* u8_Params, int s32_Len, byte* u8_Resp);
+    int     ChipExchange(const byte* u8_Data, int s32_Len, byte* u8_Resp);
+    void    ChipQueue(const byte* u8_Data, int s32_Len);
+    void    ChipQueueFrame(const byte* u8_Data, int s32_Len);
+    void    ChipFieldOff();
+    void    ChipPoll();
+
+    SimCard* mpi_Card;
+    bool     mb_TargetActive;   // INLISTPASSIVETARGET has activated the card (target number 1)
+    bool     mb_FieldOn;
+    byte     mu8_Command;       // the last command sent by writeCommand()
+
+    byte     mu8_Queue[PN532_SIM_QUEUE_SIZE]; // bytes waiting to be read by the host
+    int      ms32_QueueHead;
+    int      ms32_QueueTail;
+
+    byte     mu8_LastResp[PN532_SIM_QUEUE_SIZE]; // the last response frame (resent after a NACK)
+    int      ms32_LastRespLen;
+
+    bool     mb_Irq;
+    uint32_t mu32_RespDelay;    // SetResponseDelay()
+    bool     mb_RespPending;    // mu8_LastResp will be queued at mu32_RespReadyAt
+    uint32_t mu32_RespReadyAt;  // micros()
+
+#if PROTOCOL != PROT_HSU
+    byte     mu8_WriteBuf[PN532_SIM_FRAME_SIZE];  // BeginTransmission() ... EndTransmission()
+    int      ms32_WriteLen;
+    byte     mu8_ReadBuf[PN532_SIM_QUEUE_SIZE];   // RequestFrom() -> Read()
+    int      ms32_ReadLen;
+    int      ms32_ReadPos;
+#endif
+
+    SimStats mk_Stats;
+};
+
+#endif
@@ -7,9 +7,10 @@
 #define DATA_WRITE 1
 #define DATA_READ 3
 
-PN532_SPI::PN532_SPI(SPIClass &spi, uint8_t ss)
+PN532_SPI::PN532_SPI(SPIClass &spi, uint8_t ss, int8_t irq)
 {
     command = 0;
+    _irq = irq;
     _spi = &spi;
     _ss = ss;
 }
@@ -17,6 +18,7 @@ PN532_SPI::PN532_SPI(SPIClass &spi, uint8_t ss)
 void PN532_SPI::begin()
 {
     pinMode(_ss, OUTPUT);
+    if (_irq >= 0) pinMode(_irq, INPUT_PULLUP);
 
     _spi->begin();
     _spi->setDataMode(SPI_MODE0); // PN532 only supports mode0
@@ -32,6 +34,23 @@ void PN532_SPI::begin()
 #endif
 }
 
+// The PN532 pulls P70_IRQ low while an ACK or a response is ready.
+// Waiting for the pin needs no bus traffic and returns as soon as the chip is ready (no delay(1) granularity).
+int8_t PN532_SPI::waitIrq(uint16_t timeout)
+{
+    if (_irq < 0) return -1;
+
+    uint32_t start = millis();
+    while (digitalRead(_irq) != LOW)
+    {
+        if ((0 != timeout) && (millis() - start > timeout))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 void PN532_SPI::wakeup()
 {
     digitalWrite(_ss, LOW);
@@ -39,11 +58,17 @@ void PN532_SPI::wakeup()
     digitalWrite(_ss, HIGH);
 }
 
-int8_t PN532_SPI::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint8_t blen)
+int8_t PN532_SPI::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
 {
     command = header[0];
     writeFrame(header, hlen, body, blen);
 
+    if (0 == waitIrq(PN532_ACK_WAIT_TIME))
+    {
+        DMSG("Time out when waiting for ACK\n");
+        return -2;
+    }
+
     uint8_t timeout = PN532_ACK_WAIT_TIME;
     while (!isReady())
     {
@@ -63,8 +88,13 @@ int8_t PN532_SPI::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_
     return 0;
 }
 
-int16_t PN532_SPI::readResponse(uint8_t buf[], uint8_t len, uint16_t timeout)
+int16_t PN532_SPI::readResponse(uint8_t buf[], uint16_t len, uint16_t timeout)
 {
+    if (0 == waitIrq(timeout))
+    {
+        return PN532_TIMEOUT;
+    }
+
     uint16_t time = 0;
     while (!isReady())
     {
@@ -94,8 +124,18 @@ int16_t PN532_SPI::readResponse(uint8_t buf[], uint8_t len, uint16_t timeout)
             break;
         }
 
-        uint8_t length = read();
-        if (0 != (uint8_t)(length + read()))
+        // LEN LCS or FF FF LENM LENL LCS (extended frame)
+        uint8_t lenfield[5];
+        lenfield[0] = read();
+        lenfield[1] = read();
+        if (lenfield[0] == 0xFF && lenfield[1] == 0xFF)
+        {
+            lenfield[2] = read();
+            lenfield[3] = read();
+            lenfield[4] = read();
+        }
+        uint16_t length;
+        if (PN532Frame::DecodeLength(lenfield, sizeof(lenfield), &length) <= 0 || length < 2)
         { // checksum of length
             result = PN532_INVALID_FRAME;
             break;
@@ -114,7 +154,7 @@ int16_t PN532_SPI::readResponse(uint8_t buf[], uint8_t len, uint16_t timeout)
         length -= 2;
         if (length > len)
         {
-            for (uint8_t i = 0; i < length; i++)
+            for (uint16_t i = 0; i < length; i++)
             {
                 DMSG_HEX(read()); // dump message
             }
@@ -126,7 +166,7 @@ int16_t PN532_SPI::readResponse(uint8_t buf[], uint8_t len, uint16_t timeout)
         }
 
         uint8_t sum = PN532_PN532TOHOST + cmd;
-        for (uint8_t i = 0; i < length; i++)
+        for (uint16_t i = 0; i < length; i++)
         {
             buf[i] = read();
             sum += buf[i];
@@ -162,19 +202,19 @@ bool PN532_SPI::isReady()
     return status;
 }
 
-void PN532_SPI::writeFrame(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint8_t blen)
+void PN532_SPI::writeFrame(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
 {
     digitalWrite(_ss, LOW);
     delay(2); // wake up PN532
 
     write(DATA_WRITE);
-    write(PN532_PREAMBLE);
-    write(PN532_STARTCODE1);
-    write(PN532_STARTCODE2);
 
-    uint8_t length = hlen + blen + 1; // length of data field: TFI + DATA
-    write(length);
-    write(~length + 1); // checksum of length
+    uint8_t head[8];
+    uint8_t headlen = PN532Frame::EncodeHead(head, hlen + blen + 1); // length of data field: TFI + DATA
+    for (uint8_t i = 0; i < headlen; i++)
+    {
+        write(head[i]); // preamble, start code, length (normal or extended frame)
+    }
 
     write(PN532_HOSTTOPN532);
     uint8_t sum = PN532_HOSTTOPN532; // sum of TFI + DATA
@@ -188,7 +228,7 @@ void PN532_SPI::writeFrame(const uint8_t *header, uint8_t hlen, const uint8_t *b
 
         DMSG_HEX(header[i]);
     }
-    for (uint8_t i = 0; i < blen; i++)
+    for (uint16_t i = 0; i < blen; i++)
     {
         write(body[i]);
         sum += body[i];
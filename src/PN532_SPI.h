@@ -8,21 +8,24 @@
 class PN532_SPI : public PN532Interface
 {
 public:
-    PN532_SPI(SPIClass &spi, uint8_t ss);
+    // irq = the pin connected to P70_IRQ of the PN532 or -1 to poll the status byte
+    PN532_SPI(SPIClass &spi, uint8_t ss, int8_t irq = -1);
 
     void begin();
     void wakeup();
-    int8_t writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint8_t blen = 0);
+    int8_t writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
 
-    int16_t readResponse(uint8_t buf[], uint8_t len, uint16_t timeout);
+    int16_t readResponse(uint8_t buf[], uint16_t len, uint16_t timeout);
+    int8_t waitIrq(uint16_t timeout);
 
 private:
     SPIClass *_spi;
     uint8_t _ss;
     uint8_t command;
+    int8_t _irq;
 
     bool isReady();
-    void writeFrame(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint8_t blen = 0);
+    void writeFrame(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
     int8_t readAckFrame();
 
     inline void write(uint8_t data)
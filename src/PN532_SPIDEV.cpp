@@ -0,0 +1,380 @@
+/**************************************************************************
+
+    PN532_SPIDEV: SPI transport for Linux
+    See PN532_SPIDEV.h
+
+**************************************************************************/
+
+#include "PN532_SPIDEV.h"
+
+#if defined(PN532_HOST) && defined(__linux__) && PROTOCOL == PROT_SPI
+
+#include "PN532_debug.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#define STATUS_READ 2
+#define DATA_WRITE  1
+#define DATA_READ   3
+
+static const byte SPIDEV_ACK[] = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+
+// Bit reversal for SPI controllers without SPI_LSB_FIRST
+static byte gu8_Reverse[256];
+
+PN532_SPIDEV::PN532_SPIDEV(const char* s8_Device, uint32_t u32_SpeedHz)
+{
+    strncpy(ms8_Device, s8_Device, sizeof(ms8_Device) - 1);
+    ms8_Device[sizeof(ms8_Device) - 1] = 0;
+    mu32_Speed    = min(u32_SpeedHz, (uint32_t)PN532_SPIDEV_MAX_SPEED);
+    ms32_Fd       = -1;
+    mb_HwLsbFirst = false;
+    mu8_Command   = 0;
+    ms32_ReadLen  = 0;
+    ms32_ReadPos  = 0;
+    ms32_WriteLen = 0;
+    mpi_Irq       = NULL;
+    ResetBusStats();
+
+    for (int i=0; i<256; i++)
+    {
+        byte b = i;
+        REVERSE_BITS_ORDER(b);
+        gu8_Reverse[i] = b;
+    }
+}
+
+PN532_SPIDEV::~PN532_SPIDEV()
+{
+    if (ms32_Fd >= 0) close(ms32_Fd);
+}
+
+bool PN532_SPIDEV::IsOpen()
+{
+    return ms32_Fd >= 0;
+}
+
+bool PN532_SPIDEV::IsHardwareLsbFirst()
+{
+    return mb_HwLsbFirst;
+}
+
+void PN532_SPIDEV::GetBusStats(PN532BusStats* pk_Stats)
+{
+    *pk_Stats = mk_Stats;
+}
+
+void PN532_SPIDEV::ResetBusStats()
+{
+    memset(&mk_Stats, 0, sizeof(mk_Stats));
+}
+
+void PN532_SPIDEV::SetIrq(PN532_GpioIrq* pi_Irq)
+{
+    mpi_Irq = pi_Irq;
+}
+
+int8_t PN532_SPIDEV::waitIrq(uint16_t timeout)
+{
+    if (!mpi_Irq)
+        return -1;
+    return mpi_Irq->Wait(timeout);
+}
+
+void PN532_SPIDEV::begin()
+{
+    if (IsOpen())
+        return;
+
+    ms32_Fd = open(ms8_Device, O_RDWR | O_CLOEXEC);
+    if (ms32_Fd < 0)
+    {
+        Utils::Print("PN532_SPIDEV: Cannot open ");
+        Utils::Print(ms8_Device, LF);
+        return;
+    }
+
+    // PN532 only supports mode 0. Many controllers reject SPI_LSB_FIRST -> reverse the bits in software.
+    uint8_t u8_Mode = SPI_MODE_0 | SPI_LSB_FIRST;
+    mb_HwLsbFirst = ioctl(ms32_Fd, SPI_IOC_WR_MODE, &u8_Mode) == 0;
+    if (!mb_HwLsbFirst)
+    {
+        u8_Mode = SPI_MODE_0;
+        ioctl(ms32_Fd, SPI_IOC_WR_MODE, &u8_Mode);
+    }
+
+    uint8_t u8_Bits = 8;
+    if (ioctl(ms32_Fd, SPI_IOC_WR_BITS_PER_WORD, &u8_Bits) < 0 ||
+        ioctl(ms32_Fd, SPI_IOC_WR_MAX_SPEED_HZ,  &mu32_Speed) < 0)
+    {
+        Utils::Print("PN532_SPIDEV: Cannot configure ");
+        Utils::Print(ms8_Device, LF);
+        close(ms32_Fd);
+        ms32_Fd = -1;
+    }
+}
+
+void PN532_SPIDEV::wakeup()
+{
+    // Chip select low for 2 ms wakes up the PN532 (same as PN532_SPI)
+    ReadStatus();
+    delay(2);
+    ReadStatus();
+}
+
+// ---------------------------------------------------------------------------------------------
+
+// One SPI frame with chip select low: the SPI command byte followed by s32_Len bytes.
+// u8_TxData = NULL sends zeroes, u8_RxData = NULL discards the received bytes.
+bool PN532_SPIDEV::Transfer(byte u8_SpiCmd, const byte* u8_TxData, byte* u8_RxData, int s32_Len, uint16_t u16_DelayUs)
+{
+    if (!IsOpen())
+        return false;
+
+    mu8_Tx[0] = u8_SpiCmd;
+    if (u8_TxData) memcpy(mu8_Tx + 1, u8_TxData, s32_Len);
+    else           memset(mu8_Tx + 1, 0, s32_Len);
+
+    if (!mb_HwLsbFirst)
+    {
+        for (int i=0; i<=s32_Len; i++)
+        {
+            mu8_Tx[i] = gu8_Reverse[mu8_Tx[i]];
+        }
+    }
+
+    struct spi_ioc_transfer k_Xfer;
+    memset(&k_Xfer, 0, sizeof(k_Xfer));
+    k_Xfer.tx_buf        = (uintptr_t)mu8_Tx;
+    k_Xfer.rx_buf        = (uintptr_t)mu8_Rx;
+    k_Xfer.len           = 1 + s32_Len;
+    k_Xfer.speed_hz      = mu32_Speed;
+    k_Xfer.bits_per_word = 8;
+    k_Xfer.delay_usecs   = u16_DelayUs;
+
+    mk_Stats.u32_Transactions ++;
+    mk_Stats.u32_BusBytes += 1 + s32_Len;
+    if (ioctl(ms32_Fd, SPI_IOC_MESSAGE(1), &k_Xfer) < 0)
+        return false;
+
+    if (u8_RxData)
+    {
+        for (int i=0; i<s32_Len; i++)
+        {
+            u8_RxData[i] = mb_HwLsbFirst ? mu8_Rx[1 + i] : gu8_Reverse[mu8_Rx[1 + i]];
+        }
+    }
+    return true;
+}
+
+// One STATUS_READ, returns true if the PN532 is ready
+bool PN532_SPIDEV::ReadStatus()
+{
+    byte u8_Status = 0;
+    return Transfer(STATUS_READ, NULL, &u8_Status, 1) && (u8_Status & 1);
+}
+
+// Waits for the IRQ line or polls the status until the PN532 is ready. u16_Timeout in ms, 0 waits forever.
+bool PN532_SPIDEV::WaitReady(uint16_t u16_Timeout)
+{
+    // With the IRQ line the status is read once after the edge (ready at the first attempt)
+    if (waitIrq(u16_Timeout) == 0)
+        return false;
+
+    if (ReadStatus())
+        return true;
+
+    // The PN532 is busy: send PN532_SPIDEV_POLL_BATCH status reads per ioctl, spaced by the kernel
+    byte u8_Tx[2] = { STATUS_READ, 0x00 };
+    if (!mb_HwLsbFirst) u8_Tx[0] = gu8_Reverse[STATUS_READ];
+
+    byte u8_Rx[PN532_SPIDEV_POLL_BATCH][2];
+    struct spi_ioc_transfer k_Xfer[PN532_SPIDEV_POLL_BATCH];
+    memset(k_Xfer, 0, sizeof(k_Xfer));
+    for (int i=0; i<PN532_SPIDEV_POLL_BATCH; i++)
+    {
+        k_Xfer[i].tx_buf        = (uintptr_t)u8_Tx;
+        k_Xfer[i].rx_buf        = (uintptr_t)u8_Rx[i];
+        k_Xfer[i].len           = 2;
+        k_Xfer[i].speed_hz      = mu32_Speed;
+        k_Xfer[i].bits_per_word = 8;
+        k_Xfer[i].delay_usecs   = PN532_SPIDEV_POLL_US;
+        k_Xfer[i].cs_change     = 1; // release chip select between the status reads
+    }
+    k_Xfer[PN532_SPIDEV_POLL_BATCH - 1].cs_change = 0;
+
+    uint32_t u32_Start = millis();
+    while (true)
+    {
+        mk_Stats.u32_ReadyPolls   ++;
+        mk_Stats.u32_Transactions += PN532_SPIDEV_POLL_BATCH;
+        mk_Stats.u32_BusBytes     += 2 * PN532_SPIDEV_POLL_BATCH;
+        if (ioctl(ms32_Fd, SPI_IOC_MESSAGE(PN532_SPIDEV_POLL_BATCH), k_Xfer) < 0)
+            return false;
+
+        for (int i=0; i<PN532_SPIDEV_POLL_BATCH; i++)
+        {
+            // bit 0 is bit 7 before reversal
+            if (u8_Rx[i][1] & (mb_HwLsbFirst ? 0x01 : 0x80))
+                return true;
+        }
+        if (u16_Timeout && millis() - u32_Start > u16_Timeout)
+            return false;
+    }
+}
+
+int8_t PN532_SPIDEV::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    if (hlen + blen + 1 > PN532_EXTENDED_FRAME_LEN)
+        return PN532_NO_SPACE;
+
+    mu8_Command = header[0];
+    mk_Stats.u32_Commands ++;
+
+    byte u8_Frame[PN532_SPIDEV_IO_SIZE];
+    int  P = PN532Frame::Encode(u8_Frame, header, hlen, body, blen);
+
+    if (!Transfer(DATA_WRITE, u8_Frame, NULL, P))
+        return PN532_TIMEOUT;
+
+    return readAckFrame();
+}
+
+int8_t PN532_SPIDEV::readAckFrame()
+{
+    if (!WaitReady(PN532_ACK_WAIT_TIME))
+    {
+        DMSG("Time out when waiting for ACK\n");
+        return PN532_TIMEOUT;
+    }
+
+    // ATTENTION: Never read more than 6 bytes here! (see PN532::ReadAck())
+    byte u8_Ack[sizeof(SPIDEV_ACK)];
+    if (!Transfer(DATA_READ, NULL, u8_Ack, sizeof(u8_Ack)))
+        return PN532_TIMEOUT;
+
+    if (memcmp(u8_Ack, SPIDEV_ACK, sizeof(SPIDEV_ACK)) != 0)
+    {
+        DMSG("Invalid ACK\n");
+        return PN532_INVALID_ACK;
+    }
+    return 0;
+}
+
+// Same behaviour as PN532_HSU::readResponse(): the data behind D5 xx is stored at buf + 2 and its length returned.
+int16_t PN532_SPIDEV::readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout)
+{
+    // 00 00 FF LEN LCS D5 CMD (data) DCS 00 in one DATA_READ. LEN includes D5 CMD.
+    // 00 00 FF FF FF LENM LENL LCS D5 CMD (data) DCS 00 (extended frame, LEN > 255)
+    int  s32_Head     = (len > PN532_NORMAL_FRAME_LEN) ? 8 : 5;
+    int  s32_ReadSize = min(s32_Head + (int)len + 2, PN532_SPIDEV_IO_SIZE - 1);
+    byte u8_Frame[PN532_SPIDEV_IO_SIZE];
+    if (!WaitReady(timeout) || !Transfer(DATA_READ, NULL, u8_Frame, s32_ReadSize))
+        return PN532_TIMEOUT;
+
+    // The preamble is optional
+    int P = 0;
+    if (u8_Frame[0] == PN532_PREAMBLE && u8_Frame[1] == PN532_PREAMBLE) P++;
+    if (u8_Frame[P] != PN532_STARTCODE1 || u8_Frame[P + 1] != PN532_STARTCODE2)
+    {
+        DMSG("PN532_INVALID_FRAME");
+        return PN532_INVALID_FRAME;
+    }
+
+    uint16_t u16_Length;
+    int s32_Field = PN532Frame::DecodeLength(u8_Frame + P + 2, s32_ReadSize - P - 2, &u16_Length);
+    if (s32_Field <= 0)
+    {
+        DMSG("Invalid length checksum");
+        return PN532_INVALID_FRAME;
+    }
+    if (u16_Length < 2)
+        return PN532_INVALID_FRAME; // error frame
+
+    int s32_Start = P + 2 + s32_Field;
+    if (u16_Length > len || s32_Start + u16_Length + 1 > s32_ReadSize)
+    {
+        DMSG("PN532_NO_SPACE");
+        return PN532_NO_SPACE;
+    }
+
+    const byte* u8_Data = u8_Frame + s32_Start; // D5 CMD ...
+    byte u8_Sum = 0;
+    for (int i=0; i<=u16_Length; i++) // data + DCS
+    {
+        u8_Sum += u8_Data[i];
+    }
+    if (u8_Sum != 0)
+    {
+        DMSG("checksum is not ok\n");
+        return PN532_INVALID_FRAME;
+    }
+    if (u8_Data[0] != PN532_PN532TOHOST || u8_Data[1] != (byte)(command + 1))
+        return PN532_INVALID_FRAME;
+
+    memcpy(buf, u8_Data, u16_Length);
+    return u16_Length - 2;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+uint16_t PN532_SPIDEV::RequestFrom(uint16_t u16_Quantity)
+{
+    ms32_ReadPos = 0;
+    ms32_ReadLen = 0;
+    if (u16_Quantity == 0)
+        return 0;
+
+    u16_Quantity = min((int)u16_Quantity, PN532_SPIDEV_IO_SIZE - 1);
+
+    mu8_ReadBuf[0] = ReadStatus() ? 0x01 : 0x00;
+    if (!mu8_ReadBuf[0])
+        mk_Stats.u32_ReadyPolls ++;
+
+    // PN532::ReadPacket() reads the ready byte + the frame
+    if (u16_Quantity > 1 && mu8_ReadBuf[0])
+    {
+        if (!Transfer(DATA_READ, NULL, mu8_ReadBuf + 1, u16_Quantity - 1))
+            return 0;
+    }
+    else memset(mu8_ReadBuf + 1, 0, u16_Quantity - 1);
+
+    ms32_ReadLen = u16_Quantity;
+    return u16_Quantity;
+}
+
+int PN532_SPIDEV::Read()
+{
+    if (ms32_ReadPos >= ms32_ReadLen)
+        return -1;
+    return mu8_ReadBuf[ms32_ReadPos++];
+}
+
+void PN532_SPIDEV::BeginTransmission(uint8_t u8_Address)
+{
+    (void)u8_Address; // there is no address on SPI
+    ms32_WriteLen = 0;
+}
+
+void PN532_SPIDEV::Write(uint8_t u8_Data)
+{
+    if (ms32_WriteLen < PN532_SPIDEV_IO_SIZE - 1)
+        mu8_WriteBuf[ms32_WriteLen++] = u8_Data;
+}
+
+void PN532_SPIDEV::EndTransmission()
+{
+    // PN532::SendPacket() writes a complete command frame (normal or extended)
+    int s32_Tfi = (ms32_WriteLen > 4 && mu8_WriteBuf[3] == 0xFF && mu8_WriteBuf[4] == 0xFF) ? 8 : 5;
+    if (ms32_WriteLen > s32_Tfi + 1 && mu8_WriteBuf[s32_Tfi] == PN532_HOSTTOPN532)
+    {
+        mu8_Command = mu8_WriteBuf[s32_Tfi + 1];
+        mk_Stats.u32_Commands ++;
+    }
+    Transfer(DATA_WRITE, mu8_WriteBuf, NULL, ms32_WriteLen);
+    ms32_WriteLen = 0;
+}
+
+#endif // PN532_HOST && __linux__
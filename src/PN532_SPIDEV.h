@@ -0,0 +1,94 @@
+/**************************************************************************
+
+    PN532_SPIDEV: SPI transport for Linux (/dev/spidevB.C)
+
+    PN532_SPI (Arduino) moves every byte with a separate transfer() call
+    at SPI_CLOCK_DIV8 (~2 MHz). PN532_SPIDEV sends every PN532 SPI frame
+    (DATA_WRITE, STATUS_READ, DATA_READ) as one SPI_IOC_MESSAGE ioctl with
+    chip select held low for the whole frame.
+
+    The PN532 shifts the bits LSB first. If the SPI controller supports
+    SPI_LSB_FIRST the hardware does it, otherwise (e.g. Raspberry Pi)
+    the bytes are bit-reversed with a table before and after the transfer.
+
+    While the PN532 is busy, PN532_SPIDEV_POLL_BATCH status reads are
+    sent in one ioctl. The kernel spaces them by PN532_SPIDEV_POLL_US
+    (delay_usecs + cs_change), so waiting costs one syscall per batch
+    instead of one syscall and one usleep() per status read.
+
+    The clock defaults to 5 MHz, the maximum of the PN532.
+    GetBusStats() counts the ioctl transfers and the bytes clocked on the
+    bus (including the SPI command byte).
+
+    Only available in the host build (PN532_HOST) on Linux with PROT_SPI.
+
+**************************************************************************/
+
+#ifndef __PN532_SPIDEV_H__
+#define __PN532_SPIDEV_H__
+
+#if defined(PN532_HOST) && defined(__linux__) && PROTOCOL == PROT_SPI
+
+#include "PN532Interface.h"
+#include "PN532_GPIO.h"
+
+#define PN532_SPIDEV_MAX_SPEED   5000000 // Hz, PN532 datasheet
+#define PN532_SPIDEV_POLL_BATCH  4       // status reads per ioctl while the PN532 is busy
+#define PN532_SPIDEV_POLL_US     100     // interval of the status reads in a batch
+#define PN532_SPIDEV_IO_SIZE     (PN532_EXTENDED_FRAME_LEN + PN532_FRAME_OVERHEAD) // SPI command byte + the largest (extended) frame
+
+class PN532_SPIDEV : public PN532Interface
+{
+public:
+    // s8_Device = "/dev/spidev0.0", u32_SpeedHz is limited to PN532_SPIDEV_MAX_SPEED
+    PN532_SPIDEV(const char* s8_Device, uint32_t u32_SpeedHz = PN532_SPIDEV_MAX_SPEED);
+    ~PN532_SPIDEV();
+
+    bool    IsOpen();
+    bool    IsHardwareLsbFirst();
+    void    GetBusStats(PN532BusStats* pk_Stats);
+    void    ResetBusStats();
+    // Optional: wait for the IRQ line instead of polling the status (pi_Irq must be open)
+    void    SetIrq(PN532_GpioIrq* pi_Irq);
+
+    void    begin();
+    void    wakeup();
+    int8_t  writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout = 1000);
+    int8_t  waitIrq(uint16_t timeout);
+
+    // Low level access used by PN532::ReadPacket() and PN532::SendPacket() with the same semantic as I2C:
+    // RequestFrom() returns the status byte followed by (u16_Quantity - 1) bytes of DATA_READ,
+    // BeginTransmission() ... EndTransmission() sends one DATA_WRITE frame.
+    uint16_t RequestFrom(uint16_t u16_Quantity);
+    int     Read();
+    void    BeginTransmission(uint8_t u8_Address);
+    void    Write(uint8_t u8_Data);
+    void    EndTransmission();
+
+private:
+    bool    Transfer(byte u8_SpiCmd, const byte* u8_TxData, byte* u8_RxData, int s32_Len, uint16_t u16_DelayUs = 0);
+    bool    WaitReady(uint16_t u16_Timeout);
+    bool    ReadStatus();
+    int8_t  readAckFrame();
+
+    char     ms8_Device[64];
+    uint32_t mu32_Speed;
+    int      ms32_Fd;
+    bool     mb_HwLsbFirst;
+    byte     mu8_Command;
+
+    byte     mu8_Tx[PN532_SPIDEV_IO_SIZE];
+    byte     mu8_Rx[PN532_SPIDEV_IO_SIZE];
+    byte     mu8_ReadBuf[PN532_SPIDEV_IO_SIZE];  // RequestFrom() -> Read()
+    int      ms32_ReadLen;
+    int      ms32_ReadPos;
+    byte     mu8_WriteBuf[PN532_SPIDEV_IO_SIZE]; // BeginTransmission() -> EndTransmission()
+    int      ms32_WriteLen;
+
+    PN532_GpioIrq* mpi_Irq;
+    PN532BusStats mk_Stats;
+};
+
+#endif // PN532_HOST && __linux__
+#endif
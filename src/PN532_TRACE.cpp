@@ -0,0 +1,116 @@
+/**************************************************************************
+
+    class PN532Trace: ring buffer of binary trace records (see PN532_TRACE.h)
+
+**************************************************************************/
+
+#include "PN532_TRACE.h"
+#include <string.h>
+
+#define TRACE_MASK  (PN532_TRACE_RECORDS - 1)
+
+#if PN532_TRACE_LEVEL > TRACE_LVL_OFF
+    static PN532TraceRecord gk_Records[PN532_TRACE_RECORDS];
+    static uint32_t gu32_Head    = 0; // next record to write (counts up forever)
+    static uint32_t gu32_Tail    = 0; // next record to read
+    static uint32_t gu32_Dropped = 0;
+#endif
+
+// Called on the hot path: no formatting, no heap, no output
+void PN532Trace::Add(uint8_t u8_Level, uint8_t u8_Event, uint8_t u8_Command, int s32_Value1, int s32_Value2,
+                     const uint8_t* u8_Data, int s32_DataLen)
+{
+#if PN532_TRACE_LEVEL > TRACE_LVL_OFF
+    if (gu32_Head - gu32_Tail == PN532_TRACE_RECORDS)
+    {
+        gu32_Tail ++; // overwrite the oldest record
+        gu32_Dropped ++;
+    }
+
+    PN532TraceRecord* pk_Rec = &gk_Records[gu32_Head & TRACE_MASK];
+    pk_Rec->u32_Time   = micros();
+    pk_Rec->u8_Level   = u8_Level;
+    pk_Rec->u8_Event   = u8_Event;
+    pk_Rec->u8_Command = u8_Command;
+    pk_Rec->s16_Value1 = (int16_t)s32_Value1;
+    pk_Rec->s16_Value2 = (int16_t)s32_Value2;
+    pk_Rec->u8_DataLen = (uint8_t)(u8_Data ? min(max(s32_DataLen, 0), PN532_TRACE_DATA) : 0);
+    if (pk_Rec->u8_DataLen)
+        memcpy(pk_Rec->u8_Data, u8_Data, pk_Rec->u8_DataLen);
+
+    gu32_Head ++;
+#else
+    (void)u8_Level; (void)u8_Event; (void)u8_Command; (void)s32_Value1; (void)s32_Value2;
+    (void)u8_Data;  (void)s32_DataLen;
+#endif
+}
+
+int PN532Trace::Read(PN532TraceRecord* pk_Records, int s32_Max)
+{
+    int s32_Count = 0;
+#if PN532_TRACE_LEVEL > TRACE_LVL_OFF
+    while (s32_Count < s32_Max && gu32_Tail != gu32_Head)
+    {
+        pk_Records[s32_Count++] = gk_Records[gu32_Tail++ & TRACE_MASK];
+    }
+#else
+    (void)pk_Records; (void)s32_Max;
+#endif
+    return s32_Count;
+}
+
+int PN532Trace::GetCount()
+{
+#if PN532_TRACE_LEVEL > TRACE_LVL_OFF
+    return (int)(gu32_Head - gu32_Tail);
+#else
+    return 0;
+#endif
+}
+
+uint32_t PN532Trace::GetDropped()
+{
+#if PN532_TRACE_LEVEL > TRACE_LVL_OFF
+    return gu32_Dropped;
+#else
+    return 0;
+#endif
+}
+
+void PN532Trace::Clear()
+{
+#if PN532_TRACE_LEVEL > TRACE_LVL_OFF
+    gu32_Tail    = gu32_Head;
+    gu32_Dropped = 0;
+#endif
+}
+
+// Output (time in us, event, command, value1, value2, data):
+//   12345678 Send    cmd 40  6 0
+//   12346012 Status  cmd 5A  0 0
+//   12346020 Error   cmd 40  4 3  D5 41 00
+void PN532Trace::Print()
+{
+    static const char* s8_Events[] = { "?", "Send", "Receive", "Status", "Target", "Params", "Cmac", "Decrypt", "Error" };
+
+    PN532TraceRecord k_Rec;
+    char s8_Buf[80];
+    while (Read(&k_Rec, 1))
+    {
+        const char* s8_Event = k_Rec.u8_Event <= TRC_Error ? s8_Events[k_Rec.u8_Event] : "?";
+        sprintf(s8_Buf, "%10u %-7s cmd %02X  %d %d", (unsigned)k_Rec.u32_Time, s8_Event, k_Rec.u8_Command,
+                k_Rec.s16_Value1, k_Rec.s16_Value2);
+        Utils::Print(s8_Buf);
+        if (k_Rec.u8_DataLen)
+        {
+            Utils::Print("  ");
+            Utils::PrintHexBuf(k_Rec.u8_Data, k_Rec.u8_DataLen);
+        }
+        Utils::Print(LF);
+    }
+    if (GetDropped())
+    {
+        sprintf(s8_Buf, "%u trace records dropped\r\n", (unsigned)GetDropped());
+        Utils::Print(s8_Buf);
+    }
+}
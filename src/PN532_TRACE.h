@@ -0,0 +1,121 @@
+/**************************************************************************
+
+    PN532Trace: compile-time leveled trace of the PN532 communication
+
+    The debug output of DataExchange() used to print every command, the
+    parameters and the packet buffer with Serial.print(String(...)),
+    which allocates on the heap and costs more time on the UART than the
+    RF exchange itself.
+
+    The TRACE_xxx() macros below instead write binary records of a few
+    bytes (timestamp, event, command, two values and the first bytes of
+    the packet) into a fixed ring buffer. Nothing is formatted or printed
+    on the hot path. The application drains the buffer when it has time:
+
+        PN532Trace::Print();                  // human readable via Utils::Print()
+        PN532Trace::Read(k_Records, 16);      // or binary (e.g. send it over the network)
+
+    Levels (PN532_TRACE_LEVEL, default TRACE_LVL_ERROR):
+    TRACE_LVL_OFF    all TRACE macros compile to nothing
+    TRACE_LVL_ERROR  failures (no ACK, invalid frame, status errors, CMAC mismatch)
+    TRACE_LVL_INFO   + one record per command sent and per response
+    TRACE_LVL_DEBUG  + packet contents (parameters, CMAC, decrypted data)
+
+    Compile for example with -DPN532_TRACE_LEVEL=3 (TRACE_LVL_DEBUG).
+    If the ring buffer is full the oldest records are overwritten (see GetDropped()).
+    The ring buffer is not protected against concurrent access from multiple tasks.
+
+**************************************************************************/
+
+#ifndef __PN532_TRACE_H__
+#define __PN532_TRACE_H__
+
+#include "Utils.h"
+#include <stdint.h>
+
+#define TRACE_LVL_OFF      0
+#define TRACE_LVL_ERROR    1
+#define TRACE_LVL_INFO     2
+#define TRACE_LVL_DEBUG    3
+
+#ifndef PN532_TRACE_LEVEL
+    #define PN532_TRACE_LEVEL   TRACE_LVL_ERROR
+#endif
+#ifndef PN532_TRACE_RECORDS
+    #define PN532_TRACE_RECORDS 64  // must be a power of 2
+#endif
+#define PN532_TRACE_DATA        8   // packet bytes stored per record
+
+enum eTraceEvent
+{
+    TRC_Send = 1,   // command sent:              command, value1 = frame data length
+    TRC_Receive,    // response received:         command, value1 = data length
+    TRC_Status,     // InDataExchange:            DESFire INS, value1 = PN532 status, value2 = card status
+    TRC_Target,     // card detected:             value1 = ATQA, value2 = SAK, data = UID
+    TRC_Params,     // DESFire parameters:        DESFire INS, value1 = length, value2 = 1 if encrypted
+    TRC_Cmac,       // CMAC:                      DESFire INS, value1 = 0 TX / 1 RX calculated / 2 RX received
+    TRC_Decrypt,    // decrypted response data:   DESFire INS, value1 = length
+    TRC_Error,      // failure:                   command, value1 = eTraceError, value2 = detail
+};
+
+enum eTraceError
+{
+    TRE_WriteCommand = 1, // the transport failed to send the command or did not receive the ACK, detail = result
+    TRE_ReadResponse,     // no valid response from the transport, detail = result
+    TRE_NoAck,            // invalid ACK frame
+    TRE_InvalidFrame,     // ReadData(): invalid response frame, detail = length
+    TRE_PN532Status,      // InDataExchange: the PN532 reported an error, detail = status
+    TRE_CardStatus,       // the card reported an error, detail = status
+    TRE_CmacMismatch,     // the CMAC received from the card is wrong
+    TRE_Overflow,         // the response does not fit into the buffer of the caller, detail = length
+    TRE_Decrypt,          // decryption failed
+    TRE_NoTarget,         // InListPassiveTarget: no card found, detail = count of targets
+};
+
+struct PN532TraceRecord
+{
+    uint32_t u32_Time;     // micros()
+    uint8_t  u8_Level;     // TRACE_LVL_xxx
+    uint8_t  u8_Event;     // eTraceEvent
+    uint8_t  u8_Command;   // PN532 command or DESFire INS
+    uint8_t  u8_DataLen;   // valid bytes in u8_Data
+    int16_t  s16_Value1;
+    int16_t  s16_Value2;
+    uint8_t  u8_Data[PN532_TRACE_DATA];
+};
+
+class PN532Trace
+{
+public:
+    static void Add(uint8_t u8_Level, uint8_t u8_Event, uint8_t u8_Command, int s32_Value1, int s32_Value2,
+                    const uint8_t* u8_Data = NULL, int s32_DataLen = 0);
+
+    // Removes up to s32_Max records (the oldest first). Returns the count of records copied.
+    static int      Read(PN532TraceRecord* pk_Records, int s32_Max);
+    static int      GetCount();
+    // The count of records that have been overwritten before they were read
+    static uint32_t GetDropped();
+    static void     Clear();
+    // Reads and prints all records
+    static void     Print();
+};
+
+#if PN532_TRACE_LEVEL >= TRACE_LVL_ERROR
+    #define TRACE_ERROR(cmd, error, detail)  PN532Trace::Add(TRACE_LVL_ERROR, TRC_Error, cmd, error, detail)
+#else
+    #define TRACE_ERROR(cmd, error, detail)
+#endif
+
+#if PN532_TRACE_LEVEL >= TRACE_LVL_INFO
+    #define TRACE_INFO(event, cmd, value1, value2, data, len)  PN532Trace::Add(TRACE_LVL_INFO, event, cmd, value1, value2, data, len)
+#else
+    #define TRACE_INFO(event, cmd, value1, value2, data, len)
+#endif
+
+#if PN532_TRACE_LEVEL >= TRACE_LVL_DEBUG
+    #define TRACE_DEBUG(event, cmd, value1, value2, data, len)  PN532Trace::Add(TRACE_LVL_DEBUG, event, cmd, value1, value2, data, len)
+#else
+    #define TRACE_DEBUG(event, cmd, value1, value2, data, len)
+#endif
+
+#endif
@@ -0,0 +1,452 @@
+/**************************************************************************
+
+    PN532_TTY: HSU transport for Linux
+    See PN532_TTY.h
+
+**************************************************************************/
+
+#include "PN532_TTY.h"
+
+#if defined(PN532_HOST) && defined(__linux__) && PROTOCOL == PROT_HSU
+
+#include "PN532_debug.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/epoll.h>
+
+#define RING_MASK         (PN532_TTY_RING_SIZE - 1)
+#define FRAME_MAX_SIZE    (7 + PN532_EXTENDED_FRAME_LEN + 2) // 00 FF FF FF LENM LENL LCS + data + DCS + postamble (without preamble)
+
+static speed_t BaudConstant(int s32_Baud)
+{
+    switch (s32_Baud)
+    {
+        case   9600: return B9600;
+        case  19200: return B19200;
+        case  38400: return B38400;
+        case  57600: return B57600;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 921600: return B921600;
+        default:     return B115200;
+    }
+}
+
+PN532_TTY::PN532_TTY(const char* s8_Device, int s32_Baud)
+{
+    strncpy(ms8_Device, s8_Device, sizeof(ms8_Device) - 1);
+    ms8_Device[sizeof(ms8_Device) - 1] = 0;
+    ms32_Baud    = s32_Baud;
+    ms32_Fd      = -1;
+    ms32_Epoll   = -1;
+    mu8_Command  = 0;
+    mu32_Head    = 0;
+    mu32_Tail    = 0;
+    ms32_Scanned = 0;
+}
+
+PN532_TTY::~PN532_TTY()
+{
+    if (ms32_Epoll >= 0) close(ms32_Epoll);
+    if (ms32_Fd    >= 0) close(ms32_Fd);
+}
+
+bool PN532_TTY::IsOpen()
+{
+    return ms32_Fd >= 0 && ms32_Epoll >= 0;
+}
+
+void PN532_TTY::begin()
+{
+    if (IsOpen())
+        return;
+
+    ms32_Fd = open(ms8_Device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (ms32_Fd < 0)
+    {
+        Utils::Print("PN532_TTY: Cannot open ");
+        Utils::Print(ms8_Device, LF);
+        return;
+    }
+
+    // Raw mode 8N1, no flow control. read() never blocks (VMIN = VTIME = 0), epoll does the waiting.
+    struct termios k_Tio;
+    memset(&k_Tio, 0, sizeof(k_Tio));
+    tcgetattr(ms32_Fd, &k_Tio);
+    cfmakeraw(&k_Tio);
+    k_Tio.c_cflag |=  (CLOCAL | CREAD);
+    k_Tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+    k_Tio.c_cc[VMIN]  = 0;
+    k_Tio.c_cc[VTIME] = 0;
+    cfsetispeed(&k_Tio, BaudConstant(ms32_Baud));
+    cfsetospeed(&k_Tio, BaudConstant(ms32_Baud));
+    tcsetattr(ms32_Fd, TCSANOW, &k_Tio);
+    tcflush(ms32_Fd, TCIOFLUSH);
+
+    ms32_Epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event k_Event;
+    memset(&k_Event, 0, sizeof(k_Event));
+    k_Event.events = EPOLLIN;
+    k_Event.data.fd = ms32_Fd;
+    if (ms32_Epoll < 0 || epoll_ctl(ms32_Epoll, EPOLL_CTL_ADD, ms32_Fd, &k_Event) < 0)
+    {
+        Utils::Print("PN532_TTY: epoll failed\r\n");
+        close(ms32_Fd);
+        ms32_Fd = -1;
+    }
+}
+
+// PN532 manual chapter 7.2.11: the chip wakes up from power down with a long preamble (0x55 + zeroes)
+void PN532_TTY::wakeup()
+{
+    const byte u8_Wakeup[] = {0x55, 0x55, 0x00, 0x00, 0x00};
+    WriteAll(u8_Wakeup, sizeof(u8_Wakeup));
+    Discard();
+}
+
+// ---------------------------------------------------------------------------------------------
+
+// Discards all data from a previous command (kernel buffer and ring buffer)
+void PN532_TTY::Discard()
+{
+    Fill();
+    if (Available())
+    {
+        DMSG("Dump serial buffer: ");
+        for (int i=0; i<Available(); i++)
+        {
+            DMSG_HEX(Peek(i));
+        }
+        DMSG("\n");
+    }
+    mu32_Head    = 0;
+    mu32_Tail    = 0;
+    ms32_Scanned = 0;
+}
+
+bool PN532_TTY::WriteAll(const byte* u8_Data, int s32_Len)
+{
+    if (!IsOpen())
+        return false;
+
+    while (s32_Len > 0)
+    {
+        ssize_t s32_Written = write(ms32_Fd, u8_Data, s32_Len);
+        if (s32_Written > 0)
+        {
+            u8_Data += s32_Written;
+            s32_Len -= s32_Written;
+            continue;
+        }
+        if (s32_Written < 0 && errno != EAGAIN && errno != EINTR)
+            return false;
+
+        // The kernel buffer is full (only with very large writes)
+        struct pollfd k_Poll = { ms32_Fd, POLLOUT, 0 };
+        if (poll(&k_Poll, 1, PN532_TTY_READ_TIMEOUT) <= 0)
+            return false;
+    }
+    return true;
+}
+
+// Reads all data that the kernel has received in as few read() calls as possible.
+// returns the count of bytes added to the ring buffer
+int PN532_TTY::Fill()
+{
+    if (!IsOpen())
+        return 0;
+
+    int s32_Total = 0;
+    while (true)
+    {
+        int s32_Free = PN532_TTY_RING_SIZE - Available();
+        int s32_Index = mu32_Head & RING_MASK;
+        int s32_Chunk = min(s32_Free, PN532_TTY_RING_SIZE - s32_Index);
+        if (s32_Chunk == 0)
+            break;
+
+        ssize_t s32_Read = read(ms32_Fd, mu8_Ring + s32_Index, s32_Chunk);
+        if (s32_Read <= 0)
+            break;
+
+        mu32_Head += s32_Read;
+        s32_Total += s32_Read;
+        if (s32_Read < s32_Chunk)
+            break; // the kernel buffer is empty
+    }
+    return s32_Total;
+}
+
+// Waits until new data has been received. u16_Timeout = 0 waits forever.
+// returns false on timeout
+bool PN532_TTY::WaitData(uint32_t u32_Start, uint16_t u16_Timeout)
+{
+    while (IsOpen())
+    {
+        int s32_Wait = -1;
+        if (u16_Timeout)
+        {
+            s32_Wait = (int)u16_Timeout - (int)(millis() - u32_Start);
+            if (s32_Wait <= 0)
+                return false;
+        }
+
+        struct epoll_event k_Event;
+        int s32_Count = epoll_wait(ms32_Epoll, &k_Event, 1, s32_Wait);
+        if (s32_Count < 0 && errno != EINTR)
+            return false;
+
+        if (s32_Count > 0 && Fill() > 0)
+            return true;
+    }
+    return false;
+}
+
+int PN532_TTY::Available()
+{
+    return (int)(mu32_Head - mu32_Tail);
+}
+
+byte PN532_TTY::Peek(int s32_Offset)
+{
+    return mu8_Ring[(mu32_Tail + s32_Offset) & RING_MASK];
+}
+
+void PN532_TTY::Take(byte* u8_Buf, int s32_Len)
+{
+    for (int i=0; i<s32_Len; i++)
+    {
+        u8_Buf[i] = mu8_Ring[mu32_Tail++ & RING_MASK];
+    }
+    ms32_Scanned = max(0, ms32_Scanned - s32_Len);
+}
+
+void PN532_TTY::Drop(int s32_Len)
+{
+    mu32_Tail   += s32_Len;
+    ms32_Scanned = max(0, ms32_Scanned - s32_Len);
+}
+
+// Scans the ring buffer for the first complete frame (ACK or information frame).
+// Only the bytes that have arrived since the last call are searched for the start code.
+// returns the count of bytes from the tail up to the end of the frame (including leading bytes and the postamble)
+// or 0 if no complete frame has been received yet.
+int PN532_TTY::FrameEnd(bool* pb_Ack)
+{
+    int s32_Avail = Available();
+    while (true)
+    {
+        int P = ms32_Scanned;
+        while (P + 1 < s32_Avail && (Peek(P) != PN532_STARTCODE1 || Peek(P + 1) != PN532_STARTCODE2))
+        {
+            P++;
+        }
+        ms32_Scanned = P;
+
+        // the length field: LEN LCS or FF FF LENM LENL LCS (extended frame)
+        byte u8_Field[5];
+        int  s32_Field = min(5, s32_Avail - P - 2);
+        for (int i=0; i<s32_Field; i++)
+        {
+            u8_Field[i] = Peek(P + 2 + i);
+        }
+
+        uint16_t u16_Len;
+        s32_Field = PN532Frame::DecodeLength(u8_Field, s32_Field, &u16_Len);
+        if (s32_Field == 0)
+            return 0; // start code and length field not yet complete
+
+        if (s32_Field < 0)
+        {
+            ms32_Scanned = P + 1; // not a frame, search the next start code
+            continue;
+        }
+        if (u16_Len == 0) // ACK: 00 FF 00 FF 00
+        {
+            *pb_Ack = true;
+            return (P + 5 <= s32_Avail) ? P + 5 : 0;
+        }
+
+        *pb_Ack = false;
+        int s32_End = P + 2 + s32_Field + u16_Len + 2; // data + DCS + postamble
+        return (s32_End <= s32_Avail) ? s32_End : 0;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+
+int8_t PN532_TTY::writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    int8_t s8_Result = sendCommand(header, hlen, body, blen);
+    if (s8_Result < 0)
+        return s8_Result;
+
+    return readAckFrame();
+}
+
+// Writes the frame without waiting for the ACK
+int8_t PN532_TTY::sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body, uint16_t blen)
+{
+    Discard();
+
+    if (hlen + blen + 1 > PN532_EXTENDED_FRAME_LEN)
+        return PN532_NO_SPACE;
+
+    mu8_Command = header[0];
+    byte u8_Frame[FRAME_MAX_SIZE + 1];
+    int  P = PN532Frame::Encode(u8_Frame, header, hlen, body, blen);
+
+    DMSG("Sending: ");
+    for (int i=0; i<P; i++)
+    {
+        DMSG_HEX(u8_Frame[i]);
+    }
+    DMSG("\n");
+
+    // One write() for the entire frame
+    if (!WriteAll(u8_Frame, P))
+        return PN532_TIMEOUT;
+
+    return 0;
+}
+
+// Copies the bytes that are already in the ring buffer or in the kernel buffer of the tty, never waits.
+int16_t PN532_TTY::receiveAvailable(uint8_t *buf, int len)
+{
+    Fill();
+    int s32_Count = min(len, Available());
+    Take(buf, s32_Count);
+    return s32_Count;
+}
+
+int8_t PN532_TTY::readAckFrame()
+{
+    uint32_t u32_Start = millis();
+    while (true)
+    {
+        bool b_Ack;
+        int  s32_End = FrameEnd(&b_Ack);
+        if (s32_End > 0)
+        {
+            if (!b_Ack)
+            {
+                DMSG("Invalid ACK\n");
+                return PN532_INVALID_ACK;
+            }
+            Drop(s32_End); // the ACK frame and the bytes before it
+            return 0;
+        }
+        if (!WaitData(u32_Start, PN532_ACK_WAIT_TIME))
+        {
+            DMSG("ACK Timeout\n");
+            return PN532_TIMEOUT;
+        }
+    }
+}
+
+int16_t PN532_TTY::readResponse(uint8_t buf[], uint16_t len, uint16_t timeout)
+{
+    return readResponse(mu8_Command, buf, len, timeout);
+}
+
+// Same behaviour as PN532_HSU::readResponse(): the data behind D5 xx is stored at buf + 2 and its length returned.
+int16_t PN532_TTY::readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout)
+{
+    uint32_t u32_Start = millis();
+    byte u8_Frame[FRAME_MAX_SIZE + 16];
+    while (true)
+    {
+        bool b_Ack;
+        int  s32_End = FrameEnd(&b_Ack);
+        if (s32_End > 0 && b_Ack)
+        {
+            Drop(s32_End); // a late ACK, ignore it
+            continue;
+        }
+        if (s32_End > 0)
+        {
+            int s32_Skip = ms32_Scanned; // the bytes before the start code (preamble)
+            Drop(s32_Skip);
+            Take(u8_Frame, s32_End - s32_Skip);
+            break;
+        }
+        if (!WaitData(u32_Start, timeout))
+            return PN532_TIMEOUT;
+    }
+
+    // u8_Frame = 00 FF LEN LCS TFI CMD DATA... DCS 00
+    // or         00 FF FF FF LENM LENL LCS TFI CMD DATA... DCS 00
+    // FrameEnd() has already checked the length field.
+    uint16_t u16_Length;
+    int s32_Field = PN532Frame::DecodeLength(u8_Frame + 2, 5, &u16_Length);
+    if (s32_Field <= 0)
+        return PN532_INVALID_FRAME;
+
+    const byte* u8_Data = u8_Frame + 2 + s32_Field;
+    int s32_Length = u16_Length;
+    if (s32_Length < 2)
+        return PN532_INVALID_FRAME; // error frame
+
+    byte u8_Sum = 0;
+    for (int i=0; i<s32_Length + 1; i++)
+    {
+        u8_Sum += u8_Data[i];
+    }
+    if (u8_Sum != 0)
+    {
+        DMSG("Checksum error\n");
+        return PN532_INVALID_FRAME;
+    }
+    if (u8_Data[0] != PN532_PN532TOHOST || u8_Data[1] != (byte)(command + 1))
+    {
+        DMSG("Command error\n");
+        return PN532_INVALID_FRAME;
+    }
+
+    s32_Length -= 2;
+    if (s32_Length + 2 > len)
+        return PN532_NO_SPACE;
+
+    memcpy(buf, u8_Data, s32_Length + 2);
+    DMSG("Read:  ");
+    for (int i=0; i<s32_Length; i++)
+    {
+        DMSG_HEX(buf[2 + i]);
+    }
+    DMSG("\n");
+    return s32_Length;
+}
+
+// Returns the raw bytes for PN532::ReadPacket().
+// Returns as soon as len bytes or a complete frame are available, so a request for more bytes than the
+// response has does not wait for the timeout.
+int16_t PN532_TTY::receive(uint8_t *buf, int len, uint16_t timeout)
+{
+    uint32_t u32_Start = millis();
+    while (true)
+    {
+        bool b_Ack;
+        int  s32_End = FrameEnd(&b_Ack);
+        if (s32_End > 0 || Available() >= len)
+        {
+            int s32_Count = (s32_End > 0) ? min(len, s32_End) : len;
+            Take(buf, s32_Count);
+            return s32_Count;
+        }
+        if (!WaitData(u32_Start, timeout))
+            break;
+    }
+
+    // timeout: return what has been received
+    int s32_Count = min(len, Available());
+    if (s32_Count == 0)
+        return PN532_TIMEOUT;
+
+    Take(buf, s32_Count);
+    return s32_Count;
+}
+
+#endif // PN532_HOST && __linux__
@@ -0,0 +1,77 @@
+/**************************************************************************
+
+    PN532_TTY: HSU transport for Linux (USB-UART PN532 boards on /dev/ttyUSB*)
+
+    PN532_HSU reads the ESP32 HardwareSerial byte by byte and polls until a
+    byte arrives. On Linux this would cost one syscall per byte and a sleep
+    or busy loop for every wait. PN532_TTY instead:
+
+    - opens the tty in raw, non-blocking mode,
+    - reads everything that is available in one read() into a ring buffer,
+    - waits with epoll_wait() until the kernel has new data (no polling),
+    - scans the ring buffer incrementally for complete frames.
+
+    receive() returns as soon as a complete frame is in the ring buffer.
+    PN532::ReadData() requests more bytes than the response has, which
+    costs the full timeout with PN532_HSU (a short read). Here the end of
+    the frame is known from the length byte.
+
+    Only available in the host build (PN532_HOST) on Linux with PROT_HSU.
+
+**************************************************************************/
+
+#ifndef __PN532_TTY_H__
+#define __PN532_TTY_H__
+
+#if defined(PN532_HOST) && defined(__linux__) && PROTOCOL == PROT_HSU
+
+#include "PN532Interface.h"
+
+#define PN532_TTY_RING_SIZE    1024  // must be a power of 2
+#define PN532_TTY_READ_TIMEOUT 1000  // ms
+
+class PN532_TTY : public PN532Interface
+{
+public:
+    // s8_Device = "/dev/ttyUSB0", the PN532 uses 115200 baud after power up
+    PN532_TTY(const char* s8_Device, int s32_Baud = 115200);
+    ~PN532_TTY();
+
+    // returns false if the device could not be opened (begin() prints the error)
+    bool    IsOpen();
+
+    void    begin();
+    void    wakeup();
+    int8_t  writeCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t readResponse(uint8_t command, uint8_t buf[], uint16_t len, uint16_t timeout = PN532_TTY_READ_TIMEOUT);
+    int16_t readResponse(uint8_t buf[], uint16_t len, uint16_t timeout = PN532_TTY_READ_TIMEOUT);
+    int16_t receive(uint8_t *buf, int len, uint16_t timeout = PN532_TTY_READ_TIMEOUT);
+    int8_t  sendCommand(const uint8_t *header, uint8_t hlen, const uint8_t *body = 0, uint16_t blen = 0);
+    int16_t receiveAvailable(uint8_t *buf, int len);
+
+private:
+    bool    WriteAll(const byte* u8_Data, int s32_Len);
+    bool    WaitData(uint32_t u32_Start, uint16_t u16_Timeout);
+    int     Fill();
+    void    Discard();
+    int     FrameEnd(bool* pb_Ack);
+    int     Available();
+    byte    Peek(int s32_Offset);
+    void    Take(byte* u8_Buf, int s32_Len);
+    void    Drop(int s32_Len);
+    int8_t  readAckFrame();
+
+    char     ms8_Device[64];
+    int      ms32_Baud;
+    int      ms32_Fd;
+    int      ms32_Epoll;
+    byte     mu8_Command;
+
+    byte     mu8_Ring[PN532_TTY_RING_SIZE];
+    uint32_t mu32_Head;    // write position (free running)
+    uint32_t mu32_Tail;    // read position  (free running)
+    int      ms32_Scanned; // bytes at the tail that are known not to start a frame
+};
+
+#endif // PN532_HOST && __linux__
+#endif
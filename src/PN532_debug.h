@@ -3,7 +3,11 @@
 
 //#define DEBUG_X
 
+#ifdef PN532_HOST
+#include "HostDefines.h"
+#else
 #include "Arduino.h"
+#endif
 
 #ifdef ARDUINO_SAMD_VARIANT_COMPLIANCE
     #define DEBUG_SERIAL SerialUSB
@@ -0,0 +1,1545 @@
+/**************************************************************************
+
+    SimDesfire: A software DESFire EV1 card for the simulated PN532.
+    See SimDesfire.h
+
+**************************************************************************/
+
+#ifdef PN532_HOST
+
+#include "SimDesfire.h"
+
+// The storage byte in GetVersion: 2^(n/2) bytes
+static byte StorageCode(int s32_Storage)
+{
+    if (s32_Storage <= 2048) return 0x16;
+    if (s32_Storage <= 4096) return 0x18;
+    return 0x1A;
+}
+
+// Writes a little endian integer of u8_Bytes bytes
+static void PutUint(byte* u8_Out, uint32_t u32_Value, int s32_Bytes)
+{
+    for (int i=0; i<s32_Bytes; i++)
+    {
+        u8_Out[i] = (byte)(u32_Value >> (8 * i));
+    }
+}
+
+// Reads a little endian integer of u8_Bytes bytes
+static uint32_t GetUint(const byte* u8_In, int s32_Bytes)
+{
+    uint32_t u32_Value = 0;
+    for (int i=s32_Bytes-1; i>=0; i--)
+    {
+        u32_Value = (u32_Value << 8) | u8_In[i];
+    }
+    return u32_Value;
+}
+
+static int PaddedSize(int s32_Len, int s32_BlockSize)
+{
+    return ((s32_Len + s32_BlockSize - 1) / s32_BlockSize) * s32_BlockSize;
+}
+
+SimDesfire::SimDesfire(const byte u8_UID[7], int s32_Storage)
+{
+    memcpy(mu8_UID, u8_UID, 7);
+    ms32_Storage = min(s32_Storage, SIM_DF_MAX_STORAGE);
+
+    // The card RNG is deterministic, so a simulation run is reproducible.
+    mu32_Random = 0x2545F491;
+    for (int i=0; i<7; i++)
+    {
+        mu32_Random = (mu32_Random * 31) ^ u8_UID[i];
+    }
+
+    // Factory state: PICC master key = 2K3DES 16 zero bytes, key settings 0x0F
+    memset(mk_Apps, 0, sizeof(mk_Apps));
+    mk_Apps[0].u32_AID     = 0x000000;
+    mk_Apps[0].u8_Settings = KS_FACTORY_DEFAULT;
+    mk_Apps[0].u8_KeyCount = 1;
+    mk_Apps[0].e_KeyType   = DF_KEY_2K3DES;
+    mb_RandomID       = false;
+    mb_FormatDisabled = false;
+
+    mpi_AuthKey = NULL;
+    mpi_Session = NULL;
+    ms32_SelApp = 0;
+    Format();
+    Reset();
+}
+
+uint16_t SimDesfire::GetATQA()
+{
+    return mb_RandomID ? 0x0304 : 0x0344;
+}
+
+byte SimDesfire::GetSAK()
+{
+    return 0x20;
+}
+
+int SimDesfire::GetUID(byte u8_UID[10])
+{
+    if (mb_RandomID)
+    {
+        memcpy(u8_UID, mu8_RandomUID, 4);
+        return 4;
+    }
+    memcpy(u8_UID, mu8_UID, 7);
+    return 7;
+}
+
+int SimDesfire::GetATS(byte* u8_ATS, int s32_MaxLen)
+{
+    // TL, T0 (FSCI = 5 -> 64 byte), TA, TB, TC, historical byte
+    static const byte u8_Ats[] = { 0x06, 0x75, 0x77, 0x81, 0x02, 0x80 };
+    if (s32_MaxLen < (int)sizeof(u8_Ats))
+        return 0;
+
+    memcpy(u8_ATS, u8_Ats, sizeof(u8_Ats));
+    return sizeof(u8_Ats);
+}
+
+void SimDesfire::Reset()
+{
+    CommitTransaction(false);
+    Deauthenticate();
+    ms32_SelApp = 0;
+    me_Pending  = PEND_None;
+    ms32_OutLen = 0;
+    ms32_OutPos = 0;
+
+    // A card with random ID gets a new UID with each activation
+    mu8_RandomUID[0] = 0x08;
+    Random(mu8_RandomUID + 1, 3);
+}
+
+// ============================================================================================
+
+// Deletes all applications. Keeps the PICC master key, the PICC key settings and the configuration.
+void SimDesfire::Format()
+{
+    for (int A=1; A<=SIM_DF_MAX_APPS; A++)
+    {
+        memset(&mk_Apps[A], 0, sizeof(SimDfApp));
+    }
+    memset(mk_Apps[0].k_Files, 0, sizeof(mk_Apps[0].k_Files));
+    memset(mu8_Memory, 0, sizeof(mu8_Memory));
+    ms32_AppCount = 1;
+    ms32_MemUsed  = 256; // system area (PICC directory, PICC master key, configuration)
+}
+
+bool SimDesfire::AddApplication(uint32_t u32_AppID, byte u8_Settings, byte u8_KeyCount, DESFireKeyType e_KeyType)
+{
+    if (u32_AppID == 0 || u32_AppID > 0xFFFFFF || FindApp(u32_AppID) >= 0 || ms32_AppCount > SIM_DF_MAX_APPS)
+        return false;
+
+    if (u8_KeyCount < 1 || u8_KeyCount > SIM_DF_MAX_KEYS)
+        return false;
+
+    // Application directory entry + one block per key
+    if (Allocate((1 + u8_KeyCount) * SIM_DF_ALLOC_SIZE) < 0)
+        return false;
+
+    SimDfApp* pk_App = &mk_Apps[ms32_AppCount++];
+    memset(pk_App, 0, sizeof(SimDfApp));
+    pk_App->u32_AID     = u32_AppID;
+    pk_App->u8_Settings = u8_Settings;
+    pk_App->u8_KeyCount = u8_KeyCount;
+    pk_App->e_KeyType   = e_KeyType;
+    return true;
+}
+
+bool SimDesfire::AddDataFile(uint32_t u32_AppID, byte u8_FileID, DESFireFileType e_Type, DESFireFileEncryption e_Comm,
+                             uint16_t u16_Access, int s32_Size, const byte* u8_Data)
+{
+    int s32_App = FindApp(u32_AppID);
+    if (s32_App <= 0 || u8_FileID >= SIM_DF_MAX_FILES || s32_Size <= 0 || s32_Size > 0xFFFFFF)
+        return false;
+    if (e_Type != MDFT_STANDARD_DATA_FILE && e_Type != MDFT_BACKUP_DATA_FILE)
+        return false;
+
+    SimDfFile* pk_File = &mk_Apps[s32_App].k_Files[u8_FileID];
+    if (pk_File->b_Exists)
+        return false;
+
+    int s32_Data   = Allocate(s32_Size);
+    int s32_Mirror = (e_Type == MDFT_BACKUP_DATA_FILE) ? Allocate(s32_Size) : -1;
+    if (s32_Data < 0 || (e_Type == MDFT_BACKUP_DATA_FILE && s32_Mirror < 0))
+        return false;
+
+    memset(pk_File, 0, sizeof(SimDfFile));
+    pk_File->b_Exists   = true;
+    pk_File->u8_Type    = e_Type;
+    pk_File->u8_Comm    = e_Comm;
+    pk_File->u16_Access = u16_Access;
+    pk_File->u32_Size   = s32_Size;
+    pk_File->s32_Data   = s32_Data;
+    pk_File->s32_Mirror = s32_Mirror;
+
+    if (u8_Data)
+    {
+        memcpy(mu8_Memory + s32_Data, u8_Data, s32_Size);
+        if (s32_Mirror >= 0) memcpy(mu8_Memory + s32_Mirror, u8_Data, s32_Size);
+    }
+    return true;
+}
+
+// u8_Key must have the key size of the application's key type (16 for 2K3DES and AES, 24 for 3K3DES)
+bool SimDesfire::SetKey(uint32_t u32_AppID, byte u8_KeyNo, const byte* u8_Key, byte u8_Version)
+{
+    int s32_App = FindApp(u32_AppID);
+    if (s32_App < 0 || u8_KeyNo >= mk_Apps[s32_App].u8_KeyCount)
+        return false;
+
+    SimDfKey* pk_Key = &mk_Apps[s32_App].k_Keys[u8_KeyNo];
+    memset(pk_Key, 0, sizeof(SimDfKey));
+    memcpy(pk_Key->u8_Data, u8_Key, KeySize(mk_Apps[s32_App].e_KeyType));
+    pk_Key->u8_Version = u8_Version;
+
+    if (mk_Apps[s32_App].e_KeyType != DF_KEY_AES)
+    {
+        // Store the version in the parity bits like DES::StoreKeyVersion()
+        byte u8_Mask = 0x80;
+        for (int i=0; i<8; i++, u8_Mask >>= 1)
+        {
+            pk_Key->u8_Data[i] = (pk_Key->u8_Data[i] & 0xFE) | ((u8_Version & u8_Mask) ? 1 : 0);
+        }
+    }
+    return true;
+}
+
+// u16_IsoFid is the ISO 7816 file ID of the application, u8_Name the DF name (1...16 bytes)
+bool SimDesfire::SetDFName(uint32_t u32_AppID, uint16_t u16_IsoFid, const byte* u8_Name, int s32_NameLen)
+{
+    int s32_App = FindApp(u32_AppID);
+    if (s32_App <= 0 || s32_NameLen < 1 || s32_NameLen > 16)
+        return false;
+
+    SimDfApp* pk_App = &mk_Apps[s32_App];
+    pk_App->u16_IsoFid   = u16_IsoFid;
+    pk_App->u8_DFNameLen = (byte)s32_NameLen;
+    memcpy(pk_App->u8_DFName, u8_Name, s32_NameLen);
+    return true;
+}
+
+// ============================================================================================
+
+int SimDesfire::Transceive(const byte* u8_Command, int s32_CmdLen, byte* u8_Response, int s32_RespSize)
+{
+    if (s32_CmdLen < 1 || s32_RespSize < 1 + SIM_DF_FRAME_SIZE)
+        return -1; // no answer
+
+    mb_NoRespMac = false;
+
+    byte u8_Status;
+    if (u8_Command[0] == DF_INS_ADDITIONAL_FRAME)
+    {
+        u8_Status = Continue(u8_Command + 1, s32_CmdLen - 1);
+    }
+    else
+    {
+        // Any new command aborts a pending command
+        me_Pending      = PEND_None;
+        ms32_OutLen     = 0;
+        ms32_OutPos     = 0;
+        ms32_FrameSize  = SIM_DF_FRAME_SIZE;
+        ms32_FrameCount = 0;
+        ms32_FrameNo    = 0;
+        u8_Status = Execute(u8_Command, s32_CmdLen);
+    }
+    mu8_LastStatus = u8_Status;
+
+    if (u8_Status != ST_Success && u8_Status != ST_MoreFrames)
+    {
+        // After an error the card drops the authentication and sends only the status
+        Deauthenticate();
+        me_Pending     = PEND_None;
+        u8_Response[0] = u8_Status;
+        return 1;
+    }
+
+    // AF from an authentication or from a chained WriteData: no CMAC, the data fits into one frame
+    if (u8_Status == ST_MoreFrames)
+    {
+        u8_Response[0] = ST_MoreFrames;
+        memcpy(u8_Response + 1, mu8_Out, ms32_OutLen);
+        return 1 + ms32_OutLen;
+    }
+
+    // The CMAC is calculated over all response frames and is appended to the last frame
+    if (me_Pending != PEND_Output && mu8_AuthKeyNo != NOT_AUTHENTICATED && !mb_NoRespMac)
+    {
+        byte u8_Mac[16];
+        mu8_Out[ms32_OutLen] = ST_Success;
+        Cmac(mu8_Out, ms32_OutLen + 1, u8_Mac);
+        memcpy(mu8_Out + ms32_OutLen, u8_Mac, 8);
+        ms32_OutLen += 8;
+    }
+    return SendFrame(ST_Success, u8_Response);
+}
+
+// Sends the next response frame from mu8_Out
+int SimDesfire::SendFrame(byte u8_Status, byte* u8_Response)
+{
+    int s32_Frame = (ms32_FrameCount > 0) ? ms32_FrameSize : SIM_DF_FRAME_SIZE;
+    if (ms32_FrameCount > 0 && ms32_FrameSize == 0)
+        s32_Frame = mu8_FrameSizes[ms32_FrameNo];
+
+    int s32_Rest  = ms32_OutLen - ms32_OutPos;
+    if (s32_Rest > s32_Frame)
+    {
+        if (ms32_FrameCount > 0) ms32_FrameCount --;
+        ms32_FrameNo ++;
+        me_Pending = PEND_Output;
+        u8_Status  = ST_MoreFrames;
+    }
+    else
+    {
+        s32_Frame  = s32_Rest;
+        me_Pending = PEND_None;
+    }
+
+    u8_Response[0] = u8_Status;
+    memcpy(u8_Response + 1, mu8_Out + ms32_OutPos, s32_Frame);
+    ms32_OutPos += s32_Frame;
+    return 1 + s32_Frame;
+}
+
+// DF_INS_ADDITIONAL_FRAME
+byte SimDesfire::Continue(const byte* u8_Data, int s32_Len)
+{
+    ePending e_Pending = me_Pending;
+    me_Pending = PEND_None;
+
+    switch (e_Pending)
+    {
+        case PEND_Auth:
+            return AuthenticateStep2(u8_Data, s32_Len);
+
+        case PEND_Output:
+            if (s32_Len != 0)
+                return ST_WrongCommandLen;
+            // The CMAC has already been appended. SendFrame() sets me_Pending again if required.
+            me_Pending = PEND_Output;
+            return ST_Success;
+
+        case PEND_Write:
+            if (ms32_InLen + s32_Len > ms32_InExpected)
+                return ST_WrongCommandLen;
+
+            memcpy(mu8_In + ms32_InLen, u8_Data, s32_Len);
+            ms32_InLen += s32_Len;
+            if (ms32_InLen < ms32_InExpected)
+            {
+                me_Pending  = PEND_Write;
+                ms32_OutLen = 0;
+                return ST_MoreFrames;
+            }
+            ms32_OutLen = 0;
+            ms32_OutPos = 0;
+            return WriteDataFinish();
+
+        default:
+            return ST_IllegalCommand;
+    }
+}
+
+byte SimDesfire::Execute(const byte* u8_Cmd, int s32_Len)
+{
+    byte        u8_Ins    = u8_Cmd[0];
+    const byte* u8_Params = u8_Cmd + 1;
+    int         s32_Param = s32_Len - 1;
+
+    switch (u8_Ins)
+    {
+        // These commands are either not MACed or calculate the TX CMAC themselves
+        case DFEV1_INS_AUTHENTICATE_ISO:
+        case DFEV1_INS_AUTHENTICATE_AES:
+        case DF_INS_SELECT_APPLICATION:
+        case DF_INS_CHANGE_KEY:
+        case DF_INS_CHANGE_KEY_SETTINGS:
+        case DFEV1_INS_SET_CONFIGURATION:
+        case DF_INS_WRITE_DATA:
+        case DF_INS_CREDIT:
+        case DF_INS_DEBIT:
+        case DF_INS_LIMITED_CREDIT:
+        case DF_INS_CHANGE_FILE_SETTINGS:
+            break;
+
+        default:
+            // The CMAC of a plain command is not transmitted, but it updates the IV of the session key.
+            if (mu8_AuthKeyNo != NOT_AUTHENTICATED)
+            {
+                byte u8_Mac[16];
+                Cmac(u8_Cmd, s32_Len, u8_Mac);
+            }
+            break;
+    }
+
+    switch (u8_Ins)
+    {
+        case DFEV1_INS_AUTHENTICATE_ISO:
+        case DFEV1_INS_AUTHENTICATE_AES:       return AuthenticateStep1(u8_Ins, u8_Params, s32_Param);
+        case DF_INS_CHANGE_KEY:                return ChangeKey        (u8_Params, s32_Param);
+        case DF_INS_CHANGE_KEY_SETTINGS:       return ChangeKeySettings(u8_Params, s32_Param);
+        case DFEV1_INS_SET_CONFIGURATION:      return SetConfiguration (u8_Params, s32_Param);
+        case DF_INS_GET_KEY_SETTINGS:          return GetKeySettings   ();
+        case DF_INS_GET_KEY_VERSION:           return GetKeyVersion    (u8_Params, s32_Param);
+        case DF_INS_GET_VERSION:               return GetVersion       ();
+        case DFEV1_INS_GET_CARD_UID:           return GetCardUID       ();
+        case DF_INS_CREATE_APPLICATION:        return CreateApplication(u8_Params, s32_Param);
+        case DF_INS_DELETE_APPLICATION:        return DeleteApplication(u8_Params, s32_Param);
+        case DF_INS_GET_APPLICATION_IDS:       return GetApplicationIDs();
+        case DFEV1_INS_GET_DF_NAMES:           return GetDFNames       ();
+        case DF_INS_SELECT_APPLICATION:        return SelectApplication(u8_Params, s32_Param);
+        case DF_INS_FORMAT_PICC:               return FormatPICC       ();
+        case DFEV1_INS_FREE_MEM:               return GetFreeMemory    ();
+        case DF_INS_GET_FILE_IDS:              return GetFileIDs       ();
+        case DF_INS_GET_FILE_SETTINGS:         return GetFileSettings  (u8_Params, s32_Param);
+        case DF_INS_CHANGE_FILE_SETTINGS:      return ChangeFileSettings(u8_Params, s32_Param);
+        case DF_INS_CREATE_STD_DATA_FILE:
+        case DF_INS_CREATE_BACKUP_DATA_FILE:
+        case DF_INS_CREATE_VALUE_FILE:         return CreateFile       (u8_Ins, u8_Params, s32_Param);
+        case DF_INS_DELETE_FILE:               return DeleteFile       (u8_Params, s32_Param);
+        case DF_INS_READ_DATA:                 return ReadData         (u8_Params, s32_Param);
+        case DF_INS_WRITE_DATA:                return WriteData        (u8_Params, s32_Param);
+        case DF_INS_GET_VALUE:                 return GetValue         (u8_Params, s32_Param);
+        case DF_INS_CREDIT:
+        case DF_INS_DEBIT:
+        case DF_INS_LIMITED_CREDIT:            return ChangeValue      (u8_Ins, u8_Params, s32_Param);
+        case DF_COMMIT_TRANSACTION:            return CommitTransaction(true);
+        case DF_INS_ABORT_TRANSACTION:         return CommitTransaction(false);
+        default:                               return ST_IllegalCommand;
+    }
+}
+
+// ============================================================================================
+//                                       Authentication
+// ============================================================================================
+
+byte SimDesfire::AuthenticateStep1(byte u8_Ins, const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len != 1)
+        return ST_WrongCommandLen;
+
+    // A new authentication always invalidates the current one
+    Deauthenticate();
+
+    SimDfApp* pk_App  = CurApp();
+    byte      u8_KeyNo = u8_Params[0];
+    if (u8_KeyNo >= pk_App->u8_KeyCount)
+        return ST_KeyDoesNotExist;
+
+    bool b_AesCmd = (u8_Ins == DFEV1_INS_AUTHENTICATE_AES);
+    if (b_AesCmd != (pk_App->e_KeyType == DF_KEY_AES))
+        return ST_AuthentError;
+
+    mpi_AuthKey = LoadKey(&pk_App->k_Keys[u8_KeyNo], pk_App->e_KeyType);
+
+    // 2K3DES uses an 8 byte random, 3K3DES and AES 16 bytes
+    ms32_RndSize = (pk_App->e_KeyType == DF_KEY_2K3DES) ? 8 : 16;
+    Random(mu8_RndB, ms32_RndSize);
+
+    memset(mu8_IV, 0, sizeof(mu8_IV));
+    memcpy(mu8_Out, mu8_RndB, ms32_RndSize);
+    CbcSend(mpi_AuthKey, mu8_Out, ms32_RndSize);
+    ms32_OutLen = ms32_RndSize;
+
+    mu8_AuthPendingKey = u8_KeyNo;
+    me_Pending = PEND_Auth;
+    return ST_MoreFrames;
+}
+
+// Receives ek(RndA + RndB') and returns ek(RndA')
+byte SimDesfire::AuthenticateStep2(const byte* u8_Data, int s32_Len)
+{
+    if (s32_Len != 2 * ms32_RndSize)
+        return ST_WrongCommandLen;
+
+    byte u8_Plain[32];
+    memcpy(u8_Plain, u8_Data, s32_Len);
+    CbcReceive(mpi_AuthKey, u8_Plain, s32_Len);
+
+    byte* u8_RndA = u8_Plain;
+    byte* u8_RndB = u8_Plain + ms32_RndSize;
+
+    byte u8_Expect[16];
+    Utils::RotateBlockLeft(u8_Expect, mu8_RndB, ms32_RndSize);
+    if (memcmp(u8_Expect, u8_RndB, ms32_RndSize) != 0)
+        return ST_AuthentError;
+
+    Utils::RotateBlockLeft(mu8_Out, u8_RndA, ms32_RndSize);
+    CbcSend(mpi_AuthKey, mu8_Out, ms32_RndSize);
+    ms32_OutLen = ms32_RndSize;
+
+    // Build the session key from RndA and RndB (the same as the library does in PN532::Authenticate())
+    byte u8_SessKey[24];
+    byte* A = u8_RndA;
+    byte* B = mu8_RndB;
+    SimDfApp* pk_App = CurApp();
+    switch (pk_App->e_KeyType)
+    {
+        case DF_KEY_AES:
+            memcpy(u8_SessKey,      A,      4);
+            memcpy(u8_SessKey +  4, B,      4);
+            memcpy(u8_SessKey +  8, A + 12, 4);
+            memcpy(u8_SessKey + 12, B + 12, 4);
+            mi_SessAes.SetKeyData(u8_SessKey, 16, 0);
+            mpi_Session = &mi_SessAes;
+            break;
+
+        case DF_KEY_3K3DES:
+            memcpy(u8_SessKey,      A,      4);
+            memcpy(u8_SessKey +  4, B,      4);
+            memcpy(u8_SessKey +  8, A +  6, 4);
+            memcpy(u8_SessKey + 12, B +  6, 4);
+            memcpy(u8_SessKey + 16, A + 12, 4);
+            memcpy(u8_SessKey + 20, B + 12, 4);
+            mi_SessDes.SetKeyData(u8_SessKey, 24, 0);
+            mpi_Session = &mi_SessDes;
+            break;
+
+        default: // 2K3DES
+            memcpy(u8_SessKey,      A,      4);
+            memcpy(u8_SessKey +  4, B,      4);
+            memcpy(u8_SessKey +  8, A +  4, 4);
+            memcpy(u8_SessKey + 12, B +  4, 4);
+            // If K1 == K2 the key is a simple DES key and so is the session key
+            mi_SessDes.SetKeyData(u8_SessKey, (mpi_AuthKey->GetKeySize() == 8) ? 8 : 16, 0);
+            mpi_Session = &mi_SessDes;
+            break;
+    }
+
+    // Generate the CMAC subkeys (NIST SP 800-38B)
+    int  s32_Block = mpi_Session->GetBlockSize();
+    byte u8_R      = (s32_Block == 8) ? 0x1B : 0x87;
+    byte u8_Zero[16] = {0};
+    byte u8_L[16];
+    mpi_Session->CryptDataBlock(u8_L, u8_Zero, KEY_ENCIPHER);
+
+    memcpy(mu8_Cmac1, u8_L, s32_Block);
+    Utils::BitShiftLeft(mu8_Cmac1, s32_Block);
+    if (u8_L[0] & 0x80) mu8_Cmac1[s32_Block-1] ^= u8_R;
+
+    memcpy(mu8_Cmac2, mu8_Cmac1, s32_Block);
+    Utils::BitShiftLeft(mu8_Cmac2, s32_Block);
+    if (mu8_Cmac1[0] & 0x80) mu8_Cmac2[s32_Block-1] ^= u8_R;
+
+    memset(mu8_IV, 0, sizeof(mu8_IV));
+    mu8_AuthKeyNo = mu8_AuthPendingKey;
+    mb_NoRespMac  = true;
+    return ST_Success;
+}
+
+// Params: KeyNo, cryptogram
+byte SimDesfire::ChangeKey(const byte* u8_Params, int s32_Len)
+{
+    if (mu8_AuthKeyNo == NOT_AUTHENTICATED)
+        return ST_AuthentError;
+    if (s32_Len < 2)
+        return ST_WrongCommandLen;
+
+    SimDfApp*      pk_App   = CurApp();
+    byte           u8_KeyNo = u8_Params[0] & 0x3F;
+    DESFireKeyType e_NewType;
+
+    if (ms32_SelApp == 0)
+    {
+        // At PICC level the upper bits define the type of the new PICC master key
+        e_NewType = (DESFireKeyType)(u8_Params[0] & 0xC0);
+        if (u8_KeyNo != 0)
+            return ST_KeyDoesNotExist;
+        if (e_NewType != DF_KEY_2K3DES && e_NewType != DF_KEY_3K3DES && e_NewType != DF_KEY_AES)
+            return ST_IncorrectParam;
+    }
+    else
+    {
+        e_NewType = pk_App->e_KeyType;
+        if (u8_KeyNo >= pk_App->u8_KeyCount)
+            return ST_KeyDoesNotExist;
+    }
+
+    // Check which key is required to change the key
+    if (u8_KeyNo == 0)
+    {
+        if (!(pk_App->u8_Settings & KS_ALLOW_CHANGE_MK))
+            return ST_PermissionDenied;
+        if (mu8_AuthKeyNo != 0)
+            return ST_AuthentError;
+    }
+    else
+    {
+        byte u8_ChangeKey = pk_App->u8_Settings >> 4;
+        if (u8_ChangeKey == 0x0F)
+            return ST_PermissionDenied;
+        if (u8_ChangeKey == 0x0E) u8_ChangeKey = u8_KeyNo;
+        if (mu8_AuthKeyNo != u8_ChangeKey)
+            return ST_AuthentError;
+    }
+
+    const byte* u8_Crypt   = u8_Params + 1;
+    int         s32_Crypt  = s32_Len - 1;
+    int         s32_Block  = mpi_Session->GetBlockSize();
+    if (s32_Crypt % s32_Block || s32_Crypt > 48)
+        return ST_WrongCommandLen;
+
+    byte u8_Plain[48];
+    memcpy(u8_Plain, u8_Crypt, s32_Crypt);
+    CbcReceive(mpi_Session, u8_Plain, s32_Crypt);
+
+    bool b_SameKey = (u8_KeyNo == mu8_AuthKeyNo);
+    int  s32_KeyLen = KeySize(e_NewType);
+
+    // Key + [AES version] + CRC32 (command) + [CRC32 (new key)]
+    int P = s32_KeyLen;
+    if (e_NewType == DF_KEY_AES) P++;
+    int s32_Needed = P + 4 + (b_SameKey ? 0 : 4);
+    if (PaddedSize(s32_Needed, s32_Block) != s32_Crypt)
+        return ST_WrongCommandLen;
+
+    byte u8_Head[2] = { DF_INS_CHANGE_KEY, u8_Params[0] };
+    uint32_t u32_Crc = Utils::CalcCrc32(u8_Head, 2, u8_Plain, P);
+    if (u32_Crc != GetUint(u8_Plain + P, 4))
+        return ST_IntegrityError;
+
+    byte u8_NewKey[24];
+    memcpy(u8_NewKey, u8_Plain, s32_KeyLen);
+    if (!b_SameKey)
+    {
+        // The new key is XORed with the current key
+        Utils::XorDataBlock(u8_NewKey, pk_App->k_Keys[u8_KeyNo].u8_Data, s32_KeyLen);
+        if (Utils::CalcCrc32(u8_NewKey, s32_KeyLen) != GetUint(u8_Plain + P + 4, 4))
+            return ST_IntegrityError;
+    }
+
+    SimDfKey* pk_Key = &pk_App->k_Keys[u8_KeyNo];
+    memset(pk_Key, 0, sizeof(SimDfKey));
+    memcpy(pk_Key->u8_Data, u8_NewKey, s32_KeyLen);
+    pk_Key->u8_Version = (e_NewType == DF_KEY_AES) ? u8_Plain[s32_KeyLen] : 0;
+    pk_App->e_KeyType  = e_NewType;
+
+    // After changing the key used for the authentication, the session is closed and the card sends no CMAC.
+    if (b_SameKey)
+        Deauthenticate();
+    return ST_Success;
+}
+
+// Params: enc(settings + CRC32 + padding)
+byte SimDesfire::ChangeKeySettings(const byte* u8_Params, int s32_Len)
+{
+    if (mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+    if (!(CurApp()->u8_Settings & KS_CONFIGURATION_CHANGEABLE))
+        return ST_PermissionDenied;
+
+    byte u8_Head[1] = { DF_INS_CHANGE_KEY_SETTINGS };
+    byte u8_Plain[16];
+    byte u8_Status  = UnwrapData(CM_ENCRYPT, u8_Head, 1, u8_Params, s32_Len, 1, u8_Plain);
+    if (u8_Status != ST_Success)
+        return u8_Status;
+
+    CurApp()->u8_Settings = u8_Plain[0];
+    return ST_Success;
+}
+
+// Params: option, enc(data + CRC32 + padding)
+byte SimDesfire::SetConfiguration(const byte* u8_Params, int s32_Len)
+{
+    if (ms32_SelApp != 0 || mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+    if (s32_Len < 1)
+        return ST_WrongCommandLen;
+    if (u8_Params[0] != 0x00) // only the configuration byte is supported (not default key and ATS)
+        return ST_IncorrectParam;
+
+    byte u8_Head[2] = { DFEV1_INS_SET_CONFIGURATION, 0x00 };
+    byte u8_Plain[16];
+    byte u8_Status  = UnwrapData(CM_ENCRYPT, u8_Head, 2, u8_Params + 1, s32_Len - 1, 1, u8_Plain);
+    if (u8_Status != ST_Success)
+        return u8_Status;
+
+    mb_FormatDisabled = (u8_Plain[0] & 0x01) != 0;
+    mb_RandomID       = (u8_Plain[0] & 0x02) != 0;
+    return ST_Success;
+}
+
+byte SimDesfire::GetKeySettings()
+{
+    SimDfApp* pk_App = CurApp();
+    if (!(pk_App->u8_Settings & KS_LISTING_WITHOUT_MK) && mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+
+    mu8_Out[0]  = pk_App->u8_Settings;
+    mu8_Out[1]  = pk_App->u8_KeyCount | pk_App->e_KeyType;
+    ms32_OutLen = 2;
+    return ST_Success;
+}
+
+byte SimDesfire::GetKeyVersion(const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len != 1)
+        return ST_WrongCommandLen;
+
+    SimDfApp* pk_App   = CurApp();
+    byte      u8_KeyNo = u8_Params[0] & 0x3F;
+    if (u8_KeyNo >= pk_App->u8_KeyCount)
+        return ST_KeyDoesNotExist;
+
+    mu8_Out[0]  = KeyVersion(&pk_App->k_Keys[u8_KeyNo], pk_App->e_KeyType);
+    ms32_OutLen = 1;
+    return ST_Success;
+}
+
+// ============================================================================================
+//                                       PICC level
+// ============================================================================================
+
+// 3 frames: hardware info (7), software info (7), UID + batch + production date (14)
+byte SimDesfire::GetVersion()
+{
+    byte u8_Storage = StorageCode(ms32_Storage);
+    const byte u8_Hardware[7] = { 0x04, 0x01, 0x01, 0x01, 0x00, u8_Storage, 0x05 };
+    const byte u8_Software[7] = { 0x04, 0x01, 0x01, 0x01, 0x04, u8_Storage, 0x05 };
+    const byte u8_Batch   [7] = { 0xBA, 0x5E, 0xBA, 0x11, 0x00, 0x23, 0x19 }; // batch number, week, year
+
+    OutAppend(u8_Hardware, 7);
+    OutAppend(u8_Software, 7);
+    OutAppend(mu8_UID,     7);
+    OutAppend(u8_Batch,    7);
+    ms32_FrameSize  = 7;
+    ms32_FrameCount = 2;
+    return ST_Success;
+}
+
+// The response is encrypted: UID + CRC32 (UID + status) + padding. It has no CMAC.
+byte SimDesfire::GetCardUID()
+{
+    if (mu8_AuthKeyNo == NOT_AUTHENTICATED)
+        return ST_AuthentError;
+
+    OutAppend(mu8_UID, 7);
+    OutEncrypt(ST_Success);
+    return ST_Success;
+}
+
+// Params: AID (3), key settings, key count | key type
+byte SimDesfire::CreateApplication(const byte* u8_Params, int s32_Len)
+{
+    if (ms32_SelApp != 0)
+        return ST_PermissionDenied;
+    if (s32_Len < 5)
+        return ST_WrongCommandLen;
+    if (!(mk_Apps[0].u8_Settings & KS_CREATE_DELETE_WITHOUT_MK) && mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+
+    uint32_t       u32_AppID   = GetUint(u8_Params, 3);
+    byte           u8_KeyCount = u8_Params[4] & 0x0F;
+    DESFireKeyType e_KeyType   = (DESFireKeyType)(u8_Params[4] & 0xC0);
+
+    if (u32_AppID == 0 || u8_KeyCount < 1 || u8_KeyCount > SIM_DF_MAX_KEYS || e_KeyType == 0xC0)
+        return ST_IncorrectParam;
+    if (FindApp(u32_AppID) >= 0)
+        return ST_DuplicateAidFiles;
+    if (ms32_AppCount > SIM_DF_MAX_APPS)
+        return ST_InvalidApp;
+
+    if (!AddApplication(u32_AppID, u8_Params[3], u8_KeyCount, e_KeyType))
+        return ST_OutOfMemory;
+
+    // Optional: ISO file ID (2) + DF name (1...16)
+    if (s32_Len > 5 && !SetDFName(u32_AppID, (uint16_t)GetUint(u8_Params + 5, 2), u8_Params + 7, s32_Len - 7))
+        return ST_WrongCommandLen;
+    return ST_Success;
+}
+
+byte SimDesfire::DeleteApplication(const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len != 3)
+        return ST_WrongCommandLen;
+    if (ms32_SelApp != 0)
+        return ST_PermissionDenied;
+    if (!(mk_Apps[0].u8_Settings & KS_CREATE_DELETE_WITHOUT_MK) && mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+
+    int s32_App = FindApp(GetUint(u8_Params, 3));
+    if (s32_App <= 0)
+        return ST_AppNotFound;
+
+    // Keep the creation order for GetApplicationIDs(). The memory is not freed.
+    for (int A=s32_App; A<ms32_AppCount-1; A++)
+    {
+        mk_Apps[A] = mk_Apps[A+1];
+    }
+    ms32_AppCount --;
+    return ST_Success;
+}
+
+// 3 bytes per application, max 19 per frame
+byte SimDesfire::GetApplicationIDs()
+{
+    if (ms32_SelApp != 0)
+        return ST_PermissionDenied;
+    if (!(mk_Apps[0].u8_Settings & KS_LISTING_WITHOUT_MK) && mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+
+    for (int A=1; A<ms32_AppCount; A++)
+    {
+        PutUint(mu8_Out + ms32_OutLen, mk_Apps[A].u32_AID, 3);
+        ms32_OutLen += 3;
+    }
+    ms32_FrameSize  = 19 * 3;
+    ms32_FrameCount = SIM_DF_MAX_APPS;
+    return ST_Success;
+}
+
+// AID (3) + ISO file ID (2) + DF name, one application per frame
+byte SimDesfire::GetDFNames()
+{
+    if (ms32_SelApp != 0)
+        return ST_PermissionDenied;
+    if (!(mk_Apps[0].u8_Settings & KS_LISTING_WITHOUT_MK) && mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+
+    int s32_Frames = 0;
+    for (int A=1; A<ms32_AppCount; A++)
+    {
+        SimDfApp* pk_App = &mk_Apps[A];
+        if (pk_App->u8_DFNameLen == 0)
+            continue;
+
+        PutUint(mu8_Out + ms32_OutLen,     pk_App->u32_AID,    3);
+        PutUint(mu8_Out + ms32_OutLen + 3, pk_App->u16_IsoFid, 2);
+        memcpy (mu8_Out + ms32_OutLen + 5, pk_App->u8_DFName,  pk_App->u8_DFNameLen);
+        ms32_OutLen += 5 + pk_App->u8_DFNameLen;
+        mu8_FrameSizes[s32_Frames++] = 5 + pk_App->u8_DFNameLen;
+    }
+    // The CMAC is appended to the last frame
+    mu8_FrameSizes[max(s32_Frames - 1, 0)] = SIM_DF_FRAME_SIZE;
+    ms32_FrameSize  = 0;
+    ms32_FrameCount = SIM_DF_MAX_APPS;
+    return ST_Success;
+}
+
+byte SimDesfire::SelectApplication(const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len != 3)
+        return ST_WrongCommandLen;
+
+    // Selecting an application always ends the authentication and aborts the transaction
+    CommitTransaction(false);
+    Deauthenticate();
+
+    int s32_App = FindApp(GetUint(u8_Params, 3));
+    if (s32_App < 0)
+        return ST_AppNotFound;
+
+    ms32_SelApp = s32_App;
+    return ST_Success;
+}
+
+byte SimDesfire::FormatPICC()
+{
+    if (ms32_SelApp != 0 || mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+    if (mb_FormatDisabled)
+        return ST_PermissionDenied;
+
+    Format();
+    return ST_Success;
+}
+
+byte SimDesfire::GetFreeMemory()
+{
+    PutUint(mu8_Out, ms32_Storage - ms32_MemUsed, 3);
+    ms32_OutLen = 3;
+    return ST_Success;
+}
+
+// ============================================================================================
+//                                      Application level
+// ============================================================================================
+
+byte SimDesfire::GetFileIDs()
+{
+    if (ms32_SelApp == 0)
+        return ST_PermissionDenied;
+    if (!(CurApp()->u8_Settings & KS_LISTING_WITHOUT_MK) && mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+
+    for (int F=0; F<SIM_DF_MAX_FILES; F++)
+    {
+        if (CurApp()->k_Files[F].b_Exists)
+            mu8_Out[ms32_OutLen++] = F;
+    }
+    return ST_Success;
+}
+
+byte SimDesfire::GetFileSettings(const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len != 1)
+        return ST_WrongCommandLen;
+    if (!(CurApp()->u8_Settings & KS_LISTING_WITHOUT_MK) && mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+
+    SimDfFile* pk_File = GetFile(u8_Params[0]);
+    if (!pk_File)
+        return ST_FileNotFound;
+
+    mu8_Out[0] = pk_File->u8_Type;
+    mu8_Out[1] = pk_File->u8_Comm;
+    PutUint(mu8_Out + 2, pk_File->u16_Access, 2);
+    ms32_OutLen = 4;
+
+    if (pk_File->u8_Type == MDFT_VALUE_FILE_WITH_BACKUP)
+    {
+        PutUint(mu8_Out +  4, pk_File->s32_Lower, 4);
+        PutUint(mu8_Out +  8, pk_File->s32_Upper, 4);
+        PutUint(mu8_Out + 12, pk_File->s32_LimitedCredit, 4);
+        mu8_Out[16] = pk_File->b_LimitedEnabled ? 1 : 0;
+        ms32_OutLen = 17;
+    }
+    else
+    {
+        PutUint(mu8_Out + 4, pk_File->u32_Size, 3);
+        ms32_OutLen = 7;
+    }
+    return ST_Success;
+}
+
+// Params: FileNo, [enc](comm + access + [CRC32 + padding])
+byte SimDesfire::ChangeFileSettings(const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len < 1)
+        return ST_WrongCommandLen;
+
+    SimDfFile* pk_File = GetFile(u8_Params[0]);
+    if (!pk_File)
+        return ST_FileNotFound;
+
+    bool b_Free;
+    byte u8_Status = CheckAccess(pk_File->u16_Access, 0, -1, -1, &b_Free);
+    if (u8_Status != ST_Success)
+        return u8_Status;
+
+    byte u8_Head[2] = { DF_INS_CHANGE_FILE_SETTINGS, u8_Params[0] };
+    byte u8_Plain[16];
+    if (b_Free)
+    {
+        // With free change access the new settings are sent plain (the TX CMAC updates the IV)
+        if (s32_Len != 4)
+            return ST_WrongCommandLen;
+        if (mu8_AuthKeyNo != NOT_AUTHENTICATED)
+        {
+            byte u8_Cmd[5] = { DF_INS_CHANGE_FILE_SETTINGS, u8_Params[0], u8_Params[1], u8_Params[2], u8_Params[3] };
+            byte u8_Mac[16];
+            Cmac(u8_Cmd, 5, u8_Mac);
+        }
+        memcpy(u8_Plain, u8_Params + 1, 3);
+    }
+    else
+    {
+        u8_Status = UnwrapData(CM_ENCRYPT, u8_Head, 2, u8_Params + 1, s32_Len - 1, 3, u8_Plain);
+        if (u8_Status != ST_Success)
+            return u8_Status;
+    }
+
+    if (u8_Plain[0] != CM_PLAIN && u8_Plain[0] != CM_MAC && u8_Plain[0] != CM_ENCRYPT)
+        return ST_IncorrectParam;
+
+    pk_File->u8_Comm    = u8_Plain[0];
+    pk_File->u16_Access = GetUint(u8_Plain + 1, 2);
+    return ST_Success;
+}
+
+// Data file: FileNo, comm, access (2), size (3)
+// Value file: FileNo, comm, access (2), lower (4), upper (4), value (4), limited credit enabled
+byte SimDesfire::CreateFile(byte u8_Ins, const byte* u8_Params, int s32_Len)
+{
+    if (ms32_SelApp == 0)
+        return ST_PermissionDenied;
+    if (!(CurApp()->u8_Settings & KS_CREATE_DELETE_WITHOUT_MK) && mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+
+    bool b_Value = (u8_Ins == DF_INS_CREATE_VALUE_FILE);
+    if (s32_Len != (b_Value ? 17 : 7))
+        return ST_WrongCommandLen;
+
+    byte u8_FileID = u8_Params[0];
+    byte u8_Comm   = u8_Params[1];
+    if (u8_FileID >= SIM_DF_MAX_FILES || (u8_Comm != CM_PLAIN && u8_Comm != CM_MAC && u8_Comm != CM_ENCRYPT))
+        return ST_IncorrectParam;
+
+    SimDfFile* pk_File = &CurApp()->k_Files[u8_FileID];
+    if (pk_File->b_Exists)
+        return ST_DuplicateAidFiles;
+
+    uint16_t u16_Access = GetUint(u8_Params + 2, 2);
+    if (!b_Value)
+    {
+        DESFireFileType e_Type = (u8_Ins == DF_INS_CREATE_BACKUP_DATA_FILE) ? MDFT_BACKUP_DATA_FILE : MDFT_STANDARD_DATA_FILE;
+        int s32_Size = GetUint(u8_Params + 4, 3);
+        if (s32_Size == 0)
+            return ST_IncorrectParam;
+        if (!AddDataFile(CurApp()->u32_AID, u8_FileID, e_Type, (DESFireFileEncryption)u8_Comm, u16_Access, s32_Size))
+            return ST_OutOfMemory;
+        return ST_Success;
+    }
+
+    int32_t s32_Lower = GetUint(u8_Params +  4, 4);
+    int32_t s32_Upper = GetUint(u8_Params +  8, 4);
+    int32_t s32_Value = GetUint(u8_Params + 12, 4);
+    if (s32_Lower > s32_Upper || s32_Value < s32_Lower || s32_Value > s32_Upper)
+        return ST_LimitExceeded;
+    if (Allocate(SIM_DF_ALLOC_SIZE) < 0)
+        return ST_OutOfMemory;
+
+    memset(pk_File, 0, sizeof(SimDfFile));
+    pk_File->b_Exists         = true;
+    pk_File->u8_Type          = MDFT_VALUE_FILE_WITH_BACKUP;
+    pk_File->u8_Comm          = u8_Comm;
+    pk_File->u16_Access       = u16_Access;
+    pk_File->s32_Data         = -1;
+    pk_File->s32_Mirror       = -1;
+    pk_File->s32_Lower        = s32_Lower;
+    pk_File->s32_Upper        = s32_Upper;
+    pk_File->s32_Value        = s32_Value;
+    pk_File->s32_NewValue     = s32_Value;
+    pk_File->b_LimitedEnabled = (u8_Params[16] & 0x01) != 0;
+    return ST_Success;
+}
+
+byte SimDesfire::DeleteFile(const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len != 1)
+        return ST_WrongCommandLen;
+    if (ms32_SelApp == 0)
+        return ST_PermissionDenied;
+    if (!(CurApp()->u8_Settings & KS_CREATE_DELETE_WITHOUT_MK) && mu8_AuthKeyNo != 0)
+        return ST_AuthentError;
+
+    SimDfFile* pk_File = GetFile(u8_Params[0]);
+    if (!pk_File)
+        return ST_FileNotFound;
+
+    // Like on a real card the memory of the file is not freed before FormatPICC
+    pk_File->b_Exists = false;
+    return ST_Success;
+}
+
+// Params: FileNo, offset (3), length (3)
+byte SimDesfire::ReadData(const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len != 7)
+        return ST_WrongCommandLen;
+
+    SimDfFile* pk_File = GetFile(u8_Params[0]);
+    if (!pk_File)
+        return ST_FileNotFound;
+    if (pk_File->u8_Type != MDFT_STANDARD_DATA_FILE && pk_File->u8_Type != MDFT_BACKUP_DATA_FILE)
+        return ST_IncorrectParam;
+
+    bool b_Free;
+    byte u8_Status = CheckAccess(pk_File->u16_Access, 12, 4, -1, &b_Free);
+    if (u8_Status != ST_Success)
+        return u8_Status;
+
+    uint32_t u32_Offset = GetUint(u8_Params + 1, 3);
+    uint32_t u32_Length = GetUint(u8_Params + 4, 3);
+    if (u32_Offset >= pk_File->u32_Size)
+        return ST_LimitExceeded;
+    if (u32_Length == 0)
+        u32_Length = pk_File->u32_Size - u32_Offset;
+    if (u32_Offset + u32_Length > pk_File->u32_Size)
+        return ST_LimitExceeded;
+
+    // A backup file returns the committed data
+    OutAppend(mu8_Memory + pk_File->s32_Data + u32_Offset, u32_Length);
+
+    // With free access the data is always sent plain
+    if (!b_Free && pk_File->u8_Comm == CM_ENCRYPT)
+        OutEncrypt(ST_Success);
+    return ST_Success;
+}
+
+// Params: FileNo, offset (3), length (3), data (may be continued with DF_INS_ADDITIONAL_FRAME)
+byte SimDesfire::WriteData(const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len < 7)
+        return ST_WrongCommandLen;
+
+    SimDfFile* pk_File = GetFile(u8_Params[0]);
+    if (!pk_File)
+        return ST_FileNotFound;
+    if (pk_File->u8_Type != MDFT_STANDARD_DATA_FILE && pk_File->u8_Type != MDFT_BACKUP_DATA_FILE)
+        return ST_IncorrectParam;
+
+    bool b_Free;
+    byte u8_Status = CheckAccess(pk_File->u16_Access, 8, 4, -1, &b_Free);
+    if (u8_Status != ST_Success)
+        return u8_Status;
+
+    uint32_t u32_Offset = GetUint(u8_Params + 1, 3);
+    uint32_t u32_Length = GetUint(u8_Params + 4, 3);
+    if (u32_Length == 0 || u32_Offset + u32_Length > pk_File->u32_Size)
+        return ST_LimitExceeded;
+
+    mu8_WriteHead[0] = DF_INS_WRITE_DATA;
+    memcpy(mu8_WriteHead + 1, u8_Params, 7);
+
+    byte u8_Comm = b_Free ? (byte)CM_PLAIN : pk_File->u8_Comm;
+    ms32_InExpected = WrappedSize(u8_Comm, u32_Length);
+    ms32_InLen      = s32_Len - 7;
+    if (ms32_InLen > ms32_InExpected)
+        return ST_WrongCommandLen;
+
+    memcpy(mu8_In, u8_Params + 7, ms32_InLen);
+    if (ms32_InLen < ms32_InExpected)
+    {
+        me_Pending = PEND_Write;
+        return ST_MoreFrames;
+    }
+    return WriteDataFinish();
+}
+
+// All data of WriteData has been received
+byte SimDesfire::WriteDataFinish()
+{
+    SimDfFile* pk_File = GetFile(mu8_WriteHead[1]);
+    if (!pk_File)
+        return ST_FileNotFound;
+
+    bool b_Free;
+    CheckAccess(pk_File->u16_Access, 8, 4, -1, &b_Free);
+
+    uint32_t u32_Offset = GetUint(mu8_WriteHead + 2, 3);
+    uint32_t u32_Length = GetUint(mu8_WriteHead + 5, 3);
+    byte     u8_Comm    = b_Free ? (byte)CM_PLAIN : pk_File->u8_Comm;
+
+    static byte u8_Plain[SIM_DF_IO_SIZE];
+    byte u8_Status = UnwrapData(u8_Comm, mu8_WriteHead, 8, mu8_In, ms32_InLen, u32_Length, u8_Plain);
+    if (u8_Status != ST_Success)
+        return u8_Status;
+
+    if (pk_File->u8_Type == MDFT_BACKUP_DATA_FILE)
+    {
+        memcpy(mu8_Memory + pk_File->s32_Mirror + u32_Offset, u8_Plain, u32_Length);
+        pk_File->b_Dirty = true;
+    }
+    else
+    {
+        memcpy(mu8_Memory + pk_File->s32_Data + u32_Offset, u8_Plain, u32_Length);
+    }
+    return ST_Success;
+}
+
+byte SimDesfire::GetValue(const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len != 1)
+        return ST_WrongCommandLen;
+
+    SimDfFile* pk_File = GetFile(u8_Params[0]);
+    if (!pk_File)
+        return ST_FileNotFound;
+    if (pk_File->u8_Type != MDFT_VALUE_FILE_WITH_BACKUP)
+        return ST_IncorrectParam;
+
+    // GetValue is allowed with the read, the write and the read/write key
+    bool b_Free;
+    byte u8_Status = CheckAccess(pk_File->u16_Access, 12, 8, 4, &b_Free);
+    if (u8_Status != ST_Success)
+        return u8_Status;
+
+    PutUint(mu8_Out, pk_File->s32_Value, 4);
+    ms32_OutLen = 4;
+    if (!b_Free && pk_File->u8_Comm == CM_ENCRYPT)
+        OutEncrypt(ST_Success);
+    return ST_Success;
+}
+
+// Credit, Debit, LimitedCredit. Params: FileNo, [enc / mac](value (4))
+byte SimDesfire::ChangeValue(byte u8_Ins, const byte* u8_Params, int s32_Len)
+{
+    if (s32_Len < 1)
+        return ST_WrongCommandLen;
+
+    SimDfFile* pk_File = GetFile(u8_Params[0]);
+    if (!pk_File)
+        return ST_FileNotFound;
+    if (pk_File->u8_Type != MDFT_VALUE_FILE_WITH_BACKUP)
+        return ST_IncorrectParam;
+
+    bool b_Free;
+    byte u8_Status;
+    switch (u8_Ins)
+    {
+        case DF_INS_CREDIT: u8_Status = CheckAccess(pk_File->u16_Access, 4, -1, -1, &b_Free); break;
+        case DF_INS_DEBIT:  u8_Status = CheckAccess(pk_File->u16_Access, 12, 8,  4, &b_Free); break;
+        default:            u8_Status = CheckAccess(pk_File->u16_Access, 8,  4, -1, &b_Free); break;
+    }
+    if (u8_Status != ST_Success)
+        return u8_Status;
+
+    byte u8_Head [2] = { u8_Ins, u8_Params[0] };
+    byte u8_Plain[16];
+    u8_Status = UnwrapData(b_Free ? (byte)CM_PLAIN : pk_File->u8_Comm, u8_Head, 2, u8_Params + 1, s32_Len - 1, 4, u8_Plain);
+    if (u8_Status != ST_Success)
+        return u8_Status;
+
+    int32_t s32_Amount = GetUint(u8_Plain, 4);
+    if (s32_Amount < 0)
+        return ST_IncorrectParam;
+
+    switch (u8_Ins)
+    {
+        case DF_INS_CREDIT:
+            if (pk_File->s32_NewValue + (int64_t)s32_Amount > pk_File->s32_Upper)
+                return ST_LimitExceeded;
+            pk_File->s32_NewValue += s32_Amount;
+            break;
+
+        case DF_INS_DEBIT:
+            if (pk_File->s32_NewValue - (int64_t)s32_Amount < pk_File->s32_Lower)
+                return ST_LimitExceeded;
+            pk_File->s32_NewValue -= s32_Amount;
+            pk_File->s32_Debited  += s32_Amount;
+            break;
+
+        default: // DF_INS_LIMITED_CREDIT
+            if (!pk_File->b_LimitedEnabled || pk_File->b_LimitedUsed || s32_Amount > pk_File->s32_LimitedCredit ||
+                pk_File->s32_NewValue + (int64_t)s32_Amount > pk_File->s32_Upper)
+                return ST_LimitExceeded;
+            pk_File->s32_NewValue += s32_Amount;
+            pk_File->b_LimitedUsed = true;
+            break;
+    }
+    pk_File->b_Dirty = true;
+    return ST_Success;
+}
+
+// Commits or aborts all modifications of backup and value files in the selected application
+byte SimDesfire::CommitTransaction(bool b_Commit)
+{
+    SimDfApp* pk_App = CurApp();
+    for (int F=0; F<SIM_DF_MAX_FILES; F++)
+    {
+        SimDfFile* pk_File = &pk_App->k_Files[F];
+        if (!pk_File->b_Exists || !pk_File->b_Dirty)
+            continue;
+
+        if (pk_File->u8_Type == MDFT_VALUE_FILE_WITH_BACKUP)
+        {
+            if (b_Commit)
+            {
+                pk_File->s32_Value = pk_File->s32_NewValue;
+                // After a Debit the debited amount may be given back once with LimitedCredit
+                if (pk_File->s32_Debited > 0)   pk_File->s32_LimitedCredit = pk_File->s32_Debited;
+                else if (pk_File->b_LimitedUsed) pk_File->s32_LimitedCredit = 0;
+            }
+            pk_File->s32_NewValue  = pk_File->s32_Value;
+            pk_File->s32_Debited   = 0;
+            pk_File->b_LimitedUsed = false;
+        }
+        else // backup data file
+        {
+            if (b_Commit) memcpy(mu8_Memory + pk_File->s32_Data,   mu8_Memory + pk_File->s32_Mirror, pk_File->u32_Size);
+            else          memcpy(mu8_Memory + pk_File->s32_Mirror, mu8_Memory + pk_File->s32_Data,   pk_File->u32_Size);
+        }
+        pk_File->b_Dirty = false;
+    }
+    return ST_Success;
+}
+
+// ============================================================================================
+//                                           Helpers
+// ============================================================================================
+
+SimDfApp* SimDesfire::CurApp()
+{
+    return &mk_Apps[ms32_SelApp];
+}
+
+// returns NULL if the file does not exist or no application is selected
+SimDfFile* SimDesfire::GetFile(byte u8_FileID)
+{
+    if (ms32_SelApp == 0 || u8_FileID >= SIM_DF_MAX_FILES || !CurApp()->k_Files[u8_FileID].b_Exists)
+        return NULL;
+    return &CurApp()->k_Files[u8_FileID];
+}
+
+// returns the index in mk_Apps or -1
+int SimDesfire::FindApp(uint32_t u32_AppID)
+{
+    for (int A=0; A<ms32_AppCount; A++)
+    {
+        if (mk_Apps[A].u32_AID == u32_AppID)
+            return A;
+    }
+    return -1;
+}
+
+// Allocates EEPROM in blocks of 32 byte. returns the offset in mu8_Memory or -1 if the card is full.
+int SimDesfire::Allocate(int s32_Size)
+{
+    int s32_Alloc = PaddedSize(s32_Size, SIM_DF_ALLOC_SIZE);
+    if (ms32_MemUsed + s32_Alloc > ms32_Storage)
+        return -1;
+
+    int s32_Offset = ms32_MemUsed;
+    ms32_MemUsed += s32_Alloc;
+    return s32_Offset;
+}
+
+// Checks the access rights of a file command.
+// s32_RightX = bit position of an access right in u16_Access that allows the command (-1 = unused)
+// pb_Free = true if one of the rights is "free access" -> the data is transferred plain.
+byte SimDesfire::CheckAccess(uint16_t u16_Access, int s32_Right1, int s32_Right2, int s32_Right3, bool* pb_Free)
+{
+    int  s32_Rights[3] = { s32_Right1, s32_Right2, s32_Right3 };
+    bool b_Allowed = false;
+    *pb_Free = false;
+
+    for (int i=0; i<3; i++)
+    {
+        if (s32_Rights[i] < 0)
+            continue;
+
+        byte u8_Key = (u16_Access >> s32_Rights[i]) & 0x0F;
+        if (u8_Key == AR_FREE)
+        {
+            *pb_Free = true;
+            return ST_Success;
+        }
+        if (u8_Key == AR_NEVER)
+            continue;
+
+        b_Allowed = true;
+        if (u8_Key == mu8_AuthKeyNo)
+            return ST_Success;
+    }
+    return b_Allowed ? ST_AuthentError : ST_PermissionDenied;
+}
+
+int SimDesfire::KeySize(DESFireKeyType e_KeyType)
+{
+    return (e_KeyType == DF_KEY_3K3DES) ? 24 : 16;
+}
+
+byte SimDesfire::KeyVersion(const SimDfKey* pk_Key, DESFireKeyType e_KeyType)
+{
+    if (e_KeyType == DF_KEY_AES)
+        return pk_Key->u8_Version;
+
+    // DES: the version is stored in the parity bits of the first 8 bytes
+    byte u8_Version = 0;
+    for (int i=0; i<8; i++)
+    {
+        u8_Version = (u8_Version << 1) | (pk_Key->u8_Data[i] & 0x01);
+    }
+    return u8_Version;
+}
+
+// Loads a stored key into mi_KeyAes or mi_KeyDes for the authentication
+DESFireKey* SimDesfire::LoadKey(const SimDfKey* pk_Key, DESFireKeyType e_KeyType)
+{
+    switch (e_KeyType)
+    {
+        case DF_KEY_AES:
+            mi_KeyAes.SetKeyData(pk_Key->u8_Data, 16, 0);
+            return &mi_KeyAes;
+
+        case DF_KEY_3K3DES:
+            mi_KeyDes.SetKeyData(pk_Key->u8_Data, 24, 0);
+            return &mi_KeyDes;
+
+        default:
+        {
+            // A 2K3DES key with K1 == K2 (ignoring the parity bits) is a simple DES key
+            bool b_Simple = true;
+            for (int i=0; i<8; i++)
+            {
+                if ((pk_Key->u8_Data[i] ^ pk_Key->u8_Data[i+8]) & 0xFE) b_Simple = false;
+            }
+            mi_KeyDes.SetKeyData(pk_Key->u8_Data, b_Simple ? 8 : 16, 0);
+            return &mi_KeyDes;
+        }
+    }
+}
+
+void SimDesfire::Deauthenticate()
+{
+    mu8_AuthKeyNo = NOT_AUTHENTICATED;
+    mpi_Session   = NULL;
+}
+
+void SimDesfire::OutAppend(const byte* u8_Data, int s32_Len)
+{
+    memcpy(mu8_Out + ms32_OutLen, u8_Data, s32_Len);
+    ms32_OutLen += s32_Len;
+}
+
+// Encrypts the response: data + CRC32 (data + status) + zero padding. An encrypted response has no CMAC.
+void SimDesfire::OutEncrypt(byte u8_Status)
+{
+    uint32_t u32_Crc = Utils::CalcCrc32(mu8_Out, ms32_OutLen, &u8_Status, 1);
+    PutUint(mu8_Out + ms32_OutLen, u32_Crc, 4);
+    ms32_OutLen += 4;
+
+    int s32_Padded = PaddedSize(ms32_OutLen, mpi_Session->GetBlockSize());
+    memset(mu8_Out + ms32_OutLen, 0, s32_Padded - ms32_OutLen);
+    ms32_OutLen = s32_Padded;
+
+    CbcSend(mpi_Session, mu8_Out, ms32_OutLen);
+    mb_NoRespMac = true;
+}
+
+// The count of bytes that the host sends for s32_PlainLen bytes of data in the given communication mode
+int SimDesfire::WrappedSize(byte u8_Comm, int s32_PlainLen)
+{
+    if (mu8_AuthKeyNo == NOT_AUTHENTICATED)
+        return s32_PlainLen;
+
+    switch (u8_Comm)
+    {
+        case CM_MAC:     return s32_PlainLen + 8;
+        case CM_ENCRYPT: return PaddedSize(s32_PlainLen + 4, mpi_Session->GetBlockSize());
+        default:         return s32_PlainLen;
+    }
+}
+
+// Verifies / decrypts the data part of a command.
+// u8_Head = command + unencrypted parameters (included in CRC and CMAC)
+// plain:   data                          -> the CMAC over the command updates the IV
+// MAC:     data + CMAC (8)               -> verify the CMAC
+// encrypt: enc(data + CRC32 + padding)   -> decrypt and verify the CRC
+byte SimDesfire::UnwrapData(byte u8_Comm, const byte* u8_Head, int s32_HeadLen, const byte* u8_In, int s32_InLen,
+                            int s32_PlainLen, byte* u8_Plain)
+{
+    if (s32_InLen != WrappedSize(u8_Comm, s32_PlainLen))
+        return ST_WrongCommandLen;
+
+    static byte u8_Cmd[SIM_DF_IO_SIZE + 16];
+    memcpy(u8_Cmd, u8_Head, s32_HeadLen);
+
+    if (mu8_AuthKeyNo == NOT_AUTHENTICATED)
+    {
+        if (u8_Comm != CM_PLAIN)
+            return ST_AuthentError;
+        memcpy(u8_Plain, u8_In, s32_PlainLen);
+        return ST_Success;
+    }
+
+    byte u8_Mac[16];
+    switch (u8_Comm)
+    {
+        case CM_MAC:
+            memcpy(u8_Cmd + s32_HeadLen, u8_In, s32_PlainLen);
+            Cmac(u8_Cmd, s32_HeadLen + s32_PlainLen, u8_Mac);
+            if (memcmp(u8_Mac, u8_In + s32_PlainLen, 8) != 0)
+                return ST_IntegrityError;
+            memcpy(u8_Plain, u8_In, s32_PlainLen);
+            return ST_Success;
+
+        case CM_ENCRYPT:
+        {
+            byte* u8_Dec = u8_Cmd + s32_HeadLen;
+            memcpy(u8_Dec, u8_In, s32_InLen);
+            CbcReceive(mpi_Session, u8_Dec, s32_InLen);
+
+            uint32_t u32_Crc = Utils::CalcCrc32(u8_Cmd, s32_HeadLen + s32_PlainLen);
+            if (u32_Crc != GetUint(u8_Dec + s32_PlainLen, 4))
+                return ST_IntegrityError;
+            // The padding must be zero
+            for (int i=s32_PlainLen + 4; i<s32_InLen; i++)
+            {
+                if (u8_Dec[i]) return ST_IntegrityError;
+            }
+            memcpy(u8_Plain, u8_Dec, s32_PlainLen);
+            return ST_Success;
+        }
+
+        default: // CM_PLAIN
+            memcpy(u8_Cmd + s32_HeadLen, u8_In, s32_PlainLen);
+            Cmac(u8_Cmd, s32_HeadLen + s32_PlainLen, u8_Mac);
+            memcpy(u8_Plain, u8_In, s32_PlainLen);
+            return ST_Success;
+    }
+}
+
+// ============================================================================================
+//                                    Card side crypto
+// ============================================================================================
+
+// CBC as used by DESFire for data sent by the card: XOR with the IV, then encipher.
+void SimDesfire::CbcSend(DESFireKey* pi_Key, byte* u8_Data, int s32_Len)
+{
+    int s32_Block = pi_Key->GetBlockSize();
+    for (int B=0; B<s32_Len; B+=s32_Block)
+    {
+        Utils::XorDataBlock(u8_Data + B, mu8_IV, s32_Block);
+        pi_Key->CryptDataBlock(u8_Data + B, u8_Data + B, KEY_ENCIPHER);
+        memcpy(mu8_IV, u8_Data + B, s32_Block);
+    }
+}
+
+// CBC for data received by the card: decipher, then XOR with the IV. The IV is the received block.
+void SimDesfire::CbcReceive(DESFireKey* pi_Key, byte* u8_Data, int s32_Len)
+{
+    int  s32_Block = pi_Key->GetBlockSize();
+    byte u8_Next[16];
+    for (int B=0; B<s32_Len; B+=s32_Block)
+    {
+        memcpy(u8_Next, u8_Data + B, s32_Block);
+        pi_Key->CryptDataBlock(u8_Data + B, u8_Data + B, KEY_DECIPHER);
+        Utils::XorDataBlock(u8_Data + B, mu8_IV, s32_Block);
+        memcpy(mu8_IV, u8_Next, s32_Block);
+    }
+}
+
+// CMAC with the session key (NIST SP 800-38B). The IV is chained: the result becomes the new IV.
+void SimDesfire::Cmac(const byte* u8_Data, int s32_Len, byte u8_Mac[16])
+{
+    int  s32_Block = mpi_Session->GetBlockSize();
+    byte u8_Last[16];
+
+    // The last block is XORed with subkey 1 if complete, otherwise padded with 80 00 .. and XORed with subkey 2
+    int s32_Full = (s32_Len > 0 && s32_Len % s32_Block == 0) ? s32_Len - s32_Block : s32_Len - (s32_Len % s32_Block);
+    int s32_Rest = s32_Len - s32_Full;
+    memset(u8_Last, 0, s32_Block);
+    memcpy(u8_Last, u8_Data + s32_Full, s32_Rest);
+    if (s32_Rest == s32_Block)
+    {
+        Utils::XorDataBlock(u8_Last, mu8_Cmac1, s32_Block);
+    }
+    else
+    {
+        u8_Last[s32_Rest] = 0x80;
+        Utils::XorDataBlock(u8_Last, mu8_Cmac2, s32_Block);
+    }
+
+    for (int B=0; B<s32_Full; B+=s32_Block)
+    {
+        Utils::XorDataBlock(mu8_IV, u8_Data + B, s32_Block);
+        mpi_Session->CryptDataBlock(mu8_IV, mu8_IV, KEY_ENCIPHER);
+    }
+    Utils::XorDataBlock(mu8_IV, u8_Last, s32_Block);
+    mpi_Session->CryptDataBlock(mu8_IV, mu8_IV, KEY_ENCIPHER);
+
+    memcpy(u8_Mac, mu8_IV, s32_Block);
+}
+
+// xorshift32: deterministic, so that a simulation can be repeated
+void SimDesfire::Random(byte* u8_Data, int s32_Len)
+{
+    for (int i=0; i<s32_Len; i++)
+    {
+        mu32_Random ^= mu32_Random << 13;
+        mu32_Random ^= mu32_Random >> 17;
+        mu32_Random ^= mu32_Random << 5;
+        u8_Data[i] = (byte)mu32_Random;
+    }
+}
+
+#endif // PN532_HOST
@@ -0,0 +1,217 @@
+/**************************************************************************
+
+    SimDesfire: A software DESFire EV1 card for the simulated PN532 (PN532_SIM)
+
+    This is a card side model of the DESFire EV1 native command set as it is
+    used by the PN532 class: PICC and application level, up to 28
+    applications with up to 14 keys (2K3DES, 3K3DES or AES), standard and
+    backup data files, value files with transactions, ISO and AES
+    authentication, session keys, IV chaining, CMAC, encrypted commands
+    (ChangeKey, ChangeKeySettings, SetConfiguration) and the communication
+    modes plain, MACed and encrypted. The ISO file ID and DF name of an
+    application are stored for GetDFNames (see SetDFName()).
+
+    The card side crypto uses only AES::CryptDataBlock() and
+    DES::CryptDataBlock(). CBC, CMAC and the session key IV are implemented
+    here independently of DESFireKey, so an error in the host side
+    implementation shows up as an integrity error, exactly like with a
+    real card.
+
+    Like a real card the memory of deleted applications and files is
+    not reclaimed before FormatPICC.
+
+    Not modelled: record files, legacy authentication (0x0A) and ISO 7816
+    commands.
+
+**************************************************************************/
+
+#ifndef __SIM_DESFIRE_H__
+#define __SIM_DESFIRE_H__
+
+#include "PN532_SIM.h"
+#include "PN532.h"
+
+#define SIM_DF_MAX_APPS        28
+#define SIM_DF_MAX_KEYS        14
+#define SIM_DF_MAX_FILES       32
+#define SIM_DF_MAX_STORAGE     8192 // the largest card (8 kB EEPROM)
+#define SIM_DF_FRAME_SIZE      59   // the maximum data bytes in a response frame (+ 1 status byte)
+#define SIM_DF_ALLOC_SIZE      32   // the EEPROM is allocated in blocks of 32 bytes
+#define SIM_DF_IO_SIZE         (SIM_DF_MAX_STORAGE + 64) // a complete file + header + CRC / CMAC + padding
+
+struct SimDfKey
+{
+    byte u8_Data[24];  // DES keys store their version in the parity bits (see DES::StoreKeyVersion())
+    byte u8_Version;   // used only for AES keys
+};
+
+struct SimDfFile
+{
+    bool     b_Exists;
+    byte     u8_Type;         // DESFireFileType
+    byte     u8_Comm;         // DESFireFileEncryption
+    uint16_t u16_Access;      // DESFireFilePermissions::Pack()
+    // data files
+    uint32_t u32_Size;
+    int      s32_Data;        // offset of the committed data in mu8_Memory
+    int      s32_Mirror;      // offset of the uncommitted data (backup data file) or -1
+    // value files
+    int32_t  s32_Value;
+    int32_t  s32_NewValue;    // the value after CommitTransaction
+    int32_t  s32_Lower;
+    int32_t  s32_Upper;
+    int32_t  s32_LimitedCredit;
+    int32_t  s32_Debited;     // sum of all Debit() in the current transaction
+    bool     b_LimitedEnabled;
+    bool     b_LimitedUsed;
+    bool     b_Dirty;         // the file has been modified in the current transaction
+};
+
+struct SimDfApp
+{
+    uint32_t       u32_AID;
+    byte           u8_Settings;
+    byte           u8_KeyCount;
+    DESFireKeyType e_KeyType;
+    uint16_t       u16_IsoFid;
+    byte           u8_DFName[16];
+    byte           u8_DFNameLen;   // 0 = the application has no DF name
+    SimDfKey       k_Keys [SIM_DF_MAX_KEYS];
+    SimDfFile      k_Files[SIM_DF_MAX_FILES];
+};
+
+class SimDesfire : public SimCard
+{
+public:
+    // s32_Storage = 2048, 4096 or 8192
+    SimDesfire(const byte u8_UID[7], int s32_Storage = SIM_DF_MAX_STORAGE);
+
+    uint16_t GetATQA();
+    byte     GetSAK();
+    int      GetUID(byte u8_UID[10]);
+    int      GetATS(byte* u8_ATS, int s32_MaxLen);
+    void     Reset();
+    int      Transceive(const byte* u8_Command, int s32_CmdLen, byte* u8_Response, int s32_RespSize);
+
+    // Provisioning functions for tests and benchmarks. They bypass all permissions like a card personalisation.
+    void Format();
+    bool AddApplication(uint32_t u32_AppID, byte u8_Settings, byte u8_KeyCount, DESFireKeyType e_KeyType);
+    bool AddDataFile   (uint32_t u32_AppID, byte u8_FileID, DESFireFileType e_Type, DESFireFileEncryption e_Comm,
+                        uint16_t u16_Access, int s32_Size, const byte* u8_Data = NULL);
+    bool SetKey        (uint32_t u32_AppID, byte u8_KeyNo, const byte* u8_Key, byte u8_Version = 0);
+    bool SetDFName     (uint32_t u32_AppID, uint16_t u16_IsoFid, const byte* u8_Name, int s32_NameLen);
+
+    // The status of the last command (for tests that expect a specific error)
+    inline byte GetLastStatus()
+    {
+        return mu8_LastStatus;
+    }
+
+private:
+    enum ePending
+    {
+        PEND_None,
+        PEND_Auth,    // waiting for the second authentication frame
+        PEND_Output,  // more response frames are waiting for DF_INS_ADDITIONAL_FRAME
+        PEND_Write,   // more data frames are expected for WriteData
+    };
+
+    byte Execute          (const byte* u8_Cmd, int s32_Len);
+    byte Continue         (const byte* u8_Data, int s32_Len);
+    int  SendFrame        (byte u8_Status, byte* u8_Response);
+
+    byte AuthenticateStep1(byte u8_Ins, const byte* u8_Params, int s32_Len);
+    byte AuthenticateStep2(const byte* u8_Data, int s32_Len);
+    byte ChangeKey        (const byte* u8_Params, int s32_Len);
+    byte ChangeKeySettings(const byte* u8_Params, int s32_Len);
+    byte SetConfiguration (const byte* u8_Params, int s32_Len);
+    byte GetKeySettings   ();
+    byte GetKeyVersion    (const byte* u8_Params, int s32_Len);
+    byte GetVersion       ();
+    byte GetCardUID       ();
+    byte CreateApplication(const byte* u8_Params, int s32_Len);
+    byte DeleteApplication(const byte* u8_Params, int s32_Len);
+    byte GetApplicationIDs();
+    byte GetDFNames       ();
+    byte SelectApplication(const byte* u8_Params, int s32_Len);
+    byte FormatPICC       ();
+    byte GetFreeMemory    ();
+    byte GetFileIDs       ();
+    byte GetFileSettings  (const byte* u8_Params, int s32_Len);
+    byte ChangeFileSettings(const byte* u8_Params, int s32_Len);
+    byte CreateFile       (byte u8_Ins, const byte* u8_Params, int s32_Len);
+    byte DeleteFile       (const byte* u8_Params, int s32_Len);
+    byte ReadData         (const byte* u8_Params, int s32_Len);
+    byte WriteData        (const byte* u8_Params, int s32_Len);
+    byte WriteDataFinish  ();
+    byte GetValue         (const byte* u8_Params, int s32_Len);
+    byte ChangeValue      (byte u8_Ins, const byte* u8_Params, int s32_Len);
+    byte CommitTransaction(bool b_Commit);
+
+    // ---------- helpers ----------
+    SimDfApp*  CurApp();
+    SimDfFile* GetFile(byte u8_FileID);
+    int        FindApp(uint32_t u32_AppID);
+    int        Allocate(int s32_Size);
+    bool       IsAuth(byte u8_KeyNo);
+    bool       IsMasterAuth();
+    byte       CheckAccess(uint16_t u16_Access, int s32_Right1, int s32_Right2, int s32_Right3, bool* pb_Free);
+    int        KeySize(DESFireKeyType e_KeyType);
+    byte       KeyVersion(const SimDfKey* pk_Key, DESFireKeyType e_KeyType);
+    DESFireKey* LoadKey(const SimDfKey* pk_Key, DESFireKeyType e_KeyType);
+    void       Deauthenticate();
+    void       OutAppend(const byte* u8_Data, int s32_Len);
+    void       OutEncrypt(byte u8_Status);
+    byte       UnwrapData(byte u8_Comm, const byte* u8_Head, int s32_HeadLen, const byte* u8_In, int s32_InLen,
+                          int s32_PlainLen, byte* u8_Plain);
+    int        WrappedSize(byte u8_Comm, int s32_PlainLen);
+
+    // ---------- crypto (card side) ----------
+    void       CbcSend   (DESFireKey* pi_Key, byte* u8_Data, int s32_Len);
+    void       CbcReceive(DESFireKey* pi_Key, byte* u8_Data, int s32_Len);
+    void       Cmac      (const byte* u8_Data, int s32_Len, byte u8_Mac[16]);
+    void       Random    (byte* u8_Data, int s32_Len);
+
+    // ---------- card data (EEPROM) ----------
+    byte       mu8_UID[7];
+    int        ms32_Storage;
+    SimDfApp   mk_Apps[SIM_DF_MAX_APPS + 1]; // [0] = PICC level
+    int        ms32_AppCount;                // including the PICC
+    byte       mu8_Memory[SIM_DF_MAX_STORAGE];
+    int        ms32_MemUsed;
+    bool       mb_RandomID;
+    bool       mb_FormatDisabled;
+
+    // ---------- session state (RAM) ----------
+    int        ms32_SelApp;                  // index in mk_Apps
+    byte       mu8_AuthKeyNo;                // NOT_AUTHENTICATED or the key number
+    byte       mu8_AuthPendingKey;
+    DESFireKey* mpi_AuthKey;                 // key used in the authentication (PEND_Auth)
+    DESFireKey* mpi_Session;                 // session key
+    AES        mi_KeyAes, mi_SessAes;
+    DES        mi_KeyDes, mi_SessDes;
+    byte       mu8_IV[16];                   // IV of the session key
+    byte       mu8_Cmac1[16];                // CMAC subkeys of the session key
+    byte       mu8_Cmac2[16];
+    byte       mu8_RndB[16];
+    int        ms32_RndSize;
+    byte       mu8_RandomUID[4];
+    uint32_t   mu32_Random;
+
+    ePending   me_Pending;
+    byte       mu8_Out[SIM_DF_IO_SIZE];      // the complete response (all frames)
+    int        ms32_OutLen;
+    int        ms32_OutPos;
+    int        ms32_FrameSize;               // the size of the first ms32_FrameCount response frames
+    int        ms32_FrameCount;              // (0 = the sizes are stored in mu8_FrameSizes)
+    byte       mu8_FrameSizes[SIM_DF_MAX_APPS]; // GetDFNames: one application per frame
+    int        ms32_FrameNo;
+    bool       mb_NoRespMac;                 // the response is encrypted or part of an authentication -> no CMAC
+    byte       mu8_In[SIM_DF_IO_SIZE];       // the collected data of a chained WriteData
+    int        ms32_InLen;
+    int        ms32_InExpected;
+    byte       mu8_WriteHead[8];             // DF_INS_WRITE_DATA + file + offset + length
+    byte       mu8_LastStatus;
+};
+
+#endif
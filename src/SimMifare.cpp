@@ -0,0 +1,699 @@
+/**************************************************************************
+
+    SimMifare: Software MIFARE Classic and Ultralight / NTAG cards.
+    See SimMifare.h
+
+**************************************************************************/
+
+#ifdef PN532_HOST
+
+#include "SimMifare.h"
+#include <stdio.h>
+
+#define MF_ACK          0x0A // 4 bit ACK of MIFARE Classic and Ultralight
+
+// Access rules of the sector trailer (AN10833 / MF1S50 datasheet)
+#define RULE_NEVER      0
+#define RULE_KEY_A      1
+#define RULE_KEY_B      2
+#define RULE_KEY_AB     3
+
+// Indexed with the access bits C1 C2 C3 of a data block
+static const byte gu8_DataRead [8] = { RULE_KEY_AB, RULE_KEY_AB, RULE_KEY_AB, RULE_KEY_B,  RULE_KEY_AB, RULE_KEY_B,  RULE_KEY_AB, RULE_NEVER };
+static const byte gu8_DataWrite[8] = { RULE_KEY_AB, RULE_NEVER,  RULE_NEVER,  RULE_KEY_B,  RULE_KEY_B,  RULE_NEVER,  RULE_KEY_B,  RULE_NEVER };
+
+// Indexed with the access bits C1 C2 C3 of the sector trailer
+static const byte gu8_KeyAWrite  [8] = { RULE_KEY_A, RULE_KEY_A, RULE_NEVER, RULE_KEY_B,  RULE_KEY_B,  RULE_NEVER,  RULE_NEVER,  RULE_NEVER };
+static const byte gu8_AccessRead [8] = { RULE_KEY_A, RULE_KEY_A, RULE_KEY_A, RULE_KEY_AB, RULE_KEY_AB, RULE_KEY_AB, RULE_KEY_AB, RULE_KEY_AB };
+static const byte gu8_AccessWrite[8] = { RULE_NEVER, RULE_KEY_A, RULE_NEVER, RULE_KEY_B,  RULE_NEVER,  RULE_KEY_B,  RULE_NEVER,  RULE_NEVER };
+static const byte gu8_KeyBRead   [8] = { RULE_KEY_A, RULE_KEY_A, RULE_KEY_A, RULE_NEVER,  RULE_NEVER,  RULE_NEVER,  RULE_NEVER,  RULE_NEVER };
+static const byte gu8_KeyBWrite  [8] = { RULE_KEY_A, RULE_KEY_A, RULE_NEVER, RULE_KEY_B,  RULE_KEY_B,  RULE_NEVER,  RULE_NEVER,  RULE_NEVER };
+
+static bool IsAllowed(byte u8_Rule, bool b_KeyB)
+{
+    return (u8_Rule & (b_KeyB ? RULE_KEY_B : RULE_KEY_A)) != 0;
+}
+
+static bool ReadImageFile(const char* s8_Path, byte* u8_Buffer, int s32_MaxSize, int* ps32_Size)
+{
+    FILE* pk_File = fopen(s8_Path, "rb");
+    if (!pk_File)
+        return false;
+
+    *ps32_Size = fread(u8_Buffer, 1, s32_MaxSize, pk_File);
+    fclose(pk_File);
+    return *ps32_Size > 0;
+}
+
+static bool WriteImageFile(const char* s8_Path, const byte* u8_Image, int s32_Size)
+{
+    FILE* pk_File = fopen(s8_Path, "wb");
+    if (!pk_File)
+        return false;
+
+    bool b_Ok = (int)fwrite(u8_Image, 1, s32_Size, pk_File) == s32_Size;
+    fclose(pk_File);
+    return b_Ok;
+}
+
+// ============================================================================================
+//                                          Crypto1
+// ============================================================================================
+
+// The bits of a 32 bit word are transmitted byte by byte beginning with the highest byte, each byte LSB first.
+static inline byte WordBit(uint32_t u32_Word, int s32_Bit)
+{
+    return (u32_Word >> (s32_Bit ^ 24)) & 1;
+}
+
+// The 4 input functions fa, fb and the 5 input function fc of the Crypto1 filter
+static inline byte FilterA(byte a, byte b, byte c, byte d)
+{
+    return ((a | b) ^ (a & d)) ^ (c & ((a ^ b) | d));
+}
+
+static inline byte FilterB(byte a, byte b, byte c, byte d)
+{
+    return ((a & b) | c) ^ ((a ^ b) & (c | d));
+}
+
+static inline byte FilterC(byte a, byte b, byte c, byte d, byte e)
+{
+    return (a | ((b | e) & (d ^ e))) ^ ((a ^ (b & d)) & ((c ^ d) | (b & e)));
+}
+
+// The LFSR is stored as 48 bit with bit 0 = the oldest bit (x0) and bit 47 = x47.
+// mu32_Even holds x0, x2, ... x46, mu32_Odd holds x1, x3, ... x47 (bit 0 = lowest index).
+// Feedback polynomial: x0 x5 x9 x10 x12 x14 x15 x17 x19 x24 x25 x27 x29 x35 x39 x41 x42 x43
+#define LFSR_TAPS_EVEN  0x2010E1 // x0 x10 x12 x14 x24 x42
+#define LFSR_TAPS_ODD   0x3A7394 // x5 x9 x15 x17 x19 x25 x27 x29 x35 x39 x41 x43
+
+static inline byte Parity(uint32_t u32_Value)
+{
+    u32_Value ^= u32_Value >> 16;
+    u32_Value ^= u32_Value >> 8;
+    u32_Value ^= u32_Value >> 4;
+    return (0x6996 >> (u32_Value & 0xF)) & 1;
+}
+
+// Key bit i is the bit i of the key in transmission order (byte 0 first, each byte LSB first)
+void SimCrypto1::Init(const byte u8_Key[6])
+{
+    mu32_Even = 0;
+    mu32_Odd  = 0;
+    for (int i=0; i<48; i++)
+    {
+        byte u8_Bit = (u8_Key[i / 8] >> (i % 8)) & 1;
+        if (i & 1) mu32_Odd  |= (uint32_t)u8_Bit << (i >> 1);
+        else       mu32_Even |= (uint32_t)u8_Bit << (i >> 1);
+    }
+}
+
+// Clocks the LFSR once. Returns the keystream bit.
+// b_Encrypted = true: u8_In is encrypted with the returned keystream bit (the plaintext is fed into the LFSR)
+byte SimCrypto1::Bit(byte u8_In, bool b_Encrypted)
+{
+    // The filter uses the 20 odd bits x9, x11 ... x47
+    uint32_t O = mu32_Odd;
+    byte u8_Out = FilterC(FilterA((O >>  4) & 1, (O >>  5) & 1, (O >>  6) & 1, (O >>  7) & 1),
+                          FilterB((O >>  8) & 1, (O >>  9) & 1, (O >> 10) & 1, (O >> 11) & 1),
+                          FilterB((O >> 12) & 1, (O >> 13) & 1, (O >> 14) & 1, (O >> 15) & 1),
+                          FilterA((O >> 16) & 1, (O >> 17) & 1, (O >> 18) & 1, (O >> 19) & 1),
+                          FilterB((O >> 20) & 1, (O >> 21) & 1, (O >> 22) & 1, (O >> 23) & 1));
+
+    byte u8_Feed = (u8_In & 1) ^ (b_Encrypted ? u8_Out : 0);
+    u8_Feed ^= Parity((mu32_Even & LFSR_TAPS_EVEN) ^ (mu32_Odd & LFSR_TAPS_ODD));
+
+    // Shift by one: x1 becomes x0, the feedback becomes x47. The odd bits become the even bits.
+    uint32_t u32_NewOdd = (mu32_Even >> 1) | ((uint32_t)u8_Feed << 23);
+    mu32_Even = mu32_Odd;
+    mu32_Odd  = u32_NewOdd;
+    return u8_Out;
+}
+
+byte SimCrypto1::Byte(byte u8_In, bool b_Encrypted)
+{
+    byte u8_Out = 0;
+    for (int i=0; i<8; i++)
+    {
+        u8_Out |= Bit((u8_In >> i) & 1, b_Encrypted) << i;
+    }
+    return u8_Out;
+}
+
+uint32_t SimCrypto1::Word(uint32_t u32_In, bool b_Encrypted)
+{
+    uint32_t u32_Out = 0;
+    for (int i=0; i<32; i++)
+    {
+        u32_Out |= (uint32_t)Bit(WordBit(u32_In, i), b_Encrypted) << (i ^ 24);
+    }
+    return u32_Out;
+}
+
+// The card nonce is generated by a 16 bit LFSR: n[k+16] = n[k] ^ n[k+2] ^ n[k+3] ^ n[k+5]
+uint32_t SimCrypto1::PrngSuccessor(uint32_t u32_Nonce, int s32_Count)
+{
+    // Convert to transmission order (bit i = nonce bit i)
+    uint32_t u32_Seq = 0;
+    for (int i=0; i<32; i++)
+    {
+        u32_Seq |= (uint32_t)WordBit(u32_Nonce, i) << i;
+    }
+
+    while (s32_Count--)
+    {
+        uint32_t u32_Feed = ((u32_Seq >> 16) ^ (u32_Seq >> 18) ^ (u32_Seq >> 19) ^ (u32_Seq >> 21)) & 1;
+        u32_Seq = (u32_Seq >> 1) | (u32_Feed << 31);
+    }
+
+    uint32_t u32_Out = 0;
+    for (int i=0; i<32; i++)
+    {
+        u32_Out |= ((u32_Seq >> i) & 1) << (i ^ 24);
+    }
+    return u32_Out;
+}
+
+// ============================================================================================
+//                                      MIFARE Classic
+// ============================================================================================
+
+SimMifareClassic::SimMifareClassic(const byte u8_UID[4], bool b_4K)
+{
+    ms32_Size = b_4K ? SIM_MF_4K_SIZE : SIM_MF_1K_SIZE;
+    memset(mu8_Memory, 0, sizeof(mu8_Memory));
+
+    // Manufacturer block: UID, BCC, SAK, ATQA, manufacturer data
+    memcpy(mu8_Memory, u8_UID, 4);
+    mu8_Memory[4] = u8_UID[0] ^ u8_UID[1] ^ u8_UID[2] ^ u8_UID[3];
+    mu8_Memory[5] = b_4K ? 0x18 : 0x08;
+    mu8_Memory[6] = b_4K ? 0x02 : 0x04;
+    mu8_Memory[7] = 0x00;
+
+    // Transport configuration: key A = key B = FF FF FF FF FF FF, access bits FF 07 80 69
+    static const byte u8_Trailer[16] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x07, 0x80, 0x69,
+                                         0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    for (int S=0; S<(b_4K ? 40 : 16); S++)
+    {
+        memcpy(mu8_Memory + TrailerOf(S) * 16, u8_Trailer, 16);
+    }
+
+    LoadImage(mu8_Memory, ms32_Size);
+}
+
+uint16_t SimMifareClassic::GetATQA()
+{
+    return (ms32_Size == SIM_MF_4K_SIZE) ? 0x0002 : 0x0004;
+}
+
+byte SimMifareClassic::GetSAK()
+{
+    return (ms32_Size == SIM_MF_4K_SIZE) ? 0x18 : 0x08;
+}
+
+int SimMifareClassic::GetUID(byte u8_UID[10])
+{
+    memcpy(u8_UID, mu8_UID, 4);
+    return 4;
+}
+
+void SimMifareClassic::Reset()
+{
+    mb_Halted       = false;
+    ms32_AuthSector = -1;
+    mu8_Error       = PN532_SIM_ERR_TIMEOUT;
+}
+
+byte SimMifareClassic::GetError()
+{
+    return mu8_Error;
+}
+
+bool SimMifareClassic::LoadImage(const byte* u8_Image, int s32_Size)
+{
+    if (s32_Size != SIM_MF_1K_SIZE && s32_Size != SIM_MF_4K_SIZE)
+        return false;
+
+    memmove(mu8_Memory, u8_Image, s32_Size);
+    ms32_Size = s32_Size;
+    memcpy(mu8_UID, mu8_Memory, 4);
+
+    // The card RNG is deterministic, so a simulation run is reproducible.
+    mu32_Random = 0x9E3779B9 ^ ((uint32_t)mu8_UID[0] << 24 | mu8_UID[1] << 16 | mu8_UID[2] << 8 | mu8_UID[3]);
+    Reset();
+    return true;
+}
+
+const byte* SimMifareClassic::GetImage(int* ps32_Size)
+{
+    *ps32_Size = ms32_Size;
+    return mu8_Memory;
+}
+
+bool SimMifareClassic::LoadFile(const char* s8_Path)
+{
+    static byte u8_Image[SIM_MF_4K_SIZE + 1];
+    int s32_Size;
+    return ReadImageFile(s8_Path, u8_Image, sizeof(u8_Image), &s32_Size) && LoadImage(u8_Image, s32_Size);
+}
+
+bool SimMifareClassic::SaveFile(const char* s8_Path)
+{
+    return WriteImageFile(s8_Path, mu8_Memory, ms32_Size);
+}
+
+// The command as the host sends it with INDATAEXCHANGE. The PN532 translates it into the RF protocol.
+int SimMifareClassic::Transceive(const byte* u8_Command, int s32_CmdLen, byte* u8_Response, int s32_RespSize)
+{
+    (void)s32_RespSize;
+    if (mb_Halted || s32_CmdLen < 2)
+        return Fail(PN532_SIM_ERR_TIMEOUT);
+
+    switch (u8_Command[0])
+    {
+        case MIFARE_CMD_AUTH_A:
+        case MIFARE_CMD_AUTH_B:
+            return Authenticate(u8_Command, s32_CmdLen);
+
+        case MIFARE_CMD_READ:
+            return ReadBlock(u8_Command[1], u8_Response);
+
+        case MIFARE_CMD_WRITE:
+            if (s32_CmdLen != 18)
+                return Fail(PN532_SIM_ERR_MIFARE);
+            return WriteBlock(u8_Command[1], u8_Command + 2);
+
+        default: // value block operations are not supported
+            return Fail(PN532_SIM_ERR_MIFARE);
+    }
+}
+
+// Command: 60/61, block, key (6), UID (4)
+int SimMifareClassic::Authenticate(const byte* u8_Cmd, int s32_Len)
+{
+    if (s32_Len < 12)
+        return Fail(PN532_SIM_ERR_MIFARE);
+
+    int s32_Block = u8_Cmd[1];
+    if (s32_Block * 16 >= ms32_Size)
+        return Fail(PN532_SIM_ERR_MIFARE); // the card does not answer
+
+    bool  b_KeyB    = (u8_Cmd[0] == MIFARE_CMD_AUTH_B);
+    int   s32_Sector = SectorOf(s32_Block);
+    byte* u8_Trailer = mu8_Memory + TrailerOf(s32_Sector) * 16;
+    byte  u8_Access  = AccessBits(TrailerOf(s32_Sector));
+
+    // If key B is readable it cannot be used for authentication
+    if (b_KeyB && gu8_KeyBRead[u8_Access] != RULE_NEVER)
+        return Fail(PN532_SIM_ERR_MIFARE);
+
+    const byte* u8_CardKey = b_KeyB ? u8_Trailer + 10 : u8_Trailer;
+    const byte* u8_HostKey = u8_Cmd + 2;
+    uint32_t u32_CardUid = (uint32_t)mu8_UID[0] << 24 | mu8_UID[1] << 16 | mu8_UID[2] << 8 | mu8_UID[3];
+    uint32_t u32_HostUid = (uint32_t)u8_Cmd[8]  << 24 | u8_Cmd[9]  << 16 | u8_Cmd[10] << 8 | u8_Cmd[11];
+
+    // ---- Card: tag nonce (encrypted with the new key if a sector is already authenticated) ----
+    uint32_t u32_Nt = Random32();
+    uint32_t u32_NtSent;
+    bool     b_Nested = (ms32_AuthSector >= 0);
+    mi_Card.Init(u8_CardKey);
+    if (b_Nested) u32_NtSent = u32_Nt ^ mi_Card.Word(u32_CardUid ^ u32_Nt, false);
+    else        { u32_NtSent = u32_Nt;  mi_Card.Word(u32_CardUid ^ u32_Nt, false); }
+
+    // ---- PN532: reader nonce and reader answer ----
+    uint32_t u32_NtReader;
+    mi_Reader.Init(u8_HostKey);
+    if (b_Nested) u32_NtReader = u32_NtSent ^ mi_Reader.Word(u32_HostUid ^ u32_NtSent, true);
+    else        { u32_NtReader = u32_NtSent;  mi_Reader.Word(u32_HostUid ^ u32_NtSent, false); }
+
+    uint32_t u32_Nr    = Random32();
+    uint32_t u32_NrEnc = u32_Nr ^ mi_Reader.Word(u32_Nr, false);
+    uint32_t u32_ArEnc = SimCrypto1::PrngSuccessor(u32_NtReader, 64) ^ mi_Reader.Word(0, false);
+
+    // ---- Card: verify the reader answer, send the tag answer ----
+    ms32_AuthSector = -1;
+    mi_Card.Word(u32_NrEnc, true);
+    if ((u32_ArEnc ^ mi_Card.Word(0, false)) != SimCrypto1::PrngSuccessor(u32_Nt, 64))
+        return Fail(PN532_SIM_ERR_MIFARE); // wrong key or UID: the card stays silent
+
+    uint32_t u32_AtEnc = SimCrypto1::PrngSuccessor(u32_Nt, 96) ^ mi_Card.Word(0, false);
+
+    // ---- PN532: verify the tag answer ----
+    if ((u32_AtEnc ^ mi_Reader.Word(0, false)) != SimCrypto1::PrngSuccessor(u32_NtReader, 96))
+        return Fail(PN532_SIM_ERR_MIFARE);
+
+    ms32_AuthSector = s32_Sector;
+    mb_AuthKeyB     = b_KeyB;
+    return 0;
+}
+
+int SimMifareClassic::ReadBlock(byte u8_Block, byte* u8_Response)
+{
+    byte u8_Frame[18] = { MIFARE_CMD_READ, u8_Block };
+    AppendCrc(u8_Frame, 2);
+    LinkToCard(u8_Frame, 4);
+
+    if (ms32_AuthSector < 0 || !CheckCrc(u8_Frame, 4) || u8_Block * 16 >= ms32_Size ||
+        SectorOf(u8_Block) != ms32_AuthSector)
+        return Fail(PN532_SIM_ERR_MIFARE);
+
+    int   s32_Trailer = TrailerOf(ms32_AuthSector);
+    byte  u8_Access   = AccessBits(u8_Block);
+    byte* u8_Data     = mu8_Memory + u8_Block * 16;
+
+    if (u8_Block == s32_Trailer)
+    {
+        // Key A is never readable, access bits and key B depend on the access conditions
+        memset(u8_Frame, 0, 16);
+        if (IsAllowed(gu8_AccessRead[u8_Access], mb_AuthKeyB)) memcpy(u8_Frame + 6,  u8_Data + 6,  4);
+        if (IsAllowed(gu8_KeyBRead  [u8_Access], mb_AuthKeyB)) memcpy(u8_Frame + 10, u8_Data + 10, 6);
+    }
+    else
+    {
+        if (!IsAllowed(gu8_DataRead[u8_Access], mb_AuthKeyB))
+            return Fail(PN532_SIM_ERR_MIFARE);
+        memcpy(u8_Frame, u8_Data, 16);
+    }
+
+    AppendCrc(u8_Frame, 16);
+    LinkToHost(u8_Frame, 18);
+    if (!CheckCrc(u8_Frame, 18))
+        return Fail(PN532_SIM_ERR_MIFARE);
+
+    memcpy(u8_Response, u8_Frame, 16);
+    return 16;
+}
+
+// The PN532 sends the write command, waits for the ACK, sends the data and waits for the second ACK
+int SimMifareClassic::WriteBlock(byte u8_Block, const byte* u8_Data)
+{
+    byte u8_Frame[18] = { MIFARE_CMD_WRITE, u8_Block };
+    AppendCrc(u8_Frame, 2);
+    LinkToCard(u8_Frame, 4);
+
+    if (ms32_AuthSector < 0 || !CheckCrc(u8_Frame, 4) || u8_Block == 0 || u8_Block * 16 >= ms32_Size ||
+        SectorOf(u8_Block) != ms32_AuthSector)
+        return Fail(PN532_SIM_ERR_MIFARE);
+
+    int  s32_Trailer = TrailerOf(ms32_AuthSector);
+    byte u8_Access   = AccessBits(u8_Block);
+    bool b_Trailer   = (u8_Block == s32_Trailer);
+    if (!b_Trailer && !IsAllowed(gu8_DataWrite[u8_Access], mb_AuthKeyB))
+        return Fail(PN532_SIM_ERR_MIFARE);
+    if (!LinkAck())
+        return Fail(PN532_SIM_ERR_MIFARE);
+
+    memcpy(u8_Frame, u8_Data, 16);
+    AppendCrc(u8_Frame, 16);
+    LinkToCard(u8_Frame, 18);
+    if (!CheckCrc(u8_Frame, 18))
+        return Fail(PN532_SIM_ERR_MIFARE);
+
+    byte* u8_Dest = mu8_Memory + u8_Block * 16;
+    if (b_Trailer)
+    {
+        // Only the parts that are writable with the current key are modified.
+        // Invalid access bits would make the sector unusable on a real card. They are refused here.
+        bool b_AccessWrite = IsAllowed(gu8_AccessWrite[u8_Access], mb_AuthKeyB);
+        if (b_AccessWrite && !CheckAccessBits(u8_Frame))
+            return Fail(PN532_SIM_ERR_MIFARE);
+
+        if (IsAllowed(gu8_KeyAWrite[u8_Access], mb_AuthKeyB)) memcpy(u8_Dest,      u8_Frame,      6);
+        if (b_AccessWrite)                                    memcpy(u8_Dest + 6,  u8_Frame + 6,  4);
+        if (IsAllowed(gu8_KeyBWrite[u8_Access], mb_AuthKeyB)) memcpy(u8_Dest + 10, u8_Frame + 10, 6);
+    }
+    else
+    {
+        memcpy(u8_Dest, u8_Frame, 16);
+    }
+
+    if (!LinkAck())
+        return Fail(PN532_SIM_ERR_MIFARE);
+    return 0;
+}
+
+// The card answers with a NAK or stays silent. It goes into the HALT state and must be selected anew.
+int SimMifareClassic::Fail(byte u8_Error)
+{
+    mb_Halted       = true;
+    ms32_AuthSector = -1;
+    mu8_Error       = u8_Error;
+    return -1;
+}
+
+int SimMifareClassic::SectorOf(int s32_Block)
+{
+    if (s32_Block < 128) return s32_Block / 4;
+    return 32 + (s32_Block - 128) / 16;
+}
+
+int SimMifareClassic::TrailerOf(int s32_Sector)
+{
+    if (s32_Sector < 32) return s32_Sector * 4 + 3;
+    return 128 + (s32_Sector - 32) * 16 + 15;
+}
+
+// returns the access bits C1 C2 C3 of a block (bit 2 = C1)
+byte SimMifareClassic::AccessBits(int s32_Block)
+{
+    int s32_Sector = SectorOf(s32_Block);
+    int s32_Index;
+    if (s32_Block == TrailerOf(s32_Sector)) s32_Index = 3;
+    else if (s32_Sector < 32)               s32_Index = s32_Block % 4;
+    else                                    s32_Index = ((s32_Block - 128) % 16) / 5; // groups of 5 blocks in a 4K sector
+
+    const byte* u8_Trailer = mu8_Memory + TrailerOf(s32_Sector) * 16;
+    byte C1 = (u8_Trailer[7] >> (4 + s32_Index)) & 1;
+    byte C2 = (u8_Trailer[8] >>      s32_Index)  & 1;
+    byte C3 = (u8_Trailer[8] >> (4 + s32_Index)) & 1;
+    return (C1 << 2) | (C2 << 1) | C3;
+}
+
+// The access bits are stored twice: inverted and not inverted
+bool SimMifareClassic::CheckAccessBits(const byte* u8_Trailer)
+{
+    byte C1 = u8_Trailer[7] >> 4, C2 = u8_Trailer[8] & 0x0F, C3 = u8_Trailer[8] >> 4;
+    return ((~u8_Trailer[6]        & 0x0F) == C1) &&
+           ((~u8_Trailer[6] >> 4   & 0x0F) == C2) &&
+           ((~u8_Trailer[7]        & 0x0F) == C3);
+}
+
+// A frame from the PN532 to the card: encrypted by the reader, decrypted by the card
+void SimMifareClassic::LinkToCard(byte* u8_Data, int s32_Len)
+{
+    for (int i=0; i<s32_Len; i++)
+    {
+        u8_Data[i] = (u8_Data[i] ^ mi_Reader.Byte(0, false)) ^ mi_Card.Byte(0, false);
+    }
+}
+
+// A frame from the card to the PN532: encrypted by the card, decrypted by the reader
+void SimMifareClassic::LinkToHost(byte* u8_Data, int s32_Len)
+{
+    for (int i=0; i<s32_Len; i++)
+    {
+        u8_Data[i] = (u8_Data[i] ^ mi_Card.Byte(0, false)) ^ mi_Reader.Byte(0, false);
+    }
+}
+
+// The encrypted 4 bit ACK of the card
+bool SimMifareClassic::LinkAck()
+{
+    byte u8_Ack = MF_ACK;
+    for (int i=0; i<4; i++)
+    {
+        byte u8_Bit = (u8_Ack >> i) & 1;
+        u8_Bit ^= mi_Card.Bit(0, false) ^ mi_Reader.Bit(0, false);
+        u8_Ack = (u8_Ack & ~(1 << i)) | (u8_Bit << i);
+    }
+    return u8_Ack == MF_ACK;
+}
+
+void SimMifareClassic::AppendCrc(byte* u8_Data, int s32_Len)
+{
+    uint16_t u16_Crc = Utils::CalcCrc16(u8_Data, s32_Len);
+    u8_Data[s32_Len]     = (byte)u16_Crc;
+    u8_Data[s32_Len + 1] = (byte)(u16_Crc >> 8);
+}
+
+bool SimMifareClassic::CheckCrc(const byte* u8_Data, int s32_Len)
+{
+    uint16_t u16_Crc = Utils::CalcCrc16(u8_Data, s32_Len - 2);
+    return u8_Data[s32_Len - 2] == (byte)u16_Crc && u8_Data[s32_Len - 1] == (byte)(u16_Crc >> 8);
+}
+
+// xorshift32: deterministic, so that a simulation can be repeated
+uint32_t SimMifareClassic::Random32()
+{
+    mu32_Random ^= mu32_Random << 13;
+    mu32_Random ^= mu32_Random >> 17;
+    mu32_Random ^= mu32_Random << 5;
+    return mu32_Random;
+}
+
+// ============================================================================================
+//                                   MIFARE Ultralight / NTAG
+// ============================================================================================
+
+SimUltralight::SimUltralight(const byte u8_UID[7], int s32_Pages)
+{
+    ms32_Pages = min(s32_Pages, SIM_NTAG216_PAGES);
+    memset(mu8_Memory, 0, sizeof(mu8_Memory));
+
+    // Page 0: UID0-2, BCC0 / Page 1: UID3-6 / Page 2: BCC1, internal, lock bytes
+    memcpy(mu8_Memory,     u8_UID,     3);
+    memcpy(mu8_Memory + 4, u8_UID + 3, 4);
+    mu8_Memory[3] = 0x88 ^ u8_UID[0] ^ u8_UID[1] ^ u8_UID[2];
+    mu8_Memory[8] = u8_UID[3] ^ u8_UID[4] ^ u8_UID[5] ^ u8_UID[6];
+    mu8_Memory[9] = 0x48;
+
+    if (ms32_Pages > SIM_UL_PAGES)
+    {
+        // NTAG: capability container (NDEF size / 8), empty NDEF message, configuration pages
+        byte* u8_End = mu8_Memory + (ms32_Pages - 5) * 4;
+        mu8_Memory[12] = 0xE1;
+        mu8_Memory[13] = 0x10;
+        mu8_Memory[14] = (byte)(((ms32_Pages - 9) * 4) / 8);
+        mu8_Memory[16] = 0x03;
+        mu8_Memory[18] = 0xFE;
+        u8_End[3]  = 0xBD; // dynamic lock bytes + RFUI
+        u8_End[4]  = 0x04; // CFG0: MIRROR, RFUI, MIRROR_PAGE, AUTH0
+        u8_End[7]  = 0xFF;
+        u8_End[9]  = 0x05; // CFG1: ACCESS, RFUI, RFUI, RFUI
+        memset(u8_End + 12, 0xFF, 4); // PWD
+    }
+}
+
+uint16_t SimUltralight::GetATQA()
+{
+    return 0x0044;
+}
+
+byte SimUltralight::GetSAK()
+{
+    return 0x00;
+}
+
+int SimUltralight::GetUID(byte u8_UID[10])
+{
+    memcpy(u8_UID,     mu8_Memory,     3);
+    memcpy(u8_UID + 3, mu8_Memory + 4, 4);
+    return 7;
+}
+
+byte SimUltralight::GetError()
+{
+    return PN532_SIM_ERR_MIFARE;
+}
+
+bool SimUltralight::LoadImage(const byte* u8_Image, int s32_Size)
+{
+    if (s32_Size % 4 || s32_Size < SIM_UL_PAGES * 4 || s32_Size > (int)sizeof(mu8_Memory))
+        return false;
+
+    memcpy(mu8_Memory, u8_Image, s32_Size);
+    ms32_Pages = s32_Size / 4;
+    return true;
+}
+
+const byte* SimUltralight::GetImage(int* ps32_Size)
+{
+    *ps32_Size = ms32_Pages * 4;
+    return mu8_Memory;
+}
+
+bool SimUltralight::LoadFile(const char* s8_Path)
+{
+    static byte u8_Image[sizeof(mu8_Memory) + 1];
+    int s32_Size;
+    return ReadImageFile(s8_Path, u8_Image, sizeof(u8_Image), &s32_Size) && LoadImage(u8_Image, s32_Size);
+}
+
+bool SimUltralight::SaveFile(const char* s8_Path)
+{
+    return WriteImageFile(s8_Path, mu8_Memory, ms32_Pages * 4);
+}
+
+int SimUltralight::Transceive(const byte* u8_Command, int s32_CmdLen, byte* u8_Response, int s32_RespSize)
+{
+    bool b_Ntag = ms32_Pages > SIM_UL_PAGES;
+    int  s32_Page = (s32_CmdLen > 1) ? u8_Command[1] : 0;
+
+    switch (u8_Command[0])
+    {
+        case MIFARE_CMD_READ: // 4 pages, the address rolls over at the end of the memory
+            if (s32_CmdLen != 2 || s32_Page >= ms32_Pages)
+                return Nak();
+            for (int i=0; i<4; i++)
+            {
+                memcpy(u8_Response + 4 * i, mu8_Memory + ((s32_Page + i) % ms32_Pages) * 4, 4);
+            }
+            return 16;
+
+        case MIFARE_CMD_WRITE_ULTRALIGHT:
+        {
+            if (s32_CmdLen != 6 || s32_Page < 2 || s32_Page >= ms32_Pages || IsLocked(s32_Page))
+                return Nak();
+
+            byte* u8_Dest = mu8_Memory + s32_Page * 4;
+            if (s32_Page == 2) // only the lock bytes can be set
+            {
+                u8_Dest[2] |= u8_Command[4];
+                u8_Dest[3] |= u8_Command[5];
+            }
+            else if (s32_Page == 3) // OTP bits can only be set
+            {
+                for (int i=0; i<4; i++) u8_Dest[i] |= u8_Command[2 + i];
+            }
+            else
+            {
+                memcpy(u8_Dest, u8_Command + 2, 4);
+            }
+            return 0; // ACK
+        }
+
+        case 0x60: // GET_VERSION (NTAG)
+        {
+            if (!b_Ntag || s32_CmdLen != 1)
+                return Nak();
+            byte u8_Storage = (ms32_Pages <= SIM_NTAG213_PAGES) ? 0x0F : (ms32_Pages <= SIM_NTAG215_PAGES) ? 0x11 : 0x13;
+            const byte u8_Version[8] = { 0x00, 0x04, 0x04, 0x02, 0x01, 0x00, u8_Storage, 0x03 };
+            memcpy(u8_Response, u8_Version, 8);
+            return 8;
+        }
+
+        case 0x3A: // FAST_READ start page, end page (NTAG)
+        {
+            if (!b_Ntag || s32_CmdLen != 3)
+                return Nak();
+            int s32_End = u8_Command[2];
+            int s32_Len = (s32_End - s32_Page + 1) * 4;
+            if (s32_End < s32_Page || s32_End >= ms32_Pages || s32_Len > s32_RespSize)
+                return Nak();
+            memcpy(u8_Response, mu8_Memory + s32_Page * 4, s32_Len);
+            return s32_Len;
+        }
+
+        default:
+            return Nak();
+    }
+}
+
+// Static lock bits in page 2: byte 2 bit 3..7 = page 3..7, byte 3 bit 0..7 = page 8..15
+// The dynamic lock bits of NTAG are not evaluated.
+bool SimUltralight::IsLocked(int s32_Page)
+{
+    if (s32_Page >= 3 && s32_Page <= 7)
+        return (mu8_Memory[10] >> s32_Page) & 1;
+    if (s32_Page >= 8 && s32_Page <= 15)
+        return (mu8_Memory[11] >> (s32_Page - 8)) & 1;
+    return false;
+}
+
+int SimUltralight::Nak()
+{
+    return -1;
+}
+
+#endif // PN532_HOST
@@ -0,0 +1,134 @@
+/**************************************************************************
+
+    SimMifare: Software MIFARE Classic and MIFARE Ultralight / NTAG cards
+    for the simulated PN532 (PN532_SIM)
+
+    SimMifareClassic (1K / 4K)
+    The PN532 executes the MIFARE Classic authentication and the Crypto1
+    encryption itself. The host only sends the key and the UID with
+    MIFARE_CMD_AUTH_A / B. This class models both ends of the RF link:
+    the Crypto1 unit of the PN532 (reader) and the Crypto1 unit of the card.
+    Both run the real three pass authentication (nT, nR, aR, aT) and all
+    following frames (including CRC_A and the 4 bit ACK) are encrypted by
+    one side and decrypted by the other. A wrong key or UID fails exactly
+    where it fails with a real card. The access conditions of the sector
+    trailers are evaluated.
+
+    SimUltralight (Ultralight, NTAG213, NTAG215, NTAG216)
+    Page memory with READ (4 pages), WRITE, FAST_READ and GET_VERSION
+    (NTAG only). The static lock bits and the OTP page are evaluated.
+
+    Both cards are backed by a binary card image (the same format as a
+    dump of the card) that can be loaded and saved.
+
+**************************************************************************/
+
+#ifndef __SIM_MIFARE_H__
+#define __SIM_MIFARE_H__
+
+#include "PN532_SIM.h"
+#include "PN532.h"
+
+#define SIM_MF_1K_SIZE      1024
+#define SIM_MF_4K_SIZE      4096
+
+#define SIM_UL_PAGES        16   // MIFARE Ultralight
+#define SIM_NTAG213_PAGES   45
+#define SIM_NTAG215_PAGES   135
+#define SIM_NTAG216_PAGES   231
+
+// The Crypto1 stream cipher (48 bit LFSR with a non linear filter function).
+// The state is split into the odd and the even bits of the LFSR.
+class SimCrypto1
+{
+public:
+    void     Init(const byte u8_Key[6]);
+    byte     Bit (byte u8_In, bool b_Encrypted);
+    byte     Byte(byte u8_In, bool b_Encrypted);
+    uint32_t Word(uint32_t u32_In, bool b_Encrypted);
+
+    // The 16 bit LFSR of the card nonce shifted n times
+    static uint32_t PrngSuccessor(uint32_t u32_Nonce, int s32_Count);
+
+private:
+    uint32_t mu32_Odd;
+    uint32_t mu32_Even;
+};
+
+class SimMifareClassic : public SimCard
+{
+public:
+    // Creates a factory new card (all keys FF FF FF FF FF FF, transport access conditions)
+    SimMifareClassic(const byte u8_UID[4], bool b_4K = false);
+
+    uint16_t GetATQA();
+    byte     GetSAK();
+    int      GetUID(byte u8_UID[10]);
+    void     Reset();
+    int      Transceive(const byte* u8_Command, int s32_CmdLen, byte* u8_Response, int s32_RespSize);
+    byte     GetError();
+
+    // s32_Size = 1024 or 4096. The UID is taken from block 0.
+    bool        LoadImage(const byte* u8_Image, int s32_Size);
+    const byte* GetImage(int* ps32_Size);
+    bool        LoadFile(const char* s8_Path);
+    bool        SaveFile(const char* s8_Path);
+
+private:
+    int  Authenticate(const byte* u8_Cmd, int s32_Len);
+    int  ReadBlock (byte u8_Block, byte* u8_Response);
+    int  WriteBlock(byte u8_Block, const byte* u8_Data);
+    int  Fail(byte u8_Error);
+
+    int  SectorOf (int s32_Block);
+    int  TrailerOf(int s32_Sector);
+    byte AccessBits(int s32_Block);
+    bool CheckAccessBits(const byte* u8_Trailer);
+
+    void LinkToCard (byte* u8_Data, int s32_Len);
+    void LinkToHost (byte* u8_Data, int s32_Len);
+    bool LinkAck    ();
+    void AppendCrc  (byte* u8_Data, int s32_Len);
+    bool CheckCrc   (const byte* u8_Data, int s32_Len);
+    uint32_t Random32();
+
+    byte       mu8_Memory[SIM_MF_4K_SIZE];
+    int        ms32_Size;
+    byte       mu8_UID[4];
+
+    bool       mb_Halted;         // after an authentication error the card must be selected anew
+    int        ms32_AuthSector;   // -1 = not authenticated
+    bool       mb_AuthKeyB;
+    SimCrypto1 mi_Reader;         // Crypto1 unit of the PN532
+    SimCrypto1 mi_Card;           // Crypto1 unit of the card
+    uint32_t   mu32_Random;
+    byte       mu8_Error;
+};
+
+class SimUltralight : public SimCard
+{
+public:
+    // s32_Pages = SIM_UL_PAGES, SIM_NTAG213_PAGES, SIM_NTAG215_PAGES or SIM_NTAG216_PAGES
+    SimUltralight(const byte u8_UID[7], int s32_Pages = SIM_NTAG215_PAGES);
+
+    uint16_t GetATQA();
+    byte     GetSAK();
+    int      GetUID(byte u8_UID[10]);
+    int      Transceive(const byte* u8_Command, int s32_CmdLen, byte* u8_Response, int s32_RespSize);
+    byte     GetError();
+
+    // s32_Size = 4 * page count. The UID is taken from the pages 0 and 1.
+    bool        LoadImage(const byte* u8_Image, int s32_Size);
+    const byte* GetImage(int* ps32_Size);
+    bool        LoadFile(const char* s8_Path);
+    bool        SaveFile(const char* s8_Path);
+
+private:
+    bool IsLocked(int s32_Page);
+    int  Nak();
+
+    byte mu8_Memory[SIM_NTAG216_PAGES * 4];
+    int  ms32_Pages;
+};
+
+#endif
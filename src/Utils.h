@@ -5,6 +5,15 @@
 #ifdef _MSC_VER
 #include "../DoorOpenerSolution/WinDefines.h"
 
+// If you compile this project natively on a Linux host (PN532_HOST, see [env:host] in platformio.ini)...
+#elif defined(PN532_HOST)
+#include "HostDefines.h"
+
+#define PRINT_DEBUG(x) Utils::Print(__FILE__); Serial.print(":"); Serial.print(__LINE__);Serial.print(" ");Serial.println(x);
+
+#define TRUE   true
+#define FALSE  false
+
 // If you use the Arduino Compiler....
 #else
 #include <Arduino.h>
@@ -30,7 +39,9 @@
 // ********************************************************************************/
 
 
-#if PROTOCOL == PROT_I2C
+#if defined(PN532_HOST)
+// no #include required (there is no hardware bus on the host, see PN532_SIM)
+#elif PROTOCOL == PROT_I2C
     #include <Wire.h> // Hardware I2C bus
 #elif PROTOCOL == PROT_HSU
 // no #include required
@@ -86,7 +97,7 @@ public:
 
 // -------------------------------------------------------------------------------------------------------------------
 
-#if USE_HARDWARE_SPI
+#if USE_HARDWARE_SPI && !defined(PN532_HOST)
 // This class implements Hardware SPI (4 wire bus). It is not used for the DoorOpener sketch.
     // NOTE: This class is not used when you switched to I2C mode with PN532::InitI2C() or Software SPI mode with PN532::InitSoftwareSPI().
     class SpiClass
@@ -107,7 +118,7 @@ public:
 
 // -------------------------------------------------------------------------------------------------------------------
 
-#if PROTOCOL == PROT_I2C
+#if PROTOCOL == PROT_I2C && !defined(PN532_HOST)
 // This class implements Hardware I2C (2 wire bus with pull-up resistors). It is not used for the DoorOpener sketch.
     // NOTE: This class is not used when you switched to SPI mode with PN532::InitSoftwareSPI() or PN532::InitHardwareSPI().
     class I2cClass